@@ -0,0 +1,456 @@
+/*
+ * admission.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "admission.h"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+enum {
+    WINDOW         = 60,        /* Seconds over which rates are measured. */
+    SUBNET4_PREFIX = 96 + 24,   /* Of IPv4 addresses mapped to IPv6. */
+    SUBNET6_PREFIX = 64,
+    TABLE_MIN_SIZE = 256,
+};
+
+enum {
+    KIND_FREE = 0,
+    KIND_IP,
+    KIND_SUBNET,
+};
+
+/*
+ * Hash table entry, for an address or a subnet. Rates are estimated from
+ * the connections in the current window and in the previous one, weighted
+ * by how much of it overlaps the last WINDOW seconds.
+ */
+struct entry {
+    uint8_t  key[16];
+    uint8_t  kind;
+    uint16_t count;       /* Open connections. */
+    uint16_t connects;    /* Attempts in the current window. */
+    uint16_t previous;    /* Attempts in the previous window. */
+    uint32_t window;
+};
+
+struct ticket {
+    uint8_t addr[16];
+    bool    active;
+    bool    pending;
+    bool    exempt;       /* Not accounted in its subnet. */
+};
+
+
+/* Prefix of IPv4 addresses mapped to IPv6 (RFC 4291). */
+static const uint8_t s_v4_mapped[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF,
+};
+
+static struct entry     *s_table = NULL;
+static size_t            s_table_size = 0;  /* Power of two. */
+static size_t            s_table_used = 0;
+
+static struct ticket    *s_tickets = NULL;
+static size_t            s_n_tickets = 0;
+
+static admission_limits_t s_limits = {
+    .limit_ip     = CHATEAU_CONNECT_LIMIT_IP,
+    .limit_subnet = CHATEAU_CONNECT_LIMIT_SUBNET,
+    .rate_ip      = CHATEAU_CONNECT_RATE_IP,
+    .rate_subnet  = CHATEAU_CONNECT_RATE_SUBNET,
+    .pending_max  = CHATEAU_PENDING_MAX,
+};
+static admission_rule_t *s_rules = NULL;
+
+static admission_stats_t s_stats = { 0, };
+
+
+static uint32_t
+now_seconds (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint32_t) ts.tv_sec;
+}
+
+
+static inline bool
+prefix_match (const uint8_t a[16], const uint8_t b[16], unsigned prefix)
+{
+    const unsigned bytes = prefix / 8;
+    if (memcmp (a, b, bytes) != 0)
+        return false;
+    if (prefix % 8 == 0)
+        return true;
+    const uint8_t mask = 0xFF << (8 - prefix % 8);
+    return (a[bytes] & mask) == (b[bytes] & mask);
+}
+
+
+static inline void
+mask_prefix (uint8_t addr[16], unsigned prefix)
+{
+    for (unsigned i = 0; i < 16; i++) {
+        if (prefix >= 8)
+            prefix -= 8;
+        else {
+            addr[i] &= 0xFF << (8 - prefix);
+            prefix = 0;
+        }
+    }
+}
+
+
+static inline void
+subnet_of (const uint8_t addr[16], uint8_t subnet[16])
+{
+    const bool v4 = memcmp (addr, s_v4_mapped, sizeof (s_v4_mapped)) == 0;
+    memcpy (subnet, addr, 16);
+    mask_prefix (subnet, v4 ? SUBNET4_PREFIX : SUBNET6_PREFIX);
+}
+
+
+static bool
+normalize (const struct sockaddr *addr, socklen_t length, uint8_t out[16])
+{
+    if (addr->sa_family == AF_INET && length >= sizeof (struct sockaddr_in)) {
+        memcpy (out, s_v4_mapped, sizeof (s_v4_mapped));
+        memcpy (out + 12, &((const struct sockaddr_in*) addr)->sin_addr, 4);
+        return true;
+    }
+    if (addr->sa_family == AF_INET6 && length >= sizeof (struct sockaddr_in6)) {
+        memcpy (out, &((const struct sockaddr_in6*) addr)->sin6_addr, 16);
+        return true;
+    }
+    return false;
+}
+
+
+bool
+admission_rule_parse (admission_rule_t *rule, const char *text)
+{
+    w_assert (rule);
+    w_assert (text);
+
+    char address[INET6_ADDRSTRLEN];
+    const char *slash = strchr (text, '/');
+    const size_t length = slash ? (size_t) (slash - text) : strlen (text);
+    if (length >= sizeof (address))
+        return false;
+    memcpy (address, text, length);
+    address[length] = '\0';
+
+    unsigned long prefix = 128;
+    if (slash && !w_str_uint (slash + 1, &prefix))
+        return false;
+
+    struct in_addr in4;
+    if (inet_pton (AF_INET, address, &in4) == 1) {
+        if (prefix > 32 && slash)
+            return false;
+        struct sockaddr_in sin = { .sin_family = AF_INET, .sin_addr = in4 };
+        normalize ((struct sockaddr*) &sin, sizeof (sin), rule->addr);
+        prefix = slash ? prefix + 96 : 128;
+    } else if (inet_pton (AF_INET6, address, rule->addr) != 1 || prefix > 128) {
+        return false;
+    }
+
+    rule->prefix = (uint8_t) prefix;
+    mask_prefix (rule->addr, rule->prefix);
+    return true;
+}
+
+
+void
+admission_set_limits (const admission_limits_t *limits)
+{
+    w_assert (limits);
+
+    w_free (s_rules);
+    s_limits = *limits;
+    if (limits->n_rules) {
+        s_rules = w_alloc (admission_rule_t, limits->n_rules);
+        memcpy (s_rules, limits->rules, sizeof (admission_rule_t) * limits->n_rules);
+    }
+    s_limits.rules = s_rules;
+}
+
+
+static inline size_t
+hash (const uint8_t key[16], uint8_t kind)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u ^ kind;
+    for (unsigned i = 0; i < 16; i++)
+        h = (h ^ key[i]) * 16777619u;
+    return h;
+}
+
+
+static struct entry*
+find (const uint8_t key[16], uint8_t kind)
+{
+    if (!s_table)
+        return NULL;
+
+    for (size_t i = hash (key, kind) & (s_table_size - 1);; i = (i + 1) & (s_table_size - 1)) {
+        struct entry *entry = &s_table[i];
+        if (entry->kind == KIND_FREE)
+            return NULL;
+        if (entry->kind == kind && memcmp (entry->key, key, 16) == 0)
+            return entry;
+    }
+}
+
+
+static struct entry*
+insert (const uint8_t key[16], uint8_t kind)
+{
+    size_t i = hash (key, kind) & (s_table_size - 1);
+    while (s_table[i].kind != KIND_FREE)
+        i = (i + 1) & (s_table_size - 1);
+
+    struct entry *entry = &s_table[i];
+    memcpy (entry->key, key, 16);
+    entry->kind = kind;
+    s_table_used++;
+    return entry;
+}
+
+
+/* Without connections, and without attempts in the last two windows. */
+static inline bool
+entry_is_idle (const struct entry *entry, uint32_t window)
+{
+    return entry->count == 0 && entry->window + 1 < window;
+}
+
+
+/*
+ * Makes room for "n" more entries, dropping idle ones. Rebuilding moves
+ * entries around, so it is done before looking any of them up.
+ */
+static void
+reserve (unsigned n)
+{
+    if (s_table && (s_table_used + n) * 4 <= s_table_size * 3)
+        return;
+
+    const uint32_t window = now_seconds () / WINDOW;
+    size_t live = 0;
+    for (size_t i = 0; i < s_table_size; i++)
+        if (s_table[i].kind != KIND_FREE && !entry_is_idle (&s_table[i], window))
+            live++;
+
+    size_t size = TABLE_MIN_SIZE;
+    while ((live + n) * 2 > size)
+        size *= 2;
+
+    struct entry *old = s_table;
+    const size_t old_size = s_table_size;
+    s_table = w_alloc0 (struct entry, size);
+    s_table_size = size;
+    s_table_used = 0;
+
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].kind != KIND_FREE && !entry_is_idle (&old[i], window))
+            *insert (old[i].key, old[i].kind) = old[i];
+    }
+    w_free (old);
+}
+
+
+static struct entry*
+lookup (const uint8_t key[16], uint8_t kind)
+{
+    struct entry *entry = find (key, kind);
+    return entry ? entry : insert (key, kind);
+}
+
+
+/* Counts an attempt, and returns the estimated attempts per WINDOW. */
+static unsigned
+count_attempt (struct entry *entry, uint32_t now)
+{
+    const uint32_t window = now / WINDOW;
+    if (window != entry->window) {
+        entry->previous = (window == entry->window + 1) ? entry->connects : 0;
+        entry->connects = 0;
+        entry->window = window;
+    }
+    if (entry->connects < UINT16_MAX)
+        entry->connects++;
+
+    const uint32_t remaining = WINDOW - now % WINDOW;
+    return entry->connects + (entry->previous * remaining) / WINDOW;
+}
+
+
+static const admission_rule_t*
+find_rule (const uint8_t addr[16])
+{
+    for (unsigned i = 0; i < s_limits.n_rules; i++)
+        if (prefix_match (addr, s_rules[i].addr, s_rules[i].prefix))
+            return &s_rules[i];
+    return NULL;
+}
+
+
+static struct ticket*
+ticket_get (int fd)
+{
+    if ((size_t) fd >= s_n_tickets) {
+        size_t n = s_n_tickets ? s_n_tickets : 64;
+        while (n <= (size_t) fd)
+            n *= 2;
+        s_tickets = w_resize (s_tickets, struct ticket, n);
+        memset (s_tickets + s_n_tickets, 0x00, sizeof (struct ticket) * (n - s_n_tickets));
+        s_n_tickets = n;
+    }
+    return &s_tickets[fd];
+}
+
+
+static admission_result_t
+check (const uint8_t addr[16], bool *exempt)
+{
+    const admission_rule_t *rule = find_rule (addr);
+    if (rule && rule->limit == 0)
+        return ADMISSION_DENIED;
+
+    uint8_t subnet[16];
+    subnet_of (addr, subnet);
+
+    reserve (2);
+    const uint32_t now = now_seconds ();
+    struct entry *ip = lookup (addr, KIND_IP);
+    struct entry *net = rule ? NULL : lookup (subnet, KIND_SUBNET);
+
+    /* Rejected attempts count too, so floods stay rejected. */
+    const unsigned ip_rate = count_attempt (ip, now);
+    const unsigned net_rate = net ? count_attempt (net, now) : 0;
+
+    if (ip->count >= (rule ? rule->limit : s_limits.limit_ip))
+        return ADMISSION_IP_LIMIT;
+    if (ip_rate > (rule ? rule->rate : s_limits.rate_ip))
+        return ADMISSION_IP_RATE;
+    if (net && net->count >= s_limits.limit_subnet)
+        return ADMISSION_SUBNET_LIMIT;
+    if (net && net_rate > s_limits.rate_subnet)
+        return ADMISSION_SUBNET_RATE;
+    if (s_stats.pending >= s_limits.pending_max)
+        return ADMISSION_PENDING_LIMIT;
+
+    if (ip->count < UINT16_MAX)
+        ip->count++;
+    if (net && net->count < UINT16_MAX)
+        net->count++;
+    *exempt = (net == NULL);
+    return ADMISSION_OK;
+}
+
+
+admission_result_t
+admission_admit (int fd, const struct sockaddr *addr, socklen_t length)
+{
+    w_assert (fd >= 0);
+    w_assert (addr);
+
+    /* Only network connections are limited. */
+    uint8_t key[16];
+    if (!normalize (addr, length, key))
+        return ADMISSION_OK;
+
+    bool exempt = false;
+    const admission_result_t result = check (key, &exempt);
+    if (result != ADMISSION_OK) {
+        s_stats.rejected[result]++;
+        return result;
+    }
+
+    /* A descriptor is only reused once closed, but better safe. */
+    admission_release (fd);
+
+    struct ticket *ticket = ticket_get (fd);
+    memcpy (ticket->addr, key, 16);
+    ticket->active = true;
+    ticket->pending = true;
+    ticket->exempt = exempt;
+    s_stats.pending++;
+    s_stats.admitted++;
+    return ADMISSION_OK;
+}
+
+
+void
+admission_registered (int fd)
+{
+    if (fd < 0 || (size_t) fd >= s_n_tickets)
+        return;
+
+    struct ticket *ticket = &s_tickets[fd];
+    if (ticket->active && ticket->pending) {
+        ticket->pending = false;
+        s_stats.pending--;
+    }
+}
+
+
+static void
+release_entry (const uint8_t key[16], uint8_t kind)
+{
+    struct entry *entry = find (key, kind);
+    if (entry && entry->count > 0)
+        entry->count--;
+}
+
+
+void
+admission_release (int fd)
+{
+    if (fd < 0 || (size_t) fd >= s_n_tickets || !s_tickets[fd].active)
+        return;
+
+    struct ticket *ticket = &s_tickets[fd];
+    release_entry (ticket->addr, KIND_IP);
+    if (!ticket->exempt) {
+        uint8_t subnet[16];
+        subnet_of (ticket->addr, subnet);
+        release_entry (subnet, KIND_SUBNET);
+    }
+    if (ticket->pending)
+        s_stats.pending--;
+    memset (ticket, 0x00, sizeof (*ticket));
+}
+
+
+const char*
+admission_result_name (admission_result_t result)
+{
+    switch (result) {
+        case ADMISSION_OK:            return "admitted";
+        case ADMISSION_IP_LIMIT:      return "too many connections from address";
+        case ADMISSION_IP_RATE:       return "connecting too fast from address";
+        case ADMISSION_SUBNET_LIMIT:  return "too many connections from subnet";
+        case ADMISSION_SUBNET_RATE:   return "connecting too fast from subnet";
+        case ADMISSION_PENDING_LIMIT: return "too many unregistered connections";
+        case ADMISSION_DENIED:        return "denied";
+        case ADMISSION_N_RESULTS:     break;
+    }
+    return "unknown";
+}
+
+
+void
+admission_get_stats (admission_stats_t *stats)
+{
+    w_assert (stats);
+    *stats = s_stats;
+    stats->tracked = (unsigned) s_table_used;
+}
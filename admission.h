@@ -0,0 +1,107 @@
+/*
+ * admission.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "wheel/wheel.h"
+#include <sys/socket.h>
+
+/*
+ * Admission control for accepted connections, checked before a task is
+ * created for them. Keeps the number of open connections and the recent
+ * connection rate of each address and of each subnet (/24 for IPv4, /64
+ * for IPv6), and limits the number of connections which have not
+ * registered yet. "allow" rules in the configuration give other limits to
+ * address ranges, I-line style, and exempt them from the subnet limits.
+ *
+ * Connections are identified by their file descriptor from the moment
+ * they are admitted until they are released.
+ */
+
+#ifndef CHATEAU_CONNECT_LIMIT_IP
+#define CHATEAU_CONNECT_LIMIT_IP 10
+#endif /* !CHATEAU_CONNECT_LIMIT_IP */
+
+#ifndef CHATEAU_CONNECT_LIMIT_SUBNET
+#define CHATEAU_CONNECT_LIMIT_SUBNET 64
+#endif /* !CHATEAU_CONNECT_LIMIT_SUBNET */
+
+#ifndef CHATEAU_CONNECT_RATE_IP
+#define CHATEAU_CONNECT_RATE_IP 20 /* per minute */
+#endif /* !CHATEAU_CONNECT_RATE_IP */
+
+#ifndef CHATEAU_CONNECT_RATE_SUBNET
+#define CHATEAU_CONNECT_RATE_SUBNET 120 /* per minute */
+#endif /* !CHATEAU_CONNECT_RATE_SUBNET */
+
+#ifndef CHATEAU_PENDING_MAX
+#define CHATEAU_PENDING_MAX 1024
+#endif /* !CHATEAU_PENDING_MAX */
+
+
+typedef enum {
+    ADMISSION_OK = 0,
+    ADMISSION_IP_LIMIT,
+    ADMISSION_IP_RATE,
+    ADMISSION_SUBNET_LIMIT,
+    ADMISSION_SUBNET_RATE,
+    ADMISSION_PENDING_LIMIT,
+    ADMISSION_DENIED,         /* By an "allow" rule with no connections. */
+
+    ADMISSION_N_RESULTS
+} admission_result_t;
+
+typedef struct {
+    uint8_t  addr[16];        /* IPv4 addresses are mapped to IPv6. */
+    uint8_t  prefix;          /* In bits, of the mapped address. */
+    unsigned limit;
+    unsigned rate;
+} admission_rule_t;
+
+typedef struct {
+    unsigned      limit_ip;
+    unsigned      limit_subnet;
+    unsigned      rate_ip;
+    unsigned      rate_subnet;
+    unsigned      pending_max;
+    const admission_rule_t *rules;
+    unsigned      n_rules;
+} admission_limits_t;
+
+typedef struct {
+    unsigned      pending;
+    unsigned      tracked;    /* Addresses and subnets in the table. */
+    unsigned long admitted;
+    unsigned long rejected[ADMISSION_N_RESULTS];
+} admission_stats_t;
+
+
+/* Parses "address[/prefix]" into a rule, without its limits. */
+extern bool admission_rule_parse (admission_rule_t *rule, const char *text);
+
+/* Limits are copied, the rules may be freed afterwards. */
+extern void admission_set_limits (const admission_limits_t *limits);
+
+/*
+ * Decides whether the connection on "fd" from "addr" is accepted. If it is,
+ * it is accounted until admission_release() is called.
+ */
+extern admission_result_t admission_admit (int                    fd,
+                                           const struct sockaddr *addr,
+                                           socklen_t              length);
+
+/* The connection registered, it no longer counts as pending. */
+extern void admission_registered (int fd);
+
+extern void admission_release (int fd);
+
+extern const char* admission_result_name (admission_result_t result);
+
+extern void admission_get_stats (admission_stats_t *stats);
+
+#endif /* !ADMISSION_H */
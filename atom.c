@@ -0,0 +1,80 @@
+/*
+ * atom.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "atom.h"
+#include "proto-irc.h"
+
+
+/* Atoms keyed by their (unfolded) text. */
+static w_dict_t *s_atoms = NULL;
+static size_t    s_bytes = 0;
+
+
+static inline size_t
+atom_size (size_t length)
+{
+    /* Text and folded text, both NUL-terminated. */
+    return sizeof (atom_t) + 2 * (length + 1);
+}
+
+
+atom_t*
+atom_intern (const char *str, size_t length)
+{
+    w_assert (str);
+
+    if (!s_atoms)
+        s_atoms = w_dict_new (false);
+
+    atom_t *atom = w_dict_getn (s_atoms, str, length);
+    if (atom)
+        return atom_ref (atom);
+
+    atom = w_malloc (atom_size (length));
+    atom->refs = 1;
+    atom->length = length;
+    memcpy (atom->text, str, length);
+    atom->text[length] = '\0';
+
+    char *folded = atom->text + length + 1;
+    irc_casefold (folded, str, length);
+    folded[length] = '\0';
+    atom->folded = folded;
+
+    w_dict_setn (s_atoms, atom->text, length, atom);
+    s_bytes += atom_size (length);
+    return atom;
+}
+
+
+void
+atom_unref (atom_t *atom)
+{
+    if (!atom)
+        return;
+
+    w_assert (atom->refs > 0);
+    if (--atom->refs == 0) {
+        s_bytes -= atom_size (atom->length);
+        w_dict_deln (s_atoms, atom->text, atom->length);
+        w_free (atom);
+    }
+}
+
+
+unsigned
+atom_count (void)
+{
+    return s_atoms ? w_dict_size (s_atoms) : 0;
+}
+
+
+size_t
+atom_bytes (void)
+{
+    return s_bytes;
+}
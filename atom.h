@@ -0,0 +1,79 @@
+/*
+ * atom.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef ATOM_H
+#define ATOM_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Interned strings: nicks, hosts and channel names repeat all the time,
+ * so each distinct string is stored once in a table shared by the whole
+ * server, along with its RFC1459 case-folded form. Equal strings are the
+ * same atom and can be compared by pointer; the folded form is used as
+ * key wherever names are looked up without regard to case.
+ */
+typedef struct atom atom_t;
+
+struct atom {
+    unsigned    refs;
+    unsigned    length;
+    const char *folded;   /* Stored right after the text. */
+    char        text[];
+};
+
+
+/* Returns a new reference to the atom for the string. */
+extern atom_t* atom_intern (const char *str, size_t length);
+
+static inline atom_t*
+atom_ref (atom_t *atom)
+{
+    w_assert (atom);
+    atom->refs++;
+    return atom;
+}
+
+/* Atoms are freed once the last reference is dropped. Accepts NULL. */
+extern void atom_unref (atom_t *atom);
+
+static inline const char*
+atom_str (const atom_t *atom)
+{
+    w_assert (atom);
+    return atom->text;
+}
+
+static inline size_t
+atom_length (const atom_t *atom)
+{
+    w_assert (atom);
+    return atom->length;
+}
+
+static inline const char*
+atom_folded (const atom_t *atom)
+{
+    w_assert (atom);
+    return atom->folded;
+}
+
+/* Whether two atoms are equal ignoring case, without folding anything. */
+static inline bool
+atom_case_equal (const atom_t *a, const atom_t *b)
+{
+    w_assert (a);
+    w_assert (b);
+    return a == b || (a->length == b->length &&
+                      memcmp (a->folded, b->folded, a->length) == 0);
+}
+
+/* Number of atoms in the table, and bytes used by them. */
+extern unsigned atom_count (void);
+extern size_t atom_bytes (void);
+
+#endif /* !ATOM_H */
@@ -6,12 +6,15 @@
  */
 
 #include "auth.h"
+#include "sasl.h"
 
 
 W_OBJ (auth_simple_mem_agent_t)
 {
     auth_agent_t parent;
     const auth_simple_mem_agent_entry_t *entries;
+    auth_scram_keys_t *keys;  /* Same order as the entries. */
+    size_t n_entries;
 };
 
 
@@ -33,14 +36,94 @@ auth_simple_mem_agent_authenticate (auth_agent_t *agent,
 }
 
 
+static bool
+auth_simple_mem_agent_scram_keys (auth_agent_t      *agent,
+                                  const char        *user,
+                                  auth_scram_keys_t *keys)
+{
+    auth_simple_mem_agent_t *mem = (auth_simple_mem_agent_t*) agent;
+    for (size_t i = 0; i < mem->n_entries; i++) {
+        if (strcmp (user, mem->entries[i].user) == 0) {
+            *keys = mem->keys[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void
+auth_simple_mem_agent_destroy (void *obj)
+{
+    auth_simple_mem_agent_t *agent = obj;
+    if (agent->keys) {
+        memset (agent->keys, 0x00, sizeof (auth_scram_keys_t) * agent->n_entries);
+        w_free (agent->keys);
+    }
+}
+
+
+/* Keys with iterations unset are still to be derived. */
+static void
+reuse_keys (auth_simple_mem_agent_t       *agent,
+            const auth_simple_mem_agent_t *previous,
+            unsigned                       scram_iterations)
+{
+    for (size_t i = 0; i < agent->n_entries; i++) {
+        agent->keys[i].iterations = 0;
+        if (!previous || !previous->keys)
+            continue;
+
+        const auth_simple_mem_agent_entry_t *entry = &agent->entries[i];
+        for (size_t j = 0; j < previous->n_entries; j++) {
+            if (strcmp (entry->user, previous->entries[j].user) == 0) {
+                if (strcmp (entry->pass, previous->entries[j].pass) == 0 &&
+                    previous->keys[j].iterations == scram_iterations)
+                    agent->keys[i] = previous->keys[j];
+                break;
+            }
+        }
+    }
+}
+
+
 auth_agent_t*
-auth_simple_mem_agent_new (const auth_simple_mem_agent_entry_t *entries)
+auth_simple_mem_agent_new (const auth_simple_mem_agent_entry_t *entries,
+                           unsigned                             scram_iterations,
+                           const auth_agent_t                  *previous)
 {
     w_assert (entries);
+    w_assert (scram_iterations > 0);
 
     auth_simple_mem_agent_t *agent = w_obj_new (auth_simple_mem_agent_t);
     auth_agent_init (&agent->parent, auth_simple_mem_agent_authenticate);
     agent->entries = entries;
 
-    return (auth_agent_t*) agent;
+    while (entries[agent->n_entries].user)
+        agent->n_entries++;
+
+    /*
+     * Without keys for everybody, SCRAM is not offered at all. The previous
+     * agent is only looked at before yielding, as it may go away after.
+     */
+    bool derived = true;
+    if (agent->n_entries) {
+        agent->keys = w_alloc (auth_scram_keys_t, agent->n_entries);
+        reuse_keys (agent, (const auth_simple_mem_agent_t*) previous,
+                    scram_iterations);
+
+        const bool in_task = w_task_current () != NULL;
+        for (size_t i = 0; i < agent->n_entries && derived; i++) {
+            if (agent->keys[i].iterations)
+                continue;
+            derived = sasl_scram_derive (entries[i].pass, scram_iterations,
+                                         &agent->keys[i]);
+            if (in_task)
+                w_task_yield ();
+        }
+    }
+    if (derived)
+        agent->parent.scram_keys = auth_simple_mem_agent_scram_keys;
+
+    return w_obj_dtor ((auth_agent_t*) agent, auth_simple_mem_agent_destroy);
 }
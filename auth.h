@@ -12,12 +12,30 @@
 
 W_OBJ_DECL (auth_agent_t);
 
+enum {
+    AUTH_SCRAM_SALT_SIZE = 16,
+    AUTH_SCRAM_KEY_SIZE  = 32,  /* SHA-256 */
+};
+
+/* What a SCRAM server stores instead of the password (RFC 5802). */
+typedef struct {
+    uint8_t  salt[AUTH_SCRAM_SALT_SIZE];
+    unsigned iterations;
+    uint8_t  stored_key[AUTH_SCRAM_KEY_SIZE];
+    uint8_t  server_key[AUTH_SCRAM_KEY_SIZE];
+} auth_scram_keys_t;
+
 W_OBJ_DEF (auth_agent_t)
 {
     w_obj_t parent;
     bool (*authenticate) (auth_agent_t *agent,
                           const char   *user,
                           const char   *pass);
+
+    /* Optional, agents which only check passwords leave it NULL. */
+    bool (*scram_keys) (auth_agent_t      *agent,
+                        const char        *user,
+                        auth_scram_keys_t *keys);
 };
 
 
@@ -27,6 +45,7 @@ auth_agent_init (auth_agent_t *agent,
 {
     w_assert (agent);
     agent->authenticate = authenticate;
+    agent->scram_keys = NULL;
 }
 
 static inline bool
@@ -43,6 +62,27 @@ auth_agent_authenticate (auth_agent_t *agent,
         : false;
 }
 
+static inline bool
+auth_agent_has_scram_keys (const auth_agent_t *agent)
+{
+    w_assert (agent);
+    return agent->scram_keys != NULL;
+}
+
+static inline bool
+auth_agent_scram_keys (auth_agent_t      *agent,
+                       const char        *user,
+                       auth_scram_keys_t *keys)
+{
+    w_assert (agent);
+    w_assert (user);
+    w_assert (keys);
+
+    return agent->scram_keys
+        ? (*agent->scram_keys) (agent, user, keys)
+        : false;
+}
+
 
 extern auth_agent_t* auth_pam_agent_new (const char *service);
 
@@ -52,8 +92,17 @@ typedef struct {
     const char *pass;
 } auth_simple_mem_agent_entry_t;
 
+/*
+ * Keys for SCRAM are derived once per user when the agent is created,
+ * with "scram_iterations" rounds of PBKDF2. Keys of users whose password
+ * and iterations are the same in "previous", an agent created by this
+ * function too, are kept instead. When called from a task, it yields
+ * after deriving each key, so a rehash does not stall other clients.
+ */
 extern auth_agent_t*
-auth_simple_mem_agent_new (const auth_simple_mem_agent_entry_t *entries);
+auth_simple_mem_agent_new (const auth_simple_mem_agent_entry_t *entries,
+                           unsigned                             scram_iterations,
+                           const auth_agent_t                  *previous);
 
 
 #endif /* !AUTH_H */
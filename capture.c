@@ -0,0 +1,212 @@
+/*
+ * capture.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "capture.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+
+#ifndef CHATEAU_CAPTURE_BUFFER
+#define CHATEAU_CAPTURE_BUFFER (64 * 1024)
+#endif /* !CHATEAU_CAPTURE_BUFFER */
+
+
+/* Connection whose input is recorded. */
+W_OBJ (capture_io_t)
+{
+    w_io_t   parent;
+    w_io_t  *socket;
+    uint32_t id;
+    bool     closed;
+};
+
+
+static int      s_fd = -1;
+static w_buf_t  s_buffer = W_BUF;
+static uint32_t s_next_id = 1;
+static uint64_t s_last_us = 0;
+
+
+static uint64_t
+now_us (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void
+put_u32 (w_buf_t *buf, uint32_t value)
+{
+    const uint8_t bytes[4] = {
+        value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24,
+    };
+    w_buf_append_mem (buf, bytes, sizeof (bytes));
+}
+
+
+/*
+ * Writes out the buffered records. The trace is a local file, so this is
+ * a plain blocking write, done once per CHATEAU_CAPTURE_BUFFER bytes.
+ */
+static void
+flush_buffer (void)
+{
+    const char *data = w_buf_data (&s_buffer);
+    size_t length = w_buf_size (&s_buffer);
+
+    while (length > 0) {
+        ssize_t r = write (s_fd, data, length);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            w_printerr ("capture: Write failed, stopping: $s\n", strerror (errno));
+            w_buf_clear (&s_buffer);
+            close (s_fd);
+            s_fd = -1;
+            return;
+        }
+        data += r;
+        length -= r;
+    }
+    w_buf_clear (&s_buffer);
+}
+
+
+static void
+record (uint8_t type, uint32_t id, const void *data, size_t length)
+{
+    if (s_fd < 0)
+        return;
+
+    const uint64_t now = now_us ();
+    const uint64_t delay = now - s_last_us;
+    s_last_us = now;
+
+    w_buf_append_mem (&s_buffer, &type, 1);
+    put_u32 (&s_buffer, id);
+    put_u32 (&s_buffer, delay > UINT32_MAX ? UINT32_MAX : (uint32_t) delay);
+    if (type == CAPTURE_DATA) {
+        put_u32 (&s_buffer, (uint32_t) length);
+        w_buf_append_mem (&s_buffer, data, length);
+    }
+
+    if (w_buf_size (&s_buffer) >= CHATEAU_CAPTURE_BUFFER)
+        flush_buffer ();
+}
+
+
+bool
+capture_open (const char *path)
+{
+    w_assert (path);
+    w_assert (s_fd < 0);
+
+    if ((s_fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0)
+        return false;
+
+    w_buf_append_mem (&s_buffer, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH);
+    s_last_us = now_us ();
+    return true;
+}
+
+
+void
+capture_close (void)
+{
+    if (s_fd >= 0) {
+        flush_buffer ();
+        if (s_fd >= 0)
+            close (s_fd);
+        s_fd = -1;
+    }
+}
+
+
+bool
+capture_is_open (void)
+{
+    return s_fd >= 0;
+}
+
+
+static w_io_result_t
+capture_io_read (w_io_t *io, void *buf, size_t len)
+{
+    capture_io_t *capture = (capture_io_t*) io;
+    w_io_result_t r = w_io_read (capture->socket, buf, len);
+    if (!w_io_failed (r) && w_io_result_bytes (r) > 0)
+        record (CAPTURE_DATA, capture->id, buf, w_io_result_bytes (r));
+    return r;
+}
+
+
+static w_io_result_t
+capture_io_write (w_io_t *io, const void *buf, size_t len)
+{
+    return w_io_write (((capture_io_t*) io)->socket, buf, len);
+}
+
+
+static w_io_result_t
+capture_io_flush (w_io_t *io)
+{
+    return w_io_flush (((capture_io_t*) io)->socket);
+}
+
+
+static w_io_result_t
+capture_io_close (w_io_t *io)
+{
+    capture_io_t *capture = (capture_io_t*) io;
+    if (capture->closed)
+        return W_IO_RESULT_SUCCESS;
+
+    capture->closed = true;
+    record (CAPTURE_CLOSE, capture->id, NULL, 0);
+    return w_io_close (capture->socket);
+}
+
+
+static int
+capture_io_getfd (w_io_t *io)
+{
+    return w_io_get_fd (((capture_io_t*) io)->socket);
+}
+
+
+static void
+capture_io_destroy (void *obj)
+{
+    capture_io_t *capture = obj;
+    W_IO_NORESULT (capture_io_close ((w_io_t*) capture));
+    w_obj_unref (capture->socket);
+}
+
+
+w_io_t*
+capture_wrap (w_io_t *socket)
+{
+    w_assert (socket);
+
+    capture_io_t *capture = w_obj_new (capture_io_t);
+    w_io_init ((w_io_t*) capture);
+    capture->parent.read = capture_io_read;
+    capture->parent.write = capture_io_write;
+    capture->parent.flush = capture_io_flush;
+    capture->parent.close = capture_io_close;
+    capture->parent.getfd = capture_io_getfd;
+    capture->socket = socket;
+    capture->id = s_next_id++;
+
+    record (CAPTURE_OPEN, capture->id, NULL, 0);
+    return w_obj_dtor ((w_io_t*) capture, capture_io_destroy);
+}
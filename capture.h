@@ -0,0 +1,55 @@
+/*
+ * capture.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Traffic capture. When enabled, the bytes received from every client
+ * connection are recorded to a trace file, which chateau-replay can feed
+ * back to a server to reproduce the same load.
+ *
+ * A trace is the magic string followed by records, all integers being
+ * little endian:
+ *
+ *   u8  type        CAPTURE_OPEN, CAPTURE_DATA or CAPTURE_CLOSE
+ *   u32 connection  Identifier, unique within the trace.
+ *   u32 delay       Microseconds since the previous record.
+ *   u32 length      Bytes of data following, only for CAPTURE_DATA.
+ *
+ * Records appear in the order the server saw them, which the replay keeps.
+ */
+
+#define CAPTURE_MAGIC "CHTRACE1"
+
+enum {
+    CAPTURE_MAGIC_LENGTH = 8,
+    CAPTURE_HEADER_SIZE  = 13,  /* Without the data. */
+};
+
+enum {
+    CAPTURE_OPEN  = 1,
+    CAPTURE_DATA  = 2,
+    CAPTURE_CLOSE = 3,
+};
+
+
+/* Starts writing a new trace to "path", replacing it if it exists. */
+extern bool capture_open (const char *path);
+extern void capture_close (void);
+extern bool capture_is_open (void);
+
+/*
+ * Returns a socket which records everything read through it, and closes
+ * the connection in the trace when it is closed. Consumes the reference
+ * to "socket".
+ */
+extern w_io_t* capture_wrap (w_io_t *socket);
+
+#endif /* !CAPTURE_H */
@@ -0,0 +1,430 @@
+/*
+ * channel.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "channel.h"
+#include "link.h"
+#include "proto-irc.h"
+
+
+enum {
+    /* Leaves room for ":server 353 nick " in front, with margin. */
+    NAMES_LINE_MAX = IRC_MAX_LINE - 64,
+};
+
+
+/* Maps case-folded names (see atom_folded()) to channel_t objects. */
+static w_dict_t *s_channels = NULL;
+
+
+static bool
+fold_name (char key[CHANNEL_NAME_MAX + 1], const char *name, size_t length)
+{
+    if (!channel_name_is_valid (name, length))
+        return false;
+    irc_casefold (key, name, length);
+    key[length] = '\0';
+    return true;
+}
+
+
+static void
+channel_destroy (void *obj)
+{
+    channel_t *channel = obj;
+    w_assert (channel->n_members == 0);
+    history_clear (&channel->history);
+    w_buf_clear (&channel->names);
+    if (channel->bans)
+        w_obj_unref (channel->bans);
+    atom_unref (channel->name);
+    w_free (channel->members);
+    w_free (channel->modes);
+    w_free (channel->slots);
+}
+
+
+/*
+ * <channel> ::= ('#' | '&') <chstring>, where <chstring> is any octet
+ * except SPACE, BELL, NUL, CR, LF and comma.
+ */
+bool
+channel_name_is_valid (const char *name, size_t length)
+{
+    w_assert (name);
+
+    if (length < 2 || length > CHANNEL_NAME_MAX)
+        return false;
+    if (name[0] != '#' && name[0] != '&')
+        return false;
+
+    for (size_t i = 1; i < length; i++) {
+        switch (name[i]) {
+            case ' ': case '\a': case '\0':
+            case '\r': case '\n': case ',':
+                return false;
+        }
+    }
+    return true;
+}
+
+
+channel_t*
+channel_lookup (const char *name, size_t length)
+{
+    char key[CHANNEL_NAME_MAX + 1];
+    if (!s_channels || !fold_name (key, name, length))
+        return NULL;
+    return w_dict_get (s_channels, key);
+}
+
+
+/*
+ * Position of the channel in the list of the client. Clients are in few
+ * channels, while channels may have many members: this is cheaper than
+ * searching the members.
+ */
+static int
+find_slot (const client_t *client, const channel_t *channel)
+{
+    for (unsigned i = 0; i < client->n_channels; i++)
+        if (client->channels[i] == channel)
+            return (int) i;
+    return -1;
+}
+
+
+bool
+channel_has_member (const channel_t *channel, const client_t *client)
+{
+    w_assert (channel);
+    w_assert (client);
+    return find_slot (client, channel) >= 0;
+}
+
+
+uint8_t
+channel_member_modes (const channel_t *channel, const client_t *client)
+{
+    w_assert (channel);
+    w_assert (client);
+
+    int slot = find_slot (client, channel);
+    return (slot < 0) ? 0 : channel->modes[client->slots[slot]];
+}
+
+
+bool
+channel_set_member_modes (channel_t *channel, const client_t *client, uint8_t modes)
+{
+    w_assert (channel);
+    w_assert (client);
+
+    int slot = find_slot (client, channel);
+    if (slot < 0 || channel->modes[client->slots[slot]] == modes)
+        return false;
+
+    /* Prefixes in the cached names may change. */
+    channel->modes[client->slots[slot]] = modes;
+    w_buf_clear (&channel->names);
+    return true;
+}
+
+
+bool
+channel_is_banned (const channel_t *channel, client_t *client)
+{
+    w_assert (channel);
+    w_assert (client);
+
+    if (!channel->bans || !mask_set_count (channel->bans))
+        return false;
+
+    size_t length;
+    const char *mask = client_mask_folded_cached (client, &length);
+    return mask && mask_set_match_folded (channel->bans, mask, length) != NULL;
+}
+
+
+channel_t*
+channel_get (const char *name, size_t length)
+{
+    char key[CHANNEL_NAME_MAX + 1];
+    if (!fold_name (key, name, length))
+        return NULL;
+
+    if (!s_channels)
+        s_channels = w_dict_new (false);
+
+    channel_t *channel = w_dict_get (s_channels, key);
+    if (!channel) {
+        channel = w_obj_new (channel_t);
+        channel->name = atom_intern (name, length);
+        history_init (&channel->history);
+        w_obj_dtor (channel, channel_destroy);
+        w_dict_set (s_channels, atom_folded (channel->name), channel);
+    }
+    return channel;
+}
+
+
+static void
+names_append (channel_t *channel, unsigned member)
+{
+    const atom_t *nick = channel->members[member]->nick;
+    const uint8_t modes = channel->modes[member];
+    const bool prefixed = modes & (CHANNEL_MODE_OP | CHANNEL_MODE_VOICE);
+    const size_t length = atom_length (nick) + (prefixed ? 1 : 0);
+
+    w_buf_t *names = &channel->names;
+    if (w_buf_size (names) &&
+        w_buf_size (names) - channel->names_last + length + 1 <= NAMES_LINE_MAX) {
+        /* Fits in the last line: replace its CRLF. */
+        w_buf_resize (names, w_buf_size (names) - 2);
+        w_buf_append_char (names, ' ');
+    } else {
+        channel->names_last = w_buf_size (names);
+        w_buf_format (names, "= $s :", atom_str (channel->name));
+    }
+
+    if (modes & CHANNEL_MODE_OP)
+        w_buf_append_char (names, '@');
+    else if (modes & CHANNEL_MODE_VOICE)
+        w_buf_append_char (names, '+');
+    w_buf_append_mem (names, atom_str (nick), atom_length (nick));
+    w_buf_append_str (names, "\r\n");
+}
+
+
+const w_buf_t*
+channel_names (channel_t *channel)
+{
+    w_assert (channel);
+
+    if (!w_buf_size (&channel->names))
+        for (unsigned i = 0; i < channel->n_members; i++)
+            names_append (channel, i);
+    return &channel->names;
+}
+
+
+channel_t*
+channel_join (const char *name, size_t length, client_t *client)
+{
+    w_assert (client);
+
+    channel_t *channel = channel_get (name, length);
+    if (!channel || channel_has_member (channel, client))
+        return NULL;
+
+    if (channel->n_members == channel->a_members) {
+        channel->a_members = channel->a_members ? channel->a_members * 2 : 8;
+        channel->members = w_resize (channel->members, client_t*, channel->a_members);
+        channel->modes = w_resize (channel->modes, uint8_t, channel->a_members);
+        channel->slots = w_resize (channel->slots, unsigned, channel->a_members);
+    }
+    if (client->n_channels == client->a_channels) {
+        client->a_channels = client->a_channels ? client->a_channels * 2 : 4;
+        client->channels = w_resize (client->channels, channel_t*, client->a_channels);
+        client->slots = w_resize (client->slots, unsigned, client->a_channels);
+    }
+
+    const unsigned member = channel->n_members++;
+    const unsigned slot = client->n_channels++;
+
+    channel->members[member] = client;
+    channel->modes[member] = member ? 0 : CHANNEL_MODE_OP;
+    channel->slots[member] = slot;
+
+    client->channels[slot] = channel;
+    client->slots[slot] = member;
+
+    /* Joins are the common change, and during join floods the only one. */
+    if (w_buf_size (&channel->names))
+        names_append (channel, member);
+
+    return channel;
+}
+
+
+void
+channel_part (channel_t *channel, client_t *client)
+{
+    w_assert (channel);
+    w_assert (client);
+
+    int slot = find_slot (client, channel);
+    if (slot < 0)
+        return;
+
+    /* Swap-remove from both sides, fixing up the entries moved. */
+    const unsigned member = client->slots[slot];
+    const unsigned last_member = --channel->n_members;
+    if (member != last_member) {
+        client_t *moved = channel->members[last_member];
+        channel->members[member] = moved;
+        channel->modes[member] = channel->modes[last_member];
+        channel->slots[member] = channel->slots[last_member];
+        moved->slots[channel->slots[member]] = member;
+    }
+
+    w_buf_clear (&channel->names);
+
+    const unsigned last_slot = --client->n_channels;
+    if ((unsigned) slot != last_slot) {
+        channel_t *moved = client->channels[last_slot];
+        client->channels[slot] = moved;
+        client->slots[slot] = client->slots[last_slot];
+        moved->slots[client->slots[slot]] = slot;
+    }
+
+    channel_collect (channel);
+}
+
+
+void
+channel_collect (channel_t *channel)
+{
+    w_assert (channel);
+
+    /*
+     * Empty channels are kept around while they have scrollback or bans,
+     * so those are still there for the next client joining.
+     */
+    if (channel->n_members == 0 && history_is_empty (&channel->history) &&
+        !(channel->bans && mask_set_count (channel->bans)) &&
+        w_dict_get (s_channels, atom_folded (channel->name)) == channel) {
+        w_dict_del (s_channels, atom_folded (channel->name));
+        w_obj_unref (channel);
+    }
+}
+
+
+unsigned
+channel_snapshot (channel_t ***channels)
+{
+    w_assert (channels);
+
+    *channels = NULL;
+    if (!s_channels || !w_dict_size (s_channels))
+        return 0;
+
+    unsigned n = 0;
+    *channels = w_alloc (channel_t*, w_dict_size (s_channels));
+    w_dict_foreach (s_channels, i)
+        (*channels)[n++] = w_obj_ref (*i);
+    return n;
+}
+
+
+void
+channel_snapshot_free (channel_t **channels, unsigned n_channels)
+{
+    for (unsigned i = 0; i < n_channels; i++)
+        w_obj_unref (channels[i]);
+    w_free (channels);
+}
+
+
+/* Incremented on each fan-out, to mark the links and clients used. */
+static unsigned s_stamp = 0;
+
+
+/* Local members get the tags for their capabilities, if any are given. */
+static void
+fan_out (channel_t     *channel,
+         client_t      *except,
+         const w_buf_t *tags,
+         const void    *data,
+         size_t         length)
+{
+    const link_t *except_link = except ? except->link : NULL;
+    const unsigned stamp = ++s_stamp;
+
+    for (unsigned i = 0; i < channel->n_members; i++) {
+        client_t *member = channel->members[i];
+        if (member == except)
+            continue;
+        if (member->link) {
+            if (member->link == except_link || member->link->stamp == stamp)
+                continue;
+            member->link->stamp = stamp;
+        }
+        if (tags)
+            W_IO_NORESULT (client_send_tagged (member, tags, data, length));
+        else
+            W_IO_NORESULT (client_send (member, data, length));
+    }
+}
+
+
+void
+channel_send (channel_t  *channel,
+              client_t   *except,
+              const void *data,
+              size_t      length)
+{
+    w_assert (channel);
+    w_assert (data);
+    fan_out (channel, except, NULL, data, length);
+}
+
+
+void
+channel_send_tagged (channel_t     *channel,
+                     client_t      *except,
+                     const w_buf_t  tags[CLIENT_CAP_TAG_VARIANTS],
+                     const void    *data,
+                     size_t         length)
+{
+    w_assert (channel);
+    w_assert (tags);
+    w_assert (data);
+    fan_out (channel, except, tags, data, length);
+}
+
+
+void
+channel_send_local (channel_t  *channel,
+                    client_t   *except,
+                    const void *data,
+                    size_t      length)
+{
+    w_assert (channel);
+    w_assert (data);
+
+    for (unsigned i = 0; i < channel->n_members; i++) {
+        client_t *member = channel->members[i];
+        if (member != except && client_is_local (member))
+            W_IO_NORESULT (client_send (member, data, length));
+    }
+}
+
+
+void
+channel_quit (client_t *client, const char *reason)
+{
+    w_assert (client);
+    w_assert (reason);
+
+    w_buf_t line = W_BUF;
+    if (client_is_registered (client))
+        w_buf_format (&line, ":$s QUIT :$s\r\n", atom_str (client->nick), reason);
+
+    const unsigned stamp = ++s_stamp;
+    while (client->n_channels > 0) {
+        channel_t *channel = client->channels[client->n_channels - 1];
+        for (unsigned i = 0; w_buf_size (&line) && i < channel->n_members; i++) {
+            client_t *member = channel->members[i];
+            if (member == client || !client_is_local (member) || member->stamp == stamp)
+                continue;
+            member->stamp = stamp;
+            W_IO_NORESULT (client_send (member, w_buf_data (&line), w_buf_size (&line)));
+        }
+        channel_part (channel, client);
+    }
+    w_buf_clear (&line);
+}
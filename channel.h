@@ -0,0 +1,145 @@
+/*
+ * channel.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "client.h"
+#include "history.h"
+#include "mask.h"
+
+
+enum {
+    CHANNEL_NAME_MAX = 200,  /* RFC1459, section 1.3 */
+};
+
+
+/* Mode bits of a member in a channel. */
+enum {
+    CHANNEL_MODE_OP    = 1 << 0,
+    CHANNEL_MODE_VOICE = 1 << 1,
+};
+
+
+W_OBJ_DEF (channel_t)
+{
+    w_obj_t    parent;
+    atom_t    *name;
+
+    /*
+     * Membership is kept in parallel arrays: member clients, their mode
+     * bits, and the position of the channel in the list of channels of
+     * each member (see client_t). Fan-outs only walk "members", and
+     * joining or parting never needs to search the arrays.
+     */
+    client_t **members;
+    uint8_t   *modes;
+    unsigned  *slots;
+    unsigned   n_members;
+    unsigned   a_members;
+
+    history_t  history;
+    mask_set_t *bans;    /* NULL until the first ban is set. */
+
+    /*
+     * Rendered RPL_NAMREPLY lines, as "= <channel> :<names>" plus CRLF,
+     * without the prefix which depends on the recipient. Built when first
+     * needed, extended on joins, and emptied on other membership changes;
+     * "names_last" is the offset of the last line.
+     */
+    w_buf_t    names;
+    size_t     names_last;
+};
+
+
+extern bool channel_name_is_valid (const char *name, size_t length);
+
+extern channel_t* channel_lookup (const char *name, size_t length);
+
+/* Returns the channel with the given name, creating it if needed. */
+extern channel_t* channel_get (const char *name, size_t length);
+
+/*
+ * Adds a client to a channel, creating the channel if needed. Returns
+ * NULL if the client was already a member. Whoever joins an empty
+ * channel becomes its operator.
+ */
+extern channel_t* channel_join (const char *name,
+                                size_t      length,
+                                client_t   *client);
+
+extern void channel_part (channel_t *channel, client_t *client);
+
+/*
+ * Frees the channel once it has no members, scrollback or bans, which
+ * channel_part() does already. Callers which take the others away, e.g.
+ * trimming history, use this after.
+ */
+extern void channel_collect (channel_t *channel);
+
+/*
+ * Takes a reference to every channel, so the array stays valid while the
+ * caller yields to other tasks. Release with channel_snapshot_free().
+ */
+extern unsigned channel_snapshot (channel_t ***channels);
+extern void channel_snapshot_free (channel_t **channels, unsigned n_channels);
+
+/* Mode bits of a member, zero if the client is not in the channel. */
+extern uint8_t channel_member_modes (const channel_t *channel,
+                                     const client_t  *client);
+
+/* Returns false if the client is not a member, or already had "modes". */
+extern bool channel_set_member_modes (channel_t      *channel,
+                                      const client_t *client,
+                                      uint8_t         modes);
+
+/*
+ * Whether the "nick!user@host" of the client matches a ban. The folded
+ * mask is cached by the client, see client_mask_folded_cached().
+ */
+extern bool channel_is_banned (const channel_t *channel,
+                               client_t        *client);
+
+extern bool channel_has_member (const channel_t *channel,
+                                const client_t  *client);
+
+/*
+ * Returns the RPL_NAMREPLY lines of the channel (see channel_t), which
+ * stay valid until the membership changes.
+ */
+extern const w_buf_t* channel_names (channel_t *channel);
+
+/*
+ * Sends a message to all the members, except "except" (may be NULL).
+ * Remote members get a single copy per server link, which is never sent
+ * back through the link "except" came from.
+ */
+extern void channel_send (channel_t  *channel,
+                          client_t   *except,
+                          const void *data,
+                          size_t      length);
+
+/* Same as channel_send(), with tags as for client_send_tagged(). */
+extern void channel_send_tagged (channel_t     *channel,
+                                 client_t      *except,
+                                 const w_buf_t  tags[CLIENT_CAP_TAG_VARIANTS],
+                                 const void    *data,
+                                 size_t         length);
+
+/* Same as channel_send(), but only for clients connected to this server. */
+extern void channel_send_local (channel_t  *channel,
+                                client_t   *except,
+                                const void *data,
+                                size_t      length);
+
+/*
+ * Parts the client from all its channels, sending a QUIT message to the
+ * local members which share any channel with it.
+ */
+extern void channel_quit (client_t *client, const char *reason);
+
+#endif /* !CHANNEL_H */
@@ -0,0 +1,1399 @@
+/*
+ * chateau-bench.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE /* accept4() */
+#include "auth.h"
+#include "sasl.h"
+#include "config.h"
+#include "listener.h"
+#include "governor.h"
+#include "fairshare.h"
+#include "link.h"
+#include "xml-text.h"
+#include "tls.h"
+#include "channel.h"
+#include "client.h"
+#include "resolver.h"
+#include "xmpp-route.h"
+#include "offline.h"
+#include "hibernate.h"
+#include "ticker.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <dirent.h>
+
+extern void proto_irc_handler (listener_t*, w_io_t*);
+
+/*
+ * Runs scripted IRC conversations against proto_irc_handler() inside this
+ * process, over socketpair()s, so that measurements do not include the
+ * network stack. Each client sends its script as fast as the handler takes
+ * it, while another task reads and discards the replies. Every "$n" in the
+ * script is replaced with the number of the client, and passwords are
+ * accepted whatever they are.
+ *
+ * With "-t", clients connect over loopback TCP instead: "tcp" as plain
+ * text, "tls" with kernel TLS when the handshake manages to enable it, and
+ * "tls-user" with records always handled by OpenSSL in userspace. The TLS
+ * transports need "tls-certificate" and "tls-key" in the configuration.
+ * Clients always do TLS in userspace, which costs the same in both cases,
+ * so scripts with long messages show the difference in throughput best.
+ *
+ * With "-m memberships", as many channel memberships are spread over the
+ * clients, in channels of about a hundred members, and joins, member mode
+ * lookups, NAMES rendering and parts are timed. Clients do no I/O then.
+ *
+ * With "-l logins", as many SASL logins are done against an in-memory
+ * agent with one user per client: PLAIN, SCRAM-SHA-256 with the salted
+ * password cached as clients do, and SCRAM for unknown users, which get
+ * a made up salt. Creating the agent, and creating it again from the
+ * first one as a rehash does, are timed too. The client side of SCRAM
+ * is included in the timings, and costs about as much as the server.
+ *
+ * With "-d lookups", reverse lookups of as many addresses in 10.0.0.0/8
+ * are done by "-n" tasks, against a stub name server running in another
+ * task. A third of the addresses have a name which points back to them,
+ * a third one which does not, and the rest none at all. Every address is
+ * then looked up again, which the cache must answer; and one address
+ * never gets replies, which must time out. Results are checked, and
+ * lookups per second reported for both passes.
+ *
+ * With "-j sessions", as many XMPP sessions are bound, two resources per
+ * bare JID, and parsing their JIDs, binding, presence changes, lookups of
+ * full and bare JIDs (repeated "-r" times) and unbinding are timed.
+ *
+ * With "-o recipients", messages are stored for as many offline users, in
+ * a temporary directory, until each mailbox reaches CHATEAU_OFFLINE_QUOTA;
+ * all must then hold the same amount, and refuse one more. Mailboxes are
+ * fetched, checked and marked as delivered, and the compaction task is
+ * left to remove them, which takes up to CHATEAU_OFFLINE_COMPACT_INTERVAL.
+ *
+ * With "-i clients", as many clients register, over socketpair()s, and
+ * then send nothing. Resident memory and open descriptors per client are
+ * sampled while their tasks wait for input, and again once the one second
+ * idle period has passed and all of them hibernated.
+ *
+ * With "-x file", the IRC to XMPP text conversions are timed instead,
+ * over the contents of the file, once with each kernel the CPU supports.
+ *
+ * The handler logs each message to stderr, which is better redirected to
+ * /dev/null. Objects built for chateaud with -O0 are reused as they are,
+ * so "make clean" first for optimized measurements.
+ */
+
+static const char s_default_script[] =
+    "PASS bench\n"
+    "NICK bench$n\n"
+    "JOIN #bench\n"
+    "PRIVMSG #bench :Hello from client $n\n"
+    "NAMES #bench\n"
+    "PING :bench$n\n"
+    "PART #bench\n";
+
+
+typedef enum {
+    TRANSPORT_UNIX,
+    TRANSPORT_TCP,
+    TRANSPORT_TLS,
+    TRANSPORT_TLS_USER,
+    TRANSPORT_LAST,
+} transport_t;
+
+static const char *s_transport_names[] = {
+    [TRANSPORT_UNIX]     = "unix",
+    [TRANSPORT_TCP]      = "tcp",
+    [TRANSPORT_TLS]      = "tls",
+    [TRANSPORT_TLS_USER] = "tls-user",
+};
+
+
+struct client {
+    int      fd;
+    w_io_t  *io;
+    SSL     *ssl;
+    w_buf_t  script;
+};
+
+
+static transport_t  s_transport = TRANSPORT_UNIX;
+static SSL_CTX     *s_ssl_ctx = NULL;
+
+
+static struct {
+    unsigned long lines;
+    unsigned long sent;
+    unsigned long received;
+} s_stats;
+
+
+static uint64_t
+now_us (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static bool
+stub_authenticate (auth_agent_t *agent, const char *user, const char *pass)
+{
+    w_unused (agent);
+    w_unused (user);
+    w_unused (pass);
+    return true;
+}
+
+
+/* Appends the script with "$n" expanded, and lines ending in CRLF. */
+static void
+expand_script (w_buf_t *out, const char *script, unsigned number)
+{
+    for (const char *p = script; *p; p++) {
+        if (p[0] == '$' && p[1] == 'n') {
+            w_buf_format (out, "$I", number);
+            p++;
+        } else if (*p == '\n') {
+            w_buf_append_mem (out, "\r\n", 2);
+            s_stats.lines++;
+        } else if (*p != '\r') {
+            w_buf_append_char (out, *p);
+        }
+    }
+}
+
+
+/*
+ * Reads or writes like read() and write(), or with TLS when enabled, and
+ * yields while the socket is not ready. Returns zero at end of file.
+ */
+static ssize_t
+transfer (struct client *client, bool writing, void *buffer, size_t length)
+{
+    for (;;) {
+        bool want_write = writing;
+        if (client->ssl) {
+            ERR_clear_error ();
+            int r = writing ? SSL_write (client->ssl, buffer, length)
+                            : SSL_read (client->ssl, buffer, length);
+            if (r > 0)
+                return r;
+            switch (SSL_get_error (client->ssl, r)) {
+                case SSL_ERROR_WANT_READ:
+                    want_write = false;
+                    break;
+                case SSL_ERROR_WANT_WRITE:
+                    want_write = true;
+                    break;
+                case SSL_ERROR_ZERO_RETURN:
+                    return 0;
+                default:
+                    return -1;
+            }
+        } else {
+            ssize_t r = writing ? write (client->fd, buffer, length)
+                                : read (client->fd, buffer, length);
+            if (r >= 0)
+                return r;
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+        }
+
+        if (want_write)
+            w_task_yield_io_write (client->io);
+        else
+            w_task_yield_io_read (client->io);
+    }
+}
+
+
+static void
+reader_task (void *data)
+{
+    struct client *client = data;
+
+    for (;;) {
+        char buffer[4096];
+        ssize_t r = transfer (client, false, buffer, sizeof (buffer));
+        if (r <= 0)
+            break;
+        s_stats.received += r;
+    }
+
+    if (client->ssl)
+        SSL_free (client->ssl);
+    W_IO_NORESULT (w_io_close (client->io));
+    w_obj_unref (client->io);
+    w_free (client);
+}
+
+
+static void
+writer_task (void *data)
+{
+    struct client *client = data;
+
+    /* The handshake is done before reading, so only one task does it. */
+    while (client->ssl) {
+        ERR_clear_error ();
+        int r = SSL_connect (client->ssl);
+        if (r == 1)
+            break;
+
+        int error = SSL_get_error (client->ssl, r);
+        if (error == SSL_ERROR_WANT_READ) {
+            w_task_yield_io_read (client->io);
+        } else if (error == SSL_ERROR_WANT_WRITE) {
+            w_task_yield_io_write (client->io);
+        } else {
+            w_printerr ("TLS handshake failed\n");
+            shutdown (client->fd, SHUT_RDWR);
+            break;
+        }
+    }
+    w_task_set_name (w_task_prepare (reader_task, client, 16384), "bench-reader");
+
+    for (size_t offset = 0; offset < w_buf_size (&client->script);) {
+        ssize_t r = transfer (client, true, w_buf_data (&client->script) + offset,
+                              w_buf_size (&client->script) - offset);
+        if (r <= 0)
+            break;
+        offset += r;
+        s_stats.sent += r;
+    }
+
+    /* The reader owns the client, and stops when the server closes. */
+    w_buf_clear (&client->script);
+}
+
+
+/* Connects over loopback TCP, and accepts the connection right away. */
+static void
+connect_tcp (listener_t *listener, int fds[2])
+{
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof (addr);
+    if (getsockname (listener->fd, (struct sockaddr*) &addr, &length) != 0)
+        w_die ("Cannot get listener address: $s\n", strerror (errno));
+
+    fds[0] = socket (addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fds[0] < 0 || connect (fds[0], (struct sockaddr*) &addr, length) != 0)
+        w_die ("Cannot connect: $s\n", strerror (errno));
+    if ((fds[1] = accept4 (listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+        w_die ("Cannot accept: $s\n", strerror (errno));
+    if (fcntl (fds[0], F_SETFL, fcntl (fds[0], F_GETFL) | O_NONBLOCK) != 0)
+        w_die ("Cannot make socket non-blocking: $s\n", strerror (errno));
+}
+
+
+static void
+start_client (listener_t *listener, const char *script, unsigned number, unsigned repeat)
+{
+    int fds[2];
+    if (s_transport != TRANSPORT_UNIX)
+        connect_tcp (listener, fds);
+    else if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0)
+        w_die ("Cannot create socket pair: $s\n", strerror (errno));
+
+    struct client *client = w_new0 (struct client);
+    client->fd = fds[0];
+    client->io = w_io_unix_open_fd (fds[0]);
+    if (s_ssl_ctx && (!(client->ssl = SSL_new (s_ssl_ctx)) ||
+                      SSL_set_fd (client->ssl, fds[0]) != 1))
+        w_die ("Cannot create TLS client\n");
+    for (unsigned i = 0; i < repeat; i++)
+        expand_script (&client->script, script, number);
+    w_buf_append_str (&client->script, "QUIT :Done\r\n");
+    s_stats.lines++;
+
+    listener_spawn (listener, fds[1]);
+    w_task_set_name (w_task_prepare (writer_task, client, 16384), "bench-writer");
+}
+
+
+/* Resident set size, or zero if unknown. */
+static size_t
+resident_bytes (void)
+{
+    unsigned long size, resident = 0;
+    FILE *statm = fopen ("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf (statm, "%lu %lu", &size, &resident) != 2)
+            resident = 0;
+        fclose (statm);
+    }
+    return resident * sysconf (_SC_PAGESIZE);
+}
+
+
+static void
+bench_channels (unsigned n_clients, unsigned long memberships)
+{
+    const unsigned per_client = (memberships + n_clients - 1) / n_clients;
+    unsigned n_channels = memberships / 100;
+    if (n_channels < per_client)
+        n_channels = per_client;
+
+    /* Clients are never written to, they share a socket to /dev/null. */
+    int fd = open ("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        w_die ("Cannot open /dev/null: $s\n", strerror (errno));
+    w_io_t *null_io = w_io_unix_open_fd (fd);
+
+    client_t **clients = w_alloc (client_t*, n_clients);
+    for (unsigned i = 0; i < n_clients; i++) {
+        char nick[16];
+        snprintf (nick, sizeof (nick), "m%u", i);
+        clients[i] = client_new (null_io);
+        if (!client_register (clients[i], nick))
+            w_die ("Cannot register $s\n", nick);
+    }
+
+    /* Each client joins consecutive channels, so never one twice. */
+    char name[32];
+    unsigned long joined = 0;
+    const size_t resident = resident_bytes ();
+    uint64_t start = now_us ();
+    for (unsigned i = 0; i < n_clients; i++) {
+        for (unsigned j = 0; j < per_client && joined < memberships; j++, joined++) {
+            snprintf (name, sizeof (name), "#c%u",
+                      (unsigned) (((unsigned long) i * per_client + j) % n_channels));
+            if (!channel_join (name, strlen (name), clients[i]))
+                w_die ("$s: Joined twice\n", name);
+        }
+    }
+    const uint64_t join_us = now_us () - start + 1;
+    const size_t joined_resident = resident_bytes ();
+
+    start = now_us ();
+    unsigned long ops = 0;
+    for (unsigned i = 0; i < n_clients; i++)
+        for (unsigned j = 0; j < clients[i]->n_channels; j++)
+            ops += channel_member_modes (clients[i]->channels[j], clients[i]) & CHANNEL_MODE_OP;
+    const uint64_t modes_us = now_us () - start + 1;
+
+    channel_t **channels;
+    unsigned n = channel_snapshot (&channels);
+    size_t names_bytes = 0;
+    start = now_us ();
+    for (unsigned i = 0; i < n; i++)
+        names_bytes += w_buf_size (channel_names (channels[i]));
+    const uint64_t names_us = now_us () - start + 1;
+    channel_snapshot_free (channels, n);
+
+    start = now_us ();
+    for (unsigned i = 0; i < n_clients; i++)
+        while (clients[i]->n_channels)
+            channel_part (clients[i]->channels[clients[i]->n_channels - 1], clients[i]);
+    const uint64_t part_us = now_us () - start + 1;
+
+    w_print ("$L memberships of $I clients in $I channels, $I operators\n",
+             joined, n_clients, n, (unsigned) ops);
+    w_print ("Join $L ns, modes lookup $L ns, part $L ns per membership\n",
+             (unsigned long) (join_us * 1000 / joined),
+             (unsigned long) (modes_us * 1000 / joined),
+             (unsigned long) (part_us * 1000 / joined));
+    w_print ("NAMES for every channel in $L ms, $L bytes\n",
+             (unsigned long) (names_us / 1000), (unsigned long) names_bytes);
+    if (resident && joined_resident > resident)
+        w_print ("Resident memory grew $L bytes per membership\n",
+                 (unsigned long) ((joined_resident - resident) / joined));
+    /* Parting must free every channel, as none has bans or scrollback. */
+    n = channel_snapshot (&channels);
+    channel_snapshot_free (channels, n);
+    w_print ("$I channels left after parting\n", n);
+
+    for (unsigned i = 0; i < n_clients; i++)
+        w_obj_unref (clients[i]);
+    w_free (clients);
+    W_IO_NORESULT (w_io_close (null_io));
+    w_obj_unref (null_io);
+}
+
+
+struct login_user {
+    char    name[16];
+    char    pass[16];
+    uint8_t salted[AUTH_SCRAM_KEY_SIZE];
+    bool    salted_set;
+};
+
+
+static bool
+plain_login (auth_agent_t *agent, const struct login_user *user)
+{
+    w_buf_t input = W_BUF, out = W_BUF;
+    w_buf_append_char (&input, '\0');
+    w_buf_append_str (&input, user->name);
+    w_buf_append_char (&input, '\0');
+    w_buf_append_str (&input, user->pass);
+
+    sasl_t sasl = SASL_INIT;
+    const bool ok = sasl_start (&sasl, agent, "PLAIN") &&
+        sasl_step (&sasl, w_buf_data (&input), w_buf_size (&input), &out) == SASL_SUCCESS;
+    sasl_clear (&sasl);
+    w_buf_clear (&input);
+    w_buf_clear (&out);
+    return ok;
+}
+
+
+/*
+ * Client side of SCRAM-SHA-256. The salted password is derived the first
+ * time for each user, and then reused. Returns true if the server proved
+ * to know the keys, and accepted the proof.
+ */
+static bool
+scram_login (auth_agent_t *agent, struct login_user *user)
+{
+    sasl_t sasl = SASL_INIT;
+    w_buf_t first = W_BUF, out = W_BUF, input = W_BUF, salt = W_BUF;
+    bool ok = false;
+
+    w_buf_format (&first, "n=$s,r=bench", user->name);
+    w_buf_append_str (&input, "n,,");
+    w_buf_append_buf (&input, &first);
+    if (!sasl_start (&sasl, agent, "SCRAM-SHA-256") ||
+        sasl_step (&sasl, w_buf_data (&input), w_buf_size (&input), &out) != SASL_CONTINUE)
+        goto done;
+
+    /* r=nonce,s=salt,i=iterations */
+    const char *server_first = w_buf_str (&out);
+    const char *s = strstr (server_first, ",s=");
+    const char *i = s ? strstr (s, ",i=") : NULL;
+    unsigned long iterations;
+    if (!i || !w_str_uint (i + 3, &iterations) || !iterations || iterations > INT_MAX ||
+        !sasl_base64_decode (&salt, s + 3, i - s - 3))
+        goto done;
+
+    if (!user->salted_set) {
+        if (!PKCS5_PBKDF2_HMAC (user->pass, strlen (user->pass),
+                                (const unsigned char*) w_buf_data (&salt), w_buf_size (&salt),
+                                (int) iterations, EVP_sha256 (),
+                                sizeof (user->salted), user->salted))
+            goto done;
+        user->salted_set = true;
+    }
+
+    uint8_t client_key[AUTH_SCRAM_KEY_SIZE];
+    uint8_t stored_key[AUTH_SCRAM_KEY_SIZE];
+    uint8_t signature[AUTH_SCRAM_KEY_SIZE];
+    HMAC (EVP_sha256 (), user->salted, sizeof (user->salted),
+          (const unsigned char*) "Client Key", 10, client_key, NULL);
+    SHA256 (client_key, sizeof (client_key), stored_key);
+
+    /* "biws" is "n,," in base64. */
+    w_buf_resize (&input, 0);
+    w_buf_append_str (&input, "c=biws,");
+    w_buf_append_mem (&input, server_first, s - server_first);
+    w_buf_append_char (&first, ',');
+    w_buf_append_str (&first, server_first);
+    w_buf_append_char (&first, ',');
+    w_buf_append_buf (&first, &input);
+    HMAC (EVP_sha256 (), stored_key, sizeof (stored_key),
+          (const unsigned char*) w_buf_data (&first), w_buf_size (&first), signature, NULL);
+    for (unsigned k = 0; k < AUTH_SCRAM_KEY_SIZE; k++)
+        client_key[k] ^= signature[k];
+    w_buf_append_str (&input, ",p=");
+    sasl_base64_encode (&input, client_key, sizeof (client_key));
+
+    w_buf_resize (&out, 0);
+    ok = sasl_step (&sasl, w_buf_data (&input), w_buf_size (&input), &out) == SASL_CONTINUE &&
+         sasl_step (&sasl, NULL, 0, &out) == SASL_SUCCESS;
+
+done:
+    sasl_clear (&sasl);
+    w_buf_clear (&first);
+    w_buf_clear (&out);
+    w_buf_clear (&input);
+    w_buf_clear (&salt);
+    return ok;
+}
+
+
+static void
+bench_logins (unsigned n_users, unsigned long logins)
+{
+    struct login_user *users = w_alloc (struct login_user, n_users);
+    auth_simple_mem_agent_entry_t *entries = w_alloc (auth_simple_mem_agent_entry_t,
+                                                      n_users + 1);
+    for (unsigned i = 0; i < n_users; i++) {
+        snprintf (users[i].name, sizeof (users[i].name), "u%u", i);
+        snprintf (users[i].pass, sizeof (users[i].pass), "p%u", i);
+        users[i].salted_set = false;
+        entries[i] = (auth_simple_mem_agent_entry_t) { users[i].name, users[i].pass };
+    }
+    entries[n_users] = (auth_simple_mem_agent_entry_t) { NULL, NULL };
+
+    uint64_t start = now_us ();
+    auth_agent_t *first = auth_simple_mem_agent_new (entries, CHATEAU_SCRAM_ITERATIONS, NULL);
+    const uint64_t derive_us = now_us () - start + 1;
+    start = now_us ();
+    auth_agent_t *agent = auth_simple_mem_agent_new (entries, CHATEAU_SCRAM_ITERATIONS, first);
+    const uint64_t reuse_us = now_us () - start + 1;
+    w_obj_unref (first);
+    if (!auth_agent_has_scram_keys (agent))
+        w_die ("Cannot derive SCRAM keys\n");
+
+    w_print ("$I users, keys derived in $L ms, kept on rehash in $L us\n",
+             n_users, (unsigned long) (derive_us / 1000), (unsigned long) reuse_us);
+
+    /* Clients derive their salted passwords once, outside the timings. */
+    for (unsigned i = 0; i < n_users; i++)
+        if (!scram_login (agent, &users[i]))
+            w_die ("$s: SCRAM login failed\n", users[i].name);
+
+    start = now_us ();
+    for (unsigned long i = 0; i < logins; i++)
+        if (!plain_login (agent, &users[i % n_users]))
+            w_die ("$s: PLAIN login failed\n", users[i % n_users].name);
+    const uint64_t plain_us = now_us () - start + 1;
+
+    start = now_us ();
+    for (unsigned long i = 0; i < logins; i++)
+        if (!scram_login (agent, &users[i % n_users]))
+            w_die ("$s: SCRAM login failed\n", users[i % n_users].name);
+    const uint64_t scram_us = now_us () - start + 1;
+
+    /* Unknown users get to the last step, and fail there. */
+    struct login_user unknown = { .salted_set = true };
+    start = now_us ();
+    for (unsigned long i = 0; i < logins; i++) {
+        snprintf (unknown.name, sizeof (unknown.name), "x%lu", i % n_users);
+        if (scram_login (agent, &unknown))
+            w_die ("$s: Unknown user logged in\n", unknown.name);
+    }
+    const uint64_t unknown_us = now_us () - start + 1;
+
+    w_print ("PLAIN $L logins/s, SCRAM-SHA-256 $L logins/s, unknown users $L/s\n",
+             (unsigned long) (logins * 1000000 / plain_us),
+             (unsigned long) (logins * 1000000 / scram_us),
+             (unsigned long) (logins * 1000000 / unknown_us));
+
+    w_obj_unref (agent);
+    w_free (entries);
+    w_free (users);
+}
+
+
+/*
+ * For 10.a.b.c, "h-a-b-c.bench.test" points back to it when the number
+ * of the address is a multiple of three, "l-a-b-c.bench.test" points to
+ * the next address when it is one more, and the rest are not found.
+ */
+enum {
+    LOOKUP_CONFIRMED,
+    LOOKUP_MISMATCHED,
+    LOOKUP_NOT_FOUND,
+};
+
+static const uint32_t s_lookup_timeout_address = 0x0AFFFFFF;  /* 10.255.255.255 */
+
+static struct {
+    unsigned long next;
+    unsigned long total;
+    unsigned      running[2];
+    uint64_t      done_us[2];
+    unsigned long wrong;
+    bool          timed_out;
+} s_lookups;
+
+
+static void
+dns_put_u16 (w_buf_t *buf, unsigned value)
+{
+    w_buf_append_char (buf, (value >> 8) & 0xFF);
+    w_buf_append_char (buf, value & 0xFF);
+}
+
+
+/* Labels of the question in dotted form, and the end of the question. */
+static bool
+dns_question (const uint8_t *msg, size_t size, char *name, size_t name_size, size_t *end)
+{
+    size_t pos = 12, out = 0;
+    while (pos < size && msg[pos]) {
+        const size_t length = msg[pos];
+        if (length > 63 || pos + 1 + length > size || out + length + 2 > name_size)
+            return false;
+        if (out)
+            name[out++] = '.';
+        memcpy (name + out, msg + pos + 1, length);
+        out += length;
+        pos += 1 + length;
+    }
+    name[out] = '\0';
+    *end = pos + 5;
+    return *end <= size;
+}
+
+
+static void
+dns_stub_task (void *data)
+{
+    w_io_t *io = data;
+    const int fd = w_io_get_fd (io);
+
+    for (;;) {
+        uint8_t msg[512];
+        struct sockaddr_storage peer;
+        socklen_t peer_length = sizeof (peer);
+        ssize_t r = recvfrom (fd, msg, sizeof (msg), 0, (struct sockaddr*) &peer, &peer_length);
+        if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+            w_task_yield_io_read (io);
+            continue;
+        }
+        if (r < 0)
+            break;
+
+        char name[256];
+        size_t end;
+        if (r < 12 || !dns_question (msg, r, name, sizeof (name), &end))
+            continue;
+        const unsigned type = (msg[end - 4] << 8) | msg[end - 3];
+
+        unsigned a, b, c;
+        char kind;
+        w_buf_t answer = W_BUF;
+        unsigned rcode = 3;  /* NXDOMAIN */
+        if (type == 12 && sscanf (name, "%u.%u.%u.10.in-addr.arpa", &c, &b, &a) == 3) {
+            const uint32_t address = 0x0A000000 | (a << 16) | (b << 8) | c;
+            if (address == s_lookup_timeout_address)
+                continue;
+            const unsigned result = (address & 0xFFFFFF) % 3;
+            if (result != LOOKUP_NOT_FOUND) {
+                char host[64];
+                const int length = snprintf (host, sizeof (host), "%c-%u-%u-%u.bench.test",
+                                             result == LOOKUP_CONFIRMED ? 'h' : 'l', a, b, c);
+                dns_put_u16 (&answer, 0xC00C);
+                dns_put_u16 (&answer, 12);
+                dns_put_u16 (&answer, 1);
+                dns_put_u16 (&answer, 0);
+                dns_put_u16 (&answer, 300);
+                dns_put_u16 (&answer, length + 2);
+                for (const char *label = host; *label;) {
+                    const size_t n = strcspn (label, ".");
+                    w_buf_append_char (&answer, (char) n);
+                    w_buf_append_mem (&answer, label, n);
+                    label += n + (label[n] == '.');
+                }
+                w_buf_append_char (&answer, '\0');
+                rcode = 0;
+            }
+        } else if (type == 1 && sscanf (name, "%c-%u-%u-%u.bench.test", &kind, &a, &b, &c) == 4) {
+            const uint32_t address = (0x0A000000 | (a << 16) | (b << 8) | c) + (kind == 'l');
+            dns_put_u16 (&answer, 0xC00C);
+            dns_put_u16 (&answer, 1);
+            dns_put_u16 (&answer, 1);
+            dns_put_u16 (&answer, 0);
+            dns_put_u16 (&answer, 300);
+            dns_put_u16 (&answer, 4);
+            dns_put_u16 (&answer, address >> 16);
+            dns_put_u16 (&answer, address & 0xFFFF);
+            rcode = 0;
+        }
+
+        w_buf_t reply = W_BUF;
+        w_buf_append_mem (&reply, msg, 2);
+        dns_put_u16 (&reply, 0x8180 | rcode);
+        dns_put_u16 (&reply, 1);
+        dns_put_u16 (&reply, w_buf_size (&answer) ? 1 : 0);
+        dns_put_u16 (&reply, 0);
+        dns_put_u16 (&reply, 0);
+        w_buf_append_mem (&reply, msg + 12, end - 12);
+        w_buf_append_buf (&reply, &answer);
+        if (sendto (fd, w_buf_data (&reply), w_buf_size (&reply), 0,
+                    (struct sockaddr*) &peer, peer_length) < 0)
+            w_printerr ("DNS stub: Cannot reply: $s\n", strerror (errno));
+        w_buf_clear (&reply);
+        w_buf_clear (&answer);
+    }
+
+    W_IO_NORESULT (w_io_close (io));
+    w_obj_unref (io);
+}
+
+
+static atom_t*
+lookup_address (uint32_t address)
+{
+    const struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr   = { .s_addr = htonl (address) },
+    };
+    return resolver_lookup ((const struct sockaddr*) &addr, sizeof (addr));
+}
+
+
+static bool
+lookup_check (uint32_t address)
+{
+    atom_t *host = lookup_address (address);
+    bool ok = true;
+    if ((address & 0xFFFFFF) % 3 == LOOKUP_CONFIRMED) {
+        char expected[64];
+        snprintf (expected, sizeof (expected), "h-%u-%u-%u.bench.test",
+                  (address >> 16) & 0xFF, (address >> 8) & 0xFF, address & 0xFF);
+        ok = host && strcmp (atom_str (host), expected) == 0;
+    } else {
+        ok = host == NULL;
+    }
+    if (host)
+        atom_unref (host);
+    return ok;
+}
+
+
+/* Both passes share the addresses; the second starts when all are done. */
+static void
+lookup_task (void *data)
+{
+    w_unused (data);
+
+    for (unsigned pass = 0; pass < 2; pass++) {
+        if (pass) {
+            while (s_lookups.running[0])
+                w_task_yield ();
+            s_lookups.next = 0;
+        }
+        while (s_lookups.next < s_lookups.total) {
+            if (!lookup_check (0x0A000000 + s_lookups.next++))
+                s_lookups.wrong++;
+        }
+        if (!--s_lookups.running[pass])
+            s_lookups.done_us[pass] = now_us ();
+    }
+}
+
+
+static void
+lookup_timeout_task (void *data)
+{
+    w_unused (data);
+    atom_t *host = lookup_address (s_lookup_timeout_address);
+    s_lookups.timed_out = host == NULL;
+    if (host)
+        atom_unref (host);
+}
+
+
+static void
+bench_lookups (unsigned n_tasks, unsigned long lookups)
+{
+    int fd = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr   = { .s_addr = htonl (INADDR_LOOPBACK) },
+    };
+    socklen_t length = sizeof (addr);
+    if (fd < 0 || bind (fd, (struct sockaddr*) &addr, length) != 0 ||
+        getsockname (fd, (struct sockaddr*) &addr, &length) != 0)
+        w_die ("Cannot create stub name server: $s\n", strerror (errno));
+
+    char server[32];
+    snprintf (server, sizeof (server), "127.0.0.1:%u", (unsigned) ntohs (addr.sin_port));
+    if (!resolver_set_server (server))
+        w_die ("$s: Invalid name server\n", server);
+
+    w_task_t *task = w_task_prepare (dns_stub_task, w_io_unix_open_fd (fd), 16384);
+    w_task_set_name (task, "bench-dns");
+    w_task_set_is_system (task, true);
+
+    s_lookups.total = lookups;
+    s_lookups.running[0] = s_lookups.running[1] = n_tasks;
+    for (unsigned i = 0; i < n_tasks; i++)
+        w_task_set_name (w_task_prepare (lookup_task, NULL, 16384), "bench-lookup");
+    w_task_set_name (w_task_prepare (lookup_timeout_task, NULL, 16384), "bench-timeout");
+
+    const uint64_t start = now_us ();
+    w_task_run_scheduler ();
+    const uint64_t elapsed = now_us () - start;
+
+    resolver_stats_t stats;
+    resolver_get_stats (&stats);
+    const uint64_t miss_us = s_lookups.done_us[0] - start + 1;
+    const uint64_t hit_us = s_lookups.done_us[1] - s_lookups.done_us[0] + 1;
+    w_print ("$L lookups by $I tasks: $L/s from the stub server, $L/s from the cache\n",
+             lookups, n_tasks,
+             (unsigned long) (lookups * 1000000 / miss_us),
+             (unsigned long) (lookups * 1000000 / hit_us));
+    w_print ("$L hits, $L misses, $L timeouts, $I cached; timeout after $L ms\n",
+             stats.hits, stats.misses, stats.timeouts, stats.entries,
+             (unsigned long) (elapsed / 1000));
+    if (s_lookups.wrong || !s_lookups.timed_out || stats.timeouts != 1 ||
+        stats.hits != lookups)
+        w_die ("$L wrong results, $s\n", s_lookups.wrong,
+               s_lookups.timed_out ? "timeout ok" : "no timeout");
+}
+
+
+static void*
+route_session (unsigned number)
+{
+    return (void*) (uintptr_t) (number + 1);
+}
+
+
+static void
+bench_routes (unsigned long sessions, unsigned repeat)
+{
+    jid_t *jids = w_alloc (jid_t, sessions);
+    const size_t resident = resident_bytes ();
+
+    char text[64];
+    uint64_t start = now_us ();
+    for (unsigned long i = 0; i < sessions; i++) {
+        const int length = snprintf (text, sizeof (text), "User%lu@Bench.Test/r%lu",
+                                     i / 2, i % 2);
+        jids[i] = (jid_t) JID_INIT;
+        if (!jid_parse (&jids[i], text, length))
+            w_die ("$s: Cannot parse\n", text);
+    }
+    const uint64_t parse_us = now_us () - start + 1;
+
+    start = now_us ();
+    for (unsigned long i = 0; i < sessions; i++)
+        if (!xmpp_route_bind (&jids[i], route_session (i)))
+            w_die ("$s: Cannot bind\n", atom_str (jids[i].full));
+    const uint64_t bind_us = now_us () - start + 1;
+    const size_t bound_resident = resident_bytes ();
+
+    /* The second resource of each bare JID takes its messages. */
+    start = now_us ();
+    for (unsigned long i = 0; i < sessions; i++)
+        xmpp_route_set_presence (&jids[i], true, i % 2);
+    const uint64_t presence_us = now_us () - start + 1;
+
+    unsigned long wrong = 0;
+    start = now_us ();
+    for (unsigned r = 0; r < repeat; r++)
+        for (unsigned long i = 0; i < sessions; i++)
+            wrong += xmpp_route_lookup (&jids[i]) != route_session (i);
+    const uint64_t full_us = now_us () - start + 1;
+
+    start = now_us ();
+    for (unsigned r = 0; r < repeat; r++) {
+        for (unsigned long i = 0; i < sessions; i++) {
+            const jid_t bare = { jids[i].bare, NULL };
+            const unsigned long best = ((i | 1) < sessions) ? (i | 1) : i;
+            wrong += xmpp_route_lookup (&bare) != route_session (best);
+        }
+    }
+    const uint64_t bare_us = now_us () - start + 1;
+
+    const unsigned bound = xmpp_route_count ();
+    start = now_us ();
+    for (unsigned long i = 0; i < sessions; i++)
+        xmpp_route_unbind (&jids[i]);
+    const uint64_t unbind_us = now_us () - start + 1;
+
+    const unsigned long lookups = sessions * repeat;
+    w_print ("$I sessions bound, $I left after unbinding, $L wrong lookups\n",
+             bound, xmpp_route_count (), wrong);
+    w_print ("Parse $L ns, bind $L ns, presence $L ns, unbind $L ns per session\n",
+             (unsigned long) (parse_us * 1000 / sessions),
+             (unsigned long) (bind_us * 1000 / sessions),
+             (unsigned long) (presence_us * 1000 / sessions),
+             (unsigned long) (unbind_us * 1000 / sessions));
+    w_print ("Lookup $L ns per full JID, $L ns per bare JID\n",
+             (unsigned long) (full_us * 1000 / lookups),
+             (unsigned long) (bare_us * 1000 / lookups));
+    if (resident && bound_resident > resident)
+        w_print ("Resident memory grew $L bytes per session\n",
+                 (unsigned long) ((bound_resident - resident) / sessions));
+
+    for (unsigned long i = 0; i < sessions; i++)
+        jid_clear (&jids[i]);
+    w_free (jids);
+    if (wrong || bound != sessions)
+        w_die ("Routing table gave wrong results\n");
+}
+
+
+static unsigned
+count_files (const char *path, const char *suffix)
+{
+    DIR *dir = opendir (path);
+    if (!dir)
+        w_die ("$s: Cannot open: $s\n", path, strerror (errno));
+
+    unsigned count = 0;
+    const size_t suffix_length = strlen (suffix);
+    for (struct dirent *entry; (entry = readdir (dir));) {
+        const size_t length = strlen (entry->d_name);
+        count += length > suffix_length &&
+                 strcmp (entry->d_name + length - suffix_length, suffix) == 0;
+    }
+    closedir (dir);
+    return count;
+}
+
+
+static const char *s_offline_path = NULL;
+static uint64_t    s_compacted_us = 0;
+
+/* Polls the directory until the compaction task has removed every file. */
+static void
+compact_wait_task (void *data)
+{
+    w_unused (data);
+
+    ticker_t *ticker = ticker_new (10);
+    if (!ticker)
+        w_die ("Cannot create ticker: $s\n", strerror (errno));
+    const uint64_t start = now_us ();
+    const uint64_t limit = 2 * CHATEAU_OFFLINE_COMPACT_INTERVAL * 1000ULL;
+    while (count_files (s_offline_path, ".done") && now_us () - start < limit)
+        ticker_wait (ticker);
+    s_compacted_us = now_us () - start;
+    w_obj_unref (ticker);
+}
+
+
+static void
+bench_offline (unsigned recipients)
+{
+    char path[] = "/tmp/chateau-bench-XXXXXX";
+    if (!mkdtemp (path) || !offline_open (path))
+        w_die ("Cannot open offline store: $s\n", strerror (errno));
+    s_offline_path = path;
+
+    /* Same length for every line, so every mailbox holds the same amount. */
+    char name[16], line[64];
+    unsigned long stored = 0;
+    unsigned per_recipient = 0;
+    uint64_t start = now_us ();
+    for (unsigned i = 0; i < recipients; i++) {
+        const int name_length = snprintf (name, sizeof (name), "u%06u", i);
+        unsigned count = 0;
+        for (;; count++) {
+            const int length = snprintf (line, sizeof (line),
+                                         "PRIVMSG %s :offline message %06u\r\n", name, count);
+            if (!offline_store (name, name_length, line, length))
+                break;
+        }
+        if (i && count != per_recipient)
+            w_die ("$s: Kept $I messages, not $I\n", name, count, per_recipient);
+        per_recipient = count;
+        stored += count;
+    }
+    const uint64_t store_us = now_us () - start + 1;
+
+    offline_stats_t stats;
+    offline_get_stats (&stats);
+    if (!per_recipient || stats.mailboxes != recipients || stats.rejected != recipients ||
+        stats.bytes > (size_t) recipients * CHATEAU_OFFLINE_QUOTA)
+        w_die ("Mailboxes do not hold to the quota\n");
+    w_print ("$I mailboxes of $I messages, $L bytes on disk, $L ns per message stored\n",
+             recipients, per_recipient, (unsigned long) stats.bytes,
+             (unsigned long) (store_us * 1000 / stored));
+
+    w_buf_t out = W_BUF;
+    size_t fetched_bytes = 0;
+    start = now_us ();
+    for (unsigned i = 0; i < recipients; i++) {
+        const int name_length = snprintf (name, sizeof (name), "u%06u", i);
+        w_buf_resize (&out, 0);
+        if (offline_fetch (name, name_length, false, &out) != per_recipient)
+            w_die ("$s: Wrong number of messages fetched\n", name);
+        const int length = snprintf (line, sizeof (line),
+                                     "PRIVMSG %s :offline message %06u\r\n",
+                                     name, per_recipient - 1);
+        if (w_buf_size (&out) != (size_t) length * per_recipient ||
+            memcmp (w_buf_data (&out) + w_buf_size (&out) - length, line, length) != 0)
+            w_die ("$s: Wrong messages fetched\n", name);
+        fetched_bytes += w_buf_size (&out);
+        offline_delivered (name, name_length);
+    }
+    const uint64_t fetch_us = now_us () - start + 1;
+    w_buf_clear (&out);
+
+    offline_get_stats (&stats);
+    if (stats.mailboxes || stats.delivered != stored ||
+        count_files (path, ".off") || count_files (path, ".done") != recipients)
+        w_die ("Delivered mailboxes were not renamed\n");
+    w_print ("Fetched and delivered $L MB/s, $L us per mailbox\n",
+             (unsigned long) (fetched_bytes / fetch_us),
+             (unsigned long) (fetch_us / recipients));
+
+    w_task_set_name (w_task_prepare (compact_wait_task, NULL, 16384), "bench-compact");
+    w_task_run_scheduler ();
+    const unsigned left = count_files (path, ".done");
+    w_print ("Compaction removed $I mailboxes within $L ms, $I left\n",
+             recipients - left, (unsigned long) (s_compacted_us / 1000), left);
+
+    offline_close ();
+    if (rmdir (path) != 0)
+        w_printerr ("$s: Cannot remove: $s\n", path, strerror (errno));
+    if (left)
+        w_die ("Compaction did not remove delivered mailboxes\n");
+}
+
+
+static listener_t *s_idle_listener = NULL;
+static unsigned    s_idle_clients = 0;
+
+/* Reads from the server until its reply holds "text", and discards it. */
+static void
+wait_reply (struct client *client, const char *text)
+{
+    w_buf_t reply = W_BUF;
+    while (!w_buf_size (&reply) || !strstr (w_buf_str (&reply), text)) {
+        char buffer[4096];
+        ssize_t r = transfer (client, false, buffer, sizeof (buffer));
+        if (r <= 0)
+            w_die ("Connection closed before registration\n");
+        w_buf_append_mem (&reply, buffer, r);
+    }
+    w_buf_clear (&reply);
+}
+
+
+static void
+idle_task (void *data)
+{
+    w_unused (data);
+
+    ticker_t *ticker = ticker_new (100);
+    if (!ticker)
+        w_die ("Cannot create ticker: $s\n", strerror (errno));
+
+    const unsigned n = s_idle_clients;
+    const size_t resident = resident_bytes ();
+    const unsigned files = count_files ("/proc/self/fd", "");
+
+    struct client *clients = w_alloc (struct client, n);
+    for (unsigned i = 0; i < n; i++) {
+        int fds[2];
+        if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0)
+            w_die ("Cannot create socket pair: $s\n", strerror (errno));
+        clients[i] = (struct client) {
+            .fd = fds[0],
+            .io = w_io_unix_open_fd (fds[0]),
+            .script = W_BUF,
+        };
+        expand_script (&clients[i].script, "PASS bench\nNICK idle$n\n", i);
+        listener_spawn (s_idle_listener, fds[1]);
+        if (transfer (&clients[i], true, w_buf_data (&clients[i].script),
+                      w_buf_size (&clients[i].script)) != (ssize_t) w_buf_size (&clients[i].script))
+            w_die ("Cannot send registration\n");
+        w_buf_clear (&clients[i].script);
+    }
+    for (unsigned i = 0; i < n; i++) {
+        /* RPL_WELCOME is sent once the client is registered. */
+        char welcome[32];
+        snprintf (welcome, sizeof (welcome), " 001 idle%u ", i);
+        wait_reply (&clients[i], welcome);
+    }
+    ticker_wait (ticker);
+
+    hibernate_stats_t stats;
+    hibernate_get_stats (&stats);
+    const size_t active_resident = resident_bytes ();
+    const unsigned active_files = count_files ("/proc/self/fd", "");
+    const unsigned early = stats.parked;
+
+    /* The idle period is one second, and may last an eighth longer. */
+    const uint64_t start = now_us ();
+    while (stats.parked < n && now_us () - start < 5000000) {
+        ticker_wait (ticker);
+        hibernate_get_stats (&stats);
+    }
+    const size_t parked_resident = resident_bytes ();
+    const unsigned parked_files = count_files ("/proc/self/fd", "");
+
+    w_print ("$I clients registered, $I hibernated before the first sample\n", n, early);
+    w_print ("Active: $L bytes resident and $I descriptors per client\n",
+             (unsigned long) (active_resident > resident ? (active_resident - resident) / n : 0),
+             (active_files - files) / n);
+    w_print ("Hibernated ($I): $L bytes resident and $I descriptors per client\n",
+             stats.parked,
+             (unsigned long) (parked_resident > resident ? (parked_resident - resident) / n : 0),
+             (parked_files - files) / n);
+
+    /* Closing wakes the hibernated clients, which then quit. */
+    for (unsigned i = 0; i < n; i++) {
+        W_IO_NORESULT (w_io_close (clients[i].io));
+        w_obj_unref (clients[i].io);
+    }
+    w_free (clients);
+    w_obj_unref (ticker);
+    if (stats.parked != n)
+        w_die ("Only $I of $I clients hibernated\n", stats.parked, n);
+}
+
+
+static char*
+read_script (const char *path)
+{
+    w_io_t *io = w_io_unix_open (path, O_RDONLY, 0);
+    if (!io)
+        w_die ("$s: Cannot open: $s\n", path, strerror (errno));
+
+    w_buf_t script = W_BUF;
+    for (;;) {
+        char buffer[4096];
+        w_io_result_t r = w_io_read (io, buffer, sizeof (buffer));
+        if (w_io_failed (r))
+            w_die ("$s: Cannot read: $s\n", path, strerror (w_io_result_error (r)));
+        if (w_io_eof (r) || !w_io_result_bytes (r))
+            break;
+        w_buf_append_mem (&script, buffer, w_io_result_bytes (r));
+    }
+    W_IO_NORESULT (w_io_close (io));
+    w_obj_unref (io);
+
+    if (!w_buf_size (&script) || w_buf_data (&script)[w_buf_size (&script) - 1] != '\n')
+        w_buf_append_char (&script, '\n');
+    return w_buf_str (&script);
+}
+
+
+static void
+bench_text (const char *path, unsigned repeat)
+{
+    char *text = read_script (path);
+    const size_t length = strlen (text);
+
+    /* At least 64 MiB per kernel and direction, for stable timings. */
+    const size_t rounds = repeat * (1 + (64 << 20) / (length * repeat));
+
+    w_buf_t escaped = W_BUF, expected = W_BUF, out = W_BUF;
+    xml_text_use_kernel (XML_TEXT_SCALAR);
+    xml_text_escape (&escaped, text, length);
+    xml_text_unescape (&expected, w_buf_data (&escaped), w_buf_size (&escaped));
+
+    for (xml_text_kernel_t kernel = 0; kernel < XML_TEXT_KERNEL_LAST; kernel++) {
+        if (!xml_text_use_kernel (kernel))
+            continue;
+
+        uint64_t start = now_us ();
+        for (size_t i = 0; i < rounds; i++) {
+            w_buf_resize (&out, 0);
+            xml_text_escape (&out, text, length);
+        }
+        const uint64_t escape_us = now_us () - start + 1;
+        if (w_buf_size (&out) != w_buf_size (&escaped) ||
+            memcmp (w_buf_data (&out), w_buf_data (&escaped), w_buf_size (&out)))
+            w_die ("$s: Escaped text differs from the scalar kernel\n",
+                   xml_text_kernel_name (kernel));
+
+        start = now_us ();
+        for (size_t i = 0; i < rounds; i++) {
+            w_buf_resize (&out, 0);
+            xml_text_unescape (&out, w_buf_data (&escaped), w_buf_size (&escaped));
+        }
+        const uint64_t unescape_us = now_us () - start + 1;
+        if (w_buf_size (&out) != w_buf_size (&expected) ||
+            memcmp (w_buf_data (&out), w_buf_data (&expected), w_buf_size (&out)))
+            w_die ("$s: Unescaped text differs from the scalar kernel\n",
+                   xml_text_kernel_name (kernel));
+
+        w_print ("$s: escape $L MB/s, unescape $L MB/s\n",
+                 xml_text_kernel_name (kernel),
+                 (unsigned long) (length * rounds / escape_us),
+                 (unsigned long) (w_buf_size (&escaped) * rounds / unescape_us));
+    }
+
+    w_buf_clear (&escaped);
+    w_buf_clear (&expected);
+    w_buf_clear (&out);
+    w_free (text);
+}
+
+
+int
+main (int argc, char **argv)
+{
+    const char *config_path = "/dev/null";
+    const char *text_path = NULL;
+    unsigned long clients = 100, repeat = 10, memberships = 0, logins = 0, lookups = 0;
+    unsigned long sessions = 0, recipients = 0, idle = 0;
+    for (int opt; (opt = getopt (argc, argv, "c:d:i:j:l:m:n:o:r:t:x:")) != -1;) {
+        switch (opt) {
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'd':
+                /* All of them must fit in the cache for the second pass. */
+                if (!w_str_uint (optarg, &lookups) || !lookups ||
+                    lookups >= CHATEAU_RESOLVER_CACHE_MAX)
+                    w_die ("$s: Invalid number of lookups '$s'\n", argv[0], optarg);
+                break;
+            case 'i':
+                if (!w_str_uint (optarg, &idle) || !idle || idle > UINT_MAX)
+                    w_die ("$s: Invalid number of clients '$s'\n", argv[0], optarg);
+                break;
+            case 'j':
+                if (!w_str_uint (optarg, &sessions) || !sessions || sessions > UINT_MAX)
+                    w_die ("$s: Invalid number of sessions '$s'\n", argv[0], optarg);
+                break;
+            case 'l':
+                if (!w_str_uint (optarg, &logins) || !logins)
+                    w_die ("$s: Invalid number of logins '$s'\n", argv[0], optarg);
+                break;
+            case 'm':
+                if (!w_str_uint (optarg, &memberships) || !memberships)
+                    w_die ("$s: Invalid number of memberships '$s'\n", argv[0], optarg);
+                break;
+            case 'n':
+                if (!w_str_uint (optarg, &clients) || !clients || clients > UINT_MAX)
+                    w_die ("$s: Invalid number of clients '$s'\n", argv[0], optarg);
+                break;
+            case 'o':
+                if (!w_str_uint (optarg, &recipients) || !recipients || recipients > UINT_MAX)
+                    w_die ("$s: Invalid number of recipients '$s'\n", argv[0], optarg);
+                break;
+            case 'r':
+                if (!w_str_uint (optarg, &repeat) || !repeat || repeat > UINT_MAX)
+                    w_die ("$s: Invalid repeat count '$s'\n", argv[0], optarg);
+                break;
+            case 't':
+                for (s_transport = 0; s_transport < TRANSPORT_LAST; s_transport++)
+                    if (strcmp (optarg, s_transport_names[s_transport]) == 0)
+                        break;
+                if (s_transport == TRANSPORT_LAST)
+                    w_die ("$s: Invalid transport '$s'\n", argv[0], optarg);
+                break;
+            case 'x':
+                text_path = optarg;
+                break;
+            default:
+                w_die ("Usage: $s [-c config-file] [-n clients] [-r repeat]\n"
+                       "       [-t unix|tcp|tls|tls-user] [script]\n"
+                       "       $s [-n clients] -m memberships\n"
+                       "       $s [-n clients] -l logins\n"
+                       "       $s [-n tasks] -d lookups\n"
+                       "       $s [-r repeat] -j sessions\n"
+                       "       $s -o recipients\n"
+                       "       $s [-c config-file] -i clients\n"
+                       "       $s [-r repeat] -x text-file\n",
+                       argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+                       argv[0]);
+        }
+    }
+
+    if (text_path) {
+        bench_text (text_path, repeat);
+        return 0;
+    }
+    if (memberships) {
+        bench_channels (clients, memberships);
+        return 0;
+    }
+    if (logins) {
+        bench_logins (clients, logins);
+        return 0;
+    }
+    if (lookups) {
+        bench_lookups (clients, lookups);
+        return 0;
+    }
+    if (sessions) {
+        bench_routes (sessions, repeat);
+        return 0;
+    }
+    if (recipients) {
+        bench_offline (recipients);
+        return 0;
+    }
+
+    char *script = (optind < argc) ? read_script (argv[optind]) : NULL;
+
+    w_buf_t error = W_BUF;
+    config_t *config = config_load (config_path, &error);
+    if (!config)
+        w_die ("$B\n", &error);
+
+    /* Same setup as chateaud, without listening sockets or files. */
+    w_obj_unref (config->auth_agent);
+    config->auth_agent = w_obj_new (auth_agent_t);
+    auth_agent_init (config->auth_agent, stub_authenticate);
+    config->hibernate_idle = idle ? 1 : 0;
+    config_publish (config);
+    if (!governor_start ())
+        w_die ("Cannot start the memory governor: $s\n", strerror (errno));
+    link_init (config->server_name);
+
+    /* Never accepts, connections are handed to it with listener_spawn(). */
+    listener_t *listener;
+    if (s_transport == TRANSPORT_UNIX) {
+        int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        listener = (fd >= 0)
+            ? listener_new_fd ("IRC", fd, proto_irc_handler, NULL) : NULL;
+    } else {
+        listener = listener_new ("IRC", "tcp:127.0.0.1:0", proto_irc_handler, NULL);
+    }
+    if (!listener)
+        w_die ("Cannot create listener: $s\n", strerror (errno));
+
+    if (idle) {
+        s_idle_listener = listener;
+        s_idle_clients = idle;
+        w_task_set_name (w_task_prepare (idle_task, NULL, 16384), "bench-idle");
+        w_task_run_scheduler ();
+        w_obj_unref (listener);
+        return 0;
+    }
+
+    if (s_transport == TRANSPORT_TLS || s_transport == TRANSPORT_TLS_USER) {
+        if (!config->tls)
+            w_die ("$s: No tls-certificate and tls-key\n", config_path);
+        tls_context_set_offload (config->tls, s_transport == TRANSPORT_TLS);
+        listener->tls = true;
+        if (!(s_ssl_ctx = SSL_CTX_new (TLS_client_method ())))
+            w_die ("Cannot create TLS client context\n");
+        SSL_CTX_set_mode (s_ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    }
+
+    for (unsigned i = 0; i < clients; i++)
+        start_client (listener, script ? script : s_default_script, i, repeat);
+    w_obj_unref (listener);
+
+    const uint64_t start = now_us ();
+    w_task_run_scheduler ();
+    const uint64_t elapsed = now_us () - start;
+
+    fairshare_stats_t share;
+    fairshare_get_stats (&share);
+    w_print ("$L clients, $L lines sent, $L messages handled in $L ms\n",
+             clients, s_stats.lines, share.messages, (unsigned long) (elapsed / 1000));
+    w_print ("Handler time $L ms, $L ns per message, longest turn $L us\n",
+             (unsigned long) (share.run_time / 1000000),
+             (unsigned long) (share.messages ? share.run_time / share.messages : 0),
+             (unsigned long) (share.longest_turn / 1000));
+    w_print ("$L bytes sent, $L bytes received over $s, $L MB/s\n",
+             s_stats.sent, s_stats.received, s_transport_names[s_transport],
+             (unsigned long) ((s_stats.sent + s_stats.received) / (elapsed + 1)));
+    if (s_ssl_ctx) {
+        tls_stats_t tls;
+        tls_get_stats (&tls);
+        w_print ("$L TLS handshakes, $L offloaded to the kernel, $L failed\n",
+                 tls.handshakes, tls.offloaded, tls.failed);
+        SSL_CTX_free (s_ssl_ctx);
+    }
+
+    w_free (script);
+    return 0;
+}
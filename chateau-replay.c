@@ -0,0 +1,366 @@
+/*
+ * chateau-replay.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "capture.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+/*
+ * Feeds a trace recorded by chateaud back to a server, opening one
+ * connection for each one in the trace and sending the same bytes with
+ * the same delays, scaled by the speed factor. With a speed of zero,
+ * records are sent as fast as the server takes them, which measures its
+ * throughput. Whatever the server sends back is read and discarded.
+ */
+
+struct connection {
+    int      fd;
+    bool     closing;
+    w_buf_t  pending;
+    size_t   offset;
+};
+
+
+static struct connection *s_connections = NULL;
+static uint32_t           s_n_connections = 0;
+static struct addrinfo   *s_address = NULL;
+
+static struct {
+    unsigned long records;
+    unsigned long opened;
+    unsigned long sent;
+    unsigned long received;
+} s_stats;
+
+
+static uint64_t
+now_us (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static inline uint32_t
+get_u32 (const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+static struct connection*
+connection_get (uint32_t id)
+{
+    if (id >= s_n_connections) {
+        uint32_t n = s_n_connections ? s_n_connections : 64;
+        while (n <= id)
+            n *= 2;
+        s_connections = w_resize (s_connections, struct connection, n);
+        for (uint32_t i = s_n_connections; i < n; i++)
+            s_connections[i] = (struct connection) { .fd = -1, .pending = W_BUF };
+        s_n_connections = n;
+    }
+    return &s_connections[id];
+}
+
+
+static void
+connection_close (struct connection *connection)
+{
+    if (connection->fd >= 0) {
+        close (connection->fd);
+        connection->fd = -1;
+    }
+    w_buf_clear (&connection->pending);
+    connection->offset = 0;
+    connection->closing = false;
+}
+
+
+static void
+connection_open (struct connection *connection)
+{
+    connection_close (connection);
+
+    int fd = socket (s_address->ai_family, s_address->ai_socktype | SOCK_CLOEXEC,
+                     s_address->ai_protocol);
+    if (fd < 0)
+        w_die ("Cannot create socket: $s\n", strerror (errno));
+
+    /* Connecting over loopback does not take long enough to bother. */
+    if (connect (fd, s_address->ai_addr, s_address->ai_addrlen) != 0)
+        w_die ("Cannot connect: $s\n", strerror (errno));
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+
+    connection->fd = fd;
+    s_stats.opened++;
+}
+
+
+static void
+connection_flush (struct connection *connection)
+{
+    while (connection->fd >= 0 && connection->offset < w_buf_size (&connection->pending)) {
+        ssize_t r = send (connection->fd,
+                          w_buf_data (&connection->pending) + connection->offset,
+                          w_buf_size (&connection->pending) - connection->offset,
+                          MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (r < 0) {
+            /* The server dropped the client, as it may have done live. */
+            connection_close (connection);
+            return;
+        }
+        connection->offset += r;
+        s_stats.sent += r;
+    }
+
+    w_buf_clear (&connection->pending);
+    connection->offset = 0;
+    if (connection->closing)
+        connection_close (connection);
+}
+
+
+/*
+ * Reads and discards whatever the server sent, and writes what is pending,
+ * for at most "timeout_ms" milliseconds (or without waiting, if zero).
+ */
+static void
+pump (int timeout_ms)
+{
+    static struct pollfd *fds = NULL;
+    static uint32_t a_fds = 0;
+
+    if (a_fds < s_n_connections) {
+        a_fds = s_n_connections;
+        fds = w_resize (fds, struct pollfd, a_fds);
+    }
+
+    unsigned n = 0;
+    for (uint32_t i = 0; i < s_n_connections; i++) {
+        struct connection *connection = &s_connections[i];
+        if (connection->fd < 0)
+            continue;
+        fds[n].fd = connection->fd;
+        fds[n].events = POLLIN;
+        if (w_buf_size (&connection->pending))
+            fds[n].events |= POLLOUT;
+        fds[n].revents = 0;
+        n++;
+    }
+
+    if (n == 0) {
+        if (timeout_ms > 0)
+            usleep (timeout_ms * 1000);
+        return;
+    }
+
+    if (poll (fds, n, timeout_ms) <= 0)
+        return;
+
+    for (uint32_t i = 0, j = 0; i < s_n_connections && j < n; i++) {
+        struct connection *connection = &s_connections[i];
+        if (connection->fd != fds[j].fd)
+            continue;
+
+        if (fds[j].revents & (POLLIN | POLLHUP | POLLERR)) {
+            char buffer[16 * 1024];
+            ssize_t r;
+            while ((r = recv (connection->fd, buffer, sizeof (buffer), 0)) > 0)
+                s_stats.received += r;
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+                connection_close (connection);
+        }
+        if (connection->fd >= 0 && (fds[j].revents & POLLOUT))
+            connection_flush (connection);
+        j++;
+    }
+}
+
+
+static bool
+pending_output (void)
+{
+    for (uint32_t i = 0; i < s_n_connections; i++)
+        if (s_connections[i].fd >= 0 && w_buf_size (&s_connections[i].pending))
+            return true;
+    return false;
+}
+
+
+static void
+wait_until (uint64_t deadline)
+{
+    for (uint64_t now; (now = now_us ()) < deadline;) {
+        const uint64_t ms = (deadline - now + 999) / 1000;
+        pump (ms > INT_MAX ? INT_MAX : (int) ms);
+    }
+}
+
+
+static void
+parse_address (const char *argv0, const char *address)
+{
+    const char *colon = strrchr (address, ':');
+    if (!colon || colon == address || !colon[1])
+        w_die ("$s: Invalid address '$s', expected host:port\n", argv0, address);
+
+    char host[NI_MAXHOST];
+    const size_t length = colon - address;
+    if (length >= sizeof (host))
+        w_die ("$s: Invalid address '$s'\n", argv0, address);
+    memcpy (host, address, length);
+    host[length] = '\0';
+
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+    int r = getaddrinfo (host, colon + 1, &hints, &s_address);
+    if (r != 0)
+        w_die ("$s: $s: $s\n", argv0, address, gai_strerror (r));
+}
+
+
+static uint8_t*
+load_trace (const char *argv0, const char *path, size_t *size)
+{
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat (fd, &st) != 0)
+        w_die ("$s: $s: $s\n", argv0, path, strerror (errno));
+
+    uint8_t *data = w_alloc (uint8_t, st.st_size + 1);
+    size_t offset = 0;
+    while (offset < (size_t) st.st_size) {
+        ssize_t r = read (fd, data + offset, st.st_size - offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            w_die ("$s: $s: $s\n", argv0, path, r ? strerror (errno) : "Short read");
+        offset += r;
+    }
+    close (fd);
+
+    if (offset < CAPTURE_MAGIC_LENGTH ||
+        memcmp (data, CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH) != 0)
+        w_die ("$s: $s: Not a trace file\n", argv0, path);
+
+    *size = offset;
+    return data;
+}
+
+
+static void
+usage (const char *argv0)
+{
+    w_die ("Usage: $s [-s speed] trace-file host:port\n"
+           "A speed of 0 replays as fast as possible.\n", argv0);
+}
+
+
+int
+main (int argc, char **argv)
+{
+    unsigned long speed = 1;
+    for (int opt; (opt = getopt (argc, argv, "s:")) != -1;) {
+        switch (opt) {
+            case 's':
+                if (!w_str_uint (optarg, &speed))
+                    w_die ("$s: Invalid speed '$s'\n", argv[0], optarg);
+                break;
+            default:
+                usage (argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+        usage (argv[0]);
+
+    size_t size;
+    uint8_t *trace = load_trace (argv[0], argv[optind], &size);
+    parse_address (argv[0], argv[optind + 1]);
+
+    const uint64_t start = now_us ();
+    uint64_t deadline = start;
+
+    for (size_t offset = CAPTURE_MAGIC_LENGTH; offset < size;) {
+        if (size - offset < CAPTURE_HEADER_SIZE - 4)
+            w_die ("$s: Truncated record at offset $L\n", argv[0], (unsigned long) offset);
+
+        const uint8_t type = trace[offset];
+        const uint32_t id = get_u32 (trace + offset + 1);
+        const uint32_t delay = get_u32 (trace + offset + 5);
+        offset += CAPTURE_HEADER_SIZE - 4;
+
+        uint32_t length = 0;
+        if (type == CAPTURE_DATA) {
+            if (size - offset < 4 || size - offset - 4 < get_u32 (trace + offset))
+                w_die ("$s: Truncated record at offset $L\n", argv[0], (unsigned long) offset);
+            length = get_u32 (trace + offset);
+            offset += 4;
+        }
+
+        if (speed) {
+            deadline += delay / speed;
+            wait_until (deadline);
+        } else {
+            pump (0);
+        }
+
+        struct connection *connection = connection_get (id);
+        switch (type) {
+            case CAPTURE_OPEN:
+                connection_open (connection);
+                break;
+            case CAPTURE_DATA:
+                if (connection->fd >= 0) {
+                    w_buf_append_mem (&connection->pending, trace + offset, length);
+                    connection_flush (connection);
+                }
+                break;
+            case CAPTURE_CLOSE:
+                connection->closing = true;
+                connection_flush (connection);
+                break;
+            default:
+                w_die ("$s: Invalid record type $I\n", argv[0], (unsigned) type);
+        }
+        offset += length;
+        s_stats.records++;
+
+        /* Never queue without bound when the server cannot keep up. */
+        while (!speed && pending_output ())
+            pump (100);
+    }
+
+    while (pending_output ())
+        pump (100);
+
+    const uint64_t elapsed = now_us () - start;
+    w_print ("$L records, $L connections in $L ms\n"
+             "$L bytes sent, $L bytes received\n",
+             s_stats.records, s_stats.opened, (unsigned long) (elapsed / 1000),
+             s_stats.sent, s_stats.received);
+
+    for (uint32_t i = 0; i < s_n_connections; i++)
+        connection_close (&s_connections[i]);
+    w_free (s_connections);
+    freeaddrinfo (s_address);
+    w_free (trace);
+    return 0;
+}
@@ -6,6 +6,15 @@
  */
 
 #include "auth.h"
+#include "channel.h"
+#include "journal.h"
+#include "capture.h"
+#include "offline.h"
+#include "document.h"
+#include "config.h"
+#include "listener.h"
+#include "upgrade.h"
+#include "governor.h"
 #include <sys/types.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -13,40 +22,135 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
 
-extern void proto_irc_handler  (w_task_listener_t*, w_io_t*);
-extern void proto_xmpp_handler (w_task_listener_t*, w_io_t*);
+extern void proto_irc_handler  (listener_t*, w_io_t*);
+extern void proto_xmpp_handler (listener_t*, w_io_t*);
 
 
-static const auth_simple_mem_agent_entry_t auth_users[] = {
-    { "op",  "op3rat0r" },
-    { "joe", "jo3jo3"   },
-    { "tom", "t0mt0m"   },
-    { NULL },
-};
+#ifndef CHATEAU_JOURNAL_REPLAY_WINDOW
+#define CHATEAU_JOURNAL_REPLAY_WINDOW (24 * 60 * 60) /* s */
+#endif /* !CHATEAU_JOURNAL_REPLAY_WINDOW */
+
+
+static void
+rebuild_history (const journal_entry_t *entry, void *userdata)
+{
+    unsigned *count = userdata;
+    if (!channel_name_is_valid (entry->target, entry->target_length))
+        return;
+
+    channel_t *channel = channel_get (entry->target, entry->target_length);
+    atom_t *sender = atom_intern (entry->sender, entry->sender_length);
+    if (history_append_at (&channel->history, entry->notice, sender,
+                           entry->body, entry->body_length, entry->time))
+        (*count)++;
+    else
+        channel_collect (channel);  /* Not kept: drop it if it was new. */
+    atom_unref (sender);
+}
 
 
 int
 main (int argc, char **argv)
 {
-    w_task_t *task;
-    auth_agent_t *auth_agent = auth_simple_mem_agent_new (auth_users);
+    upgrade_init (argc, argv);
+
+    const char *config_path = CHATEAU_CONFIG_PATH;
+    int upgrade_fd = -1;
+    for (int opt; (opt = getopt (argc, argv, "c:U:")) != -1;) {
+        unsigned long value;
+        switch (opt) {
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'U':
+                if (!w_str_uint (optarg, &value) || value > INT_MAX)
+                    w_die ("$s: Invalid file descriptor '$s'\n", argv[0], optarg);
+                upgrade_fd = (int) value;
+                break;
+            default:
+                w_die ("Usage: $s [-c config-file]\n", argv[0]);
+        }
+    }
+
+    w_buf_t error = W_BUF;
+    config_t *config = config_load (config_path, &error);
+    if (!config)
+        w_die ("$B\n", &error);
 
-    w_task_listener_t *irc_listener =
-            w_task_listener_new ("tcp:6686", proto_irc_handler, auth_agent);
-    task = w_task_prepare (w_task_listener_run, irc_listener, 16384);
-    w_task_set_name (task, "IRC");
+    config_publish (config);
+    config = config_acquire ();
+    config_watch_sighup ();
+    document_watch ();
+    upgrade_watch_sigusr2 ();
+    if (!governor_start ())
+        w_die ("Cannot start the memory governor: $s\n", strerror (errno));
+    link_init (config->server_name);
 
-    w_task_listener_t *xmpp_listener =
-            w_task_listener_new ("tcp:5269", proto_xmpp_handler, auth_agent);
-    task = w_task_prepare (w_task_listener_run, xmpp_listener, 16384);
-    w_task_set_name (task, "XMPP");
+    if (config->journal_path) {
+        if (!journal_open (config->journal_path))
+            w_die ("$s: Cannot open journal: $s\n", config->journal_path,
+                   strerror (errno));
+
+        unsigned count = 0;
+        const uint32_t now = (uint32_t) time (NULL);
+        journal_replay (NULL, 0, now - CHATEAU_JOURNAL_REPLAY_WINDOW, now,
+                        rebuild_history, &count);
+        w_printerr ("Replayed $I messages from journal\n", count);
+    }
+
+    if (config->offline_path && !offline_open (config->offline_path))
+        w_die ("$s: Cannot open offline store: $s\n", config->offline_path,
+               strerror (errno));
+
+    if (config->capture_path) {
+        if (!capture_open (config->capture_path))
+            w_die ("$s: Cannot open capture: $s\n", config->capture_path,
+                   strerror (errno));
+        w_printerr ("Capturing client traffic to $s\n", config->capture_path);
+    }
+
+    if (upgrade_fd >= 0) {
+        if (!upgrade_receive (upgrade_fd))
+            w_die ("Upgrade failed, the previous process keeps running\n");
+    } else {
+        listener_t *listener =
+                listener_new ("IRC", config->listen_irc, proto_irc_handler, NULL);
+        if (!listener)
+            w_die ("$s: Cannot listen: $s\n", config->listen_irc, strerror (errno));
+        listener_start (listener);
+        w_obj_unref (listener);
+
+        if (config->listen_irc_tls) {
+            listener = listener_new ("IRC-TLS", config->listen_irc_tls,
+                                     proto_irc_handler, NULL);
+            if (!listener)
+                w_die ("$s: Cannot listen: $s\n", config->listen_irc_tls,
+                       strerror (errno));
+            listener->tls = true;
+            listener_start (listener);
+            w_obj_unref (listener);
+        }
+
+        listener = listener_new ("XMPP", config->listen_xmpp, proto_xmpp_handler, NULL);
+        if (!listener)
+            w_die ("$s: Cannot listen: $s\n", config->listen_xmpp, strerror (errno));
+        listener_start (listener);
+        w_obj_unref (listener);
+    }
 
     w_task_run_scheduler ();
 
-    w_obj_unref (xmpp_listener);
-    w_obj_unref (irc_listener);
-    w_obj_unref (auth_agent);
+    if (journal_is_open ())
+        journal_close ();
+    if (offline_is_open ())
+        offline_close ();
+    if (capture_is_open ())
+        capture_close ();
+
+    config_release (&config);
 
     return 0;
 }
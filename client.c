@@ -0,0 +1,405 @@
+/*
+ * client.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "client.h"
+#include "proto-irc.h"
+#include "link.h"
+#include "governor.h"
+#include "resolver.h"
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <errno.h>
+
+
+enum {
+    NICK_MAX = 9,  /* RFC1459, section 1.2 */
+};
+
+
+/* Maps case-folded nicks (see atom_folded()) to client_t objects. */
+static w_dict_t  *s_clients = NULL;
+
+/* Registered clients, in no particular order. */
+static client_t **s_registered = NULL;
+static unsigned   s_n_registered = 0;
+static unsigned   s_a_registered = 0;
+
+/* Clients connected to this server. */
+static client_t **s_local = NULL;
+static unsigned   s_n_local = 0;
+static unsigned   s_a_local = 0;
+
+
+static bool
+fold_nick (char key[NICK_MAX + 1], const char *nick, size_t length)
+{
+    if (length == 0 || length > NICK_MAX)
+        return false;
+    irc_casefold (key, nick, length);
+    key[length] = '\0';
+    return true;
+}
+
+
+static void
+client_destroy (void *obj)
+{
+    client_t *client = obj;
+    w_assert (client->n_channels == 0);
+    client_unregister (client);
+
+    if (client_is_local (client)) {
+        client_t *last = s_local[--s_n_local];
+        s_local[client->local_index] = last;
+        last->local_index = client->local_index;
+    }
+
+    atom_unref (client->host);
+    w_buf_clear (&client->mask_folded);
+    w_buf_clear (&client->login_nick);
+    w_buf_clear (&client->login_pass);
+    if (client->sasl) {
+        sasl_clear (client->sasl);
+        w_free (client->sasl);
+    }
+    w_buf_clear (&client->sasl_input);
+    w_buf_clear (&client->account);
+    w_free (client->channels);
+    w_free (client->slots);
+}
+
+
+client_t*
+client_new (w_io_t *socket)
+{
+    w_assert (socket);
+
+    client_t *client = w_obj_new (client_t);
+    client->socket = socket;
+
+    if (s_n_local == s_a_local) {
+        s_a_local = s_a_local ? s_a_local * 2 : 64;
+        s_local = w_resize (s_local, client_t*, s_a_local);
+    }
+    client->local_index = s_n_local;
+    s_local[s_n_local++] = client;
+
+    return w_obj_dtor (client, client_destroy);
+}
+
+
+client_t*
+client_new_remote (link_t *link, struct link_server *server)
+{
+    w_assert (link);
+    w_assert (server);
+
+    client_t *client = w_obj_new (client_t);
+    client->socket = link->socket;
+    client->link = link;
+    client->server = server;
+    return w_obj_dtor (client, client_destroy);
+}
+
+
+bool
+client_register (client_t *client, const char *nick)
+{
+    w_assert (client);
+    w_assert (nick);
+    w_assert (!client_is_registered (client));
+
+    const size_t length = strlen (nick);
+    if (length == 0 || length > NICK_MAX)
+        return false;
+
+    atom_t *atom = atom_intern (nick, length);
+    if (!s_clients) {
+        s_clients = w_dict_new (false);
+    } else if (w_dict_getn (s_clients, atom_folded (atom), length)) {
+        atom_unref (atom);
+        return false;
+    }
+
+    w_dict_setn (s_clients, atom_folded (atom), length, client);
+    client->nick = atom;
+    w_buf_clear (&client->mask_folded);
+
+    if (s_n_registered == s_a_registered) {
+        s_a_registered = s_a_registered ? s_a_registered * 2 : 64;
+        s_registered = w_resize (s_registered, client_t*, s_a_registered);
+    }
+    client->index = s_n_registered;
+    s_registered[s_n_registered++] = client;
+    return true;
+}
+
+
+void
+client_lookup_host (client_t *client)
+{
+    w_assert (client);
+    w_assert (client_is_local (client));
+
+    struct sockaddr_storage addr;
+    socklen_t addr_length = sizeof (addr);
+    char host[INET6_ADDRSTRLEN] = "unknown";
+    int fd = w_io_get_fd (client->socket);
+
+    if (fd >= 0 && getpeername (fd, (struct sockaddr*) &addr, &addr_length) == 0) {
+        if (addr.ss_family == AF_INET)
+            inet_ntop (AF_INET, &((struct sockaddr_in*) &addr)->sin_addr,
+                       host, sizeof (host));
+        else if (addr.ss_family == AF_INET6)
+            inet_ntop (AF_INET6, &((struct sockaddr_in6*) &addr)->sin6_addr,
+                       host, sizeof (host));
+    }
+    atom_unref (client->host);
+    client->host = atom_intern (host, strlen (host));
+    w_buf_clear (&client->mask_folded);
+}
+
+
+void
+client_resolve_host (client_t *client)
+{
+    w_assert (client);
+    w_assert (client_is_local (client));
+
+    struct sockaddr_storage addr;
+    socklen_t addr_length = sizeof (addr);
+    int fd = w_io_get_fd (client->socket);
+    if (fd < 0 || getpeername (fd, (struct sockaddr*) &addr, &addr_length) != 0)
+        return;
+
+    atom_t *host = resolver_lookup ((struct sockaddr*) &addr, addr_length);
+    if (host) {
+        atom_unref (client->host);
+        client->host = host;
+        w_buf_clear (&client->mask_folded);
+    }
+}
+
+
+static size_t
+write_mask (const client_t *client, bool folded, char out[IRC_MAX_LINE])
+{
+    /* There are no separate user names: the nick is used instead. */
+    const char *nick = folded ? atom_folded (client->nick) : atom_str (client->nick);
+    const size_t nick_length = atom_length (client->nick);
+
+    const char *host = NULL;
+    size_t host_length = 0;
+    if (client->server) {
+        host = w_buf_data (&client->server->name);
+        host_length = w_buf_size (&client->server->name);
+    } else if (client->host) {
+        host = folded ? atom_folded (client->host) : atom_str (client->host);
+        host_length = atom_length (client->host);
+    }
+    if (2 * nick_length + host_length + 2 >= IRC_MAX_LINE)
+        return 0;
+
+    char *p = out;
+    memcpy (p, nick, nick_length);
+    p += nick_length;
+    *p++ = '!';
+    memcpy (p, nick, nick_length);
+    p += nick_length;
+    *p++ = '@';
+    if (host_length) {
+        /* Server names are few, and folded here. */
+        if (folded && client->server)
+            irc_casefold (p, host, host_length);
+        else
+            memcpy (p, host, host_length);
+    }
+    p += host_length;
+    *p = '\0';
+    return p - out;
+}
+
+
+size_t
+client_mask (const client_t *client, char out[IRC_MAX_LINE])
+{
+    w_assert (client);
+    w_assert (client_is_registered (client));
+    w_assert (out);
+    return write_mask (client, false, out);
+}
+
+
+size_t
+client_mask_folded (const client_t *client, char out[IRC_MAX_LINE])
+{
+    w_assert (client);
+    w_assert (client_is_registered (client));
+    w_assert (out);
+    return write_mask (client, true, out);
+}
+
+
+const char*
+client_mask_folded_cached (client_t *client, size_t *length)
+{
+    w_assert (client);
+    w_assert (client_is_registered (client));
+    w_assert (length);
+
+    if (!w_buf_size (&client->mask_folded)) {
+        char mask[IRC_MAX_LINE];
+        size_t mask_length = write_mask (client, true, mask);
+        if (!mask_length)
+            return NULL;
+        w_buf_append_mem (&client->mask_folded, mask, mask_length);
+    }
+    *length = w_buf_size (&client->mask_folded);
+    return w_buf_data (&client->mask_folded);
+}
+
+
+bool
+client_match_mask (const client_t *client, const mask_t *mask)
+{
+    w_assert (client);
+    w_assert (mask);
+
+    if (strpbrk (mask_text (mask), "!@")) {
+        char full[IRC_MAX_LINE];
+        size_t length = client_mask_folded (client, full);
+        return mask_match_folded (mask, full, length);
+    }
+    return mask_match_folded (mask, atom_folded (client->nick),
+                              atom_length (client->nick));
+}
+
+
+void
+client_unregister (client_t *client)
+{
+    w_assert (client);
+
+    if (!client_is_registered (client))
+        return;
+
+    w_dict_deln (s_clients, atom_folded (client->nick), atom_length (client->nick));
+    atom_unref (client->nick);
+    client->nick = NULL;
+    w_buf_clear (&client->mask_folded);
+
+    client_t *last = s_registered[--s_n_registered];
+    s_registered[client->index] = last;
+    last->index = client->index;
+}
+
+
+unsigned
+client_count (void)
+{
+    return s_n_registered;
+}
+
+
+client_t*
+client_at (unsigned index)
+{
+    w_assert (index < s_n_registered);
+    return s_registered[index];
+}
+
+
+unsigned
+client_local_count (void)
+{
+    return s_n_local;
+}
+
+
+client_t*
+client_local_at (unsigned index)
+{
+    w_assert (index < s_n_local);
+    return s_local[index];
+}
+
+
+client_t*
+client_lookup (const char *nick, size_t length)
+{
+    w_assert (nick);
+
+    char key[NICK_MAX + 1];
+    if (!s_clients || !fold_nick (key, nick, length))
+        return NULL;
+    return w_dict_getn (s_clients, key, length);
+}
+
+
+w_io_result_t
+client_send (client_t *client, const void *data, size_t length)
+{
+    w_assert (client);
+    w_assert (data);
+
+    if (client_is_local (client) && !governor_admit_send (client, length))
+        return W_IO_RESULT_ERROR (ENOBUFS);
+
+    w_io_result_t r = W_IO_RESULT (0);
+    W_IO_CHAIN (r, w_io_write (client->socket, data, length));
+    W_IO_CHAIN (r, w_io_flush (client->socket));
+    return r;
+}
+
+
+w_io_result_t
+client_sendf (client_t *client, const char *format, ...)
+{
+    w_assert (client);
+    w_assert (format);
+
+    w_buf_t line = W_BUF;
+    w_io_buf_t io;
+    w_io_buf_init (&io, &line, true);
+
+    va_list args;
+    va_start (args, format);
+    W_IO_NORESULT (w_io_formatv ((w_io_t*) &io, format, args));
+    va_end (args);
+
+    w_io_result_t r = client_send (client, w_buf_data (&line), w_buf_size (&line));
+    w_buf_clear (&line);
+    return r;
+}
+
+
+w_io_result_t
+client_send_tagged (client_t      *client,
+                    const w_buf_t  tags[CLIENT_CAP_TAG_VARIANTS],
+                    const void    *data,
+                    size_t         length)
+{
+    w_assert (client);
+    w_assert (tags);
+    w_assert (data);
+
+    const w_buf_t *section = client_is_local (client)
+        ? &tags[client->caps & (CLIENT_CAP_TAG_VARIANTS - 1)] : &tags[0];
+
+    if (client_is_local (client) &&
+        !governor_admit_send (client, w_buf_size (section) + length))
+        return W_IO_RESULT_ERROR (ENOBUFS);
+
+    w_io_result_t r = W_IO_RESULT (0);
+    if (w_buf_size (section))
+        W_IO_CHAIN (r, w_io_write (client->socket, w_buf_data (section),
+                                   w_buf_size (section)));
+    W_IO_CHAIN (r, w_io_write (client->socket, data, length));
+    W_IO_CHAIN (r, w_io_flush (client->socket));
+    return r;
+}
@@ -0,0 +1,178 @@
+/*
+ * client.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include "proto-irc.h"
+#include "mask.h"
+#include "atom.h"
+#include "sasl.h"
+#include "fairshare.h"
+
+W_OBJ_DECL (channel_t);
+W_OBJ_DECL (client_t);
+W_OBJ_DECL (link_t);
+struct link_server;
+
+
+/* IRCv3 capabilities, enabled with CAP REQ. */
+enum {
+    CLIENT_CAP_MESSAGE_TAGS = 1 << 0,
+    CLIENT_CAP_SERVER_TIME  = 1 << 1,
+
+    /* Number of combinations of the capabilities which affect tags. */
+    CLIENT_CAP_TAG_VARIANTS = 1 << 2,
+
+    CLIENT_CAP_SASL         = 1 << 2,
+};
+
+W_OBJ_DEF (client_t)
+{
+    w_obj_t     parent;
+    w_io_t     *socket;
+    atom_t     *nick;       /* NULL until registered. */
+    atom_t     *host;       /* Address of local clients. */
+    w_buf_t     mask_folded; /* Cached, empty when the nick or host change. */
+    bool        oper;
+    unsigned    index;      /* Position in the array of registered clients. */
+    unsigned    local_index; /* Position in the array of local clients. */
+    unsigned    stamp;      /* Avoids sending duplicates in fan-outs. */
+    uint8_t     caps;
+    bool        cap_negotiating; /* Registration waits for CAP END. */
+
+    /* Accounting of local clients, see governor.h */
+    size_t      sendq;
+    size_t      recvq;
+    bool        throttled;
+    bool        sendq_exceeded;
+
+    /* Turns and handling time of local clients, see fairshare.h */
+    fairshare_t share;
+
+    /*
+     * Remote clients are reached through the link to the server they are
+     * connected to, and "socket" is the socket of that link. Both are
+     * NULL for clients connected to this server.
+     */
+    link_t             *link;
+    struct link_server *server;
+
+    /* NICK and PASS given before registration. */
+    w_buf_t     login_nick;
+    w_buf_t     login_pass;
+
+    /*
+     * AUTHENTICATE exchange in progress, with the response received so
+     * far, and the account it authenticated, which stands for PASS.
+     */
+    sasl_t     *sasl;
+    w_buf_t     sasl_input;
+    w_buf_t     account;
+
+    /*
+     * Channels joined by the client, and the position of the client in
+     * the membership arrays of each one (see channel_t).
+     */
+    channel_t **channels;
+    unsigned   *slots;
+    unsigned    n_channels;
+    unsigned    a_channels;
+};
+
+
+extern client_t* client_new (w_io_t *socket);
+extern client_t* client_new_remote (link_t             *link,
+                                    struct link_server *server);
+
+/*
+ * Makes the client reachable by its nick. Returns false if the nick is
+ * already used by some other client.
+ */
+extern bool client_register (client_t *client, const char *nick);
+extern void client_unregister (client_t *client);
+extern client_t* client_lookup (const char *nick, size_t length);
+
+/* Address of the peer of the client socket, for local clients. */
+extern void client_lookup_host (client_t *client);
+
+/*
+ * Replaces the address with the name of the peer, if it has one. Yields
+ * until the name is resolved, which gives up after a timeout (see
+ * resolver.h), so it must be called from the task of the client.
+ */
+extern void client_resolve_host (client_t *client);
+
+/*
+ * Writes "nick!user@host", as matched by bans, returning its length.
+ * Remote clients use the name of their server as host.
+ */
+extern size_t client_mask (const client_t *client, char out[IRC_MAX_LINE]);
+
+/* Same, case-folded, as matched by mask_set_match_folded(). */
+extern size_t client_mask_folded (const client_t *client, char out[IRC_MAX_LINE]);
+
+/*
+ * Same again, built once and kept by the client until its nick or host
+ * change, for ban checks on every message. Returns NULL if too long.
+ */
+extern const char* client_mask_folded_cached (client_t *client, size_t *length);
+
+/*
+ * Matches a mask against the nick of a client, or against its whole
+ * "nick!user@host" if the mask has "!" or "@" in it.
+ */
+extern bool client_match_mask (const client_t *client, const mask_t *mask);
+
+/* Registered clients, both local and remote, can be walked by index. */
+extern unsigned client_count (void);
+extern client_t* client_at (unsigned index);
+
+/* Same for clients connected to this server, registered or not. */
+extern unsigned client_local_count (void);
+extern client_t* client_local_at (unsigned index);
+
+static inline bool
+client_is_local (const client_t *client)
+{
+    w_assert (client);
+    return client->link == NULL;
+}
+
+static inline bool
+client_is_registered (const client_t *client)
+{
+    w_assert (client);
+    return client->nick != NULL;
+}
+
+/* The nick, or "*" for clients not registered yet, as used in replies. */
+static inline const char*
+client_nick (const client_t *client)
+{
+    w_assert (client);
+    return client->nick ? atom_str (client->nick) : "*";
+}
+
+extern w_io_result_t client_send (client_t   *client,
+                                  const void *data,
+                                  size_t      length);
+
+/* Same, for a line formatted like w_io_format() does. */
+extern w_io_result_t client_sendf (client_t *client, const char *format, ...);
+
+/*
+ * Sends a message preceded by the tag section rendered for the
+ * capabilities of the client, i.e. tags[client->caps], which may be
+ * empty. Remote clients never get tags.
+ */
+extern w_io_result_t client_send_tagged (client_t      *client,
+                                         const w_buf_t  tags[CLIENT_CAP_TAG_VARIANTS],
+                                         const void    *data,
+                                         size_t         length);
+
+#endif /* !CLIENT_H */
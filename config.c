@@ -0,0 +1,539 @@
+/*
+ * config.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "config.h"
+#include "history.h"
+#include "governor.h"
+#include "sasl.h"
+#include "resolver.h"
+#include "offline.h"
+#include "fairshare.h"
+#include "document.h"
+#include "hibernate.h"
+#include <sys/signalfd.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+enum {
+    MAX_FIELDS = 4,
+};
+
+
+static config_t *s_current = NULL;
+
+/* Incremented by each rehash, see config_rehash(). */
+static unsigned s_generation = 0;
+
+
+static void
+config_destroy (void *obj)
+{
+    config_t *config = obj;
+
+    if (config->auth_agent)
+        w_obj_unref (config->auth_agent);
+    if (config->oper_agent)
+        w_obj_unref (config->oper_agent);
+    if (config->tls)
+        w_obj_unref (config->tls);
+    if (config->bans)
+        w_obj_unref (config->bans);
+
+    for (unsigned i = 0; i < config->n_strings; i++)
+        w_free (config->strings[i]);
+    w_free (config->strings);
+    w_free (config->users);
+    w_free (config->opers);
+    w_free (config->peers);
+    w_free (config->allow_rules);
+    w_free (config->path);
+}
+
+
+static const char*
+config_strdup (config_t *config, const char *str)
+{
+    config->strings = w_resize (config->strings, char*, config->n_strings + 1);
+    return config->strings[config->n_strings++] = w_str_dup (str);
+}
+
+
+static void
+add_entry (config_t                       *config,
+           auth_simple_mem_agent_entry_t **entries,
+           unsigned                       *n_entries,
+           const char                     *user,
+           const char                     *pass)
+{
+    /* Keep room for the NULL terminator expected by the agent. */
+    *entries = w_resize (*entries, auth_simple_mem_agent_entry_t, *n_entries + 2);
+    (*entries)[*n_entries] = (auth_simple_mem_agent_entry_t) {
+        .user = config_strdup (config, user),
+        .pass = config_strdup (config, pass),
+    };
+    (*entries)[++(*n_entries)] = (auth_simple_mem_agent_entry_t) { NULL };
+}
+
+
+static bool
+parse_size (const char *str, size_t *value)
+{
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull (str, &end, 0);
+    if (errno || end == str)
+        return false;
+
+    switch (*end) {
+        case 'k': case 'K': v *= 1024ULL; end++; break;
+        case 'm': case 'M': v *= 1024ULL * 1024; end++; break;
+        case 'g': case 'G': v *= 1024ULL * 1024 * 1024; end++; break;
+    }
+    if (*end != '\0')
+        return false;
+
+    *value = (size_t) v;
+    return true;
+}
+
+
+static bool
+parse_count (const char *str, unsigned *value)
+{
+    size_t v;
+    if (!parse_size (str, &v) || v > UINT_MAX)
+        return false;
+    *value = (unsigned) v;
+    return true;
+}
+
+
+/*
+ * Cuts the line at a "#" which starts it or follows a blank, and removes
+ * the blanks left before it, so comments never end up in the last field.
+ */
+static void
+strip_comment (char *line)
+{
+    char *end = line;
+    for (char *p = line; *p; p++) {
+        if (*p == '#' && (p == line || p[-1] == ' ' || p[-1] == '\t'))
+            break;
+        end = p + 1;
+    }
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    *end = '\0';
+}
+
+
+/*
+ * Splits a line in up to MAX_FIELDS whitespace-separated fields; the
+ * last one takes the rest of the line. Returns the number of fields.
+ */
+static unsigned
+split_fields (char *line, char *fields[MAX_FIELDS])
+{
+    strip_comment (line);
+
+    unsigned n = 0;
+    while (n < MAX_FIELDS) {
+        while (*line == ' ' || *line == '\t')
+            line++;
+        if (*line == '\0')
+            break;
+        fields[n++] = line;
+        if (n == MAX_FIELDS)
+            break;
+        while (*line && *line != ' ' && *line != '\t')
+            line++;
+        if (*line)
+            *line++ = '\0';
+    }
+    return n;
+}
+
+
+static bool
+parse_line (config_t *config, char *line, const char **error)
+{
+    char *f[MAX_FIELDS];
+    unsigned n = split_fields (line, f);
+    if (n == 0)
+        return true;
+
+    /* Lets the last field of a directive contain spaces. */
+#define JOIN_REST(i) \
+    for (unsigned j = (i); j + 1 < n; j++) f[j][strlen (f[j])] = ' '
+
+    if (strcmp (f[0], "server-name") == 0 && n == 2) {
+        config->server_name = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "server-info") == 0 && n >= 2) {
+        JOIN_REST (1);
+        config->server_info = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "listen-irc") == 0 && n == 2) {
+        config->listen_irc = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "listen-irc-tls") == 0 && n == 2) {
+        config->listen_irc_tls = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "listen-xmpp") == 0 && n == 2) {
+        config->listen_xmpp = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "tls-certificate") == 0 && n == 2) {
+        config->tls_certificate = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "tls-key") == 0 && n == 2) {
+        config->tls_key = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "journal") == 0 && n == 2) {
+        config->journal_path = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "resolver") == 0 && n == 2) {
+        config->resolver = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "offline") == 0 && n == 2) {
+        config->offline_path = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "offline-quota") == 0 && n == 2) {
+        if (!parse_size (f[1], &config->offline_quota))
+            return (*error = "invalid size"), false;
+    } else if (strcmp (f[0], "motd") == 0 && n == 2) {
+        config->motd_path = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "info") == 0 && n == 2) {
+        config->info_path = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "admin") == 0 && n == 2) {
+        config->admin_path = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "capture") == 0 && n == 2) {
+        config->capture_path = config_strdup (config, f[1]);
+    } else if (strcmp (f[0], "history-channel-max") == 0 && n == 2) {
+        if (!parse_size (f[1], &config->history_channel_max))
+            return (*error = "invalid size"), false;
+    } else if (strcmp (f[0], "history-total-max") == 0 && n == 2) {
+        if (!parse_size (f[1], &config->history_total_max))
+            return (*error = "invalid size"), false;
+    } else if (strcmp (f[0], "history-replay-lines") == 0 && n == 2) {
+        size_t lines;
+        if (!parse_size (f[1], &lines) || lines > UINT16_MAX)
+            return (*error = "invalid number of lines"), false;
+        config->history_replay_lines = lines;
+    } else if (strcmp (f[0], "sendq-user") == 0 && n == 2) {
+        if (!parse_size (f[1], &config->sendq_user))
+            return (*error = "invalid size"), false;
+    } else if (strcmp (f[0], "sendq-oper") == 0 && n == 2) {
+        if (!parse_size (f[1], &config->sendq_oper))
+            return (*error = "invalid size"), false;
+    } else if (strcmp (f[0], "sendq-socket-buffer") == 0 && n == 2) {
+        if (strcmp (f[1], "on") == 0)
+            config->sendq_socket_buffer = true;
+        else if (strcmp (f[1], "off") == 0)
+            config->sendq_socket_buffer = false;
+        else
+            return (*error = "expected 'on' or 'off'"), false;
+    } else if (strcmp (f[0], "memory-max") == 0 && n == 2) {
+        if (!parse_size (f[1], &config->memory_max))
+            return (*error = "invalid size"), false;
+    } else if (strcmp (f[0], "scram-iterations") == 0 && n == 2) {
+        size_t iterations;
+        if (!parse_size (f[1], &iterations) || iterations < 1 || iterations > UINT32_MAX)
+            return (*error = "invalid number of iterations"), false;
+        config->scram_iterations = iterations;
+    } else if (strcmp (f[0], "turn-messages") == 0 && n == 2) {
+        if (!parse_count (f[1], &config->turn_messages) || config->turn_messages == 0)
+            return (*error = "invalid number of messages"), false;
+    } else if (strcmp (f[0], "turn-time") == 0 && n == 2) {
+        if (!parse_count (f[1], &config->turn_time) || config->turn_time == 0)
+            return (*error = "invalid time"), false;
+    } else if (strcmp (f[0], "hibernate-idle") == 0 && n == 2) {
+        if (!parse_count (f[1], &config->hibernate_idle))
+            return (*error = "invalid time"), false;
+    } else if (strcmp (f[0], "connect-limit-ip") == 0 && n == 2) {
+        if (!parse_count (f[1], &config->connect_limit_ip))
+            return (*error = "invalid number of connections"), false;
+    } else if (strcmp (f[0], "connect-limit-subnet") == 0 && n == 2) {
+        if (!parse_count (f[1], &config->connect_limit_subnet))
+            return (*error = "invalid number of connections"), false;
+    } else if (strcmp (f[0], "connect-rate-ip") == 0 && n == 2) {
+        if (!parse_count (f[1], &config->connect_rate_ip))
+            return (*error = "invalid rate"), false;
+    } else if (strcmp (f[0], "connect-rate-subnet") == 0 && n == 2) {
+        if (!parse_count (f[1], &config->connect_rate_subnet))
+            return (*error = "invalid rate"), false;
+    } else if (strcmp (f[0], "pending-max") == 0 && n == 2) {
+        if (!parse_count (f[1], &config->pending_max))
+            return (*error = "invalid number of connections"), false;
+    } else if (strcmp (f[0], "allow") == 0 && n == 4) {
+        admission_rule_t rule;
+        if (!admission_rule_parse (&rule, f[1]))
+            return (*error = "invalid address"), false;
+        if (!parse_count (f[2], &rule.limit) || !parse_count (f[3], &rule.rate))
+            return (*error = "invalid number of connections"), false;
+        config->allow_rules = w_resize (config->allow_rules, admission_rule_t,
+                                        config->n_allow_rules + 1);
+        config->allow_rules[config->n_allow_rules++] = rule;
+    } else if (strcmp (f[0], "ban") == 0 && n == 2) {
+        mask_set_add (config->bans, f[1], strlen (f[1]));
+    } else if (strcmp (f[0], "user") == 0 && n == 3) {
+        add_entry (config, &config->users, &config->n_users, f[1], f[2]);
+    } else if (strcmp (f[0], "oper") == 0 && n == 3) {
+        add_entry (config, &config->opers, &config->n_opers, f[1], f[2]);
+    } else if (strcmp (f[0], "link") == 0 && n == 4) {
+        config->peers = w_resize (config->peers, link_peer_t, config->n_peers + 2);
+        config->peers[config->n_peers] = (link_peer_t) {
+            .name     = config_strdup (config, f[1]),
+            .password = config_strdup (config, f[2]),
+            .address  = config_strdup (config, f[3]),
+        };
+        config->peers[++config->n_peers] = (link_peer_t) { NULL };
+    } else {
+        *error = "unknown directive or wrong number of arguments";
+        return false;
+    }
+
+#undef JOIN_REST
+    return true;
+}
+
+
+config_t*
+config_load (const char *path, w_buf_t *error)
+{
+    w_assert (path);
+    w_assert (error);
+
+    w_io_t *io = w_io_unix_open (path, O_RDONLY, 0);
+    if (!io) {
+        w_buf_format (error, "$s: $s", path, strerror (errno));
+        return NULL;
+    }
+
+    config_t *config = w_obj_new (config_t);
+    w_obj_dtor (config, config_destroy);
+    config->path = w_str_dup (path);
+    config->server_name = CHATEAU_SERVER_NAME;
+    config->server_info = CHATEAU_SERVER_INFO;
+    config->listen_irc = "tcp:6686";
+    config->listen_xmpp = "tcp:5269";
+    config->history_channel_max = CHATEAU_HISTORY_CHANNEL_MAX;
+    config->history_total_max = CHATEAU_HISTORY_TOTAL_MAX;
+    config->history_replay_lines = CHATEAU_HISTORY_REPLAY_LINES;
+    config->sendq_user = CHATEAU_SENDQ_USER;
+    config->sendq_oper = CHATEAU_SENDQ_OPER;
+    config->sendq_socket_buffer = true;
+    config->memory_max = CHATEAU_MEMORY_MAX;
+    config->offline_quota = CHATEAU_OFFLINE_QUOTA;
+    config->scram_iterations = CHATEAU_SCRAM_ITERATIONS;
+    config->turn_messages = CHATEAU_TURN_MESSAGES;
+    config->turn_time = CHATEAU_TURN_TIME;
+    config->hibernate_idle = CHATEAU_HIBERNATE_IDLE;
+    config->connect_limit_ip = CHATEAU_CONNECT_LIMIT_IP;
+    config->connect_limit_subnet = CHATEAU_CONNECT_LIMIT_SUBNET;
+    config->connect_rate_ip = CHATEAU_CONNECT_RATE_IP;
+    config->connect_rate_subnet = CHATEAU_CONNECT_RATE_SUBNET;
+    config->pending_max = CHATEAU_PENDING_MAX;
+    config->bans = mask_set_new ();
+
+    w_buf_t line = W_BUF;
+    w_buf_t overflow = W_BUF;
+    unsigned lineno = 0;
+    bool ok = true;
+
+    for (;;) {
+        w_io_result_t r = w_io_read_line (io, &line, &overflow, 0);
+        if (w_io_failed (r)) {
+            w_buf_format (error, "$s: $s", path, strerror (w_io_result_error (r)));
+            ok = false;
+            break;
+        }
+        if (w_io_eof (r) && !w_buf_size (&line))
+            break;
+
+        lineno++;
+        const char *message = NULL;
+        if (!parse_line (config, w_buf_str (&line), &message)) {
+            w_buf_format (error, "$s:$I: $s", path, lineno, message);
+            ok = false;
+            break;
+        }
+        w_buf_clear (&line);
+        if (w_io_eof (r))
+            break;
+    }
+
+    w_buf_clear (&line);
+    w_buf_clear (&overflow);
+    W_IO_NORESULT (w_io_close (io));
+    w_obj_unref (io);
+
+    if (ok && (config->tls_certificate || config->tls_key || config->listen_irc_tls)) {
+        if (!config->tls_certificate || !config->tls_key) {
+            w_buf_format (error, "$s: TLS needs both tls-certificate and tls-key", path);
+            ok = false;
+        } else if (!(config->tls = tls_context_new (config->tls_certificate,
+                                                    config->tls_key, error))) {
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        w_obj_unref (config);
+        return NULL;
+    }
+
+    if (!config->users) {
+        config->users = w_new0 (auth_simple_mem_agent_entry_t);
+    }
+    if (!config->opers) {
+        config->opers = w_new0 (auth_simple_mem_agent_entry_t);
+    }
+    if (!config->peers) {
+        config->peers = w_new0 (link_peer_t);
+    }
+    /* Both are taken before yielding, and kept until done with. */
+    config_t *previous = s_current ? w_obj_ref (s_current) : NULL;
+    config->auth_agent = auth_simple_mem_agent_new (config->users,
+                                                    config->scram_iterations,
+                                                    previous ? previous->auth_agent : NULL);
+    config->oper_agent = auth_simple_mem_agent_new (config->opers,
+                                                    config->scram_iterations,
+                                                    previous ? previous->oper_agent : NULL);
+    if (previous)
+        w_obj_unref (previous);
+    return config;
+}
+
+
+static inline bool
+str_equal (const char *a, const char *b)
+{
+    return (a && b) ? strcmp (a, b) == 0 : a == b;
+}
+
+
+void
+config_publish (config_t *config)
+{
+    w_assert (config);
+
+    history_set_limits (config->history_channel_max,
+                        config->history_total_max,
+                        config->history_replay_lines);
+    governor_set_limits (config->sendq_user,
+                         config->sendq_oper,
+                         config->memory_max,
+                         config->sendq_socket_buffer);
+    offline_set_quota (config->offline_quota);
+    sasl_set_scram_iterations (config->scram_iterations);
+    fairshare_set_limits (config->turn_messages, config->turn_time);
+    hibernate_set_idle (config->hibernate_idle);
+    admission_set_limits (&(const admission_limits_t) {
+        .limit_ip     = config->connect_limit_ip,
+        .limit_subnet = config->connect_limit_subnet,
+        .rate_ip      = config->connect_rate_ip,
+        .rate_subnet  = config->connect_rate_subnet,
+        .pending_max  = config->pending_max,
+        .rules        = config->allow_rules,
+        .n_rules      = config->n_allow_rules,
+    });
+    document_set_path (DOCUMENT_MOTD, config->motd_path);
+    document_set_path (DOCUMENT_INFO, config->info_path);
+    document_set_path (DOCUMENT_ADMIN, config->admin_path);
+    if (!resolver_set_server (config->resolver))
+        w_printerr ("config: Invalid resolver address '$s'\n", config->resolver);
+
+    config_t *old = s_current;
+    s_current = config;
+    if (old) {
+        if (strcmp (old->listen_irc, config->listen_irc) != 0 ||
+            strcmp (old->listen_xmpp, config->listen_xmpp) != 0 ||
+            !str_equal (old->listen_irc_tls, config->listen_irc_tls))
+            w_printerr ("config: Listener changes need a restart\n");
+        if (strcmp (old->server_name, config->server_name) != 0)
+            w_printerr ("config: Server name changes need a restart\n");
+
+        /* Freed once the last handler using it releases its reference. */
+        w_obj_unref (old);
+    }
+}
+
+
+config_t*
+config_acquire (void)
+{
+    w_assert (s_current);
+    return w_obj_ref (s_current);
+}
+
+
+bool
+config_rehash (w_buf_t *error)
+{
+    w_assert (error);
+    w_assert (s_current);
+
+    /*
+     * Deriving SCRAM keys yields to other tasks, which may start another
+     * rehash and publish it first; only the newest one is published.
+     */
+    const unsigned generation = ++s_generation;
+
+    config_t *config = config_load (s_current->path, error);
+    if (!config)
+        return false;
+
+    if (generation != s_generation) {
+        w_buf_format (error, "$s: superseded by a newer rehash", config->path);
+        w_obj_unref (config);
+        return false;
+    }
+
+    config_publish (config);
+    return true;
+}
+
+
+static void
+sighup_task (void *data)
+{
+    w_io_t *io = data;
+
+    for (;;) {
+        struct signalfd_siginfo info;
+        ssize_t r = read (w_io_get_fd (io), &info, sizeof (info));
+        if (r < 0 && errno == EAGAIN) {
+            w_task_yield_io_read (io);
+            continue;
+        }
+        if (r != sizeof (info))
+            break;
+
+        w_buf_t error = W_BUF;
+        if (config_rehash (&error))
+            w_printerr ("config: Rehashed $s\n", s_current->path);
+        else
+            w_printerr ("config: Rehash failed: $B\n", &error);
+        w_buf_clear (&error);
+    }
+
+    W_IO_NORESULT (w_io_close (io));
+    w_obj_unref (io);
+}
+
+
+void
+config_watch_sighup (void)
+{
+    sigset_t mask;
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGHUP);
+    if (sigprocmask (SIG_BLOCK, &mask, NULL) != 0)
+        return;
+
+    int fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    w_task_t *task = w_task_prepare (sighup_task, w_io_unix_open_fd (fd), 16384);
+    w_task_set_name (task, "rehash");
+    w_task_set_is_system (task, true);
+}
@@ -0,0 +1,129 @@
+/*
+ * config.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "admission.h"
+#include "auth.h"
+#include "link.h"
+#include "tls.h"
+#include "mask.h"
+
+#ifndef CHATEAU_CONFIG_PATH
+#define CHATEAU_CONFIG_PATH "chateau.conf"
+#endif /* !CHATEAU_CONFIG_PATH */
+
+#ifndef CHATEAU_SERVER_NAME
+#define CHATEAU_SERVER_NAME "chateau.localhost"
+#endif /* !CHATEAU_SERVER_NAME */
+
+#ifndef CHATEAU_SERVER_INFO
+#define CHATEAU_SERVER_INFO "Chateau chat server"
+#endif /* !CHATEAU_SERVER_INFO */
+
+/*
+ * Configuration objects are immutable once loaded. Rehashing loads a new
+ * one and publishes it by swapping the current pointer; code which uses
+ * the configuration holds a reference while it does so, which keeps the
+ * old object alive until the last user releases it.
+ */
+W_OBJ_DECL (config_t);
+
+W_OBJ_DEF (config_t)
+{
+    w_obj_t        parent;
+    char          *path;
+
+    const char    *server_name;
+    const char    *server_info;
+    const char    *listen_irc;
+    const char    *listen_irc_tls;
+    const char    *listen_xmpp;
+    const char    *tls_certificate;
+    const char    *tls_key;
+    const char    *journal_path;
+    const char    *capture_path;
+    const char    *offline_path;
+    const char    *motd_path;
+    const char    *info_path;
+    const char    *admin_path;
+    const char    *resolver;
+
+    size_t         history_channel_max;
+    size_t         history_total_max;
+    unsigned       history_replay_lines;
+
+    size_t         sendq_user;
+    size_t         sendq_oper;
+    bool           sendq_socket_buffer;
+    size_t         memory_max;
+    size_t         offline_quota;
+
+    unsigned       scram_iterations;
+
+    unsigned       turn_messages;
+    unsigned       turn_time;
+    unsigned       hibernate_idle;
+
+    unsigned       connect_limit_ip;
+    unsigned       connect_limit_subnet;
+    unsigned       connect_rate_ip;
+    unsigned       connect_rate_subnet;
+    unsigned       pending_max;
+
+    auth_agent_t  *auth_agent;
+    auth_agent_t  *oper_agent;
+    link_peer_t   *peers;
+    admission_rule_t *allow_rules;
+    tls_context_t *tls;
+    mask_set_t    *bans;     /* Server bans, matched on registration. */
+
+    /* Backing storage for the above. */
+    auth_simple_mem_agent_entry_t *users;
+    auth_simple_mem_agent_entry_t *opers;
+    char         **strings;
+    unsigned       n_users;
+    unsigned       n_opers;
+    unsigned       n_peers;
+    unsigned       n_allow_rules;
+    unsigned       n_strings;
+};
+
+
+/*
+ * Parses a configuration file. On failure, returns NULL and a message
+ * describing the problem is placed in "error".
+ */
+extern config_t* config_load (const char *path, w_buf_t *error);
+
+/* Makes "config" the current configuration, and consumes the reference. */
+extern void config_publish (config_t *config);
+
+/* Returns a new reference to the current configuration. */
+extern config_t* config_acquire (void);
+
+static inline void
+config_release (config_t **config)
+{
+    w_assert (config);
+    if (*config) {
+        w_obj_unref (*config);
+        *config = NULL;
+    }
+}
+
+/*
+ * Loads the configuration again from the same file, and publishes it if
+ * there were no errors.
+ */
+extern bool config_rehash (w_buf_t *error);
+
+/* Starts a task which rehashes the configuration on SIGHUP. */
+extern void config_watch_sighup (void);
+
+#endif /* !CONFIG_H */
@@ -0,0 +1,297 @@
+/*
+ * document.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "document.h"
+#include "link.h"
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+enum {
+    /* Leaves room for the prefix, numeric and nick of each reply. */
+    TEXT_MAX = IRC_MAX_LINE - 128,
+
+    /* ADMINLOC1, ADMINLOC2 and ADMINEMAIL take the first lines. */
+    ADMIN_LINES = 3,
+
+    WATCH_EVENTS = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                   IN_CREATE | IN_DELETE,
+};
+
+
+struct line {
+    uint32_t nick_at;   /* Offset in the text where the nick goes. */
+    uint32_t end;
+};
+
+struct document {
+    char        *path;      /* NULL if there is no file. */
+    const char  *name;      /* Part of the path after the directory. */
+    int          watch;     /* Of the directory, -1 if not watched. */
+    bool         stale;     /* Rendered again before sending. */
+    w_buf_t      text;
+    struct line *lines;
+    unsigned     n_lines;
+    unsigned     a_lines;
+};
+
+
+static struct document s_documents[DOCUMENT_LAST + 1] = {
+    [0 ... DOCUMENT_LAST] = { .watch = -1, .stale = true },
+};
+static int s_inotify = -1;
+
+
+static void
+add_watch (struct document *doc)
+{
+    doc->watch = -1;
+    if (s_inotify < 0 || !doc->path)
+        return;
+
+    /*
+     * Editors and deployment tools often replace files by renaming a new
+     * one over them, so the directory is watched instead of the file.
+     */
+    char *directory = w_str_dup (doc->path);
+    char *slash = strrchr (directory, '/');
+    if (slash == directory)
+        slash[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+
+    doc->watch = inotify_add_watch (s_inotify, slash ? directory : ".", WATCH_EVENTS);
+    if (doc->watch < 0)
+        w_printerr ("$s: Cannot watch for changes: $s\n", doc->path, strerror (errno));
+    w_free (directory);
+}
+
+
+/*
+ * The kernel gives the same watch to every path in a directory, so it is
+ * only removed once no document uses it.
+ */
+static void
+remove_watch (int watch)
+{
+    if (s_inotify < 0 || watch < 0)
+        return;
+    for (unsigned i = 0; i <= DOCUMENT_LAST; i++)
+        if (s_documents[i].watch == watch)
+            return;
+    inotify_rm_watch (s_inotify, watch);
+}
+
+
+void
+document_set_path (document_kind_t kind, const char *path)
+{
+    w_assert (kind <= DOCUMENT_LAST);
+
+    struct document *doc = &s_documents[kind];
+    const int old_watch = doc->watch;
+    w_free (doc->path);
+    doc->path = path ? w_str_dup (path) : NULL;
+    if (doc->path) {
+        const char *slash = strrchr (doc->path, '/');
+        doc->name = slash ? slash + 1 : doc->path;
+    }
+    doc->stale = true;
+    add_watch (doc);
+    remove_watch (old_watch);
+}
+
+
+static void
+add_line (struct document *doc, irc_rpl_t code, const char *arg)
+{
+    const char *format;
+    const char *name;
+    uint8_t narg;
+
+    bool got_info = irc_rpl_info (code, &narg, &name, &format);
+    w_assert (got_info);
+    w_unused (got_info);
+
+    if (doc->n_lines == doc->a_lines) {
+        doc->a_lines = doc->a_lines ? doc->a_lines * 2 : 16;
+        doc->lines = w_resize (doc->lines, struct line, doc->a_lines);
+    }
+
+    struct line *line = &doc->lines[doc->n_lines++];
+    w_buf_format (&doc->text, ":$s $I ", link_server_name (), (unsigned) code);
+    line->nick_at = w_buf_size (&doc->text);
+    w_buf_append_char (&doc->text, ' ');
+    w_buf_format (&doc->text, format, arg);
+    w_buf_append_str (&doc->text, "\r\n");
+    line->end = w_buf_size (&doc->text);
+}
+
+
+static void
+render (document_kind_t kind)
+{
+    static const irc_rpl_t s_admin_lines[ADMIN_LINES] = {
+        IRC_RPL_ADMINLOC1, IRC_RPL_ADMINLOC2, IRC_RPL_ADMINEMAIL,
+    };
+
+    struct document *doc = &s_documents[kind];
+    w_buf_clear (&doc->text);
+    doc->n_lines = 0;
+    doc->stale = false;
+
+    w_io_t *io = doc->path ? w_io_unix_open (doc->path, O_RDONLY, 0) : NULL;
+    if (doc->path && !io)
+        w_printerr ("$s: Cannot open: $s\n", doc->path, strerror (errno));
+
+    if (io && kind == DOCUMENT_MOTD)
+        add_line (doc, IRC_RPL_MOTDSTART, link_server_name ());
+    else if (io && kind == DOCUMENT_ADMIN)
+        add_line (doc, IRC_RPL_ADMINME, link_server_name ());
+
+    w_buf_t line = W_BUF;
+    w_buf_t overflow = W_BUF;
+    for (unsigned lineno = 0; io; lineno++) {
+        w_io_result_t r = w_io_read_line (io, &line, &overflow, 0);
+        if (w_io_failed (r) || (w_io_eof (r) && !w_buf_size (&line)))
+            break;
+
+        size_t length = w_buf_size (&line);
+        while (length && (w_buf_data (&line)[length - 1] == '\n' ||
+                          w_buf_data (&line)[length - 1] == '\r'))
+            length--;
+        w_buf_resize (&line, length > TEXT_MAX ? TEXT_MAX : length);
+
+        switch (kind) {
+            case DOCUMENT_MOTD:
+                add_line (doc, IRC_RPL_MOTD, w_buf_str (&line));
+                break;
+            case DOCUMENT_INFO:
+                add_line (doc, IRC_RPL_INFO, w_buf_str (&line));
+                break;
+            case DOCUMENT_ADMIN:
+                if (lineno < ADMIN_LINES)
+                    add_line (doc, s_admin_lines[lineno], w_buf_str (&line));
+                break;
+        }
+        w_buf_clear (&line);
+        if (w_io_eof (r))
+            break;
+    }
+    w_buf_clear (&line);
+    w_buf_clear (&overflow);
+
+    switch (kind) {
+        case DOCUMENT_MOTD:
+            add_line (doc, io ? IRC_RPL_ENDOFMOTD : IRC_RPL_NOMOTD, NULL);
+            break;
+        case DOCUMENT_INFO:
+            add_line (doc, IRC_RPL_ENDOFINFO, NULL);
+            break;
+        case DOCUMENT_ADMIN:
+            if (!io)
+                add_line (doc, IRC_RPL_NOADMININFO, link_server_name ());
+            break;
+    }
+
+    if (io) {
+        W_IO_NORESULT (w_io_close (io));
+        w_obj_unref (io);
+    }
+}
+
+
+w_io_result_t
+document_send (document_kind_t kind, client_t *client)
+{
+    w_assert (kind <= DOCUMENT_LAST);
+    w_assert (client);
+
+    struct document *doc = &s_documents[kind];
+    if (doc->stale)
+        render (kind);
+
+    const char *nick = client_nick (client);
+    const size_t nick_length = strlen (nick);
+
+    w_buf_t out = W_BUF;
+    w_buf_resize (&out, w_buf_size (&doc->text) + doc->n_lines * nick_length);
+
+    const char *text = w_buf_data (&doc->text);
+    char *p = w_buf_data (&out);
+    uint32_t start = 0;
+    for (unsigned i = 0; i < doc->n_lines; i++) {
+        const struct line *line = &doc->lines[i];
+        memcpy (p, text + start, line->nick_at - start);
+        p += line->nick_at - start;
+        memcpy (p, nick, nick_length);
+        p += nick_length;
+        memcpy (p, text + line->nick_at, line->end - line->nick_at);
+        p += line->end - line->nick_at;
+        start = line->end;
+    }
+
+    w_io_result_t r = client_send (client, w_buf_data (&out), w_buf_size (&out));
+    w_buf_clear (&out);
+    return r;
+}
+
+
+static void
+inotify_task (void *data)
+{
+    w_io_t *io = data;
+
+    for (;;) {
+        char events[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+        ssize_t r = read (w_io_get_fd (io), events, sizeof (events));
+        if (r < 0 && errno == EAGAIN) {
+            w_task_yield_io_read (io);
+            continue;
+        }
+        if (r <= 0)
+            break;
+
+        for (char *p = events; p < events + r;) {
+            const struct inotify_event *event = (const struct inotify_event*) p;
+            p += sizeof (*event) + event->len;
+            for (unsigned i = 0; i <= DOCUMENT_LAST; i++) {
+                struct document *doc = &s_documents[i];
+                if ((event->mask & IN_Q_OVERFLOW) ||
+                    (doc->watch == event->wd && event->len &&
+                     strcmp (event->name, doc->name) == 0))
+                    doc->stale = true;
+            }
+        }
+    }
+
+    W_IO_NORESULT (w_io_close (io));
+    w_obj_unref (io);
+    s_inotify = -1;
+}
+
+
+void
+document_watch (void)
+{
+    w_assert (s_inotify < 0);
+
+    s_inotify = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+    if (s_inotify < 0) {
+        w_printerr ("Cannot watch documents, changes need a rehash: $s\n",
+                    strerror (errno));
+        return;
+    }
+    for (unsigned i = 0; i <= DOCUMENT_LAST; i++)
+        add_watch (&s_documents[i]);
+
+    w_task_t *task = w_task_prepare (inotify_task, w_io_unix_open_fd (s_inotify), 16384);
+    w_task_set_name (task, "documents");
+    w_task_set_is_system (task, true);
+}
@@ -0,0 +1,40 @@
+/*
+ * document.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef DOCUMENT_H
+#define DOCUMENT_H
+
+#include "client.h"
+
+/*
+ * Text documents sent as replies to MOTD, INFO and ADMIN, the first of
+ * them to every client on registration. Each document is rendered once
+ * into a block of complete reply lines, in which only the position of the
+ * nick of the recipient is left out; sending it is one copy of the block
+ * with the nick filled in, and a single write.
+ *
+ * Files are watched with inotify, and a document is rendered again the
+ * next time it is sent after its file changed, or after a rehash.
+ */
+
+typedef enum {
+    DOCUMENT_MOTD,
+    DOCUMENT_INFO,
+    DOCUMENT_ADMIN,
+    DOCUMENT_LAST = DOCUMENT_ADMIN,
+} document_kind_t;
+
+
+/* Sets the file of a document; NULL sends the "missing" replies. */
+extern void document_set_path (document_kind_t kind, const char *path);
+
+/* Starts the task which notices changes to the files. */
+extern void document_watch (void);
+
+extern w_io_result_t document_send (document_kind_t kind, client_t *client);
+
+#endif /* !DOCUMENT_H */
@@ -0,0 +1,108 @@
+/*
+ * fairshare.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "fairshare.h"
+#include <time.h>
+
+
+static unsigned          s_turn_messages = CHATEAU_TURN_MESSAGES;
+static uint64_t          s_turn_time = CHATEAU_TURN_TIME * 1000ULL;
+static const fairshare_t *s_last = NULL;  /* Which task handled the last message. */
+static fairshare_stats_t s_stats = { 0, };
+
+
+static inline uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void
+fairshare_set_limits (unsigned messages, unsigned time_us)
+{
+    s_turn_messages = messages ? messages : 1;
+    s_turn_time = time_us * 1000ULL;
+}
+
+
+void
+fairshare_read (fairshare_t *share)
+{
+    w_assert (share);
+    share->read_start = now_ns ();
+}
+
+
+void
+fairshare_begin (fairshare_t *share, bool control)
+{
+    w_assert (share);
+
+    /* Not needed if the task waited for input, and others ran then. */
+    share->control = control;
+    if (share->turn_over && !control) {
+        share->turn_over = false;
+        if (s_last == share) {
+            share->yields++;
+            s_stats.yields++;
+            s_last = NULL;
+            w_task_yield ();
+        }
+    }
+
+    /*
+     * A new turn starts when another task handled messages in between, or
+     * the task was idle for a while, meaning it waited for input. Reading
+     * the message is not charged then, as the wait may be part of it.
+     */
+    const uint64_t now = now_ns ();
+    if (s_last != share || now - share->last_end > s_turn_time) {
+        share->turn_time = 0;
+        share->turn_messages = 0;
+        share->turn_over = false;
+        share->last_end = now;
+    } else {
+        share->last_end = share->read_start;
+    }
+    s_last = share;  /* last_end is the start of this message, until it ends. */
+}
+
+
+void
+fairshare_end (fairshare_t *share)
+{
+    w_assert (share);
+
+    const uint64_t now = now_ns ();
+    const uint64_t elapsed = now - share->last_end;
+    share->last_end = now;
+    share->run_time += elapsed;
+    share->messages++;
+    s_stats.run_time += elapsed;
+    s_stats.messages++;
+
+    if (share->control)
+        return;
+
+    share->turn_time += elapsed;
+    if (share->turn_time > s_stats.longest_turn)
+        s_stats.longest_turn = share->turn_time;
+
+    if (++share->turn_messages >= s_turn_messages || share->turn_time >= s_turn_time)
+        share->turn_over = true;
+}
+
+
+void
+fairshare_get_stats (fairshare_stats_t *stats)
+{
+    w_assert (stats);
+    *stats = s_stats;
+}
@@ -0,0 +1,72 @@
+/*
+ * fairshare.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef FAIRSHARE_H
+#define FAIRSHARE_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Fair sharing of the scheduler among connection tasks. Tasks only yield
+ * when they would block, so a client which pipelines many messages could
+ * keep the others waiting for as long as its input lasts. Instead, each
+ * task gets a turn of a limited amount of messages and handling time,
+ * after which it yields even if more input is buffered.
+ *
+ * The yield is lazy: once the turn is over, control messages (PING, PONG,
+ * QUIT) read meanwhile are still handled right away, and the task only
+ * yields before handling the next data message. Control messages are not
+ * charged to the turn. Reading and parsing are charged along with the
+ * handling, and the time is accounted per task, for STATS.
+ */
+
+#ifndef CHATEAU_TURN_MESSAGES
+#define CHATEAU_TURN_MESSAGES 16
+#endif /* !CHATEAU_TURN_MESSAGES */
+
+#ifndef CHATEAU_TURN_TIME
+#define CHATEAU_TURN_TIME 2000 /* us */
+#endif /* !CHATEAU_TURN_TIME */
+
+
+typedef struct {
+    uint64_t      turn_time;     /* ns handling messages in this turn. */
+    uint64_t      last_end;      /* ns, monotonic, of the last message. */
+    uint64_t      read_start;    /* ns, monotonic, of the current message. */
+    unsigned      turn_messages;
+    bool          turn_over;     /* Yields before the next data message. */
+    bool          control;       /* The current message is a control one. */
+    uint64_t      run_time;      /* ns handling messages, in total. */
+    unsigned long messages;
+    unsigned long yields;        /* Forced by the quotas. */
+} fairshare_t;
+
+typedef struct {
+    uint64_t      run_time;      /* ns */
+    uint64_t      longest_turn;  /* ns */
+    unsigned long messages;
+    unsigned long yields;
+} fairshare_stats_t;
+
+
+extern void fairshare_set_limits (unsigned messages, unsigned time_us);
+
+/* Called before reading a message, so that parsing it is charged. */
+extern void fairshare_read (fairshare_t *share);
+
+/*
+ * Called before handling a message, once parsed. Yields the current task
+ * first if its turn is over, unless the message is a "control" one.
+ */
+extern void fairshare_begin (fairshare_t *share, bool control);
+
+/* Called after handling a message; ends the turn if over the quotas. */
+extern void fairshare_end (fairshare_t *share);
+
+extern void fairshare_get_stats (fairshare_stats_t *stats);
+
+#endif /* !FAIRSHARE_H */
@@ -0,0 +1,292 @@
+/*
+ * governor.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "governor.h"
+#include "channel.h"
+#include "ticker.h"
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/sockios.h>
+#include <stdlib.h>
+#include <limits.h>
+
+
+static size_t   s_sendq_user = CHATEAU_SENDQ_USER;
+static size_t   s_sendq_oper = CHATEAU_SENDQ_OPER;
+static size_t   s_memory_max = CHATEAU_MEMORY_MAX;
+static bool     s_size_buffers = true;
+
+static ticker_t        *s_ticker = NULL;
+static governor_stats_t s_stats  = { 0, };
+
+
+void
+governor_set_limits (size_t sendq_user,
+                     size_t sendq_oper,
+                     size_t memory_max,
+                     bool   size_buffers)
+{
+    s_sendq_user = sendq_user;
+    s_sendq_oper = sendq_oper;
+    s_memory_max = memory_max;
+    s_size_buffers = size_buffers;
+
+    /* Classes may be bigger or smaller now. */
+    for (unsigned i = 0; i < client_local_count (); i++)
+        governor_attach (client_local_at (i));
+}
+
+
+size_t
+governor_sendq_limit (const client_t *client)
+{
+    w_assert (client);
+    return client->oper ? s_sendq_oper : s_sendq_user;
+}
+
+
+/* A client is heavy when it holds more than a quarter of its limit. */
+static inline size_t
+client_usage (const client_t *client)
+{
+    return client->sendq + client->recvq;
+}
+
+static inline bool
+client_is_heavy (const client_t *client)
+{
+    return client_usage (client) > governor_sendq_limit (client) / 4;
+}
+
+
+size_t
+governor_unsent_bytes (w_io_t *socket)
+{
+    int pending;
+    int fd = w_io_get_fd (socket);
+    if (fd < 0 || ioctl (fd, SIOCOUTQ, &pending) != 0 || pending < 0)
+        return 0;
+    return (size_t) pending;
+}
+
+
+static size_t
+unread_bytes (w_io_t *socket)
+{
+    int pending;
+    int fd = w_io_get_fd (socket);
+    if (fd < 0 || ioctl (fd, SIOCINQ, &pending) != 0 || pending < 0)
+        return 0;
+    return (size_t) pending;
+}
+
+
+void
+governor_attach (client_t *client)
+{
+    w_assert (client);
+
+    int fd = w_io_get_fd (client->socket);
+    if (!s_size_buffers || fd < 0 || !client_is_local (client))
+        return;
+
+    /* The kernel doubles the value, leaving room for its bookkeeping. */
+    const size_t limit = governor_sendq_limit (client);
+    int size = limit > INT_MAX ? INT_MAX : (int) limit;
+    setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+}
+
+
+/*
+ * The queue is full, so the ERROR is sent without waiting; the task of
+ * the client sees the connection closed, and cleans up.
+ */
+static void
+disconnect (client_t *client)
+{
+    static const char line[] = "ERROR :Closing link: SendQ exceeded\r\n";
+
+    if (client->sendq_exceeded)
+        return;
+    client->sendq_exceeded = true;
+    s_stats.sendq_kills++;
+
+    int fd = w_io_get_fd (client->socket);
+    if (fd >= 0) {
+        send (fd, line, sizeof (line) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        shutdown (fd, SHUT_RDWR);
+    }
+    w_printerr ("governor: Disconnecting $s, SendQ exceeded\n", client_nick (client));
+}
+
+
+bool
+governor_admit_send (client_t *client, size_t length)
+{
+    w_assert (client);
+
+    if (client->sendq_exceeded)
+        return false;
+
+    /*
+     * The estimate only grows between samples; the real queue is only
+     * asked for when the estimate says the limit is near.
+     */
+    const size_t limit = governor_sendq_limit (client);
+    client->sendq += length;
+    if (client->sendq > limit) {
+        client->sendq = governor_unsent_bytes (client->socket) + length;
+        if (client->sendq > limit) {
+            disconnect (client);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void
+governor_wait_read (client_t *client)
+{
+    w_assert (client);
+
+    if (!client->throttled || client->sendq_exceeded)
+        return;
+
+    /* Throttled clients are few, and only while under pressure. */
+    ticker_t *ticker = ticker_new (CHATEAU_GOVERNOR_INTERVAL);
+    if (!ticker) {
+        w_task_yield ();
+        return;
+    }
+    while (client->throttled && !client->sendq_exceeded && ticker_wait (ticker))
+        ;
+    w_obj_unref (ticker);
+}
+
+
+static int
+compare_usage (const void *a, const void *b)
+{
+    const size_t ua = client_usage (*(client_t* const*) a);
+    const size_t ub = client_usage (*(client_t* const*) b);
+    return (ua < ub) - (ua > ub);  /* Heaviest first. */
+}
+
+
+static void
+shed_history (void)
+{
+    channel_t **channels;
+    unsigned n_channels = channel_snapshot (&channels);
+    for (unsigned i = 0; i < n_channels; i++) {
+        history_trim (&channels[i]->history, channels[i]->history.bytes / 2);
+        /* Channels left with nothing else than scrollback go away. */
+        channel_collect (channels[i]);
+    }
+    channel_snapshot_free (channels, n_channels);
+}
+
+
+static void
+sample (void)
+{
+    governor_stats_t stats = {
+        .budget      = s_memory_max,
+        .sendq_user  = s_sendq_user,
+        .sendq_oper  = s_sendq_oper,
+        .history     = history_total_bytes (),
+        .atoms       = atom_bytes (),
+        .clients     = client_local_count (),
+        .sendq_kills = s_stats.sendq_kills,
+    };
+
+    for (unsigned i = 0; i < stats.clients; i++) {
+        client_t *client = client_local_at (i);
+        client->sendq = governor_unsent_bytes (client->socket);
+        client->recvq = unread_bytes (client->socket);
+        if (client->sendq > governor_sendq_limit (client))
+            disconnect (client);
+        stats.sendq += client->sendq;
+        stats.recvq += client->recvq;
+    }
+
+    stats.total = stats.sendq + stats.recvq + stats.history + stats.atoms;
+    if (stats.total > s_memory_max)
+        stats.level = GOVERNOR_LEVEL_DISCONNECT;
+    else if (stats.total > s_memory_max / 10 * 9)
+        stats.level = GOVERNOR_LEVEL_SHED;
+    else if (stats.total > s_memory_max / 4 * 3)
+        stats.level = GOVERNOR_LEVEL_THROTTLE;
+    else
+        stats.level = GOVERNOR_LEVEL_OK;
+
+    for (unsigned i = 0; i < stats.clients; i++) {
+        client_t *client = client_local_at (i);
+        client->throttled = (stats.level >= GOVERNOR_LEVEL_THROTTLE &&
+                             client_is_heavy (client));
+        if (client->throttled)
+            stats.throttled++;
+    }
+
+    if (stats.level >= GOVERNOR_LEVEL_SHED) {
+        shed_history ();
+        stats.total -= stats.history - history_total_bytes ();
+        stats.history = history_total_bytes ();
+    }
+
+    if (stats.level >= GOVERNOR_LEVEL_DISCONNECT && stats.total > s_memory_max &&
+        stats.clients > 0) {
+        client_t **clients = w_alloc (client_t*, stats.clients);
+        for (unsigned i = 0; i < stats.clients; i++)
+            clients[i] = client_local_at (i);
+        qsort (clients, stats.clients, sizeof (client_t*), compare_usage);
+
+        for (unsigned i = 0; i < stats.clients && stats.total > s_memory_max; i++) {
+            if (!client_is_heavy (clients[i]))
+                break;
+            stats.total -= client_usage (clients[i]);
+            disconnect (clients[i]);
+        }
+        w_free (clients);
+    }
+
+    stats.sendq_kills = s_stats.sendq_kills;
+    s_stats = stats;
+}
+
+
+static void
+governor_task (void *data)
+{
+    w_unused (data);
+    while (ticker_wait (s_ticker))
+        sample ();
+}
+
+
+bool
+governor_start (void)
+{
+    if (s_ticker)
+        return true;
+    if (!(s_ticker = ticker_new (CHATEAU_GOVERNOR_INTERVAL)))
+        return false;
+
+    w_task_t *task = w_task_prepare (governor_task, NULL, 16384);
+    w_task_set_name (task, "governor");
+    w_task_set_is_system (task, true);
+    return true;
+}
+
+
+void
+governor_get_stats (governor_stats_t *stats)
+{
+    w_assert (stats);
+    *stats = s_stats;
+}
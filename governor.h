@@ -0,0 +1,105 @@
+/*
+ * governor.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef GOVERNOR_H
+#define GOVERNOR_H
+
+#include "client.h"
+
+/*
+ * Memory governor. Accounts the bytes held on behalf of each local client
+ * (input not read yet, output not acknowledged yet) and by the server as
+ * a whole (scrollback, atoms), and checks them periodically against the
+ * global budget. Under pressure it reacts in steps:
+ *
+ *   1. Stops reading from the heaviest clients.
+ *   2. Sheds half of the scrollback of every channel.
+ *   3. Disconnects the heaviest clients, worst first, until usage is
+ *      back under the budget.
+ *
+ * Independently of that, a client whose send queue grows over the limit
+ * of its class (users or operators) is disconnected right away.
+ */
+
+#ifndef CHATEAU_GOVERNOR_INTERVAL
+#define CHATEAU_GOVERNOR_INTERVAL 1000 /* ms */
+#endif /* !CHATEAU_GOVERNOR_INTERVAL */
+
+#ifndef CHATEAU_SENDQ_USER
+#define CHATEAU_SENDQ_USER (512 * 1024)
+#endif /* !CHATEAU_SENDQ_USER */
+
+#ifndef CHATEAU_SENDQ_OPER
+#define CHATEAU_SENDQ_OPER (4 * 1024 * 1024)
+#endif /* !CHATEAU_SENDQ_OPER */
+
+#ifndef CHATEAU_MEMORY_MAX
+#define CHATEAU_MEMORY_MAX (256 * 1024 * 1024)
+#endif /* !CHATEAU_MEMORY_MAX */
+
+
+typedef enum {
+    GOVERNOR_LEVEL_OK = 0,
+    GOVERNOR_LEVEL_THROTTLE,   /* From 75% of the budget. */
+    GOVERNOR_LEVEL_SHED,       /* From 90%. */
+    GOVERNOR_LEVEL_DISCONNECT, /* Over the budget. */
+} governor_level_t;
+
+typedef struct {
+    governor_level_t level;
+    size_t           budget;
+    size_t           sendq_user;
+    size_t           sendq_oper;
+    size_t           total;
+    size_t           sendq;
+    size_t           recvq;
+    size_t           history;
+    size_t           atoms;
+    unsigned         clients;
+    unsigned         throttled;
+    unsigned long    sendq_kills;
+} governor_stats_t;
+
+
+/*
+ * With "size_buffers" off, send buffers are left to kernel autotuning, and
+ * a slow reader may block its writers before its SendQ is noticed.
+ */
+extern void governor_set_limits (size_t sendq_user,
+                                 size_t sendq_oper,
+                                 size_t memory_max,
+                                 bool   size_buffers);
+
+/* Starts the task which samples usage periodically. */
+extern bool governor_start (void);
+
+/*
+ * Sizes the kernel send buffer of a local client after its class, so that
+ * reaching the limit disconnects it instead of blocking whoever writes to
+ * it. Called again when the class of the client changes. Does nothing when
+ * buffer sizing is turned off; a buffer which was sized already stays so.
+ */
+extern void governor_attach (client_t *client);
+
+extern size_t governor_sendq_limit (const client_t *client);
+
+/*
+ * Accounts "length" bytes about to be sent to a local client. Returns
+ * false if they must not be sent, because the client went over its limit
+ * and is being disconnected.
+ */
+extern bool governor_admit_send (client_t *client, size_t length);
+
+/* Yields the current task while reading from the client is paused. */
+extern void governor_wait_read (client_t *client);
+
+/* Bytes written to a socket which the peer has not acknowledged yet. */
+extern size_t governor_unsent_bytes (w_io_t *socket);
+
+extern void governor_get_stats (governor_stats_t *stats);
+
+#endif /* !GOVERNOR_H */
@@ -0,0 +1,367 @@
+/*
+ * hibernate.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "hibernate.h"
+#include "ticker.h"
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+enum {
+    STACK_SIZE = 16384,
+    MAX_EVENTS = 64,
+    WHEEL_SPAN = 8,     /* Clock ticks in an idle period. */
+    WHEEL_SLOTS = 16,   /* More than WHEEL_SPAN + 1, see clock_task(). */
+};
+
+
+struct sleeper {
+    void      (*wake) (void *data);
+    void       *data;
+    const char *name;
+    int         fd;
+};
+
+
+static unsigned          s_idle = CHATEAU_HIBERNATE_IDLE;
+static int               s_epoll = -1;       /* Hibernated sockets. */
+static struct sleeper  **s_parked = NULL;    /* Indexed by fd. */
+static unsigned          s_a_parked = 0;
+static hibernate_stats_t s_stats = { 0, };
+static ticker_t         *s_clock = NULL;
+static uint64_t          s_tick = 0;
+static int               s_wheel[WHEEL_SLOTS];  /* Eventfds. */
+
+
+static unsigned
+clock_interval (void)
+{
+    if (!s_idle)
+        return 1000;
+    const unsigned interval = s_idle * 1000 / WHEEL_SPAN;
+    return interval ? interval : 1;
+}
+
+
+void
+hibernate_set_idle (unsigned seconds)
+{
+    s_idle = seconds;
+    if (s_clock)
+        ticker_set_interval (s_clock, clock_interval ());
+}
+
+
+static void
+set_slot (unsigned slot, bool fire)
+{
+    /* Reading a clear slot fails with EAGAIN, which is fine. */
+    uint64_t value = 1;
+    ssize_t r = fire ? write (s_wheel[slot], &value, sizeof (value))
+                     : read (s_wheel[slot], &value, sizeof (value));
+    w_unused (r);
+}
+
+
+/*
+ * Waiters which arm at tick "t" add slot (t + WHEEL_SPAN + 1) to their epoll
+ * set, and the clock fires it when it gets to that tick. Nobody else reads
+ * the slots, so all the waiters see it; the clock clears each slot before
+ * the tick at which waiters start to arm it again.
+ */
+static void
+clock_task (void *data)
+{
+    w_unused (data);
+
+    for (uint64_t ticks; (ticks = ticker_wait (s_clock));) {
+        /*
+         * Ticks missed while the scheduler was busy fire their slots too,
+         * but no more than would not clear a slot fired in the same loop:
+         * after a long stall, waiters due earlier wake an idle period late.
+         */
+        const uint64_t most = WHEEL_SLOTS - WHEEL_SPAN - 1;
+        if (ticks > most) {
+            s_tick += ticks - most;
+            ticks = most;
+        }
+        while (ticks--) {
+            s_tick++;
+            set_slot ((s_tick + WHEEL_SPAN + 1) % WHEEL_SLOTS, false);
+            set_slot (s_tick % WHEEL_SLOTS, true);
+        }
+    }
+    w_printerr ("hibernate: Clock stopped: $s\n", strerror (errno));
+}
+
+
+static bool
+start_clock (void)
+{
+    if (s_clock)
+        return true;
+
+    for (unsigned i = 0; i < WHEEL_SLOTS; i++) {
+        if ((s_wheel[i] = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            while (i--)
+                close (s_wheel[i]);
+            return false;
+        }
+    }
+    if (!(s_clock = ticker_new (clock_interval ()))) {
+        for (unsigned i = 0; i < WHEEL_SLOTS; i++)
+            close (s_wheel[i]);
+        return false;
+    }
+
+    w_task_t *task = w_task_prepare (clock_task, NULL, STACK_SIZE);
+    w_task_set_name (task, "hibernate-clock");
+    w_task_set_is_system (task, true);
+    return true;
+}
+
+
+static bool
+open_waiter (hibernate_waiter_t *waiter, int fd)
+{
+    int epfd = epoll_create1 (EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return false;
+
+    waiter->epoll = w_io_unix_open_fd (epfd);
+    waiter->slot = -1;
+
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.fd = fd };
+    if (epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        hibernate_clear_waiter (waiter);
+        return false;
+    }
+    return true;
+}
+
+
+/* Costs no system call unless the slot changed, i.e. once per tick at most. */
+static bool
+arm_waiter (hibernate_waiter_t *waiter)
+{
+    waiter->deadline = s_tick + WHEEL_SPAN + 1;
+
+    const int slot = waiter->deadline % WHEEL_SLOTS;
+    if (slot == waiter->slot)
+        return true;
+
+    const int epfd = w_io_get_fd (waiter->epoll);
+    struct epoll_event event = { .events = EPOLLIN | EPOLLET, .data.fd = s_wheel[slot] };
+    if ((waiter->slot >= 0 &&
+         epoll_ctl (epfd, EPOLL_CTL_DEL, s_wheel[waiter->slot], NULL) != 0) ||
+        epoll_ctl (epfd, EPOLL_CTL_ADD, s_wheel[slot], &event) != 0) {
+        hibernate_clear_waiter (waiter);
+        return false;
+    }
+    waiter->slot = slot;
+    return true;
+}
+
+
+bool
+hibernate_wait (w_io_t *socket, hibernate_waiter_t *waiter)
+{
+    w_assert (socket);
+    w_assert (waiter);
+
+    const int fd = w_io_get_fd (socket);
+    if (!s_idle || fd < 0 || socket->backch != W_IO_EOF)
+        return true;
+
+    /* Input, the end of the stream, or an error: the parser handles them. */
+    char c;
+    if (recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0 ||
+        (errno != EAGAIN && errno != EWOULDBLOCK))
+        return true;
+
+    /* The read would block: only now is the idle timer armed. */
+    if (!start_clock () ||
+        (!waiter->epoll && !open_waiter (waiter, fd)) ||
+        !arm_waiter (waiter))
+        return true;
+
+    for (;;) {
+        w_task_yield_io_read (waiter->epoll);
+
+        struct epoll_event events[2];
+        int n = epoll_wait (w_io_get_fd (waiter->epoll), events, 2, 0);
+        if (n < 0 && errno != EINTR)
+            return true;
+
+        for (int i = 0; i < n; i++)
+            if (events[i].data.fd == fd)
+                return true;
+
+        /* The slot may have fired for an earlier deadline. */
+        if (s_tick >= waiter->deadline)
+            return false;
+    }
+}
+
+
+void
+hibernate_clear_waiter (hibernate_waiter_t *waiter)
+{
+    w_assert (waiter);
+
+    if (waiter->epoll) {
+        W_IO_NORESULT (w_io_close (waiter->epoll));
+        w_obj_unref (waiter->epoll);
+        waiter->epoll = NULL;
+    }
+    waiter->slot = -1;
+}
+
+
+static void
+wake_task (void *data)
+{
+    struct sleeper *sleeper = data;
+    (*sleeper->wake) (sleeper->data);
+    w_free (sleeper);
+}
+
+
+static void
+hibernate_task (void *data)
+{
+    w_io_t *io = data;
+
+    for (;;) {
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait (s_epoll, events, MAX_EVENTS, 0);
+        if (n < 0 && errno != EINTR)
+            break;
+        if (n <= 0) {
+            w_task_yield_io_read (io);
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct sleeper *sleeper = events[i].data.ptr;
+            epoll_ctl (s_epoll, EPOLL_CTL_DEL, sleeper->fd, NULL);
+            s_parked[sleeper->fd] = NULL;
+            s_stats.parked--;
+            s_stats.wakeups++;
+
+            w_task_t *task = w_task_prepare (wake_task, sleeper, STACK_SIZE);
+            w_task_set_name (task, sleeper->name);
+        }
+    }
+
+    w_printerr ("hibernate: epoll_wait failed: $s\n", strerror (errno));
+    W_IO_NORESULT (w_io_close (io));
+    w_obj_unref (io);
+}
+
+
+static bool
+start_loop (void)
+{
+    if (s_epoll < 0) {
+        if ((s_epoll = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+            return false;
+
+        w_task_t *task = w_task_prepare (hibernate_task, w_io_unix_open_fd (s_epoll), STACK_SIZE);
+        w_task_set_name (task, "hibernate");
+        w_task_set_is_system (task, true);
+    }
+    return true;
+}
+
+
+/*
+ * Closing a parked socket removes it from the epoll set, so a sleeper whose
+ * socket was closed without being shut down first never wakes. Its entry is
+ * dropped once that is noticed, so that the descriptor can be reused: the
+ * sleeper data is left alone, as "wake" is the only way to release it.
+ */
+static bool
+check_parked (int fd)
+{
+    struct sleeper *sleeper = s_parked[fd];
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+        .data.ptr = sleeper,
+    };
+    if (epoll_ctl (s_epoll, EPOLL_CTL_MOD, fd, &event) == 0 ||
+        (errno != ENOENT && errno != EBADF))
+        return true;
+
+    w_printerr ("hibernate: Socket $I ($s) was closed while parked\n",
+                (unsigned) fd, sleeper->name);
+    s_parked[fd] = NULL;
+    s_stats.parked--;
+    w_free (sleeper);
+    return false;
+}
+
+
+bool
+hibernate_park (int fd, const char *name, void (*wake) (void *data), void *data)
+{
+    w_assert (fd >= 0);
+    w_assert (name);
+    w_assert (wake);
+
+    if (!start_loop ())
+        return false;
+
+    /* A socket being parked is open, so an entry left for it is stale. */
+    if ((unsigned) fd < s_a_parked && s_parked[fd])
+        check_parked (fd);
+
+    struct sleeper *sleeper = w_new (struct sleeper);
+    sleeper->wake = wake;
+    sleeper->data = data;
+    sleeper->name = name;
+    sleeper->fd = fd;
+
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+        .data.ptr = sleeper,
+    };
+    if (epoll_ctl (s_epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+        w_free (sleeper);
+        return false;
+    }
+
+    if ((unsigned) fd >= s_a_parked) {
+        const unsigned old_size = s_a_parked;
+        const unsigned needed = (unsigned) fd + 1;
+        s_a_parked = needed > old_size * 2 ? needed : old_size * 2;
+        s_parked = w_resize (s_parked, struct sleeper*, s_a_parked);
+        memset (s_parked + old_size, 0, (s_a_parked - old_size) * sizeof (struct sleeper*));
+    }
+    s_parked[fd] = sleeper;
+    s_stats.parked++;
+    s_stats.hibernations++;
+    return true;
+}
+
+
+bool
+hibernate_is_parked (int fd)
+{
+    return fd >= 0 && (unsigned) fd < s_a_parked && s_parked[fd] && check_parked (fd);
+}
+
+
+void
+hibernate_get_stats (hibernate_stats_t *stats)
+{
+    w_assert (stats);
+    *stats = s_stats;
+}
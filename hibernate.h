@@ -0,0 +1,74 @@
+/*
+ * hibernate.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef HIBERNATE_H
+#define HIBERNATE_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Hibernation of idle connections. A connection task which waited for
+ * input during the idle period exits, which frees its stack, and its
+ * socket is handed to a single task which waits for input on all of the
+ * hibernated sockets with epoll. When input arrives, or the connection is
+ * shut down, a new task is started for the connection.
+ *
+ * Tasks cannot wait with a timeout, so connections which may hibernate
+ * wait on an epoll set of their own, with the socket and one slot of a
+ * timer wheel shared by all of them. The idle period is measured in ticks
+ * of the wheel, so it may last up to an eighth longer. The epoll set is
+ * only kept while the task runs: hibernated connections use no other
+ * descriptor than their socket.
+ *
+ * Parked sockets must be shut down, not closed, to wake their sleeper.
+ */
+
+#ifndef CHATEAU_HIBERNATE_IDLE
+#define CHATEAU_HIBERNATE_IDLE 60 /* s, zero disables hibernation */
+#endif /* !CHATEAU_HIBERNATE_IDLE */
+
+
+typedef struct {
+    w_io_t  *epoll;
+    int      slot;
+    uint64_t deadline;
+} hibernate_waiter_t;
+
+#define HIBERNATE_WAITER_INIT { NULL, -1, 0 }
+
+
+extern void hibernate_set_idle (unsigned seconds);
+
+/*
+ * Waits until there is input on the socket, setting up the waiter on the
+ * first call. Returns false if the socket was idle for the idle period
+ * instead, and the connection should hibernate.
+ */
+extern bool hibernate_wait (w_io_t *socket, hibernate_waiter_t *waiter);
+extern void hibernate_clear_waiter (hibernate_waiter_t *waiter);
+
+/*
+ * Watches a socket whose task is about to exit; "wake" is called with
+ * "data" from a new task, named "name", when the socket has input. The
+ * name must stay valid meanwhile.
+ */
+extern bool hibernate_park (int         fd,
+                            const char *name,
+                            void      (*wake) (void *data),
+                            void       *data);
+
+extern bool hibernate_is_parked (int fd);
+
+typedef struct {
+    unsigned      parked;
+    unsigned long hibernations;
+    unsigned long wakeups;
+} hibernate_stats_t;
+
+extern void hibernate_get_stats (hibernate_stats_t *stats);
+
+#endif /* !HIBERNATE_H */
@@ -0,0 +1,219 @@
+/*
+ * history.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "history.h"
+#include "proto-irc.h"
+
+
+static size_t   s_channel_max  = CHATEAU_HISTORY_CHANNEL_MAX;
+static size_t   s_total_max    = CHATEAU_HISTORY_TOTAL_MAX;
+static unsigned s_replay_lines = CHATEAU_HISTORY_REPLAY_LINES;
+static size_t   s_total_bytes  = 0;
+
+
+void
+history_set_limits (size_t channel_max, size_t total_max, unsigned replay_lines)
+{
+    s_channel_max  = channel_max;
+    s_total_max    = total_max;
+    s_replay_lines = replay_lines;
+}
+
+
+size_t
+history_total_bytes (void)
+{
+    return s_total_bytes;
+}
+
+
+static inline size_t
+entry_cost (size_t body_length)
+{
+    return sizeof (struct history_entry) + body_length;
+}
+
+
+static void
+evict_oldest (history_t *history)
+{
+    w_assert (history->count > 0);
+
+    struct history_entry *entry = &history->entries[history->first];
+    w_assert (entry->offset == history->arena_start);
+
+    history->arena_start += entry->length;
+    history->bytes -= entry_cost (entry->length);
+    s_total_bytes -= entry_cost (entry->length);
+    atom_unref (entry->sender);
+
+    history->first = (history->first + 1) % history->capacity;
+    if (--history->count == 0)
+        history->arena_start = history->arena_end = 0;
+}
+
+
+/* Makes room for "length" more bytes at the end of the arena. */
+static void
+arena_reserve (history_t *history, size_t length)
+{
+    if (history->arena_end + length <= history->arena_alloc)
+        return;
+
+    if (history->arena_start > 0) {
+        size_t live = history->arena_end - history->arena_start;
+        memmove (history->arena, history->arena + history->arena_start, live);
+        for (unsigned i = 0; i < history->count; i++) {
+            unsigned pos = (history->first + i) % history->capacity;
+            history->entries[pos].offset -= history->arena_start;
+        }
+        history->arena_start = 0;
+        history->arena_end = live;
+    }
+
+    if (history->arena_end + length > history->arena_alloc) {
+        size_t alloc = history->arena_alloc ? history->arena_alloc * 2 : 1024;
+        while (alloc < history->arena_end + length)
+            alloc *= 2;
+        if (alloc > s_channel_max)
+            alloc = s_channel_max;
+        history->arena = w_resize (history->arena, char, alloc);
+        history->arena_alloc = alloc;
+    }
+}
+
+
+static void
+entries_reserve (history_t *history)
+{
+    if (history->count < history->capacity)
+        return;
+
+    unsigned capacity = history->capacity ? history->capacity * 2 : 16;
+    struct history_entry *entries = w_alloc (struct history_entry, capacity);
+    for (unsigned i = 0; i < history->count; i++)
+        entries[i] = history->entries[(history->first + i) % history->capacity];
+
+    w_free (history->entries);
+    history->entries = entries;
+    history->capacity = capacity;
+    history->first = 0;
+}
+
+
+void
+history_clear (history_t *history)
+{
+    w_assert (history);
+
+    while (history->count > 0)
+        evict_oldest (history);
+
+    w_free (history->entries);
+    w_free (history->arena);
+    history_init (history);
+}
+
+
+void
+history_trim (history_t *history, size_t max_bytes)
+{
+    w_assert (history);
+
+    while (history->count > 0 && history->bytes > max_bytes)
+        evict_oldest (history);
+}
+
+
+bool
+history_append_at (history_t  *history,
+                   bool        notice,
+                   atom_t     *sender,
+                   const char *body,
+                   size_t      body_length,
+                   uint32_t    when)
+{
+    w_assert (history);
+    w_assert (sender);
+    w_assert (body);
+
+    const size_t cost = entry_cost (body_length);
+    if (cost > s_channel_max || body_length > UINT16_MAX)
+        return false;
+
+    while (history->count > 0 &&
+           (history->bytes + cost > s_channel_max ||
+            s_total_bytes + cost > s_total_max))
+        evict_oldest (history);
+
+    /*
+     * Other channels may be holding the whole server-wide budget: the
+     * message is still delivered, but it is not kept in the scrollback.
+     */
+    if (s_total_bytes + cost > s_total_max)
+        return false;
+
+    arena_reserve (history, body_length);
+    entries_reserve (history);
+
+    unsigned pos = (history->first + history->count++) % history->capacity;
+    history->entries[pos] = (struct history_entry) {
+        .sender = atom_ref (sender),
+        .time   = when,
+        .offset = history->arena_end,
+        .length = body_length,
+        .notice = notice,
+    };
+    memcpy (history->arena + history->arena_end, body, body_length);
+    history->arena_end += body_length;
+    history->bytes += cost;
+    s_total_bytes += cost;
+    return true;
+}
+
+
+void
+history_append (history_t  *history,
+                bool        notice,
+                atom_t     *sender,
+                const char *body,
+                size_t      body_length)
+{
+    history_append_at (history, notice, sender, body, body_length,
+                       (uint32_t) time (NULL));
+}
+
+
+void
+history_replay (const history_t *history,
+                const char      *target,
+                bool             server_time,
+                w_buf_t         *out)
+{
+    w_assert (history);
+    w_assert (target);
+    w_assert (out);
+
+    unsigned n = history->count < s_replay_lines ? history->count : s_replay_lines;
+    for (unsigned i = history->count - n; i < history->count; i++) {
+        const struct history_entry *entry =
+            &history->entries[(history->first + i) % history->capacity];
+        if (server_time) {
+            const struct timespec when = { .tv_sec = entry->time };
+            w_buf_append_str (out, "@time=");
+            irc_tag_time (out, &when);
+            w_buf_append_char (out, ' ');
+        }
+        w_buf_append_char (out, ':');
+        w_buf_append_mem (out, atom_str (entry->sender), atom_length (entry->sender));
+        w_buf_append_str (out, entry->notice ? " NOTICE " : " PRIVMSG ");
+        w_buf_append_str (out, target);
+        w_buf_append_str (out, " :");
+        w_buf_append_mem (out, history->arena + entry->offset, entry->length);
+        w_buf_append_str (out, "\r\n");
+    }
+}
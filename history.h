@@ -0,0 +1,114 @@
+/*
+ * history.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "atom.h"
+
+/*
+ * Bounded per-channel scrollback. Message bodies are stored back to back
+ * in a per-channel byte arena, while senders are atoms, so each entry is
+ * just a reference to the sender plus the location of the body in the
+ * arena.
+ */
+
+#ifndef CHATEAU_HISTORY_CHANNEL_MAX
+#define CHATEAU_HISTORY_CHANNEL_MAX (64 * 1024)
+#endif /* !CHATEAU_HISTORY_CHANNEL_MAX */
+
+#ifndef CHATEAU_HISTORY_TOTAL_MAX
+#define CHATEAU_HISTORY_TOTAL_MAX (16 * 1024 * 1024)
+#endif /* !CHATEAU_HISTORY_TOTAL_MAX */
+
+#ifndef CHATEAU_HISTORY_REPLAY_LINES
+#define CHATEAU_HISTORY_REPLAY_LINES 25
+#endif /* !CHATEAU_HISTORY_REPLAY_LINES */
+
+
+struct history_entry {
+    atom_t   *sender;
+    uint32_t  time;
+    uint32_t  offset;
+    uint16_t  length;
+    bool      notice;
+};
+
+typedef struct {
+    struct history_entry *entries;   /* Ring of entries. */
+    unsigned              first;
+    unsigned              count;
+    unsigned              capacity;
+
+    char                 *arena;     /* Live bodies are in [start, end). */
+    size_t                arena_start;
+    size_t                arena_end;
+    size_t                arena_alloc;
+
+    size_t                bytes;     /* Accounted against the limits. */
+} history_t;
+
+
+/*
+ * Sets the maximum amount of bytes used by the scrollback of a single
+ * channel, by all the channels together, and the amount of lines sent
+ * to clients when they join a channel.
+ */
+extern void history_set_limits (size_t   channel_max,
+                                 size_t   total_max,
+                                 unsigned replay_lines);
+
+extern size_t history_total_bytes (void);
+
+static inline void
+history_init (history_t *history)
+{
+    w_assert (history);
+    memset (history, 0x00, sizeof (history_t));
+}
+
+static inline bool
+history_is_empty (const history_t *history)
+{
+    w_assert (history);
+    return history->count == 0;
+}
+
+extern void history_clear (history_t *history);
+
+/* Drops the oldest lines until at most "max_bytes" are used. */
+extern void history_trim (history_t *history, size_t max_bytes);
+
+extern void history_append (history_t  *history,
+                            bool        notice,
+                            atom_t     *sender,
+                            const char *body,
+                            size_t      body_length);
+
+/*
+ * Same, with the time the message was sent, e.g. when rebuilding from the
+ * journal. Returns false if the message is not kept in the scrollback.
+ */
+extern bool history_append_at (history_t  *history,
+                               bool        notice,
+                               atom_t     *sender,
+                               const char *body,
+                               size_t      body_length,
+                               uint32_t    when);
+
+/*
+ * Appends the last lines of the history, addressed to "target", to "out",
+ * which the caller sends in a single write through client_send(), so it
+ * counts against the SendQ of the client. With "server_time" each line
+ * is tagged with the time it was originally sent.
+ */
+extern void history_replay (const history_t *history,
+                            const char      *target,
+                            bool             server_time,
+                            w_buf_t         *out);
+
+#endif /* !HISTORY_H */
@@ -0,0 +1,750 @@
+/*
+ * journal.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE /* pipe2() */
+#include "journal.h"
+#include "proto-irc.h"
+#include "ticker.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+
+enum {
+    /* Granularity of the sparse time and target indexes. */
+    BLOCK_SIZE  = 64 * 1024,
+    N_BLOCKS    = (CHATEAU_JOURNAL_SEGMENT_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE,
+    BITMAP_SIZE = (N_BLOCKS + 7) / 8,
+
+    TARGET_MAX  = 255,
+};
+
+#define NO_OFFSET UINT32_MAX
+
+static const char k_magic[8] = { 'C', 'H', 'T', 'J', 'R', 'N', 'L', '1' };
+
+
+struct segment_header {
+    char     magic[8];
+    uint64_t seqno;
+    uint32_t created;
+    uint32_t reserved;
+};
+
+/*
+ * Records are laid out as the header followed by the target, sender and
+ * body bytes, padded to a multiple of four. A zero length marks the end
+ * of the used part of a segment, as segments are created zero-filled.
+ */
+struct record_header {
+    uint32_t length;
+    uint32_t checksum;
+    uint32_t time;
+    uint16_t target_length;
+    uint16_t sender_length;
+    uint16_t body_length;
+    uint8_t  notice;
+    uint8_t  reserved;
+};
+
+/* First record starting in a block, and its timestamp. */
+struct block_point {
+    uint32_t offset;
+    uint32_t time;
+};
+
+struct segment {
+    uint64_t           seqno;
+    int                fd;
+    char              *map;
+    size_t             used;
+    size_t             synced;
+    uint32_t           first_time;
+    uint32_t           last_time;
+
+    struct block_point points[N_BLOCKS];
+
+    /*
+     * Maps case-folded targets to (index + 1) into "bitmaps", which have
+     * one bit set for each block containing records for the target.
+     */
+    w_dict_t          *targets;
+    uint8_t           *bitmaps;
+    unsigned           n_bitmaps;
+};
+
+
+static char            *s_path = NULL;
+static struct segment **s_segments = NULL;
+static unsigned         s_n_segments = 0;
+static ticker_t        *s_ticker = NULL;
+
+/*
+ * Syncing blocks, so the commit task hands it over to a thread: requests
+ * and replies go through pipes, and the task yields while it waits.
+ */
+struct sync_request {
+    uint64_t seqno;
+    size_t   end;
+    int      fd;     /* Duplicated, closed by the thread. */
+    int      error;
+};
+
+static pthread_t        s_sync_thread;
+static int              s_sync_requests[2] = { -1, -1 };
+static int              s_sync_replies[2] = { -1, -1 };
+static w_io_t          *s_sync_replies_io = NULL;
+
+
+static inline size_t
+record_size (size_t target_length, size_t sender_length, size_t body_length)
+{
+    size_t size = sizeof (struct record_header)
+                + target_length + sender_length + body_length;
+    return (size + 3) & ~((size_t) 3);
+}
+
+
+static uint32_t
+checksum (const char *data, size_t length)
+{
+    uint32_t hash = 2166136261U;  /* FNV-1a */
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t) data[i]) * 16777619U;
+    return hash;
+}
+
+
+static inline struct segment*
+active_segment (void)
+{
+    return s_n_segments ? s_segments[s_n_segments - 1] : NULL;
+}
+
+
+static void
+segment_path (char *path, size_t size, uint64_t seqno)
+{
+    snprintf (path, size, "%s/%016llx.jnl", s_path, (unsigned long long) seqno);
+}
+
+
+static uint8_t*
+segment_target_bitmap (struct segment *segment,
+                       const char     *target,
+                       size_t          length,
+                       bool            create)
+{
+    char key[TARGET_MAX + 1];
+    if (length > TARGET_MAX)
+        length = TARGET_MAX;
+    irc_casefold (key, target, length);
+    key[length] = '\0';
+
+    uintptr_t index = (uintptr_t) w_dict_get (segment->targets, key);
+    if (index == 0) {
+        if (!create)
+            return NULL;
+        segment->bitmaps = w_resize (segment->bitmaps, uint8_t,
+                                     (segment->n_bitmaps + 1) * BITMAP_SIZE);
+        memset (segment->bitmaps + segment->n_bitmaps * BITMAP_SIZE,
+                0x00, BITMAP_SIZE);
+        index = ++segment->n_bitmaps;
+        w_dict_set (segment->targets, key, (void*) index);
+    }
+    return segment->bitmaps + (index - 1) * BITMAP_SIZE;
+}
+
+
+static void
+segment_index_record (struct segment *segment, size_t offset)
+{
+    const struct record_header *header =
+        (const struct record_header*) (segment->map + offset);
+    const unsigned block = offset / BLOCK_SIZE;
+
+    if (segment->points[block].offset == NO_OFFSET) {
+        segment->points[block] = (struct block_point) {
+            .offset = offset,
+            .time   = header->time,
+        };
+    }
+    if (segment->first_time == 0)
+        segment->first_time = header->time;
+    segment->last_time = header->time;
+
+    uint8_t *bitmap = segment_target_bitmap (segment,
+                                             (const char*) (header + 1),
+                                             header->target_length,
+                                             true);
+    bitmap[block / 8] |= 1 << (block % 8);
+}
+
+
+/* Returns the size of the valid record at "offset", or zero. */
+static size_t
+segment_check_record (const struct segment *segment, size_t offset)
+{
+    if (offset + sizeof (struct record_header) > CHATEAU_JOURNAL_SEGMENT_SIZE)
+        return 0;
+
+    const struct record_header *header =
+        (const struct record_header*) (segment->map + offset);
+    const size_t payload = header->target_length
+                         + header->sender_length
+                         + header->body_length;
+
+    if (header->length == 0 ||
+        header->length != record_size (header->target_length,
+                                       header->sender_length,
+                                       header->body_length) ||
+        offset + header->length > CHATEAU_JOURNAL_SEGMENT_SIZE ||
+        header->checksum != checksum ((const char*) (header + 1), payload))
+        return 0;
+
+    return header->length;
+}
+
+
+static void
+segment_free (struct segment *segment)
+{
+    munmap (segment->map, CHATEAU_JOURNAL_SEGMENT_SIZE);
+    close (segment->fd);
+    w_obj_unref (segment->targets);
+    w_free (segment->bitmaps);
+    w_free (segment);
+}
+
+
+static struct segment*
+segment_map (uint64_t seqno, bool create)
+{
+    char path[PATH_MAX];
+    segment_path (path, sizeof (path), seqno);
+
+    int fd = open (path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0640);
+    if (fd < 0)
+        return NULL;
+
+    if (create && ftruncate (fd, CHATEAU_JOURNAL_SEGMENT_SIZE) != 0) {
+        int saved_errno = errno;
+        unlink (path);
+        close (fd);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    char *map = mmap (NULL, CHATEAU_JOURNAL_SEGMENT_SIZE,
+                      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        int saved_errno = errno;
+        close (fd);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    struct segment *segment = w_new0 (struct segment);
+    segment->seqno = seqno;
+    segment->fd = fd;
+    segment->map = map;
+    segment->targets = w_dict_new (false);
+    for (unsigned i = 0; i < N_BLOCKS; i++)
+        segment->points[i].offset = NO_OFFSET;
+
+    struct segment_header *header = (struct segment_header*) map;
+    if (create) {
+        memcpy (header->magic, k_magic, sizeof (k_magic));
+        header->seqno = seqno;
+        header->created = (uint32_t) time (NULL);
+        segment->used = sizeof (struct segment_header);
+        return segment;
+    }
+
+    if (memcmp (header->magic, k_magic, sizeof (k_magic)) != 0 ||
+        header->seqno != seqno) {
+        segment_free (segment);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Rebuild the index; scanning stops at the first torn record. */
+    size_t offset = sizeof (struct segment_header);
+    for (size_t length; (length = segment_check_record (segment, offset)); offset += length)
+        segment_index_record (segment, offset);
+    segment->used = segment->synced = offset;
+    return segment;
+}
+
+
+static size_t
+page_start (size_t offset)
+{
+    static size_t page_size = 0;
+    if (!page_size)
+        page_size = sysconf (_SC_PAGESIZE);
+    return offset & ~(page_size - 1);
+}
+
+
+/* Blocks until the segment is on disk; only used when shutting down. */
+static void
+segment_sync (struct segment *segment)
+{
+    if (segment->synced >= segment->used)
+        return;
+
+    size_t start = page_start (segment->synced);
+    if (msync (segment->map + start, segment->used - start, MS_SYNC) == 0)
+        segment->synced = segment->used;
+    else
+        w_printerr ("journal: msync failed: $s\n", strerror (errno));
+}
+
+
+static void*
+sync_thread (void *data)
+{
+    w_unused (data);
+
+    for (;;) {
+        struct sync_request request;
+        ssize_t r = read (s_sync_requests[0], &request, sizeof (request));
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r != sizeof (request))
+            break;
+
+        request.error = (fdatasync (request.fd) == 0) ? 0 : errno;
+        close (request.fd);
+
+        while ((r = write (s_sync_replies[1], &request, sizeof (request))) < 0 &&
+               errno == EINTR);
+    }
+    return NULL;
+}
+
+
+/* First segment from "seqno" onwards with data not on disk yet. */
+static struct segment*
+dirty_segment (uint64_t seqno)
+{
+    for (unsigned i = 0; i < s_n_segments; i++)
+        if (s_segments[i]->seqno >= seqno &&
+            s_segments[i]->synced < s_segments[i]->used)
+            return s_segments[i];
+    return NULL;
+}
+
+
+static struct segment*
+find_segment (uint64_t seqno)
+{
+    for (unsigned i = 0; i < s_n_segments; i++)
+        if (s_segments[i]->seqno == seqno)
+            return s_segments[i];
+    return NULL;
+}
+
+
+/*
+ * Has the sync thread write the segment up to its current end, and yields
+ * until it is done. Returns false on error. Appending continues meanwhile,
+ * and the segment may be dropped by compaction before the reply arrives.
+ */
+static bool
+segment_sync_async (struct segment *segment)
+{
+    struct sync_request request = {
+        .seqno = segment->seqno,
+        .end   = segment->used,
+        .fd    = dup (segment->fd),
+    };
+    if (request.fd < 0) {
+        w_printerr ("journal: Cannot sync: $s\n", strerror (errno));
+        return false;
+    }
+
+    /* Starts the writeback of the dirty pages, without waiting for it. */
+    size_t start = page_start (segment->synced);
+    msync (segment->map + start, request.end - start, MS_ASYNC);
+
+    if (write (s_sync_requests[1], &request, sizeof (request)) != sizeof (request)) {
+        w_printerr ("journal: Cannot sync: $s\n", strerror (errno));
+        close (request.fd);
+        return false;
+    }
+
+    for (;;) {
+        ssize_t r = read (w_io_get_fd (s_sync_replies_io), &request, sizeof (request));
+        if (r == sizeof (request))
+            break;
+        if (r < 0 && errno == EAGAIN)
+            w_task_yield_io_read (s_sync_replies_io);
+        else if (r >= 0 || errno != EINTR)
+            return false;
+    }
+
+    if (request.error) {
+        w_printerr ("journal: fdatasync failed: $s\n", strerror (request.error));
+        return false;
+    }
+    if ((segment = find_segment (request.seqno)) && segment->synced < request.end)
+        segment->synced = request.end;
+    return true;
+}
+
+
+/*
+ * Records are never modified once written, so compaction amounts to
+ * dropping whole segments which are past the retention period, or over
+ * the maximum amount of segments. The active segment is always kept.
+ */
+static void
+compact (void)
+{
+    const uint32_t now = (uint32_t) time (NULL);
+    unsigned drop = 0;
+
+    while (drop + 1 < s_n_segments) {
+        const struct segment *segment = s_segments[drop];
+        if (s_n_segments - drop <= CHATEAU_JOURNAL_MAX_SEGMENTS &&
+            segment->last_time + CHATEAU_JOURNAL_RETENTION >= now)
+            break;
+        drop++;
+    }
+
+    for (unsigned i = 0; i < drop; i++) {
+        char path[PATH_MAX];
+        segment_path (path, sizeof (path), s_segments[i]->seqno);
+        unlink (path);
+        segment_free (s_segments[i]);
+    }
+    if (drop) {
+        s_n_segments -= drop;
+        memmove (s_segments, s_segments + drop,
+                 s_n_segments * sizeof (struct segment*));
+    }
+}
+
+
+static bool
+rotate (void)
+{
+    struct segment *old = active_segment ();
+    struct segment *segment = segment_map (old ? old->seqno + 1 : 1, true);
+    if (!segment)
+        return false;
+
+    /* The old segment is left for the commit task to sync. */
+    s_segments = w_resize (s_segments, struct segment*, s_n_segments + 1);
+    s_segments[s_n_segments++] = segment;
+    compact ();
+    return true;
+}
+
+
+static void
+commit_task (void *data)
+{
+    w_unused (data);
+
+    while (s_ticker && ticker_wait (s_ticker)) {
+        /* Each segment once per tick, so that appends are grouped. */
+        struct segment *segment;
+        for (uint64_t seqno = 0; s_ticker && (segment = dirty_segment (seqno));) {
+            seqno = segment->seqno + 1;
+            if (!segment_sync_async (segment))
+                break;
+        }
+    }
+}
+
+
+static int
+compare_seqno (const void *a, const void *b)
+{
+    const uint64_t sa = *((const uint64_t*) a);
+    const uint64_t sb = *((const uint64_t*) b);
+    return (sa > sb) - (sa < sb);
+}
+
+
+bool
+journal_open (const char *path)
+{
+    w_assert (path);
+    w_assert (!s_path);
+
+    if (mkdir (path, 0750) != 0 && errno != EEXIST)
+        return false;
+
+    DIR *dir = opendir (path);
+    if (!dir)
+        return false;
+
+    uint64_t *seqnos = NULL;
+    unsigned n_seqnos = 0;
+    for (struct dirent *entry; (entry = readdir (dir));) {
+        unsigned long long seqno;
+        char suffix[5];
+        if (strlen (entry->d_name) == 20 &&
+            sscanf (entry->d_name, "%16llx%4s", &seqno, suffix) == 2 &&
+            strcmp (suffix, ".jnl") == 0) {
+            seqnos = w_resize (seqnos, uint64_t, n_seqnos + 1);
+            seqnos[n_seqnos++] = seqno;
+        }
+    }
+    closedir (dir);
+    qsort (seqnos, n_seqnos, sizeof (uint64_t), compare_seqno);
+
+    s_path = w_str_dup (path);
+    for (unsigned i = 0; i < n_seqnos; i++) {
+        struct segment *segment = segment_map (seqnos[i], false);
+        if (!segment) {
+            w_printerr ("journal: Skipping segment $L: $s\n",
+                        (unsigned long) seqnos[i], strerror (errno));
+            continue;
+        }
+        s_segments = w_resize (s_segments, struct segment*, s_n_segments + 1);
+        s_segments[s_n_segments++] = segment;
+    }
+    w_free (seqnos);
+
+    if (!s_n_segments && !rotate ()) {
+        journal_close ();
+        return false;
+    }
+
+    if (!(s_ticker = ticker_new (CHATEAU_JOURNAL_COMMIT_INTERVAL))) {
+        journal_close ();
+        return false;
+    }
+
+    if (pipe2 (s_sync_requests, O_CLOEXEC) != 0 ||
+        pipe2 (s_sync_replies, O_CLOEXEC) != 0 ||
+        fcntl (s_sync_replies[0], F_SETFL, O_NONBLOCK) != 0 ||
+        (errno = pthread_create (&s_sync_thread, NULL, sync_thread, NULL)) != 0) {
+        int saved_errno = errno;
+        journal_close ();
+        errno = saved_errno;
+        return false;
+    }
+    s_sync_replies_io = w_io_unix_open_fd (s_sync_replies[0]);
+
+    w_task_t *task = w_task_prepare (commit_task, NULL, 16384);
+    w_task_set_name (task, "journal");
+    w_task_set_is_system (task, true);
+    return true;
+}
+
+
+void
+journal_close (void)
+{
+    if (s_sync_replies_io) {
+        /* The thread exits once it reads end-of-file. */
+        close (s_sync_requests[1]);
+        s_sync_requests[1] = -1;
+        pthread_join (s_sync_thread, NULL);
+        W_IO_NORESULT (w_io_close (s_sync_replies_io));
+        w_obj_unref (s_sync_replies_io);
+        s_sync_replies_io = NULL;
+        s_sync_replies[0] = -1;
+    }
+    for (unsigned i = 0; i < 2; i++) {
+        if (s_sync_requests[i] >= 0)
+            close (s_sync_requests[i]);
+        if (s_sync_replies[i] >= 0)
+            close (s_sync_replies[i]);
+        s_sync_requests[i] = s_sync_replies[i] = -1;
+    }
+
+    journal_commit ();
+
+    if (s_ticker) {
+        w_obj_unref (s_ticker);
+        s_ticker = NULL;
+    }
+    for (unsigned i = 0; i < s_n_segments; i++)
+        segment_free (s_segments[i]);
+    w_free (s_segments);
+    w_free (s_path);
+    s_n_segments = 0;
+}
+
+
+bool
+journal_is_open (void)
+{
+    return s_path != NULL;
+}
+
+
+void
+journal_append (bool        notice,
+                const char *target,
+                size_t      target_length,
+                const char *sender,
+                size_t      sender_length,
+                const char *body,
+                size_t      body_length)
+{
+    if (!s_path)
+        return;
+
+    w_assert (target);
+    w_assert (sender);
+    w_assert (body);
+
+    if (target_length > UINT16_MAX || sender_length > UINT16_MAX ||
+        body_length > UINT16_MAX)
+        return;
+
+    const size_t length = record_size (target_length, sender_length, body_length);
+    struct segment *segment = active_segment ();
+    if (segment->used + length > CHATEAU_JOURNAL_SEGMENT_SIZE) {
+        if (!rotate ()) {
+            w_printerr ("journal: Cannot create segment: $s\n", strerror (errno));
+            return;
+        }
+        segment = active_segment ();
+    }
+
+    struct record_header *header =
+        (struct record_header*) (segment->map + segment->used);
+    char *payload = (char*) (header + 1);
+    memcpy (payload, target, target_length);
+    memcpy (payload + target_length, sender, sender_length);
+    memcpy (payload + target_length + sender_length, body, body_length);
+
+    *header = (struct record_header) {
+        .length        = length,
+        .checksum      = checksum (payload, target_length + sender_length + body_length),
+        .time          = (uint32_t) time (NULL),
+        .target_length = target_length,
+        .sender_length = sender_length,
+        .body_length   = body_length,
+        .notice        = notice,
+    };
+
+    segment_index_record (segment, segment->used);
+    segment->used += length;
+}
+
+
+void
+journal_commit (void)
+{
+    for (unsigned i = 0; i < s_n_segments; i++)
+        segment_sync (s_segments[i]);
+}
+
+
+static void
+replay_block_range (const struct segment *segment,
+                    size_t                offset,
+                    size_t                end,
+                    const char           *target,
+                    size_t                target_length,
+                    uint32_t              since,
+                    uint32_t              until,
+                    journal_visit_func_t  visit,
+                    void                 *userdata)
+{
+    char key[TARGET_MAX + 1], folded[TARGET_MAX + 1];
+    if (target) {
+        if (target_length > TARGET_MAX)
+            target_length = TARGET_MAX;
+        irc_casefold (key, target, target_length);
+    }
+
+    while (offset < end && offset < segment->used) {
+        const struct record_header *header =
+            (const struct record_header*) (segment->map + offset);
+        const char *payload = (const char*) (header + 1);
+        offset += header->length;
+
+        if (header->time < since || header->time > until)
+            continue;
+
+        if (target) {
+            if (header->target_length != target_length)
+                continue;
+            irc_casefold (folded, payload, target_length);
+            if (memcmp (key, folded, target_length) != 0)
+                continue;
+        }
+
+        const journal_entry_t entry = {
+            .time          = header->time,
+            .notice        = header->notice,
+            .target        = payload,
+            .target_length = header->target_length,
+            .sender        = payload + header->target_length,
+            .sender_length = header->sender_length,
+            .body          = payload + header->target_length + header->sender_length,
+            .body_length   = header->body_length,
+        };
+        (*visit) (&entry, userdata);
+    }
+}
+
+
+void
+journal_replay (const char          *target,
+                size_t               target_length,
+                uint32_t             since,
+                uint32_t             until,
+                journal_visit_func_t visit,
+                void                *userdata)
+{
+    w_assert (visit);
+
+    for (unsigned i = 0; i < s_n_segments; i++) {
+        struct segment *segment = s_segments[i];
+        if (segment->first_time == 0 ||
+            segment->last_time < since || segment->first_time > until)
+            continue;
+
+        const uint8_t *bitmap = NULL;
+        if (target && !(bitmap = segment_target_bitmap (segment, target,
+                                                        target_length,
+                                                        false)))
+            continue;
+
+        for (unsigned block = 0; block < N_BLOCKS; block++) {
+            const struct block_point *point = &segment->points[block];
+            if (point->offset == NO_OFFSET)
+                continue;
+            if (point->time > until)
+                break;
+
+            /* Skip blocks whose records are all older than "since". */
+            if (block + 1 < N_BLOCKS &&
+                segment->points[block + 1].offset != NO_OFFSET &&
+                segment->points[block + 1].time < since)
+                continue;
+
+            if (bitmap && !(bitmap[block / 8] & (1 << (block % 8))))
+                continue;
+
+            /* Scan records starting in this block, and only those. */
+            replay_block_range (segment, point->offset,
+                                (block + 1) * (size_t) BLOCK_SIZE,
+                                target, target_length,
+                                since, until, visit, userdata);
+        }
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * journal.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Durable log of channel and private messages. The journal is a set of
+ * fixed-size, memory-mapped segment files which are only ever appended
+ * to. Appending is a copy into the mapping, and never touches the disk.
+ * Once per commit interval, a system task starts the writeback of the
+ * data appended since the last flush, and a helper thread waits for it
+ * with fdatasync(), so the scheduler does not block on the disk. Entries
+ * appended during the last interval may be lost on a crash.
+ */
+
+#ifndef CHATEAU_JOURNAL_SEGMENT_SIZE
+#define CHATEAU_JOURNAL_SEGMENT_SIZE (16 * 1024 * 1024)
+#endif /* !CHATEAU_JOURNAL_SEGMENT_SIZE */
+
+#ifndef CHATEAU_JOURNAL_COMMIT_INTERVAL
+#define CHATEAU_JOURNAL_COMMIT_INTERVAL 100 /* ms */
+#endif /* !CHATEAU_JOURNAL_COMMIT_INTERVAL */
+
+#ifndef CHATEAU_JOURNAL_MAX_SEGMENTS
+#define CHATEAU_JOURNAL_MAX_SEGMENTS 64
+#endif /* !CHATEAU_JOURNAL_MAX_SEGMENTS */
+
+#ifndef CHATEAU_JOURNAL_RETENTION
+#define CHATEAU_JOURNAL_RETENTION (30 * 24 * 60 * 60) /* s */
+#endif /* !CHATEAU_JOURNAL_RETENTION */
+
+
+typedef struct {
+    uint32_t    time;
+    bool        notice;
+    const char *target;
+    size_t      target_length;
+    const char *sender;
+    size_t      sender_length;
+    const char *body;
+    size_t      body_length;
+} journal_entry_t;
+
+typedef void (*journal_visit_func_t) (const journal_entry_t *entry,
+                                      void                  *userdata);
+
+
+/*
+ * Opens the journal stored in the given directory, creating it if needed,
+ * and starts the commit task. Returns false and sets errno on failure.
+ */
+extern bool journal_open (const char *path);
+extern void journal_close (void);
+extern bool journal_is_open (void);
+
+/* Does nothing if the journal has not been opened. */
+extern void journal_append (bool        notice,
+                            const char *target,
+                            size_t      target_length,
+                            const char *sender,
+                            size_t      sender_length,
+                            const char *body,
+                            size_t      body_length);
+
+/*
+ * Flushes appended entries to disk, blocking until done. The commit task
+ * does it without blocking; this is for upgrades and shutdown.
+ */
+extern void journal_commit (void);
+
+/*
+ * Calls "visit" for each entry in the time range [since, until], in the
+ * order they were appended. If "target" is non-NULL, only the entries
+ * for that channel or nick are visited.
+ */
+extern void journal_replay (const char          *target,
+                            size_t               target_length,
+                            uint32_t             since,
+                            uint32_t             until,
+                            journal_visit_func_t visit,
+                            void                *userdata);
+
+#endif /* !JOURNAL_H */
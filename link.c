@@ -0,0 +1,938 @@
+/*
+ * link.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "link.h"
+#include "admission.h"
+#include "channel.h"
+#include "config.h"
+#include "journal.h"
+#include <openssl/crypto.h>
+#include <openssl/sha.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+enum {
+    BURST_LINE_MAX = 510,  /* RFC1459, section 2.3, without CR-LF */
+};
+
+
+static char *s_name = NULL;
+
+/* Remote servers; a server always comes after its uplink. */
+static struct link_server **s_servers = NULL;
+static unsigned             s_n_servers = 0;
+
+/* Direct links. */
+static link_t **s_links = NULL;
+static unsigned s_n_links = 0;
+
+
+void
+link_init (const char *server_name)
+{
+    w_assert (server_name);
+    w_assert (!s_name);
+    s_name = w_str_dup (server_name);
+}
+
+
+const char*
+link_server_name (void)
+{
+    return s_name;
+}
+
+
+unsigned
+link_server_count (void)
+{
+    return s_n_servers;
+}
+
+
+const struct link_server*
+link_server_at (unsigned index)
+{
+    w_assert (index < s_n_servers);
+    return s_servers[index];
+}
+
+
+/* The returned peer belongs to "config". */
+static const link_peer_t*
+find_peer (const config_t *config, const char *name)
+{
+    for (const link_peer_t *peer = config->peers; peer->name; peer++)
+        if (strcasecmp (peer->name, name) == 0)
+            return peer;
+    return NULL;
+}
+
+
+static struct link_server*
+server_lookup (const char *name)
+{
+    for (unsigned i = 0; i < s_n_servers; i++)
+        if (strcasecmp (w_buf_str (&s_servers[i]->name), name) == 0)
+            return s_servers[i];
+    return NULL;
+}
+
+
+static struct link_server*
+server_add (const char         *name,
+            const char         *info,
+            unsigned            hops,
+            link_t             *link,
+            struct link_server *uplink)
+{
+    struct link_server *server = w_new0 (struct link_server);
+    w_buf_set_str (&server->name, name);
+    w_buf_set_str (&server->info, info);
+    server->hops = hops;
+    server->link = link;
+    server->uplink = uplink;
+
+    s_servers = w_resize (s_servers, struct link_server*, s_n_servers + 1);
+    s_servers[s_n_servers++] = server;
+    return server;
+}
+
+
+static void
+remote_client_remove (client_t *client, const char *reason)
+{
+    struct link_server *server = client->server;
+    for (unsigned i = 0; i < server->n_clients; i++) {
+        if (server->clients[i] == client) {
+            server->clients[i] = server->clients[--server->n_clients];
+            break;
+        }
+    }
+
+    channel_quit (client, reason);
+    client_unregister (client);
+    w_obj_unref (client);
+}
+
+
+void
+link_kill (client_t *client, const char *reason)
+{
+    w_assert (client);
+    w_assert (!client_is_local (client));
+    w_assert (reason);
+
+    w_buf_t line = W_BUF;
+    w_buf_format (&line, ":$s KILL $s :$s\r\n", s_name, atom_str (client->nick), reason);
+    W_IO_NORESULT (client_send (client, w_buf_data (&line), w_buf_size (&line)));
+    w_buf_clear (&line);
+    remote_client_remove (client, "Killed");
+}
+
+
+/* Removes a server, all the servers behind it, and their clients. */
+static void
+server_remove (struct link_server *server, const char *reason)
+{
+    for (unsigned i = 0; i < s_n_servers;) {
+        if (s_servers[i]->uplink == server) {
+            server_remove (s_servers[i], reason);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+
+    while (server->n_clients > 0)
+        remote_client_remove (server->clients[server->n_clients - 1], reason);
+
+    for (unsigned i = 0; i < s_n_servers; i++) {
+        if (s_servers[i] == server) {
+            memmove (&s_servers[i], &s_servers[i + 1],
+                     (--s_n_servers - i) * sizeof (struct link_server*));
+            break;
+        }
+    }
+
+    w_buf_clear (&server->name);
+    w_buf_clear (&server->info);
+    w_free (server->clients);
+    w_free (server);
+}
+
+
+void
+link_broadcast (link_t *except, const void *data, size_t length)
+{
+    w_assert (data);
+
+    for (unsigned i = 0; i < s_n_links; i++) {
+        if (s_links[i] != except) {
+            W_IO_NORESULT (w_io_write (s_links[i]->socket, data, length));
+            W_IO_NORESULT (w_io_flush (s_links[i]->socket));
+        }
+    }
+}
+
+
+/*
+ * Rebuilds the text of a message received from a link, to forward it
+ * through the others. Parameters are kept as they were received.
+ */
+static void
+format_message (w_buf_t *out, const irc_message_t *message)
+{
+    w_buf_clear (out);
+    if (w_buf_size (&message->prefix.nick)) {
+        w_buf_append_char (out, ':');
+        w_buf_append_buf (out, &message->prefix.nick);
+        w_buf_append_char (out, ' ');
+    }
+    w_buf_append_buf (out, &message->cmd_text);
+    if (w_buf_size (&message->params_text)) {
+        w_buf_append_char (out, ' ');
+        w_buf_append_buf (out, &message->params_text);
+    }
+    w_buf_append_str (out, "\r\n");
+}
+
+
+static void
+burst_append_joins (w_buf_t *burst, const client_t *client)
+{
+    size_t start = 0;
+    for (unsigned i = 0; i < client->n_channels; i++) {
+        const atom_t *name = client->channels[i]->name;
+        if (start && w_buf_size (burst) - start + atom_length (name) + 1 > BURST_LINE_MAX) {
+            w_buf_append_str (burst, "\r\n");
+            start = 0;
+        }
+        if (!start) {
+            start = w_buf_size (burst);
+            w_buf_format (burst, ":$s JOIN ", atom_str (client->nick));
+        } else {
+            w_buf_append_char (burst, ',');
+        }
+        w_buf_append_mem (burst, atom_str (name), atom_length (name));
+    }
+    if (start)
+        w_buf_append_str (burst, "\r\n");
+}
+
+
+static void
+burst_append_modes (w_buf_t *burst, link_t *link, const channel_t *channel)
+{
+    for (unsigned i = 0; i < channel->n_members; i++) {
+        const client_t *member = channel->members[i];
+        if (member->link == link)
+            continue;
+        if (channel->modes[i] & CHANNEL_MODE_OP)
+            w_buf_format (burst, ":$s MODE $s +o $s\r\n", s_name,
+                          atom_str (channel->name), atom_str (member->nick));
+        if (channel->modes[i] & CHANNEL_MODE_VOICE)
+            w_buf_format (burst, ":$s MODE $s +v $s\r\n", s_name,
+                          atom_str (channel->name), atom_str (member->nick));
+    }
+
+    const unsigned n_bans = channel->bans ? mask_set_count (channel->bans) : 0;
+    for (unsigned i = 0; i < n_bans; i++)
+        w_buf_format (burst, ":$s MODE $s +b $s\r\n", s_name,
+                      atom_str (channel->name),
+                      mask_text (mask_set_at (channel->bans, i)));
+}
+
+
+/*
+ * The state burst introduces all the servers and clients not behind the
+ * link to the peer, then the modes of their members and the bans of every
+ * channel. It is rendered into a single buffer and written at once,
+ * without waiting for the peer to reply to anything; joins of each client
+ * are coalesced into as few JOIN lines as possible.
+ */
+static w_io_result_t
+send_burst (link_t *link)
+{
+    w_buf_t burst = W_BUF;
+
+    for (unsigned i = 0; i < s_n_servers; i++) {
+        const struct link_server *server = s_servers[i];
+        if (server->link == link)
+            continue;
+        w_buf_format (&burst, ":$s SERVER $B $I :$B\r\n",
+                      server->uplink ? w_buf_str (&server->uplink->name) : s_name,
+                      &server->name, server->hops + 1, &server->info);
+    }
+
+    for (unsigned i = 0; i < client_count (); i++) {
+        const client_t *client = client_at (i);
+        if (client->link == link)
+            continue;
+        w_buf_format (&burst, ":$s NICK $s $I\r\n",
+                      client->server ? w_buf_str (&client->server->name) : s_name,
+                      atom_str (client->nick),
+                      client->server ? client->server->hops + 1 : 1);
+        burst_append_joins (&burst, client);
+    }
+
+    channel_t **channels;
+    const unsigned n_channels = channel_snapshot (&channels);
+    for (unsigned i = 0; i < n_channels; i++)
+        burst_append_modes (&burst, link, channels[i]);
+    channel_snapshot_free (channels, n_channels);
+
+    w_io_result_t r = w_io_write (link->socket, w_buf_data (&burst), w_buf_size (&burst));
+    w_buf_clear (&burst);
+    return w_io_failed (r) ? r : w_io_flush (link->socket);
+}
+
+
+static client_t*
+link_source (link_t *link, const irc_message_t *message)
+{
+    if (!w_buf_size (&message->prefix.nick))
+        return NULL;
+
+    /* Ignore messages which come from the wrong direction. */
+    client_t *client = client_lookup (w_buf_data (&message->prefix.nick),
+                                      w_buf_size (&message->prefix.nick));
+    return (client && client->link == link) ? client : NULL;
+}
+
+
+static void
+handle_server (link_t *link, const irc_message_t *message)
+{
+    if (message->n_params < 3)
+        return;
+
+    char name[IRC_MAX_LINE], buf[IRC_MAX_LINE];
+    irc_buf_cstr (&message->params[0], name);
+
+    struct link_server *uplink = NULL;
+    if (w_buf_size (&message->prefix.nick))
+        uplink = server_lookup (irc_buf_cstr (&message->prefix.nick, buf));
+    if (!uplink || uplink->link != link)
+        uplink = link->peer;
+
+    if (strcasecmp (name, s_name) == 0 || server_lookup (name)) {
+        /* Accepting the server would close a loop in the tree. */
+        w_buf_t squit = W_BUF;
+        w_buf_format (&squit, ":$s SQUIT $s :Server already linked\r\n", s_name, name);
+        W_IO_NORESULT (w_io_write (link->socket, w_buf_data (&squit), w_buf_size (&squit)));
+        W_IO_NORESULT (w_io_flush (link->socket));
+        w_buf_clear (&squit);
+        return;
+    }
+
+    unsigned long hops = 1;
+    w_str_uint (irc_buf_cstr (&message->params[1], buf), &hops);
+    server_add (name, irc_buf_cstr (&message->params[2], buf),
+                hops, link, uplink);
+
+    /* Bump the hop count for the servers further away. */
+    w_buf_t out = W_BUF;
+    w_buf_format (&out, ":$B SERVER $s $L :$B\r\n", &uplink->name, name,
+                  hops + 1, &message->params[2]);
+    link_broadcast (link, w_buf_data (&out), w_buf_size (&out));
+    w_buf_clear (&out);
+}
+
+
+static void
+handle_squit (link_t *link, const irc_message_t *message, const w_buf_t *line)
+{
+    if (message->n_params < 1)
+        return;
+
+    char name[IRC_MAX_LINE];
+    struct link_server *server =
+        server_lookup (irc_buf_cstr (&message->params[0], name));
+    if (!server || server->link != link)
+        return;
+
+    if (server == link->peer) {
+        /* The peer is leaving: the whole link goes away. */
+        shutdown (w_io_get_fd (link->socket), SHUT_RDWR);
+        return;
+    }
+
+    w_buf_t reason = W_BUF;
+    w_buf_format (&reason, "$B $B",
+                  server->uplink ? &server->uplink->name : &link->peer->name,
+                  &server->name);
+    server_remove (server, w_buf_str (&reason));
+    w_buf_clear (&reason);
+    link_broadcast (link, w_buf_data (line), w_buf_size (line));
+}
+
+
+static void
+handle_nick (link_t *link, const irc_message_t *message, const w_buf_t *line)
+{
+    if (message->n_params < 1 || !w_buf_size (&message->prefix.nick))
+        return;
+
+    char nick[IRC_MAX_LINE];
+    struct link_server *server =
+        server_lookup (irc_buf_cstr (&message->prefix.nick, nick));
+    if (!server || server->link != link)
+        return;
+
+    irc_buf_cstr (&message->params[0], nick);
+    client_t *client = client_new_remote (link, server);
+
+    if (!client_register (client, nick)) {
+        /* The client connected first is kept; the new one goes away. */
+        w_buf_t kill = W_BUF;
+        w_buf_format (&kill, ":$s KILL $s :Nick collision\r\n", s_name, nick);
+        W_IO_NORESULT (w_io_write (link->socket, w_buf_data (&kill), w_buf_size (&kill)));
+        W_IO_NORESULT (w_io_flush (link->socket));
+        w_buf_clear (&kill);
+        w_obj_unref (client);
+        return;
+    }
+
+    if (server->n_clients == server->a_clients) {
+        server->a_clients = server->a_clients ? server->a_clients * 2 : 16;
+        server->clients = w_resize (server->clients, client_t*, server->a_clients);
+    }
+    server->clients[server->n_clients++] = client;
+
+    link_broadcast (link, w_buf_data (line), w_buf_size (line));
+}
+
+
+static void
+handle_kill (link_t *link, const irc_message_t *message, const w_buf_t *line)
+{
+    if (message->n_params < 1)
+        return;
+
+    /* Only remote clients can be killed through links. */
+    client_t *client = client_lookup (w_buf_data (&message->params[0]),
+                                      w_buf_size (&message->params[0]));
+    if (!client || client_is_local (client))
+        return;
+
+    if (client->link != link)
+        W_IO_NORESULT (client_send (client, w_buf_data (line), w_buf_size (line)));
+    else
+        link_broadcast (link, w_buf_data (line), w_buf_size (line));
+    remote_client_remove (client, "Killed");
+}
+
+
+struct join_ctx {
+    link_t   *link;
+    client_t *client;
+    bool      join;
+};
+
+
+static void
+handle_join_part_target (const char *name, size_t length, void *userdata)
+{
+    struct join_ctx *ctx = userdata;
+    channel_t *channel;
+
+    if (ctx->join) {
+        if (!(channel = channel_join (name, length, ctx->client)))
+            return;
+        /* Operators are set by the server of the channel creator. */
+        channel_set_member_modes (channel, ctx->client, 0);
+    } else if (!(channel = channel_lookup (name, length)) ||
+               !channel_has_member (channel, ctx->client)) {
+        return;
+    }
+
+    w_buf_t out = W_BUF;
+    w_buf_format (&out, ":$s $s $s\r\n", atom_str (ctx->client->nick),
+                  ctx->join ? "JOIN" : "PART", atom_str (channel->name));
+    channel_send_local (channel, NULL, w_buf_data (&out), w_buf_size (&out));
+    w_buf_clear (&out);
+
+    if (!ctx->join)
+        channel_part (channel, ctx->client);
+}
+
+
+static void
+foreach_target (const w_buf_t *list,
+                void (*func) (const char*, size_t, void*),
+                void *userdata)
+{
+    const char *item = w_buf_data (list);
+    const char *end = item + w_buf_size (list);
+
+    while (item < end) {
+        const char *comma = memchr (item, ',', end - item);
+        size_t length = (comma ? comma : end) - item;
+        if (length > 0) {
+            /* Longer items cannot be valid names, and are truncated. */
+            char name[IRC_MAX_LINE];
+            const size_t copied = length < IRC_MAX_LINE ? length : IRC_MAX_LINE - 1;
+            memcpy (name, item, copied);
+            name[copied] = '\0';
+            (*func) (name, copied, userdata);
+        }
+        item += length + 1;
+    }
+}
+
+
+static void
+handle_message (link_t *link, const irc_message_t *message, const w_buf_t *line)
+{
+    client_t *source = link_source (link, message);
+    if (!source || message->n_params < 2)
+        return;
+
+    const w_buf_t *target = &message->params[0];
+    const w_buf_t *text = &message->params[1];
+    const bool notice = (message->cmd == IRC_CMD_NOTICE);
+
+    if (w_buf_data (target)[0] == '#' || w_buf_data (target)[0] == '&') {
+        channel_t *channel = channel_lookup (w_buf_data (target), w_buf_size (target));
+        if (!channel)
+            return;
+        /* Only links with members in the channel get the message. */
+        channel_send (channel, source, w_buf_data (line), w_buf_size (line));
+        history_append (&channel->history, notice, source->nick,
+                        w_buf_data (text), w_buf_size (text));
+        journal_append (notice, w_buf_data (target), w_buf_size (target),
+                        atom_str (source->nick), atom_length (source->nick),
+                        w_buf_data (text), w_buf_size (text));
+    } else {
+        client_t *client = client_lookup (w_buf_data (target), w_buf_size (target));
+        if (client && client->link != link) {
+            W_IO_NORESULT (client_send (client, w_buf_data (line), w_buf_size (line)));
+            if (client_is_local (client))
+                journal_append (notice, w_buf_data (target), w_buf_size (target),
+                                atom_str (source->nick), atom_length (source->nick),
+                                w_buf_data (text), w_buf_size (text));
+        }
+    }
+}
+
+
+/*
+ * MODE <channel> {+|-}{b|o|v} <mask or nick>, from a client or a server
+ * behind the link. Only changes are shown to local members and passed on,
+ * so a burst repeating known modes and bans goes no further.
+ */
+static void
+handle_mode (link_t *link, const irc_message_t *message, const w_buf_t *line)
+{
+    if (message->n_params < 3 || !w_buf_size (&message->prefix.nick))
+        return;
+
+    char buf[IRC_MAX_LINE];
+    if (!link_source (link, message)) {
+        struct link_server *server =
+            server_lookup (irc_buf_cstr (&message->prefix.nick, buf));
+        if (!server || server->link != link)
+            return;
+    }
+
+    const w_buf_t *name = &message->params[0];
+    const w_buf_t *arg = &message->params[2];
+    const char *mode = irc_buf_cstr (&message->params[1], buf);
+    const bool add = (mode[0] != '-');
+    if (mode[0] == '+' || mode[0] == '-')
+        mode++;
+
+    channel_t *channel;
+    if (strcmp (mode, "b") == 0) {
+        if (!(channel = add ? channel_get (w_buf_data (name), w_buf_size (name))
+                            : channel_lookup (w_buf_data (name), w_buf_size (name))))
+            return;
+        if (!channel->bans)
+            channel->bans = mask_set_new ();
+        if (!(add ? mask_set_add (channel->bans, w_buf_data (arg), w_buf_size (arg))
+                  : mask_set_del (channel->bans, w_buf_data (arg), w_buf_size (arg)))) {
+            channel_collect (channel);
+            return;
+        }
+    } else if (strcmp (mode, "o") == 0 || strcmp (mode, "v") == 0) {
+        client_t *member = client_lookup (w_buf_data (arg), w_buf_size (arg));
+        if (!member ||
+            !(channel = channel_lookup (w_buf_data (name), w_buf_size (name))))
+            return;
+        const uint8_t flag = (mode[0] == 'o') ? CHANNEL_MODE_OP : CHANNEL_MODE_VOICE;
+        const uint8_t modes = channel_member_modes (channel, member);
+        if (!channel_set_member_modes (channel, member,
+                                       add ? (modes | flag) : (modes & ~flag)))
+            return;
+    } else {
+        return;
+    }
+
+    channel_send_local (channel, NULL, w_buf_data (line), w_buf_size (line));
+    link_broadcast (link, w_buf_data (line), w_buf_size (line));
+    channel_collect (channel);
+}
+
+
+static void
+link_run (link_t *link)
+{
+    irc_message_t message = { 0, };
+    w_buf_t line = W_BUF;
+
+    for (;; irc_message_reset (&message)) {
+        if (!irc_message_parse (&message, link->socket))
+            break;
+
+        format_message (&line, &message);
+
+        switch (message.cmd) {
+            case IRC_CMD_SERVER:
+                handle_server (link, &message);
+                break;
+
+            case IRC_CMD_SQUIT:
+                handle_squit (link, &message, &line);
+                break;
+
+            case IRC_CMD_NICK:
+                handle_nick (link, &message, &line);
+                break;
+
+            case IRC_CMD_KILL:
+                handle_kill (link, &message, &line);
+                break;
+
+            case IRC_CMD_JOIN:
+            case IRC_CMD_PART: {
+                struct join_ctx ctx = {
+                    .link   = link,
+                    .client = link_source (link, &message),
+                    .join   = (message.cmd == IRC_CMD_JOIN),
+                };
+                if (ctx.client && message.n_params > 0) {
+                    foreach_target (&message.params[0], handle_join_part_target, &ctx);
+                    link_broadcast (link, w_buf_data (&line), w_buf_size (&line));
+                }
+                break;
+            }
+
+            case IRC_CMD_QUIT: {
+                client_t *client = link_source (link, &message);
+                if (client) {
+                    char reason[IRC_MAX_LINE] = "Quit";
+                    if (message.n_params)
+                        irc_buf_cstr (&message.params[0], reason);
+                    remote_client_remove (client, reason);
+                    link_broadcast (link, w_buf_data (&line), w_buf_size (&line));
+                }
+                break;
+            }
+
+            case IRC_CMD_PRIVMSG:
+            case IRC_CMD_NOTICE:
+                handle_message (link, &message, &line);
+                break;
+
+            case IRC_CMD_MODE:
+                handle_mode (link, &message, &line);
+                break;
+
+            case IRC_CMD_PING:
+                W_IO_NORESULT (w_io_format (link->socket, ":$s PONG $s\r\n",
+                                            s_name, s_name));
+                W_IO_NORESULT (w_io_flush (link->socket));
+                break;
+
+            case IRC_CMD_ERROR:
+                goto done;
+
+            default:
+                break;
+        }
+    }
+
+done:
+    w_buf_clear (&line);
+    irc_message_reset (&message);
+}
+
+
+static link_t*
+link_new (w_io_t *socket, const char *name, const char *info, unsigned hops)
+{
+    link_t *link = w_obj_new (link_t);
+    link->socket = socket;
+    link->peer = server_add (name, info, hops, link, NULL);
+
+    s_links = w_resize (s_links, link_t*, s_n_links + 1);
+    s_links[s_n_links++] = link;
+    return link;
+}
+
+
+static void
+link_lost (link_t *link)
+{
+    for (unsigned i = 0; i < s_n_links; i++) {
+        if (s_links[i] == link) {
+            s_links[i] = s_links[--s_n_links];
+            break;
+        }
+    }
+
+    w_buf_t out = W_BUF;
+    w_buf_format (&out, ":$s SQUIT $B :Link closed\r\n", s_name, &link->peer->name);
+    link_broadcast (NULL, w_buf_data (&out), w_buf_size (&out));
+    w_buf_clear (&out);
+
+    w_buf_t reason = W_BUF;
+    w_buf_format (&reason, "$s $B", s_name, &link->peer->name);
+    server_remove (link->peer, w_buf_str (&reason));
+    w_buf_clear (&reason);
+
+    w_obj_unref (link);
+}
+
+
+/* Compares digests, so timing tells neither the contents nor the length. */
+static bool
+password_matches (const char *expected, const char *given)
+{
+    uint8_t expected_digest[SHA256_DIGEST_LENGTH];
+    uint8_t given_digest[SHA256_DIGEST_LENGTH];
+    SHA256 ((const uint8_t*) expected, strlen (expected), expected_digest);
+    SHA256 ((const uint8_t*) given, strlen (given), given_digest);
+    return CRYPTO_memcmp (expected_digest, given_digest, SHA256_DIGEST_LENGTH) == 0;
+}
+
+
+/*
+ * Validates the SERVER message sent by a peer. On success, the link is
+ * registered, the peer introduced to the rest of the network, and the
+ * state burst sent; then the link runs until closed.
+ */
+static void
+link_establish (w_io_t              *socket,
+                const char          *password,
+                const irc_message_t *message,
+                bool                 send_credentials)
+{
+    char name[IRC_MAX_LINE], info[IRC_MAX_LINE];
+    irc_buf_cstr (&message->params[0], name);
+    irc_buf_cstr (&message->params[2], info);
+
+    config_t *config = config_acquire ();
+    const link_peer_t *peer = find_peer (config, name);
+
+    const char *error = NULL;
+    if (!peer || !password || !password_matches (peer->password, password))
+        error = "Access denied";
+    else if (strcasecmp (name, s_name) == 0 || server_lookup (name))
+        error = "Server already linked";
+
+    if (error) {
+        config_release (&config);
+        W_IO_NORESULT (w_io_format (socket, "ERROR :$s\r\n", error));
+        W_IO_NORESULT (w_io_flush (socket));
+        return;
+    }
+
+    /* Accepted links no longer count as pending connections. */
+    admission_registered (w_io_get_fd (socket));
+
+    if (send_credentials) {
+        W_IO_NORESULT (w_io_format (socket, "PASS $s\r\nSERVER $s 1 :$s\r\n",
+                                    peer->password, s_name, config->server_info));
+    }
+    config_release (&config);
+
+    link_t *link = link_new (socket, name, info, 1);
+    w_printerr ("$s: Linked to $s\n", w_task_name (), name);
+
+    w_buf_t out = W_BUF;
+    w_buf_format (&out, ":$s SERVER $s 2 :$s\r\n", s_name, name, info);
+    link_broadcast (link, w_buf_data (&out), w_buf_size (&out));
+    w_buf_clear (&out);
+
+    if (!w_io_failed (send_burst (link)))
+        link_run (link);
+
+    w_printerr ("$s: Link to $s closed\n", w_task_name (), name);
+    link_lost (link);
+}
+
+
+void
+link_accept (w_io_t              *socket,
+             const char          *password,
+             const irc_message_t *server_message)
+{
+    w_assert (socket);
+    w_assert (server_message);
+    w_assert (server_message->n_params >= 3);
+    w_assert (s_name);
+
+    link_establish (socket, password, server_message, true);
+}
+
+
+struct connect_ctx {
+    config_t          *config;
+    const link_peer_t *peer;
+    char              *port;
+};
+
+
+static int
+connect_socket (const char *address, const char *port)
+{
+    char host[256];
+    const char *colon = strrchr (address, ':');
+    size_t host_length = colon ? (size_t) (colon - address) : strlen (address);
+    if (host_length >= sizeof (host))
+        return -1;
+    memcpy (host, address, host_length);
+    host[host_length] = '\0';
+    if (!port)
+        port = colon ? colon + 1 : "6686";
+
+    const struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags    = AI_NUMERICSERV,
+    };
+    struct addrinfo *addresses;
+    if (getaddrinfo (host, port, &hints, &addresses) != 0)
+        return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+        fd = socket (ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS)
+            break;
+        close (fd);
+        fd = -1;
+    }
+    freeaddrinfo (addresses);
+    return fd;
+}
+
+
+static void
+link_connect_task (void *data)
+{
+    struct connect_ctx *ctx = data;
+    config_t *config = ctx->config;
+    const link_peer_t *peer = ctx->peer;
+
+    int fd = connect_socket (peer->address, ctx->port);
+    w_free (ctx->port);
+    w_free (ctx);
+
+    if (fd < 0) {
+        w_printerr ("$s: Cannot connect to $s\n", w_task_name (), peer->address);
+        config_release (&config);
+        return;
+    }
+
+    w_io_t *unix_io = w_io_unix_open_fd (fd);
+    w_task_yield_io_write (unix_io);
+
+    int error = 0;
+    socklen_t error_length = sizeof (error);
+    if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &error_length) != 0 || error) {
+        w_printerr ("$s: Cannot connect to $s: $s\n", w_task_name (),
+                    peer->address, strerror (error ? error : errno));
+        W_IO_NORESULT (w_io_close (unix_io));
+        w_obj_unref (unix_io);
+        config_release (&config);
+        return;
+    }
+
+    w_io_t *socket = w_io_task_open (unix_io);
+    W_IO_NORESULT (w_io_format (socket, "PASS $s\r\nSERVER $s 1 :$s\r\n",
+                                peer->password, s_name, config->server_info));
+    W_IO_NORESULT (w_io_flush (socket));
+    config_release (&config);
+
+    /* Wait for the peer to identify itself with PASS and SERVER. */
+    irc_message_t message = { 0, };
+    w_buf_t password = W_BUF;
+    for (;; irc_message_reset (&message)) {
+        if (!irc_message_parse (&message, socket))
+            break;
+        if (message.cmd == IRC_CMD_PASS && message.n_params > 0) {
+            w_buf_clear (&password);
+            w_buf_append_buf (&password, &message.params[0]);
+        } else if (message.cmd == IRC_CMD_SERVER && message.n_params >= 3) {
+            link_establish (socket, w_buf_str (&password), &message, false);
+            break;
+        } else if (message.cmd == IRC_CMD_ERROR) {
+            break;
+        }
+    }
+
+    irc_message_reset (&message);
+    w_buf_clear (&password);
+    W_IO_NORESULT (w_io_close (socket));
+    w_obj_unref (socket);
+    w_obj_unref (unix_io);
+}
+
+
+bool
+link_connect (const char *name, const char *port)
+{
+    w_assert (name);
+
+    config_t *config = config_acquire ();
+    const link_peer_t *peer = find_peer (config, name);
+    if (!peer || server_lookup (name)) {
+        config_release (&config);
+        return false;
+    }
+
+    /* The task keeps the configuration alive until connected. */
+    struct connect_ctx *ctx = w_new0 (struct connect_ctx);
+    ctx->config = config;
+    ctx->peer = peer;
+    ctx->port = port ? w_str_dup (port) : NULL;
+
+    w_task_t *task = w_task_prepare (link_connect_task, ctx, 16384);
+    w_task_set_name (task, peer->name);
+    return true;
+}
+
+
+bool
+link_squit (const char *name, const char *comment)
+{
+    w_assert (name);
+    w_assert (comment);
+
+    for (unsigned i = 0; i < s_n_links; i++) {
+        link_t *link = s_links[i];
+        if (strcasecmp (w_buf_str (&link->peer->name), name) == 0) {
+            W_IO_NORESULT (w_io_format (link->socket, "ERROR :$s\r\n", comment));
+            W_IO_NORESULT (w_io_flush (link->socket));
+            /* The task running the link notices the shutdown and cleans up. */
+            shutdown (w_io_get_fd (link->socket), SHUT_RDWR);
+            return true;
+        }
+    }
+    return false;
+}
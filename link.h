@@ -0,0 +1,79 @@
+/*
+ * link.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+#include "client.h"
+#include "proto-irc.h"
+
+/*
+ * Servers are linked in a spanning tree: each server knows which of its
+ * direct links leads to every other server, and never accepts a server
+ * which it already knows about, which would close a loop.
+ */
+
+typedef struct {
+    const char *name;
+    const char *password;
+    const char *address;  /* host:port */
+} link_peer_t;
+
+
+struct link_server {
+    w_buf_t             name;
+    w_buf_t             info;
+    unsigned            hops;
+    link_t             *link;    /* Direct link leading to the server. */
+    struct link_server *uplink;  /* NULL if directly linked to us. */
+
+    client_t          **clients;
+    unsigned            n_clients;
+    unsigned            a_clients;
+};
+
+W_OBJ_DEF (link_t)
+{
+    w_obj_t             parent;
+    w_io_t             *socket;
+    struct link_server *peer;
+    unsigned            stamp;  /* Used by channel_send() */
+};
+
+
+/* Peers are looked up in the current configuration, see config.h */
+extern void link_init (const char *server_name);
+
+extern const char* link_server_name (void);
+
+/* Known remote servers, in the order they were introduced. */
+extern unsigned link_server_count (void);
+extern const struct link_server* link_server_at (unsigned index);
+
+/*
+ * Takes over a connection on which a peer has sent PASS and SERVER, and
+ * runs the link until it is closed.
+ */
+extern void link_accept (w_io_t              *socket,
+                         const char          *password,
+                         const irc_message_t *server_message);
+
+/* Starts a task which connects to a configured peer. */
+extern bool link_connect (const char *name, const char *port);
+
+/* Closes the link to a directly connected server. */
+extern bool link_squit (const char *name, const char *comment);
+
+/* Sends a KILL towards the server of a remote client, and forgets it. */
+extern void link_kill (client_t *client, const char *reason);
+
+/* Sends a message through all the links, except "except" (may be NULL). */
+extern void link_broadcast (link_t     *except,
+                            const void *data,
+                            size_t      length);
+
+#endif /* !LINK_H */
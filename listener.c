@@ -0,0 +1,274 @@
+/*
+ * listener.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE /* accept4() */
+#include "listener.h"
+#include "config.h"
+#include "tls.h"
+#include "admission.h"
+#include "hibernate.h"
+#include "ticker.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+enum {
+    BACKLOG    = 128,
+    STACK_SIZE = 16384,
+
+    /* Pauses in accepting while out of descriptors or memory, in ms. */
+    BACKOFF_MIN = 10,
+    BACKOFF_MAX = 1000,
+};
+
+
+static listener_t **s_listeners = NULL;
+static unsigned     s_n_listeners = 0;
+
+
+static void
+listener_destroy (void *obj)
+{
+    listener_t *listener = obj;
+    if (listener->io) {
+        W_IO_NORESULT (w_io_close (listener->io));
+        w_obj_unref (listener->io);
+    }
+    w_free (listener->name);
+}
+
+
+listener_t*
+listener_new_fd (const char        *name,
+                 int                fd,
+                 listener_handler_t handler,
+                 void              *userdata)
+{
+    w_assert (name);
+    w_assert (fd >= 0);
+    w_assert (handler);
+
+    int flags = fcntl (fd, F_GETFL);
+    if (flags < 0 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) != 0)
+        return NULL;
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+    listener_t *listener = w_obj_new (listener_t);
+    listener->name = w_str_dup (name);
+    listener->fd = fd;
+    listener->io = w_io_unix_open_fd (fd);
+    listener->handler = handler;
+    listener->userdata = userdata;
+    return w_obj_dtor (listener, listener_destroy);
+}
+
+
+listener_t*
+listener_new (const char        *name,
+              const char        *address,
+              listener_handler_t handler,
+              void              *userdata)
+{
+    w_assert (address);
+
+    if (strncmp (address, "tcp:", 4) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    address += 4;
+
+    char host[256] = "";
+    const char *port = strrchr (address, ':');
+    if (port) {
+        size_t length = port - address;
+        if (length >= sizeof (host)) {
+            errno = EINVAL;
+            return NULL;
+        }
+        memcpy (host, address, length);
+        host[length] = '\0';
+        port++;
+    } else {
+        port = address;
+    }
+
+    const struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags    = AI_PASSIVE | AI_NUMERICSERV,
+    };
+    struct addrinfo *addresses;
+    if (getaddrinfo (host[0] ? host : NULL, port, &hints, &addresses) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+        if ((fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+            continue;
+        int one = 1;
+        setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+        if (bind (fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen (fd, BACKLOG) == 0)
+            break;
+        close (fd);
+        fd = -1;
+    }
+    freeaddrinfo (addresses);
+
+    if (fd < 0)
+        return NULL;
+
+    listener_t *listener = listener_new_fd (name, fd, handler, userdata);
+    if (!listener)
+        close (fd);
+    return listener;
+}
+
+
+struct connection {
+    listener_t *listener;
+    int         fd;
+};
+
+
+static void
+connection_task (void *data)
+{
+    struct connection *connection = data;
+    listener_t *listener = connection->listener;
+    const int fd = connection->fd;
+    w_io_t *unix_io = w_io_unix_open_fd (fd);
+    w_free (connection);
+
+    w_io_t *io = w_obj_ref (unix_io);
+    if (listener->tls) {
+        /* Picks up certificates reloaded by REHASH for new connections. */
+        config_t *config = config_acquire ();
+        w_obj_unref (io);
+        io = config->tls ? tls_accept (config->tls, unix_io) : NULL;
+        config_release (&config);
+    }
+
+    if (io) {
+        w_io_t *socket = w_io_task_open (io);
+        (*listener->handler) (listener, socket);
+        w_obj_unref (socket);
+        w_obj_unref (io);
+    } else {
+        W_IO_NORESULT (w_io_close (unix_io));
+    }
+
+    w_obj_unref (unix_io);
+    w_obj_unref (listener);
+    if (!hibernate_is_parked (fd))
+        admission_release (fd);
+}
+
+
+void
+listener_spawn (listener_t *listener, int fd)
+{
+    w_assert (listener);
+    w_assert (fd >= 0);
+
+    struct connection *connection = w_new (struct connection);
+    connection->listener = w_obj_ref (listener);
+    connection->fd = fd;
+
+    w_task_t *task = w_task_prepare (connection_task, connection, STACK_SIZE);
+    w_task_set_name (task, listener->name);
+}
+
+
+static void
+accept_task (void *data)
+{
+    listener_t *listener = data;
+
+    /*
+     * Created upfront: backing off is needed when there are no descriptors
+     * left, and then a timerfd could not be created. Rearming the ticker
+     * discards its pending ticks.
+     */
+    ticker_t *ticker = ticker_new (BACKOFF_MAX);
+    unsigned backoff = 0;
+
+    for (;;) {
+        struct sockaddr_storage addr;
+        socklen_t addr_length = sizeof (addr);
+        int fd = accept4 (listener->fd, (struct sockaddr*) &addr, &addr_length,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd >= 0) {
+            backoff = 0;
+            /*
+             * Refused before anything is allocated for them, so floods
+             * cost little more than the accept() itself.
+             */
+            if (admission_admit (fd, (struct sockaddr*) &addr, addr_length) == ADMISSION_OK)
+                listener_spawn (listener, fd);
+            else
+                close (fd);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            w_task_yield_io_read (listener->io);
+        } else if (errno == EMFILE || errno == ENFILE ||
+                   errno == ENOBUFS || errno == ENOMEM) {
+            /*
+             * Pending connections stay in the backlog until descriptors or
+             * memory are freed; retrying right away would spin.
+             */
+            if (!backoff) {
+                w_printerr ("$s: accept failed, pausing: $s\n",
+                            listener->name, strerror (errno));
+                backoff = BACKOFF_MIN;
+            } else if ((backoff *= 2) > BACKOFF_MAX) {
+                backoff = BACKOFF_MAX;
+            }
+            if (!ticker || !ticker_set_interval (ticker, backoff) || !ticker_wait (ticker))
+                w_task_yield ();
+        } else if (errno == EBADF || errno == EINVAL) {
+            w_printerr ("$s: accept failed: $s\n", listener->name, strerror (errno));
+            break;
+        }
+        /* Other errors, e.g. ECONNABORTED or EPROTO, are for one connection. */
+    }
+
+    if (ticker)
+        w_obj_unref (ticker);
+}
+
+
+void
+listener_start (listener_t *listener)
+{
+    w_assert (listener);
+
+    s_listeners = w_resize (s_listeners, listener_t*, s_n_listeners + 1);
+    s_listeners[s_n_listeners++] = w_obj_ref (listener);
+
+    w_task_t *task = w_task_prepare (accept_task, listener, STACK_SIZE);
+    w_task_set_name (task, listener->name);
+}
+
+
+unsigned
+listener_count (void)
+{
+    return s_n_listeners;
+}
+
+
+listener_t*
+listener_at (unsigned index)
+{
+    w_assert (index < s_n_listeners);
+    return s_listeners[index];
+}
@@ -0,0 +1,59 @@
+/*
+ * listener.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Accepts connections and runs a handler in a new task for each one.
+ * Unlike w_task_listener_t, the listening socket is available, which
+ * allows handing it over to another process.
+ */
+W_OBJ_DECL (listener_t);
+
+typedef void (*listener_handler_t) (listener_t*, w_io_t*);
+
+W_OBJ_DEF (listener_t)
+{
+    w_obj_t            parent;
+    char              *name;
+    int                fd;
+    w_io_t            *io;
+    listener_handler_t handler;
+    void              *userdata;
+    bool               tls;     /* Handshake with the configured certificate. */
+};
+
+
+/*
+ * Binds to an address of the form "tcp:port" or "tcp:host:port".
+ * Returns NULL and sets errno on failure.
+ */
+extern listener_t* listener_new (const char        *name,
+                                 const char        *address,
+                                 listener_handler_t handler,
+                                 void              *userdata);
+
+/* Uses an already listening socket, e.g. one inherited on upgrade. */
+extern listener_t* listener_new_fd (const char        *name,
+                                    int                fd,
+                                    listener_handler_t handler,
+                                    void              *userdata);
+
+/* Starts the task which accepts connections. */
+extern void listener_start (listener_t *listener);
+
+/* Runs the handler on an already accepted socket, in a new task. */
+extern void listener_spawn (listener_t *listener, int fd);
+
+/* Started listeners, for handing them over on upgrade. */
+extern unsigned listener_count (void);
+extern listener_t* listener_at (unsigned index);
+
+#endif /* !LISTENER_H */
@@ -0,0 +1,452 @@
+/*
+ * mask.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE /* memrchr() */
+#include "mask.h"
+#include "proto-irc.h"
+#include <stdint.h>
+
+
+struct mask {
+    char    *text;
+    char    *pattern;    /* Case-folded. */
+    size_t   length;
+    size_t   prefix;     /* Literal characters before the first wildcard. */
+    size_t   suffix;     /* Literal characters after the last wildcard. */
+    size_t   min_length; /* Characters other than "*". */
+    bool     wild;
+    bool     star;
+};
+
+
+static inline bool
+is_wild (char ch)
+{
+    return ch == '*' || ch == '?';
+}
+
+
+bool
+mask_is_wild (const char *str, size_t length)
+{
+    w_assert (str);
+
+    for (size_t i = 0; i < length; i++)
+        if (is_wild (str[i]))
+            return true;
+    return false;
+}
+
+
+mask_t*
+mask_new (const char *text, size_t length)
+{
+    w_assert (text);
+
+    mask_t *mask = w_new0 (mask_t);
+    mask->text = w_alloc (char, length + 1);
+    memcpy (mask->text, text, length);
+    mask->text[length] = '\0';
+
+    mask->pattern = w_alloc (char, length + 1);
+    irc_casefold (mask->pattern, text, length);
+    mask->pattern[length] = '\0';
+    mask->length = length;
+
+    while (mask->prefix < length && !is_wild (text[mask->prefix]))
+        mask->prefix++;
+    mask->wild = (mask->prefix < length);
+
+    if (mask->wild) {
+        while (mask->suffix < length && !is_wild (text[length - 1 - mask->suffix]))
+            mask->suffix++;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '*')
+            mask->star = true;
+        else
+            mask->min_length++;
+    }
+    return mask;
+}
+
+
+void
+mask_free (mask_t *mask)
+{
+    if (mask) {
+        w_free (mask->text);
+        w_free (mask->pattern);
+        w_free (mask);
+    }
+}
+
+
+const char*
+mask_text (const mask_t *mask)
+{
+    w_assert (mask);
+    return mask->text;
+}
+
+
+/* Matches folded "pat" against folded "str"; both may be empty. */
+static bool
+glob (const char *pat, size_t pat_length, const char *str, size_t length)
+{
+    size_t p = 0, s = 0, star = SIZE_MAX, star_s = 0;
+
+    while (s < length) {
+        if (p < pat_length && pat[p] == '*') {
+            star = ++p;
+            star_s = s;
+        } else if (p < pat_length && (pat[p] == '?' || pat[p] == str[s])) {
+            p++;
+            s++;
+        } else if (star != SIZE_MAX) {
+            p = star;
+            s = ++star_s;
+        } else {
+            return false;
+        }
+    }
+    while (p < pat_length && pat[p] == '*')
+        p++;
+    return p == pat_length;
+}
+
+
+bool
+mask_match_folded (const mask_t *mask, const char *str, size_t length)
+{
+    w_assert (mask);
+    w_assert (str);
+
+    if (length < mask->min_length || (!mask->star && length != mask->min_length))
+        return false;
+    if (!mask->wild)
+        return memcmp (mask->pattern, str, length) == 0;
+
+    if (memcmp (mask->pattern, str, mask->prefix) != 0)
+        return false;
+    if (memcmp (mask->pattern + mask->length - mask->suffix,
+                str + length - mask->suffix, mask->suffix) != 0)
+        return false;
+
+    return glob (mask->pattern + mask->prefix,
+                 mask->length - mask->prefix - mask->suffix,
+                 str + mask->prefix,
+                 length - mask->prefix - mask->suffix);
+}
+
+
+static size_t
+fold (char out[IRC_MAX_LINE], const char *str, size_t length)
+{
+    if (length >= IRC_MAX_LINE)
+        length = IRC_MAX_LINE - 1;
+    irc_casefold (out, str, length);
+    return length;
+}
+
+
+bool
+mask_match (const mask_t *mask, const char *str, size_t length)
+{
+    w_assert (mask);
+    w_assert (str);
+
+    char folded[IRC_MAX_LINE];
+    length = fold (folded, str, length);
+    return mask_match_folded (mask, folded, length);
+}
+
+
+struct bucket {
+    mask_t **masks;
+    unsigned n_masks;
+};
+
+
+W_OBJ_DEF (mask_set_t)
+{
+    w_obj_t        parent;
+
+    /* All masks, in the order they were added. */
+    mask_t       **masks;
+    unsigned       n_masks;
+
+    /*
+     * All masks are in the dictionary, keyed by their folded pattern:
+     * masks without wildcards are matched with a single lookup. Masks
+     * with wildcards also go in a bucket keyed by their first character
+     * if it is a literal, else by their last one, or with the rest if
+     * they start and end with a wildcard.
+     *
+     * Host bans, "*!*@host" and "*!*@*.domain", would all end up in a
+     * few "last" buckets. Instead, they are keyed by "host" and ".domain"
+     * and found with one lookup for the host, and one per dot in it.
+     */
+    w_dict_t      *patterns;
+    w_dict_t      *hosts;
+    w_dict_t      *domains;
+    struct bucket  first[256];
+    struct bucket  last[256];
+    struct bucket  other;
+};
+
+
+static const char k_host_prefix[] = "*!*@";
+#define HOST_PREFIX_LENGTH (sizeof (k_host_prefix) - 1)
+
+
+/*
+ * Returns the dictionary indexing a host ban, and its key, or NULL for
+ * other masks.
+ */
+static w_dict_t*
+host_index (const mask_set_t *set, const mask_t *mask, const char **key, size_t *length)
+{
+    if (mask->length <= HOST_PREFIX_LENGTH + 1 ||
+        memcmp (mask->pattern, k_host_prefix, HOST_PREFIX_LENGTH) != 0)
+        return NULL;
+
+    const char *host = mask->pattern + HOST_PREFIX_LENGTH;
+    size_t host_length = mask->length - HOST_PREFIX_LENGTH;
+    w_dict_t *dict = set->hosts;
+    if (host[0] == '*' && host[1] == '.') {
+        host++;
+        host_length--;
+        dict = set->domains;
+    }
+    if (mask_is_wild (host, host_length))
+        return NULL;
+
+    *key = host;
+    *length = host_length;
+    return dict;
+}
+
+
+static const mask_t*
+host_match (const mask_set_t *set, const char *str, size_t length)
+{
+    const char *at = memrchr (str, '@', length);
+    if (!at)
+        return NULL;
+
+    const char *host = at + 1;
+    const size_t host_length = str + length - host;
+    const mask_t *mask = w_dict_getn (set->hosts, host, host_length);
+    if (mask && mask_match_folded (mask, str, length))
+        return mask;
+
+    for (const char *dot = host; (dot = memchr (dot, '.', str + length - dot)); dot++) {
+        mask = w_dict_getn (set->domains, dot, str + length - dot);
+        if (mask && mask_match_folded (mask, str, length))
+            return mask;
+    }
+    return NULL;
+}
+
+
+static struct bucket*
+bucket_for (mask_set_t *set, const mask_t *mask)
+{
+    if (mask->prefix)
+        return &set->first[(unsigned char) mask->pattern[0]];
+    if (mask->suffix)
+        return &set->last[(unsigned char) mask->pattern[mask->length - 1]];
+    return &set->other;
+}
+
+
+static void
+bucket_add (struct bucket *bucket, mask_t *mask)
+{
+    bucket->masks = w_resize (bucket->masks, mask_t*, bucket->n_masks + 1);
+    bucket->masks[bucket->n_masks++] = mask;
+}
+
+
+static void
+bucket_del (struct bucket *bucket, const mask_t *mask)
+{
+    for (unsigned i = 0; i < bucket->n_masks; i++) {
+        if (bucket->masks[i] == mask) {
+            bucket->masks[i] = bucket->masks[--bucket->n_masks];
+            return;
+        }
+    }
+}
+
+
+static const mask_t*
+bucket_match (const struct bucket *bucket, const char *str, size_t length)
+{
+    for (unsigned i = 0; i < bucket->n_masks; i++)
+        if (mask_match_folded (bucket->masks[i], str, length))
+            return bucket->masks[i];
+    return NULL;
+}
+
+
+static void
+mask_set_destroy (void *obj)
+{
+    mask_set_t *set = obj;
+
+    for (unsigned i = 0; i < w_lengthof (set->first); i++) {
+        w_free (set->first[i].masks);
+        w_free (set->last[i].masks);
+    }
+    w_free (set->other.masks);
+
+    for (unsigned i = 0; i < set->n_masks; i++)
+        mask_free (set->masks[i]);
+    w_free (set->masks);
+    w_obj_unref (set->patterns);
+    w_obj_unref (set->hosts);
+    w_obj_unref (set->domains);
+}
+
+
+mask_set_t*
+mask_set_new (void)
+{
+    mask_set_t *set = w_obj_new (mask_set_t);
+    set->patterns = w_dict_new (false);
+    set->hosts = w_dict_new (false);
+    set->domains = w_dict_new (false);
+    return w_obj_dtor (set, mask_set_destroy);
+}
+
+
+static mask_t*
+find (const mask_set_t *set, const char *text, size_t length)
+{
+    char folded[IRC_MAX_LINE];
+    length = fold (folded, text, length);
+    return w_dict_getn (set->patterns, folded, length);
+}
+
+
+bool
+mask_set_add (mask_set_t *set, const char *text, size_t length)
+{
+    w_assert (set);
+    w_assert (text);
+
+    if (length >= IRC_MAX_LINE || find (set, text, length))
+        return false;
+
+    mask_t *mask = mask_new (text, length);
+    set->masks = w_resize (set->masks, mask_t*, set->n_masks + 1);
+    set->masks[set->n_masks++] = mask;
+
+    w_dict_setn (set->patterns, mask->pattern, mask->length, mask);
+
+    const char *key;
+    size_t key_length;
+    w_dict_t *index = host_index (set, mask, &key, &key_length);
+    if (index)
+        w_dict_setn (index, key, key_length, mask);
+    else if (mask->wild)
+        bucket_add (bucket_for (set, mask), mask);
+    return true;
+}
+
+
+bool
+mask_set_del (mask_set_t *set, const char *text, size_t length)
+{
+    w_assert (set);
+    w_assert (text);
+
+    mask_t *mask = find (set, text, length);
+    if (!mask)
+        return false;
+
+    w_dict_deln (set->patterns, mask->pattern, mask->length);
+
+    const char *key;
+    size_t key_length;
+    w_dict_t *index = host_index (set, mask, &key, &key_length);
+    if (index)
+        w_dict_deln (index, key, key_length);
+    else if (mask->wild)
+        bucket_del (bucket_for (set, mask), mask);
+
+    /* Keeps the order, for listing. */
+    for (unsigned i = 0; i < set->n_masks; i++) {
+        if (set->masks[i] == mask) {
+            memmove (&set->masks[i], &set->masks[i + 1],
+                     sizeof (mask_t*) * (set->n_masks - i - 1));
+            set->n_masks--;
+            break;
+        }
+    }
+    mask_free (mask);
+    return true;
+}
+
+
+unsigned
+mask_set_count (const mask_set_t *set)
+{
+    w_assert (set);
+    return set->n_masks;
+}
+
+
+const mask_t*
+mask_set_at (const mask_set_t *set, unsigned index)
+{
+    w_assert (set);
+    w_assert (index < set->n_masks);
+    return set->masks[index];
+}
+
+
+const mask_t*
+mask_set_match (const mask_set_t *set, const char *str, size_t length)
+{
+    w_assert (set);
+    w_assert (str);
+
+    if (!set->n_masks)
+        return NULL;
+
+    /* Folded once for all the masks. */
+    char folded[IRC_MAX_LINE];
+    length = fold (folded, str, length);
+    return mask_set_match_folded (set, folded, length);
+}
+
+
+const mask_t*
+mask_set_match_folded (const mask_set_t *set, const char *folded, size_t length)
+{
+    w_assert (set);
+    w_assert (folded);
+
+    if (!set->n_masks)
+        return NULL;
+
+    /* A pattern always matches itself, whether it has wildcards or not. */
+    const mask_t *mask = w_dict_getn (set->patterns, folded, length);
+    if (!mask)
+        mask = host_match (set, folded, length);
+    if (!mask && length)
+        mask = bucket_match (&set->first[(unsigned char) folded[0]], folded, length);
+    if (!mask && length)
+        mask = bucket_match (&set->last[(unsigned char) folded[length - 1]], folded, length);
+    if (!mask)
+        mask = bucket_match (&set->other, folded, length);
+    return mask;
+}
@@ -0,0 +1,64 @@
+/*
+ * mask.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef MASK_H
+#define MASK_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Wildcard masks ("*" matches any run of characters, "?" any single one)
+ * compiled once, and compared using RFC1459 case folding. The literal
+ * prefix and suffix of a mask are checked with plain comparisons before
+ * falling back to wildcard matching for the part in between.
+ */
+typedef struct mask mask_t;
+
+extern mask_t* mask_new (const char *text, size_t length);
+extern void mask_free (mask_t *mask);
+
+/* The mask as it was given, NUL-terminated. */
+extern const char* mask_text (const mask_t *mask);
+
+extern bool mask_match (const mask_t *mask, const char *str, size_t length);
+
+/* Same as mask_match(), for an already case-folded string (see atom_t). */
+extern bool mask_match_folded (const mask_t *mask,
+                               const char   *str,
+                               size_t        length);
+
+/* Whether the string has wildcards, i.e. it is a mask and not a name. */
+extern bool mask_is_wild (const char *str, size_t length);
+
+
+/*
+ * Sets of masks (e.g. a ban list) are matched all at once: masks are
+ * indexed by their literal parts, and only those which can possibly
+ * match a string are checked, so thousands of them are cheap. Host bans
+ * ("*!*@host", "*!*@*.domain") are found by the host of the string.
+ */
+W_OBJ_DECL (mask_set_t);
+
+extern mask_set_t* mask_set_new (void);
+
+/* Returns false if an equivalent mask is already in the set. */
+extern bool mask_set_add (mask_set_t *set, const char *text, size_t length);
+extern bool mask_set_del (mask_set_t *set, const char *text, size_t length);
+
+extern unsigned mask_set_count (const mask_set_t *set);
+extern const mask_t* mask_set_at (const mask_set_t *set, unsigned index);
+
+/* Returns the first mask found matching the string, or NULL. */
+extern const mask_t* mask_set_match (const mask_set_t *set,
+                                     const char       *str,
+                                     size_t            length);
+
+extern const mask_t* mask_set_match_folded (const mask_set_t *set,
+                                            const char       *folded,
+                                            size_t            length);
+
+#endif /* !MASK_H */
@@ -0,0 +1,467 @@
+/*
+ * offline.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "offline.h"
+#include "proto-irc.h"
+#include "ticker.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <limits.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+
+enum {
+    RECIPIENT_MAX = 64,
+    COMPACT_BATCH = 32,   /* Removals between yields. */
+};
+
+static const char k_magic[8] = { 'C', 'H', 'O', 'F', 'F', 'L', 'N', '1' };
+static const char k_pending[] = ".off";
+static const char k_done[] = ".done";
+
+
+struct mailbox_header {
+    char     magic[8];
+};
+
+/*
+ * Records are the header followed by the line, padded to a multiple of
+ * four. As in the journal, a record which does not check out marks the
+ * end of the mailbox, which is truncated there when the store is opened.
+ */
+struct record_header {
+    uint32_t length;
+    uint32_t checksum;
+    uint32_t time;
+    uint32_t line_length;
+};
+
+struct mailbox {
+    size_t   used;
+    unsigned count;
+};
+
+
+static char       *s_path = NULL;
+static w_dict_t   *s_mailboxes = NULL;   /* Folded recipient to mailbox. */
+static char      **s_done = NULL;        /* Paths of delivered mailboxes. */
+static unsigned    s_n_done = 0;
+static ticker_t   *s_ticker = NULL;
+static size_t      s_quota = CHATEAU_OFFLINE_QUOTA;
+static offline_stats_t s_stats = { 0, };
+
+
+static inline size_t
+record_size (size_t line_length)
+{
+    return (sizeof (struct record_header) + line_length + 3) & ~((size_t) 3);
+}
+
+
+static uint32_t
+checksum (const char *data, size_t length)
+{
+    uint32_t hash = 2166136261U;  /* FNV-1a */
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t) data[i]) * 16777619U;
+    return hash;
+}
+
+
+static bool
+fold_key (char key[RECIPIENT_MAX + 1], const char *recipient, size_t length)
+{
+    if (length == 0 || length > RECIPIENT_MAX)
+        return false;
+    irc_casefold (key, recipient, length);
+    key[length] = '\0';
+    return true;
+}
+
+
+/* File names are the folded recipient in hex, nicks may have any byte. */
+static void
+mailbox_path (char *path, size_t size, const char *key, const char *suffix)
+{
+    int n = snprintf (path, size, "%s/", s_path);
+    for (; *key && n + 3 < (int) size; key++)
+        n += snprintf (path + n, size - n, "%02x", (uint8_t) *key);
+    snprintf (path + n, size - n, "%s", suffix);
+}
+
+
+static bool
+parse_name (const char *name, char key[RECIPIENT_MAX + 1])
+{
+    const char *dot = strchr (name, '.');
+    const size_t length = dot ? (size_t) (dot - name) : 0;
+    if (length == 0 || length % 2 || length / 2 > RECIPIENT_MAX)
+        return false;
+
+    for (size_t i = 0; i < length; i += 2) {
+        unsigned byte;
+        if (!isxdigit ((uint8_t) name[i]) || !isxdigit ((uint8_t) name[i + 1]) ||
+            sscanf (name + i, "%2x", &byte) != 1 || byte == 0)
+            return false;
+        key[i / 2] = (char) byte;
+    }
+    key[length / 2] = '\0';
+    return true;
+}
+
+
+static size_t
+check_record (const char *map, size_t offset, size_t size)
+{
+    if (offset + sizeof (struct record_header) > size)
+        return 0;
+
+    const struct record_header *header =
+        (const struct record_header*) (map + offset);
+    if (header->length != record_size (header->line_length) ||
+        offset + header->length > size ||
+        header->checksum != checksum ((const char*) (header + 1), header->line_length))
+        return 0;
+    return header->length;
+}
+
+
+/* Indexes an existing mailbox, dropping any torn record at its end. */
+static void
+load_mailbox (const char *name, const char *key)
+{
+    char path[PATH_MAX];
+    snprintf (path, sizeof (path), "%s/%s", s_path, name);
+
+    int fd = open (path, O_RDWR | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat (fd, &st) != 0) {
+        w_printerr ("offline: Skipping $s: $s\n", name, strerror (errno));
+        if (fd >= 0)
+            close (fd);
+        return;
+    }
+
+    const size_t size = st.st_size;
+    char *map = (size < sizeof (struct mailbox_header)) ? MAP_FAILED
+              : mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED ||
+        memcmp (((const struct mailbox_header*) map)->magic, k_magic, sizeof (k_magic)) != 0) {
+        w_printerr ("offline: Skipping $s: invalid mailbox\n", name);
+        if (map != MAP_FAILED)
+            munmap (map, size);
+        close (fd);
+        return;
+    }
+
+    struct mailbox *mailbox = w_new0 (struct mailbox);
+    size_t offset = sizeof (struct mailbox_header);
+    for (size_t length; (length = check_record (map, offset, size)); offset += length)
+        mailbox->count++;
+    mailbox->used = offset;
+    munmap (map, size);
+
+    if (offset < size && ftruncate (fd, offset) != 0)
+        w_printerr ("offline: Cannot truncate $s: $s\n", name, strerror (errno));
+    close (fd);
+
+    if (!mailbox->count) {
+        unlink (path);
+        w_free (mailbox);
+        return;
+    }
+    w_dict_set (s_mailboxes, key, mailbox);
+    s_stats.mailboxes++;
+    s_stats.bytes += mailbox->used - sizeof (struct mailbox_header);
+}
+
+
+static void
+queue_done (const char *path)
+{
+    s_done = w_resize (s_done, char*, s_n_done + 1);
+    s_done[s_n_done++] = w_str_dup (path);
+}
+
+
+/*
+ * Removes delivered mailboxes. Unlinking may have to free many blocks,
+ * so it is done here in batches, instead of while delivering.
+ */
+static void
+compact (bool yield)
+{
+    /* Mailboxes delivered while yielding are removed in this pass too. */
+    for (unsigned i = 0; i < s_n_done; i++) {
+        unlink (s_done[i]);
+        w_free (s_done[i]);
+        if (yield && (i + 1) % COMPACT_BATCH == 0)
+            w_task_yield ();
+    }
+    s_n_done = 0;
+}
+
+
+static void
+compact_task (void *data)
+{
+    w_unused (data);
+
+    while (s_ticker && ticker_wait (s_ticker))
+        if (s_n_done)
+            compact (true);
+}
+
+
+bool
+offline_open (const char *path)
+{
+    w_assert (path);
+    w_assert (!s_path);
+
+    if (mkdir (path, 0750) != 0 && errno != EEXIST)
+        return false;
+
+    DIR *dir = opendir (path);
+    if (!dir)
+        return false;
+
+    s_path = w_str_dup (path);
+    s_mailboxes = w_dict_new (false);
+
+    for (struct dirent *entry; (entry = readdir (dir));) {
+        char key[RECIPIENT_MAX + 1];
+        const char *suffix = strchr (entry->d_name, '.');
+        if (!suffix || !parse_name (entry->d_name, key))
+            continue;
+
+        if (strcmp (suffix, k_pending) == 0) {
+            load_mailbox (entry->d_name, key);
+        } else if (strcmp (suffix, k_done) == 0) {
+            char done[PATH_MAX];
+            snprintf (done, sizeof (done), "%s/%s", s_path, entry->d_name);
+            queue_done (done);
+        }
+    }
+    closedir (dir);
+
+    if (!(s_ticker = ticker_new (CHATEAU_OFFLINE_COMPACT_INTERVAL))) {
+        offline_close ();
+        return false;
+    }
+
+    w_task_t *task = w_task_prepare (compact_task, NULL, 16384);
+    w_task_set_name (task, "offline");
+    w_task_set_is_system (task, true);
+    return true;
+}
+
+
+void
+offline_close (void)
+{
+    if (s_ticker) {
+        w_obj_unref (s_ticker);
+        s_ticker = NULL;
+    }
+    compact (false);
+    w_free (s_done);
+
+    if (s_mailboxes) {
+        w_dict_foreach (s_mailboxes, i)
+            w_free (*i);
+        w_obj_unref (s_mailboxes);
+        s_mailboxes = NULL;
+    }
+    w_free (s_path);
+}
+
+
+bool
+offline_is_open (void)
+{
+    return s_path != NULL;
+}
+
+
+void
+offline_set_quota (size_t bytes)
+{
+    s_quota = bytes;
+}
+
+
+bool
+offline_store (const char *recipient,
+               size_t      recipient_length,
+               const char *line,
+               size_t      line_length)
+{
+    w_assert (recipient);
+    w_assert (line);
+
+    char key[RECIPIENT_MAX + 1];
+    if (!s_path || !fold_key (key, recipient, recipient_length))
+        return false;
+
+    struct mailbox *mailbox = w_dict_get (s_mailboxes, key);
+    const size_t used = mailbox ? mailbox->used : sizeof (struct mailbox_header);
+    const size_t length = record_size (line_length);
+    if (used - sizeof (struct mailbox_header) + length > s_quota) {
+        s_stats.rejected++;
+        return false;
+    }
+
+    char path[PATH_MAX];
+    mailbox_path (path, sizeof (path), key, k_pending);
+    int fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    if (fd < 0 || ftruncate (fd, used + length) != 0) {
+        w_printerr ("offline: Cannot write $s: $s\n", path, strerror (errno));
+        if (fd >= 0)
+            close (fd);
+        s_stats.rejected++;
+        return false;
+    }
+
+    /* Only the pages being written are mapped. */
+    static size_t page_size = 0;
+    if (!page_size)
+        page_size = sysconf (_SC_PAGESIZE);
+    const size_t start = mailbox ? used & ~(page_size - 1) : 0;
+
+    char *map = mmap (NULL, used + length - start, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, start);
+    close (fd);
+    if (map == MAP_FAILED) {
+        w_printerr ("offline: Cannot map $s: $s\n", path, strerror (errno));
+        s_stats.rejected++;
+        return false;
+    }
+
+    if (!mailbox)
+        memcpy (((struct mailbox_header*) map)->magic, k_magic, sizeof (k_magic));
+
+    struct record_header *header = (struct record_header*) (map + used - start);
+    memcpy (header + 1, line, line_length);
+    *header = (struct record_header) {
+        .length      = length,
+        .checksum    = checksum (line, line_length),
+        .time        = (uint32_t) time (NULL),
+        .line_length = line_length,
+    };
+    munmap (map, used + length - start);
+
+    if (!mailbox) {
+        mailbox = w_new0 (struct mailbox);
+        mailbox->used = used;
+        w_dict_set (s_mailboxes, key, mailbox);
+        s_stats.mailboxes++;
+    }
+    mailbox->used += length;
+    mailbox->count++;
+    s_stats.bytes += length;
+    s_stats.stored++;
+    return true;
+}
+
+
+unsigned
+offline_fetch (const char *recipient,
+               size_t      recipient_length,
+               bool        with_time,
+               w_buf_t    *out)
+{
+    w_assert (recipient);
+    w_assert (out);
+
+    char key[RECIPIENT_MAX + 1];
+    if (!s_path || !fold_key (key, recipient, recipient_length))
+        return 0;
+
+    const struct mailbox *mailbox = w_dict_get (s_mailboxes, key);
+    if (!mailbox)
+        return 0;
+
+    char path[PATH_MAX];
+    mailbox_path (path, sizeof (path), key, k_pending);
+    int fd = open (path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        w_printerr ("offline: Cannot read $s: $s\n", path, strerror (errno));
+        return 0;
+    }
+
+    /* Read in one go; the records are then walked in memory. */
+    char *map = mmap (NULL, mailbox->used, PROT_READ,
+                      MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close (fd);
+    if (map == MAP_FAILED) {
+        w_printerr ("offline: Cannot map $s: $s\n", path, strerror (errno));
+        return 0;
+    }
+
+    unsigned count = 0;
+    size_t offset = sizeof (struct mailbox_header);
+    for (size_t length; (length = check_record (map, offset, mailbox->used)); offset += length) {
+        const struct record_header *header =
+            (const struct record_header*) (map + offset);
+        if (with_time) {
+            const struct timespec when = { .tv_sec = header->time };
+            w_buf_append_str (out, "@time=");
+            irc_tag_time (out, &when);
+            w_buf_append_char (out, ' ');
+        }
+        w_buf_append_mem (out, header + 1, header->line_length);
+        count++;
+    }
+    munmap (map, mailbox->used);
+    return count;
+}
+
+
+void
+offline_delivered (const char *recipient, size_t recipient_length)
+{
+    w_assert (recipient);
+
+    char key[RECIPIENT_MAX + 1];
+    if (!s_path || !fold_key (key, recipient, recipient_length))
+        return;
+
+    struct mailbox *mailbox = w_dict_get (s_mailboxes, key);
+    if (!mailbox)
+        return;
+
+    char path[PATH_MAX], done[PATH_MAX];
+    mailbox_path (path, sizeof (path), key, k_pending);
+    mailbox_path (done, sizeof (done), key, k_done);
+    if (rename (path, done) != 0) {
+        w_printerr ("offline: Cannot rename $s: $s\n", path, strerror (errno));
+        return;
+    }
+    queue_done (done);
+
+    s_stats.mailboxes--;
+    s_stats.bytes -= mailbox->used - sizeof (struct mailbox_header);
+    s_stats.delivered += mailbox->count;
+    w_dict_del (s_mailboxes, key);
+    w_free (mailbox);
+}
+
+
+void
+offline_get_stats (offline_stats_t *stats)
+{
+    w_assert (stats);
+    *stats = s_stats;
+}
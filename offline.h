@@ -0,0 +1,77 @@
+/*
+ * offline.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef OFFLINE_H
+#define OFFLINE_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Messages kept for users who are not connected. Each recipient has an
+ * append-only mailbox file, written and read through memory mappings;
+ * only the size and message count of each mailbox are kept in memory.
+ * Messages are stored as the lines sent on delivery, so delivering them
+ * is one pass over the mapping which fills a single write.
+ *
+ * Delivered mailboxes are renamed at once, inline, so they are never
+ * delivered twice. They are unlinked later by a cooperative system task
+ * on the scheduler thread, in batches between yields.
+ */
+
+#ifndef CHATEAU_OFFLINE_QUOTA
+#define CHATEAU_OFFLINE_QUOTA (64 * 1024) /* bytes per recipient */
+#endif /* !CHATEAU_OFFLINE_QUOTA */
+
+#ifndef CHATEAU_OFFLINE_COMPACT_INTERVAL
+#define CHATEAU_OFFLINE_COMPACT_INTERVAL 5000 /* ms */
+#endif /* !CHATEAU_OFFLINE_COMPACT_INTERVAL */
+
+
+/*
+ * Opens the store in the given directory, creating it if needed, and
+ * starts the task which removes delivered mailboxes. Returns false and
+ * sets errno on failure.
+ */
+extern bool offline_open (const char *path);
+extern void offline_close (void);
+extern bool offline_is_open (void);
+
+extern void offline_set_quota (size_t bytes);
+
+/*
+ * Stores a complete line, CRLF included, for the recipient. Returns
+ * false if the store is not open, the mailbox would go over the quota,
+ * or the mailbox cannot be written.
+ */
+extern bool offline_store (const char *recipient,
+                           size_t      recipient_length,
+                           const char *line,
+                           size_t      line_length);
+
+/*
+ * Appends the stored lines for the recipient to "out", prefixed with
+ * their "server-time" tag if "with_time" is set. Returns the amount of
+ * messages; they are kept until offline_delivered() is called.
+ */
+extern unsigned offline_fetch (const char *recipient,
+                               size_t      recipient_length,
+                               bool        with_time,
+                               w_buf_t    *out);
+
+extern void offline_delivered (const char *recipient, size_t recipient_length);
+
+typedef struct {
+    unsigned      mailboxes;
+    size_t        bytes;
+    unsigned long stored;
+    unsigned long delivered;
+    unsigned long rejected;
+} offline_stats_t;
+
+extern void offline_get_stats (offline_stats_t *stats);
+
+#endif /* !OFFLINE_H */
@@ -6,6 +6,7 @@
  */
 
 #include "proto-irc.h"
+#include <stdio.h>
 
 enum {
     CR    = 0x0D, /* '\r' */
@@ -14,6 +15,8 @@ enum {
     COLON = ':',
     BANG  = '!',
     AT    = '@',
+    SEMI  = ';',
+    EQUAL = '=',
 
     /* Pseudo-characters */
     CRLF  = 256,
@@ -91,6 +94,84 @@ matchchar (P, int ch, const char *errmsg, S)
 }
 
 
+/*
+ * Splits "tags_text" once it is complete, so the slices do not move when
+ * the buffer grows. Tags past IRC_MAX_TAGS are dropped.
+ */
+static void
+split_tags (irc_message_t *msg)
+{
+    const char *item = w_buf_data (&msg->tags_text);
+    const char *end = item + w_buf_size (&msg->tags_text);
+
+    while (item < end && msg->n_tags < IRC_MAX_TAGS) {
+        const char *semi = memchr (item, SEMI, end - item);
+        if (!semi)
+            semi = end;
+        const char *equal = memchr (item, EQUAL, semi - item);
+        const char *key_end = equal ? equal : semi;
+        if (key_end > item) {
+            irc_tag_t *tag = &msg->tags[msg->n_tags++];
+            tag->key = (w_buf_t) { .data = (char*) item, .size = key_end - item };
+            tag->value = equal
+                ? (w_buf_t) { .data = (char*) equal + 1, .size = semi - equal - 1 }
+                : (w_buf_t) { .data = NULL, .size = 0 };
+        }
+        item = semi + 1;
+    }
+}
+
+
+static inline bool
+is_tag_key_char (int ch)
+{
+    return (ch >= 'A' && ch <= 'Z')
+        || (ch >= 'a' && ch <= 'z')
+        || (ch >= '0' && ch <= '9')
+        || ch == '-' || ch == '/' || ch == '.' || ch == '+';
+}
+
+
+/*
+ * <tags>  ::= '@' <tag> [';' <tag>]*
+ * <tag>   ::= <key> ['=' <escaped value>]
+ *
+ * Values are validated and stored escaped; unescaping is left to whoever
+ * needs a value. The whole section is bounded by IRC_MAX_TAGS_LENGTH.
+ */
+static void
+parse_tags (P, S)
+{
+    matchchar (p, AT, "Malformed tags", CHECK_OK);
+
+    size_t length = 1;
+    bool in_value = false;
+    while (p->look != SPACE && p->look != CRLF) {
+        if (++length > IRC_MAX_TAGS_LENGTH) {
+            p->error = "Tags too long";
+            *status = kStatusError;
+            return;
+        }
+        if (p->look == SEMI) {
+            in_value = false;
+        } else if (p->look == EQUAL && !in_value) {
+            in_value = true;
+        } else if (!in_value && !is_tag_key_char (p->look)) {
+            p->error = "Invalid tag key";
+            *status = kStatusError;
+            return;
+        } else if (p->look == '\0' || p->look == CR || p->look == LF) {
+            p->error = "Invalid tag value";
+            *status = kStatusError;
+            return;
+        }
+        w_buf_append_char (&p->msg->tags_text, p->look);
+        nextchar (p, CHECK_OK);
+    }
+    split_tags (p->msg);
+}
+
+
 /*
  * <prefix> ::= <servername> | <nick> ['!' user ] ['@' host ]
  */
@@ -163,10 +244,18 @@ parse_command (P, S)
     goto read_command_rest
 
     switch (p->look) {
-        case 'A': /* A{DMIN,WAY} */
+        case 'A': /* A{DMIN,UTHENTICATE,WAY} */
             SAVECHAR ();
             switch (p->look) {
+                case 'U': /* AUTHENTICATE */
+                    SAVECHAR ();
+                    MATCHSAVE ('T'); MATCHSAVE ('H'); MATCHSAVE ('E');
+                    MATCHSAVE ('N'); MATCHSAVE ('T'); MATCHSAVE ('I');
+                    MATCHSAVE ('C'); MATCHSAVE ('A'); MATCHSAVE ('T');
+                    MATCHSAVE ('E');
+                    RETCMD (AUTHENTICATE);
                 case 'D': /* ADMIN */
+                    SAVECHAR ();
                     MATCHSAVE ('M'); MATCHSAVE ('I'); MATCHSAVE ('N');
                     RETCMD (ADMIN);
                 case 'W': /* AWAY */
@@ -175,11 +264,20 @@ parse_command (P, S)
             }
             goto read_command_rest;
 
-        case 'C': /* CONNECT */
+        case 'C': /* C{AP,ONNECT} */
             SAVECHAR ();
-            MATCHSAVE ('O'); MATCHSAVE ('N'); MATCHSAVE ('N');
-            MATCHSAVE ('E'); MATCHSAVE ('C'); MATCHSAVE ('T');
-            RETCMD (CONNECT);
+            switch (p->look) {
+                case 'A': /* CAP */
+                    SAVECHAR ();
+                    MATCHSAVE ('P');
+                    RETCMD (CAP);
+                case 'O': /* CONNECT */
+                    SAVECHAR ();
+                    MATCHSAVE ('N'); MATCHSAVE ('N');
+                    MATCHSAVE ('E'); MATCHSAVE ('C'); MATCHSAVE ('T');
+                    RETCMD (CONNECT);
+            }
+            goto read_command_rest;
 
         case 'E': /* ERROR */
             SAVECHAR ();
@@ -244,10 +342,20 @@ parse_command (P, S)
             }
             goto read_command_rest;
 
-        case 'M': /* MODE */
+        case 'M': /* MO{DE,TD} */
             SAVECHAR ();
-            MATCHSAVE ('O'); MATCHSAVE ('D'); MATCHSAVE ('E');
-            RETCMD (MODE);
+            MATCHSAVE ('O');
+            switch (p->look) {
+                case 'D': /* MODE */
+                    SAVECHAR ();
+                    MATCHSAVE ('E');
+                    RETCMD (MODE);
+                case 'T': /* MOTD */
+                    SAVECHAR ();
+                    MATCHSAVE ('D');
+                    RETCMD (MOTD);
+            }
+            goto read_command_rest;
 
         case 'N': /* N{AMES,ICK,OTICE} */
             SAVECHAR ();
@@ -475,12 +583,17 @@ parse_param (P, S)
 
 
 /*
- * <message> ::= [':' <prefix> <SPACE> ] <command> <params> <crlf>
+ * <message> ::= ['@' <tags> <SPACE> ] [':' <prefix> <SPACE> ] <command> <params> <crlf>
  */
 static inline void
 parse_message (P, S)
 {
     nextchar (p, CHECK_OK);
+    if (p->look == AT) {
+        parse_tags (p, CHECK_OK);
+        matchchar (p, SPACE, "Space expected", CHECK_OK);
+        skipspace (p, CHECK_OK);
+    }
     if (p->look == COLON) {
         parse_prefix (p, CHECK_OK);
         matchchar (p, SPACE, "Space expected", CHECK_OK);
@@ -519,3 +632,64 @@ irc_message_parse (irc_message_t *msg, w_io_t *input)
             return false;
     }
 }
+
+
+const irc_tag_t*
+irc_message_tag (const irc_message_t *msg, const char *key)
+{
+    w_assert (msg);
+    w_assert (key);
+
+    const size_t length = strlen (key);
+    for (uint8_t i = 0; i < msg->n_tags; i++) {
+        const irc_tag_t *tag = &msg->tags[i];
+        if (w_buf_size (&tag->key) == length &&
+            memcmp (w_buf_data (&tag->key), key, length) == 0)
+            return tag;
+    }
+    return NULL;
+}
+
+
+void
+irc_tag_unescape (const irc_tag_t *tag, w_buf_t *out)
+{
+    w_assert (tag);
+    w_assert (out);
+
+    const char *value = w_buf_data (&tag->value);
+    const size_t length = w_buf_size (&tag->value);
+
+    for (size_t i = 0; i < length; i++) {
+        if (value[i] != '\\') {
+            w_buf_append_char (out, value[i]);
+            continue;
+        }
+        /* A trailing backslash is dropped. */
+        if (++i == length)
+            break;
+        switch (value[i]) {
+            case ':': w_buf_append_char (out, SEMI);  break;
+            case 's': w_buf_append_char (out, SPACE); break;
+            case 'r': w_buf_append_char (out, CR);    break;
+            case 'n': w_buf_append_char (out, LF);    break;
+            default:  w_buf_append_char (out, value[i]);
+        }
+    }
+}
+
+
+void
+irc_tag_time (w_buf_t *out, const struct timespec *when)
+{
+    w_assert (out);
+    w_assert (when);
+
+    struct tm tm;
+    char text[32];
+    gmtime_r (&when->tv_sec, &tm);
+    size_t length = strftime (text, sizeof (text), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf (text + length, sizeof (text) - length, ".%03uZ",
+              (unsigned) (when->tv_nsec / 1000000));
+    w_buf_append_str (out, text);
+}
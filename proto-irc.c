@@ -6,7 +6,23 @@
  */
 
 #include "proto-irc.h"
+#include "proto-xmpp.h"
 #include "auth.h"
+#include "channel.h"
+#include "journal.h"
+#include "link.h"
+#include "config.h"
+#include "listener.h"
+#include "upgrade.h"
+#include "query.h"
+#include "governor.h"
+#include "capture.h"
+#include "admission.h"
+#include "offline.h"
+#include "document.h"
+#include "hibernate.h"
+#include <sys/socket.h>
+#include <stdio.h>
 
 
 enum {
@@ -42,9 +58,9 @@ check_nparams (const irc_message_t *msg)
 
 
 static w_io_result_t
-send_error (w_task_listener_t *listener,
-            w_io_t            *socket,
-            irc_rpl_t          code,
+send_error (listener_t *listener,
+            client_t   *client,
+            irc_rpl_t   code,
             ...)
 {
     va_list args;
@@ -58,36 +74,810 @@ send_error (w_task_listener_t *listener,
     w_assert (got_info); /* TODO: Signal server error here. */
     w_unused (got_info);
 
-    w_io_result_t r = W_IO_RESULT (0);
-
-    /* TODO: Sender prefix, target */
-    W_IO_CHAIN (r, w_io_format (socket, ":* $I * ", (unsigned) code));
-    W_IO_CHAIN (r, w_io_formatv (socket, format, args));
-    W_IO_CHAIN (r, w_io_putchar (socket, CR));
-    W_IO_CHAIN (r, w_io_putchar (socket, LF));
-    W_IO_CHAIN (r, w_io_flush (socket));
+    /* Rendered first, so that the governor accounts the whole line. */
+    w_buf_t line = W_BUF;
+    w_io_buf_t io;
+    w_io_buf_init (&io, &line, true);
 
+    /* Numerics are always three digits, e.g. "001" for RPL_WELCOME. */
+    char code_text[4];
+    snprintf (code_text, sizeof (code_text), "%03u", (unsigned) code);
+    W_IO_NORESULT (w_io_format ((w_io_t*) &io, ":$s $s $s ", link_server_name (),
+                                code_text, client_nick (client)));
+    W_IO_NORESULT (w_io_formatv ((w_io_t*) &io, format, args));
+    w_buf_append_mem (&line, "\r\n", 2);
     va_end (args);
+
+    w_io_result_t r = client_send (client, w_buf_data (&line), w_buf_size (&line));
+    w_buf_clear (&line);
+    return r;
 }
 
 
-void
-proto_irc_handler (w_task_listener_t *listener, w_io_t *socket)
+/*
+ * Calls "func" for each item of a comma-separated list, e.g. the list
+ * of targets given to JOIN, PART, or PRIVMSG.
+ */
+static void
+foreach_target (const w_buf_t *list,
+                void (*func) (const char*, size_t, void*),
+                void *userdata)
 {
-    w_printerr ("$s: Client connected\n", w_task_name ());
+    const char *item = w_buf_data (list);
+    const char *end = item + w_buf_size (list);
+
+    while (item < end) {
+        const char *comma = memchr (item, ',', end - item);
+        size_t length = (comma ? comma : end) - item;
+        if (length > 0) {
+            /* Longer items cannot be valid names, and are truncated. */
+            char name[IRC_MAX_LINE];
+            const size_t copied = length < IRC_MAX_LINE ? length : IRC_MAX_LINE - 1;
+            memcpy (name, item, copied);
+            name[copied] = '\0';
+            (*func) (name, copied, userdata);
+        }
+        item += length + 1;
+    }
+}
+
+
+struct handler_ctx {
+    listener_t          *listener;
+    client_t            *client;
+    const irc_message_t *message;
+    const w_buf_t       *tags;     /* Indexed by capabilities. */
+    const config_t      *config;
+};
+
+
+/*
+ * Renders the tag section of a relayed message for each combination of
+ * capabilities: client-only tags ("+" prefix) go to clients which enabled
+ * "message-tags", and the time the server got the message to those which
+ * enabled "server-time". Others get no tags at all.
+ */
+static void
+render_tags (w_buf_t tags[CLIENT_CAP_TAG_VARIANTS], const irc_message_t *message)
+{
+    w_buf_t client_tags = W_BUF;
+    for (uint8_t i = 0; i < message->n_tags; i++) {
+        const irc_tag_t *tag = &message->tags[i];
+        if (w_buf_data (&tag->key)[0] != '+')
+            continue;
+        if (w_buf_size (&client_tags))
+            w_buf_append_char (&client_tags, ';');
+        w_buf_append_buf (&client_tags, &tag->key);
+        if (w_buf_size (&tag->value)) {
+            w_buf_append_char (&client_tags, '=');
+            w_buf_append_buf (&client_tags, &tag->value);
+        }
+    }
+
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
+    w_buf_t time_tag = W_BUF;
+    w_buf_append_str (&time_tag, "time=");
+    irc_tag_time (&time_tag, &now);
+
+    for (unsigned caps = 0; caps < CLIENT_CAP_TAG_VARIANTS; caps++) {
+        const bool with_time = (caps & CLIENT_CAP_SERVER_TIME);
+        const bool with_client = (caps & CLIENT_CAP_MESSAGE_TAGS) &&
+                                 w_buf_size (&client_tags);
+        tags[caps] = W_BUF;
+        if (!with_time && !with_client)
+            continue;
+
+        w_buf_append_char (&tags[caps], '@');
+        if (with_time)
+            w_buf_append_buf (&tags[caps], &time_tag);
+        if (with_time && with_client)
+            w_buf_append_char (&tags[caps], ';');
+        if (with_client)
+            w_buf_append_buf (&tags[caps], &client_tags);
+        w_buf_append_char (&tags[caps], ' ');
+    }
+
+    w_buf_clear (&time_tag);
+    w_buf_clear (&client_tags);
+}
+
+
+static void
+clear_tags (w_buf_t tags[CLIENT_CAP_TAG_VARIANTS])
+{
+    for (unsigned caps = 0; caps < CLIENT_CAP_TAG_VARIANTS; caps++)
+        w_buf_clear (&tags[caps]);
+}
+
+
+static void
+send_to_channel_members (channel_t  *channel,
+                         client_t   *client,
+                         const char *command,
+                         const char *trailing)
+{
+    w_buf_t line = W_BUF;
+    w_buf_format (&line, ":$s $s $s", atom_str (client->nick), command,
+                  atom_str (channel->name));
+    if (trailing) {
+        w_buf_append_str (&line, " :");
+        w_buf_append_str (&line, trailing);
+    }
+    w_buf_append_str (&line, "\r\n");
+
+    /* Membership changes go to every server, not just the interested ones. */
+    channel_send_local (channel, NULL, w_buf_data (&line), w_buf_size (&line));
+    link_broadcast (NULL, w_buf_data (&line), w_buf_size (&line));
+    w_buf_clear (&line);
+}
+
+
+static void
+handle_join_target (const char *name, size_t length, void *userdata)
+{
+    struct handler_ctx *ctx = userdata;
+
+    if (!channel_name_is_valid (name, length)) {
+        send_error (ctx->listener, ctx->client,
+                    IRC_RPL_NOSUCHCHANNEL, name);
+        return;
+    }
+
+    channel_t *channel = channel_lookup (name, length);
+    if (channel && channel_is_banned (channel, ctx->client)) {
+        send_error (ctx->listener, ctx->client,
+                    IRC_RPL_BANNEDFROMCHAN, name);
+        return;
+    }
+
+    if (!(channel = channel_join (name, length, ctx->client)))
+        return;  /* Already joined. */
+
+    send_to_channel_members (channel, ctx->client, "JOIN", NULL);
+    if (channel_member_modes (channel, ctx->client) & CHANNEL_MODE_OP) {
+        /* Servers only take modes from MODE, not from who joined first. */
+        w_buf_t line = W_BUF;
+        w_buf_format (&line, ":$s MODE $s +o $s\r\n", link_server_name (),
+                      atom_str (channel->name), atom_str (ctx->client->nick));
+        link_broadcast (NULL, w_buf_data (&line), w_buf_size (&line));
+        w_buf_clear (&line);
+    }
+    query_join (ctx->client, channel);
+
+    w_buf_t replay = W_BUF;
+    history_replay (&channel->history, atom_str (channel->name),
+                    ctx->client->caps & CLIENT_CAP_SERVER_TIME, &replay);
+    if (w_buf_size (&replay))
+        W_IO_NORESULT (client_send (ctx->client, w_buf_data (&replay), w_buf_size (&replay)));
+    w_buf_clear (&replay);
+}
+
+
+static void
+handle_part_target (const char *name, size_t length, void *userdata)
+{
+    struct handler_ctx *ctx = userdata;
+
+    channel_t *channel = channel_lookup (name, length);
+    if (!channel) {
+        send_error (ctx->listener, ctx->client,
+                    IRC_RPL_NOSUCHCHANNEL, name);
+    } else if (!channel_has_member (channel, ctx->client)) {
+        send_error (ctx->listener, ctx->client,
+                    IRC_RPL_NOTONCHANNEL, name);
+    } else {
+        send_to_channel_members (channel, ctx->client, "PART", NULL);
+        channel_part (channel, ctx->client);
+    }
+}
+
+
+/* Offline messages are only kept for accounts, not for any nick. */
+static bool
+is_account (const config_t *config, const char *name, size_t length)
+{
+    if (length >= IRC_MAX_LINE)
+        return false;
+
+    char folded[IRC_MAX_LINE], user[IRC_MAX_LINE];
+    irc_casefold (folded, name, length);
+    for (unsigned i = 0; i < config->n_users; i++) {
+        if (strlen (config->users[i].user) != length)
+            continue;
+        irc_casefold (user, config->users[i].user, length);
+        if (memcmp (folded, user, length) == 0)
+            return true;
+    }
+    return false;
+}
+
+
+static void
+handle_message_target (const char *name, size_t length, void *userdata)
+{
+    struct handler_ctx *ctx = userdata;
+    const bool notice = (ctx->message->cmd == IRC_CMD_NOTICE);
+    const w_buf_t *text = &ctx->message->params[1];
+
+    w_buf_t line = W_BUF;
+    w_buf_format (&line, ":$s $s $s :$B\r\n", atom_str (ctx->client->nick),
+                  notice ? "NOTICE" : "PRIVMSG", name, text);
+
+    if (name[0] == '#' || name[0] == '&') {
+        channel_t *channel = channel_lookup (name, length);
+        if (!channel) {
+            if (!notice)
+                send_error (ctx->listener, ctx->client,
+                            IRC_RPL_NOSUCHNICK, name);
+        } else if (!channel_has_member (channel, ctx->client) ||
+                   channel_is_banned (channel, ctx->client)) {
+            if (!notice)
+                send_error (ctx->listener, ctx->client,
+                            IRC_RPL_CANNOTSENDTOCHAN, name);
+        } else {
+            channel_send_tagged (channel, ctx->client, ctx->tags,
+                                 w_buf_data (&line), w_buf_size (&line));
+            history_append (&channel->history, notice, ctx->client->nick,
+                            w_buf_data (text), w_buf_size (text));
+            journal_append (notice, name, length,
+                            atom_str (ctx->client->nick),
+                            atom_length (ctx->client->nick),
+                            w_buf_data (text), w_buf_size (text));
+        }
+    } else {
+        client_t *target = client_lookup (name, length);
+        if (target) {
+            W_IO_NORESULT (client_send_tagged (target, ctx->tags,
+                                               w_buf_data (&line),
+                                               w_buf_size (&line)));
+            journal_append (notice, name, length,
+                            atom_str (ctx->client->nick),
+                            atom_length (ctx->client->nick),
+                            w_buf_data (text), w_buf_size (text));
+        } else if (memchr (name, '@', length) &&
+                   proto_xmpp_send_from_irc (atom_str (ctx->client->nick), notice,
+                                             name, length, w_buf_data (text),
+                                             w_buf_size (text))) {
+            journal_append (notice, name, length,
+                            atom_str (ctx->client->nick),
+                            atom_length (ctx->client->nick),
+                            w_buf_data (text), w_buf_size (text));
+        } else if (is_account (ctx->config, name, length) &&
+                   offline_store (name, length, w_buf_data (&line), w_buf_size (&line))) {
+            if (!notice)
+                send_error (ctx->listener, ctx->client, IRC_RPL_AWAY,
+                            name, "Not connected, the message will be delivered on login");
+            journal_append (notice, name, length,
+                            atom_str (ctx->client->nick),
+                            atom_length (ctx->client->nick),
+                            w_buf_data (text), w_buf_size (text));
+        } else if (!notice) {
+            send_error (ctx->listener, ctx->client,
+                        IRC_RPL_NOSUCHNICK, name);
+        }
+    }
+
+    w_buf_clear (&line);
+}
+
+
+static void
+send_links (listener_t *listener, client_t *client, const config_t *config)
+{
+    const char *name = link_server_name ();
+    send_error (listener, client, IRC_RPL_LINKS, name, name, 0,
+                config->server_info);
+
+    char server_name[IRC_MAX_LINE], server_info[IRC_MAX_LINE];
+    for (unsigned i = 0; i < link_server_count (); i++) {
+        const struct link_server *server = link_server_at (i);
+        send_error (listener, client, IRC_RPL_LINKS,
+                    irc_buf_cstr (&server->name, server_name),
+                    server->uplink ? w_buf_str (&server->uplink->name) : name,
+                    server->hops,
+                    irc_buf_cstr (&server->info, server_info));
+    }
+    send_error (listener, client, IRC_RPL_ENDOFLINKS, "*");
+}
+
+
+static void
+client_quit (client_t *client, const char *reason)
+{
+    channel_quit (client, reason);
+
+    if (client_is_registered (client)) {
+        w_buf_t line = W_BUF;
+        w_buf_format (&line, ":$s QUIT :$s\r\n", atom_str (client->nick), reason);
+        link_broadcast (NULL, w_buf_data (&line), w_buf_size (&line));
+        w_buf_clear (&line);
+    }
+}
+
+
+/*
+ * MODE <channel> {+|-}b [<mask>]
+ *
+ * Only bans are supported, which channel and IRC operators can change.
+ * Changes are also sent to the other servers.
+ */
+static void
+handle_mode (listener_t *listener, client_t *client, const irc_message_t *message)
+{
+    char name[IRC_MAX_LINE], modes[IRC_MAX_LINE];
+    irc_buf_cstr (&message->params[0], name);
+    irc_buf_cstr (&message->params[1], modes);
+
+    if (!channel_name_is_valid (name, strlen (name))) {
+        send_error (listener, client, IRC_RPL_UMODEUNKNOWNFLAG);
+        return;
+    }
+
+    channel_t *channel = channel_lookup (name, strlen (name));
+    if (!channel) {
+        send_error (listener, client, IRC_RPL_NOSUCHCHANNEL, name);
+        return;
+    }
+
+    const bool add = (modes[0] != '-');
+    const char *mode = (modes[0] == '+' || modes[0] == '-') ? modes + 1 : modes;
+    if (strcmp (mode, "b") != 0) {
+        send_error (listener, client, IRC_RPL_UNKNOWNMODE, mode);
+        return;
+    }
+
+    if (message->n_params < 3) {
+        const unsigned n_bans = channel->bans ? mask_set_count (channel->bans) : 0;
+        for (unsigned i = 0; i < n_bans; i++)
+            send_error (listener, client, IRC_RPL_BANLIST, name,
+                        mask_text (mask_set_at (channel->bans, i)));
+        send_error (listener, client, IRC_RPL_ENDOFBANLIST, name);
+        return;
+    }
+
+    if (!client->oper && !(channel_member_modes (channel, client) & CHANNEL_MODE_OP)) {
+        send_error (listener, client, IRC_RPL_CHANOPRIVSNEEDED, name);
+        return;
+    }
+
+    const w_buf_t *mask = &message->params[2];
+    if (!channel->bans)
+        channel->bans = mask_set_new ();
+    if (add ? mask_set_add (channel->bans, w_buf_data (mask), w_buf_size (mask))
+            : mask_set_del (channel->bans, w_buf_data (mask), w_buf_size (mask))) {
+        w_buf_t line = W_BUF;
+        w_buf_format (&line, ":$s MODE $s $s $B\r\n", atom_str (client->nick),
+                      atom_str (channel->name), add ? "+b" : "-b", mask);
+        channel_send_local (channel, NULL, w_buf_data (&line), w_buf_size (&line));
+        link_broadcast (NULL, w_buf_data (&line), w_buf_size (&line));
+        w_buf_clear (&line);
+        /* Removing the last ban may leave nothing to keep the channel. */
+        if (!add)
+            channel_collect (channel);
+    }
+}
+
+
+static void
+kill_client (client_t *victim, const char *reason)
+{
+    if (!client_is_local (victim)) {
+        link_kill (victim, reason);
+        return;
+    }
+
+    w_buf_t line = W_BUF;
+    w_buf_format (&line, "ERROR :Closing link: $s\r\n", reason);
+    W_IO_NORESULT (client_send (victim, w_buf_data (&line), w_buf_size (&line)));
+    w_buf_clear (&line);
+
+    /* Its handler sees the connection closed, and cleans up. */
+    shutdown (w_io_get_fd (victim->socket), SHUT_RDWR);
+}
+
+
+/*
+ * KILL <nick> <comment>, where the nick may also be a mask. Operators
+ * can disconnect several clients at once this way.
+ */
+static void
+handle_kill (listener_t *listener, client_t *client, const irc_message_t *message)
+{
+    char target[IRC_MAX_LINE], comment[IRC_MAX_LINE];
+    irc_buf_cstr (&message->params[0], target);
+    irc_buf_cstr (&message->params[1], comment);
+
+    w_buf_t reason = W_BUF;
+    w_buf_format (&reason, "Killed ($s ($s))", atom_str (client->nick), comment);
+
+    /* Killing remote clients changes the list, hence the snapshot. */
+    mask_t *mask = mask_new (target, strlen (target));
+    unsigned n_clients = client_count ();
+    client_t **clients = n_clients ? w_alloc (client_t*, n_clients) : NULL;
+    for (unsigned i = 0; i < n_clients; i++)
+        clients[i] = w_obj_ref (client_at (i));
+
+    /* A mask never kills the operator who sent it, only its own nick does. */
+    const bool wild = mask_is_wild (target, strlen (target));
+    unsigned killed = 0;
+    for (unsigned i = 0; i < n_clients; i++) {
+        if (client_is_registered (clients[i]) &&
+            !(wild && clients[i] == client) &&
+            client_match_mask (clients[i], mask)) {
+            kill_client (clients[i], w_buf_str (&reason));
+            killed++;
+        }
+        w_obj_unref (clients[i]);
+    }
+
+    w_free (clients);
+    mask_free (mask);
+    w_buf_clear (&reason);
+
+    if (!killed)
+        send_error (listener, client, IRC_RPL_NOSUCHNICK, target);
+}
+
+
+/* Sends the messages kept while the client was away, in a single write. */
+static void
+deliver_offline (client_t *client)
+{
+    w_buf_t lines = W_BUF;
+    if (offline_fetch (atom_str (client->nick), atom_length (client->nick),
+                       client->caps & CLIENT_CAP_SERVER_TIME, &lines) &&
+        !w_io_failed (client_send (client, w_buf_data (&lines), w_buf_size (&lines))))
+        offline_delivered (atom_str (client->nick), atom_length (client->nick));
+    w_buf_clear (&lines);
+}
+
+
+/*
+ * Registers the client once both NICK and PASS have been given and they
+ * authenticate, or NICK has been given after authenticating with SASL as
+ * the same user. Returns false if the connection must be closed.
+ */
+static bool
+try_login (listener_t *listener, client_t *client, const config_t *config)
+{
+    if (client_is_registered (client) ||
+        client->cap_negotiating ||
+        !w_buf_size (&client->login_nick) ||
+        (!w_buf_size (&client->login_pass) && !w_buf_size (&client->account)))
+        return true;
+
+    if (w_buf_size (&client->account)) {
+        if (strcmp (w_buf_str (&client->account),
+                    w_buf_str (&client->login_nick)) != 0) {
+            /* Let the client pick the nick of its account. */
+            send_error (listener, client, IRC_RPL_ERRONEUSNICKNAME,
+                        w_buf_str (&client->login_nick));
+            w_buf_clear (&client->login_nick);
+            return true;
+        }
+    } else if (!auth_agent_authenticate (config->auth_agent,
+                                         w_buf_str (&client->login_nick),
+                                         w_buf_str (&client->login_pass))) {
+        send_error (listener, client, IRC_RPL_PASSWDMISMATCH);
+        return false;
+    }
+    if (!client_register (client, w_buf_str (&client->login_nick))) {
+        send_error (listener, client, IRC_RPL_NICKNAMEINUSE,
+                    w_buf_str (&client->login_nick));
+        return false;
+    }
+
+    char mask[IRC_MAX_LINE];
+    size_t length = client_mask_folded (client, mask);
+    if (mask_set_match_folded (config->bans, mask, length)) {
+        send_error (listener, client, IRC_RPL_YOUREBANNEDCREEP);
+        client_unregister (client);
+        return false;
+    }
+    admission_registered (w_io_get_fd (client->socket));
+
+    client_mask (client, mask);
+    send_error (listener, client, IRC_RPL_WELCOME, mask);
+
+    w_buf_t line = W_BUF;
+    w_buf_format (&line, ":$s NICK $s 1\r\n", link_server_name (),
+                  atom_str (client->nick));
+    link_broadcast (NULL, w_buf_data (&line), w_buf_size (&line));
+    w_buf_clear (&line);
+
+    W_IO_NORESULT (document_send (DOCUMENT_MOTD, client));
+    deliver_offline (client);
+    return true;
+}
+
+
+static const struct {
+    const char *name;
+    uint8_t     flag;
+} s_caps[] = {
+    { "message-tags", CLIENT_CAP_MESSAGE_TAGS },
+    { "server-time",  CLIENT_CAP_SERVER_TIME  },
+    { "sasl",         CLIENT_CAP_SASL         },
+};
+
+
+static uint8_t
+find_cap (const char *name, size_t length)
+{
+    for (unsigned i = 0; i < w_lengthof (s_caps); i++)
+        if (strlen (s_caps[i].name) == length &&
+            memcmp (s_caps[i].name, name, length) == 0)
+            return s_caps[i].flag;
+    return 0;
+}
+
+
+static void
+send_cap (client_t *client, const char *subcommand, const char *caps)
+{
+    W_IO_NORESULT (client_sendf (client, ":$s CAP $s $s :$s\r\n",
+                                 link_server_name (), client_nick (client),
+                                 subcommand, caps));
+}
+
+
+/*
+ * CAP LS [<version>] | LIST | REQ :<capabilities> | END
+ *
+ * Negotiation suspends registration until CAP END, so capabilities are
+ * enabled before the client gets anything tagged. Requests are applied
+ * all at once, or not at all. Returns false if the connection must be
+ * closed.
+ */
+static bool
+handle_cap (listener_t          *listener,
+            client_t            *client,
+            const irc_message_t *message,
+            const config_t      *config)
+{
+    char subcommand[IRC_MAX_LINE];
+    irc_buf_cstr (&message->params[0], subcommand);
+
+    if (strcmp (subcommand, "LS") == 0 || strcmp (subcommand, "LIST") == 0) {
+        const bool list = (subcommand[1] == 'I');
 
-    auth_agent_t *auth_agent = listener->userdata;
+        /* Version 302 and later get the values of the capabilities. */
+        unsigned long version = 0;
+        if (!list && message->n_params > 1) {
+            char text[IRC_MAX_LINE];
+            if (!w_str_uint (irc_buf_cstr (&message->params[1], text), &version))
+                version = 0;
+        }
+
+        w_buf_t caps = W_BUF;
+        for (unsigned i = 0; i < w_lengthof (s_caps); i++) {
+            if (list && !(client->caps & s_caps[i].flag))
+                continue;
+            if (w_buf_size (&caps))
+                w_buf_append_char (&caps, ' ');
+            w_buf_append_str (&caps, s_caps[i].name);
+            if (version >= 302 && s_caps[i].flag == CLIENT_CAP_SASL)
+                w_buf_format (&caps, "=$s", sasl_mechanisms (config->auth_agent));
+        }
+        if (!list && !client_is_registered (client))
+            client->cap_negotiating = true;
+        send_cap (client, subcommand, w_buf_size (&caps) ? w_buf_str (&caps) : "");
+        w_buf_clear (&caps);
+        return true;
+    }
+
+    if (strcmp (subcommand, "REQ") == 0) {
+        char requested[IRC_MAX_LINE] = "";
+        if (message->n_params > 1)
+            irc_buf_cstr (&message->params[1], requested);
+
+        uint8_t caps = client->caps;
+        bool valid = true;
+        for (const char *p = requested; *p && valid; ) {
+            const size_t length = strcspn (p, " ");
+            if (length) {
+                const bool disable = (*p == '-');
+                const uint8_t flag = find_cap (p + disable, length - disable);
+                if (!flag)
+                    valid = false;
+                else if (disable)
+                    caps &= ~flag;
+                else
+                    caps |= flag;
+            }
+            p += length + (p[length] == ' ');
+        }
+
+        if (valid)
+            client->caps = caps;
+        if (!client_is_registered (client))
+            client->cap_negotiating = true;
+        send_cap (client, valid ? "ACK" : "NAK", requested);
+        return true;
+    }
+
+    if (strcmp (subcommand, "END") == 0) {
+        client->cap_negotiating = false;
+        return try_login (listener, client, config);
+    }
+
+    send_error (listener, client, IRC_RPL_INVALIDCAPCMD, subcommand);
+    return true;
+}
+
+
+static void
+end_sasl (client_t *client)
+{
+    if (client->sasl) {
+        sasl_clear (client->sasl);
+        w_free (client->sasl);
+    }
+    w_buf_clear (&client->sasl_input);
+}
+
+
+/* Challenges go in lines of 400 bytes, ending with a shorter one or "+". */
+static void
+send_authenticate (client_t *client, const w_buf_t *challenge)
+{
+    w_buf_t encoded = W_BUF, lines = W_BUF;
+    sasl_base64_encode (&encoded, w_buf_data (challenge), w_buf_size (challenge));
+
+    size_t offset = 0;
+    for (size_t length; offset < w_buf_size (&encoded); offset += length) {
+        length = w_buf_size (&encoded) - offset;
+        if (length > IRC_SASL_CHUNK)
+            length = IRC_SASL_CHUNK;
+        w_buf_append_str (&lines, "AUTHENTICATE ");
+        w_buf_append_mem (&lines, w_buf_data (&encoded) + offset, length);
+        w_buf_append_str (&lines, "\r\n");
+    }
+    if (offset % IRC_SASL_CHUNK == 0)
+        w_buf_append_str (&lines, "AUTHENTICATE +\r\n");
+    W_IO_NORESULT (client_send (client, w_buf_data (&lines), w_buf_size (&lines)));
+    w_buf_clear (&encoded);
+    w_buf_clear (&lines);
+}
+
+
+/*
+ * AUTHENTICATE <mechanism> | <response> | + | *
+ *
+ * Responses are base64, split in lines of 400 bytes like challenges; a
+ * "+" stands for an empty response, and "*" aborts. The account is kept
+ * until NICK completes the registration (see try_login).
+ */
+static void
+handle_authenticate (listener_t          *listener,
+                     client_t            *client,
+                     const irc_message_t *message,
+                     const config_t      *config)
+{
+    if (client_is_registered (client) || w_buf_size (&client->account)) {
+        send_error (listener, client, IRC_RPL_SASLALREADY);
+        return;
+    }
+
+    char param[IRC_MAX_LINE];
+    irc_buf_cstr (&message->params[0], param);
+
+    if (strcmp (param, "*") == 0) {
+        send_error (listener, client,
+                    client->sasl ? IRC_RPL_SASLABORTED : IRC_RPL_SASLFAIL);
+        end_sasl (client);
+        return;
+    }
+
+    if (!client->sasl) {
+        client->sasl = w_new (sasl_t);
+        *client->sasl = (sasl_t) SASL_INIT;
+        if (!sasl_start (client->sasl, config->auth_agent, param)) {
+            send_error (listener, client, IRC_RPL_SASLMECHS,
+                        sasl_mechanisms (config->auth_agent));
+            send_error (listener, client, IRC_RPL_SASLFAIL);
+            end_sasl (client);
+        } else {
+            const w_buf_t empty = W_BUF;
+            send_authenticate (client, &empty);
+        }
+        return;
+    }
+
+    const size_t length = strlen (param);
+    if (strcmp (param, "+") != 0)
+        w_buf_append_mem (&client->sasl_input, param, length);
+    if (w_buf_size (&client->sasl_input) > CHATEAU_SASL_MAX_INPUT) {
+        send_error (listener, client, IRC_RPL_SASLTOOLONG);
+        end_sasl (client);
+        return;
+    }
+    if (length == IRC_SASL_CHUNK)
+        return;
+
+    w_buf_t input = W_BUF;
+    w_buf_t output = W_BUF;
+    sasl_status_t status = SASL_FAILURE;
+    if (sasl_base64_decode (&input, w_buf_data (&client->sasl_input),
+                            w_buf_size (&client->sasl_input)))
+        status = sasl_step (client->sasl, w_buf_data (&input),
+                            w_buf_size (&input), &output);
+
+    /* May hold a password. */
+    memset (w_buf_data (&input), 0x00, w_buf_size (&input));
+    w_buf_clear (&input);
+    w_buf_clear (&client->sasl_input);
+
+    switch (status) {
+        case SASL_CONTINUE:
+            send_authenticate (client, &output);
+            break;
+        case SASL_SUCCESS:
+            w_buf_set_str (&client->account, sasl_user (client->sasl));
+            send_error (listener, client, IRC_RPL_LOGGEDIN,
+                        client_nick (client), w_buf_str (&client->account),
+                        w_buf_str (&client->account));
+            send_error (listener, client, IRC_RPL_SASLSUCCESS);
+            end_sasl (client);
+            break;
+        case SASL_FAILURE:
+            send_error (listener, client, IRC_RPL_SASLFAIL);
+            end_sasl (client);
+            break;
+    }
+    w_buf_clear (&output);
+}
+
+
+static inline bool
+is_control (const irc_message_t *message)
+{
+    return message->cmd == IRC_CMD_PING ||
+           message->cmd == IRC_CMD_PONG ||
+           message->cmd == IRC_CMD_QUIT;
+}
+
+
+/*
+ * Handles messages from the client until it quits, and returns false, or
+ * it stays idle long enough to hibernate, and returns true; it is then
+ * left registered and connected.
+ */
+static bool
+run_client (listener_t *listener, client_t *client)
+{
+    w_io_t *socket = client->socket;
+    hibernate_waiter_t waiter = HIBERNATE_WAITER_INIT;
     irc_message_t message = { 0, };
+    config_t *config = NULL;
+    struct handler_ctx ctx = {
+        .listener = listener,
+        .client   = client,
+        .message  = &message,
+    };
+
+    governor_attach (client);
+
+    for (;; fairshare_end (&client->share),
+            irc_message_reset (&message), config_release (&config)) {
+        governor_wait_read (client);
 
-    w_buf_t user = W_BUF;
-    w_buf_t pass = W_BUF;
-    bool got_user = false; /* TODO: Change to an actual user object. */
+        /* TLS sockets may hold decrypted input, which epoll cannot see. */
+        if (!listener->tls && client_is_registered (client) &&
+            !hibernate_wait (socket, &waiter))
+            goto hibernate;
 
-    for (;; irc_message_reset (&message)) {
+        fairshare_read (&client->share);
         if (!irc_message_parse (&message, socket)) {
             /* Return error to the client */
             break;
         }
+        fairshare_begin (&client->share, is_control (&message));
+
+        /* Keeps the configuration alive even if rehashed meanwhile. */
+        config = config_acquire ();
+        ctx.config = config;
 
         w_printerr ("origin : $B\n"
                     "user   : $B\n"
@@ -108,57 +898,333 @@ proto_irc_handler (w_task_listener_t *listener, w_io_t *socket)
         switch (message.cmd) {
             case IRC_CMD_NICK:
                 if (!check_nparams (&message)) {
-                    send_error (listener, socket, IRC_RPL_NONICKNAMEGIVEN);
+                    send_error (listener, client, IRC_RPL_NONICKNAMEGIVEN);
+                } else if (client_is_registered (client)) {
+                    char nick[IRC_MAX_LINE];
+                    send_error (listener, client, IRC_RPL_ERRONEUSNICKNAME,
+                                irc_buf_cstr (&message.params[0], nick));
                 } else {
-                    w_buf_clear (&user);
-                    w_buf_append_buf (&user, &message.params[0]);
-                    if (got_user) {
-                        send_error (listener, socket, IRC_RPL_ERRONEUSNICKNAME,
-                                    w_buf_str (&user));
-                    } else {
-                        if (w_buf_size (&user) && w_buf_size (&pass)) {
-                            if (auth_agent_authenticate (auth_agent,
-                                                         w_buf_str (&user),
-                                                         w_buf_str (&pass))) {
-                                got_user = true;
-                            } else {
-                                send_error (listener, socket, IRC_RPL_PASSWDMISMATCH);
-                                goto close_connection;
-                            }
-                        }
-                    }
+                    w_buf_clear (&client->login_nick);
+                    w_buf_append_buf (&client->login_nick, &message.params[0]);
+                    if (!try_login (listener, client, config))
+                        goto close_connection;
                 }
                 break;
 
             case IRC_CMD_PASS:
                 if (!check_nparams (&message)) {
-                    send_error (listener, socket, IRC_RPL_NEEDMOREPARAMS,
+                    send_error (listener, client, IRC_RPL_NEEDMOREPARAMS,
+                                w_buf_str (&message.cmd_text));
+                } else if (client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_ALREADYREGISTERED);
+                } else {
+                    w_buf_clear (&client->login_pass);
+                    w_buf_append_buf (&client->login_pass, &message.params[0]);
+                    if (!try_login (listener, client, config))
+                        goto close_connection;
+                }
+                break;
+
+            case IRC_CMD_CAP:
+                if (!check_nparams (&message)) {
+                    send_error (listener, client, IRC_RPL_NEEDMOREPARAMS,
+                                w_buf_str (&message.cmd_text));
+                } else if (!handle_cap (listener, client, &message, config)) {
+                    goto close_connection;
+                }
+                break;
+
+            case IRC_CMD_AUTHENTICATE:
+                if (!check_nparams (&message)) {
+                    send_error (listener, client, IRC_RPL_NEEDMOREPARAMS,
+                                w_buf_str (&message.cmd_text));
+                } else {
+                    handle_authenticate (listener, client, &message, config);
+                }
+                break;
+
+            case IRC_CMD_JOIN:
+            case IRC_CMD_PART:
+            case IRC_CMD_PRIVMSG:
+            case IRC_CMD_NOTICE:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else if (!check_nparams (&message)) {
+                    send_error (listener, client, IRC_RPL_NEEDMOREPARAMS,
                                 w_buf_str (&message.cmd_text));
+                } else if (message.cmd == IRC_CMD_JOIN) {
+                    foreach_target (&message.params[0], handle_join_target, &ctx);
+                } else if (message.cmd == IRC_CMD_PART) {
+                    foreach_target (&message.params[0], handle_part_target, &ctx);
                 } else {
-                    w_buf_clear (&pass);
-                    w_buf_append_buf (&pass, &message.params[0]);
-                    if (got_user) {
-                        send_error (listener, socket, IRC_RPL_ALREADYREGISTERED);
+                    w_buf_t tags[CLIENT_CAP_TAG_VARIANTS];
+                    render_tags (tags, &message);
+                    ctx.tags = tags;
+                    foreach_target (&message.params[0], handle_message_target, &ctx);
+                    ctx.tags = NULL;
+                    clear_tags (tags);
+                }
+                break;
+
+            case IRC_CMD_LIST:
+            case IRC_CMD_NAMES:
+            case IRC_CMD_WHO:
+            case IRC_CMD_STATS:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else if (message.cmd == IRC_CMD_STATS) {
+                    query_stats (client, &message);
+                } else if (message.cmd == IRC_CMD_LIST) {
+                    query_list (client, &message);
+                } else if (message.cmd == IRC_CMD_NAMES) {
+                    query_names (client, &message);
+                } else {
+                    query_who (client, &message);
+                }
+                break;
+
+            case IRC_CMD_MODE:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else if (!check_nparams (&message)) {
+                    send_error (listener, client, IRC_RPL_NEEDMOREPARAMS,
+                                w_buf_str (&message.cmd_text));
+                } else {
+                    handle_mode (listener, client, &message);
+                }
+                break;
+
+            case IRC_CMD_KILL:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else if (!client->oper) {
+                    send_error (listener, client, IRC_RPL_NOPRIVILEGES);
+                } else if (!check_nparams (&message)) {
+                    send_error (listener, client, IRC_RPL_NEEDMOREPARAMS,
+                                w_buf_str (&message.cmd_text));
+                } else {
+                    handle_kill (listener, client, &message);
+                }
+                break;
+
+            case IRC_CMD_QUIT:
+                goto close_connection;
+
+            case IRC_CMD_PING:
+                if (!check_nparams (&message)) {
+                    send_error (listener, client, IRC_RPL_NOORIGIN);
+                } else {
+                    W_IO_NORESULT (client_sendf (client, ":$s PONG $s :$B\r\n",
+                                                 link_server_name (),
+                                                 link_server_name (),
+                                                 &message.params[0]));
+                }
+                break;
+
+            case IRC_CMD_PONG:
+                break;
+
+            case IRC_CMD_SERVER:
+                if (client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_ALREADYREGISTERED);
+                } else if (!check_nparams (&message)) {
+                    send_error (listener, client, IRC_RPL_NEEDMOREPARAMS,
+                                w_buf_str (&message.cmd_text));
+                } else {
+                    /* The connection is now a server link. */
+                    link_accept (socket, w_buf_size (&client->login_pass)
+                                            ? w_buf_str (&client->login_pass)
+                                            : NULL, &message);
+                    goto close_connection;
+                }
+                break;
+
+            case IRC_CMD_OPER:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else if (!check_nparams (&message)) {
+                    send_error (listener, client, IRC_RPL_NEEDMOREPARAMS,
+                                w_buf_str (&message.cmd_text));
+                } else {
+                    char oper_user[IRC_MAX_LINE], oper_pass[IRC_MAX_LINE];
+                    if (auth_agent_authenticate (config->oper_agent,
+                                                 irc_buf_cstr (&message.params[0], oper_user),
+                                                 irc_buf_cstr (&message.params[1], oper_pass))) {
+                        client->oper = true;
+                        governor_attach (client);
+                        send_error (listener, client, IRC_RPL_YOUREOPER);
                     } else {
-                        if (w_buf_size (&user) && w_buf_size (&pass)) {
-                            if (auth_agent_authenticate (auth_agent,
-                                                         w_buf_str (&user),
-                                                         w_buf_str (&pass))) {
-                                got_user = true;
-                            } else {
-                                send_error (listener, socket, IRC_RPL_PASSWDMISMATCH);
-                                goto close_connection;
-                            }
-                        }
+                        send_error (listener, client, IRC_RPL_PASSWDMISMATCH);
+                    }
+                }
+                break;
+
+            case IRC_CMD_CONNECT:
+            case IRC_CMD_SQUIT:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else if (!client->oper) {
+                    send_error (listener, client, IRC_RPL_NOPRIVILEGES);
+                } else if (!check_nparams (&message)) {
+                    send_error (listener, client, IRC_RPL_NEEDMOREPARAMS,
+                                w_buf_str (&message.cmd_text));
+                } else {
+                    char name[IRC_MAX_LINE], arg[IRC_MAX_LINE];
+                    irc_buf_cstr (&message.params[0], name);
+                    bool found = (message.cmd == IRC_CMD_CONNECT)
+                        ? link_connect (name, message.n_params > 1
+                                        ? irc_buf_cstr (&message.params[1], arg)
+                                        : NULL)
+                        : link_squit (name, irc_buf_cstr (&message.params[1], arg));
+                    if (!found)
+                        send_error (listener, client, IRC_RPL_NOSUCHSERVER, name);
+                }
+                break;
+
+            case IRC_CMD_MOTD:
+            case IRC_CMD_INFO:
+            case IRC_CMD_ADMIN:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else if (message.cmd == IRC_CMD_MOTD) {
+                    /* Only this server answers, whatever the target. */
+                    W_IO_NORESULT (document_send (DOCUMENT_MOTD, client));
+                } else if (message.cmd == IRC_CMD_INFO) {
+                    W_IO_NORESULT (document_send (DOCUMENT_INFO, client));
+                } else {
+                    W_IO_NORESULT (document_send (DOCUMENT_ADMIN, client));
+                }
+                break;
+
+            case IRC_CMD_LINKS:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else {
+                    send_links (listener, client, config);
+                }
+                break;
+
+            case IRC_CMD_REHASH:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else if (!client->oper) {
+                    send_error (listener, client, IRC_RPL_NOPRIVILEGES);
+                } else {
+                    send_error (listener, client, IRC_RPL_REHASHING, config->path);
+                    w_buf_t error = W_BUF;
+                    if (!config_rehash (&error)) {
+                        W_IO_NORESULT (client_sendf (client, ":$s NOTICE $s :Rehash failed: $B\r\n",
+                                                     link_server_name (), client_nick (client), &error));
                     }
+                    w_buf_clear (&error);
+                }
+                break;
+
+            case IRC_CMD_RESTART:
+                if (!client_is_registered (client)) {
+                    send_error (listener, client, IRC_RPL_NOTREGISTERED);
+                } else if (!client->oper) {
+                    send_error (listener, client, IRC_RPL_NOPRIVILEGES);
+                } else if (!upgrade_start ()) {
+                    W_IO_NORESULT (client_sendf (client, ":$s NOTICE $s :Restart failed\r\n",
+                                                 link_server_name (), client_nick (client)));
                 }
                 break;
         }
     }
 
-close_connection:
+close_connection: {
+        char reason[IRC_MAX_LINE] = "Connection closed";
+        if (message.cmd == IRC_CMD_QUIT && message.n_params)
+            irc_buf_cstr (&message.params[0], reason);
+        client_quit (client, reason);
+    }
+    config_release (&config);
+    hibernate_clear_waiter (&waiter);
+    w_obj_unref (client);
     W_IO_NORESULT (w_io_flush (socket));
     W_IO_NORESULT (w_io_close (socket));
     w_printerr ("$s: Connection closed\n", w_task_name ());
+    return false;
+
+hibernate:
+    hibernate_clear_waiter (&waiter);
+    W_IO_NORESULT (w_io_flush (socket));
+    return true;
 }
 
+
+struct sleeping_client {
+    listener_t *listener;
+    client_t   *client;
+};
+
+
+/*
+ * Runs a hibernated client in the task started when it got input, until
+ * it quits or hibernates again. The client keeps running if it cannot be
+ * hibernated.
+ */
+static void
+wake_client (void *data)
+{
+    struct sleeping_client *sleeping = data;
+    w_io_t *socket = sleeping->client->socket;
+    const int fd = w_io_get_fd (socket);
+
+    while (run_client (sleeping->listener, sleeping->client))
+        if (hibernate_park (fd, sleeping->listener->name, wake_client, sleeping))
+            return;
+
+    w_obj_unref (socket);
+    w_obj_unref (sleeping->listener);
+    w_free (sleeping);
+    admission_release (fd);
+}
+
+
+/* Keeps what the task of the client used while it hibernates. */
+static void
+serve_client (listener_t *listener, client_t *client)
+{
+    if (!run_client (listener, client))
+        return;
+
+    struct sleeping_client *sleeping = w_new (struct sleeping_client);
+    sleeping->listener = w_obj_ref (listener);
+    sleeping->client = client;
+    w_obj_ref (client->socket);
+
+    if (!hibernate_park (w_io_get_fd (client->socket), listener->name,
+                         wake_client, sleeping))
+        wake_client (sleeping);
+    else
+        w_printerr ("$s: Client hibernated\n", w_task_name ());
+}
+
+
+void
+proto_irc_handler (listener_t *listener, w_io_t *socket)
+{
+    w_printerr ("$s: Client connected\n", w_task_name ());
+
+    /* The trace only sees what is parsed, after TLS has been removed. */
+    w_io_t *captured = NULL;
+    if (capture_is_open ())
+        socket = captured = capture_wrap (w_obj_ref (socket));
+
+    client_t *client = client_new (socket);
+    client_lookup_host (client);
+    client_resolve_host (client);
+    serve_client (listener, client);
+    if (captured)
+        w_obj_unref (captured);
+}
+
+
+void
+proto_irc_resume (listener_t *listener, client_t *client)
+{
+    w_printerr ("$s: Client resumed\n", w_task_name ());
+    serve_client (listener, client);
+}
@@ -9,6 +9,7 @@
 #define PROTO_IRC_H
 
 #include "wheel/wheel.h"
+#include <time.h>
 
 /*
  * Standard RFC1459 IRC commands are listed in the form (N, M, NAME), where:
@@ -49,7 +50,8 @@
     F (1, 2, CONNECT) \
     F (0, 1, TRACE)   \
     F (0, 1, ADMIN)   \
-    F (0, 1, INFO)
+    F (0, 1, INFO)    \
+    F (0, 1, MOTD)
 
 /* 4.4 Sending messages */
 #define IRC_MSGSEND_CMDS(F) \
@@ -80,6 +82,11 @@
     F (1,-1, USERHOST) \
     F (1,-1, ISON)
 
+/* IRCv3 capability negotiation and SASL */
+#define IRC_IRCV3_CMDS(F) \
+    F (1, 1, CAP) \
+    F (1, 0, AUTHENTICATE)
+
 #define IRC_MANDATORY_CMDS(F) \
     IRC_CONNREG_CMDS  (F) \
     IRC_CHANOPS_CMDS  (F) \
@@ -90,7 +97,8 @@
 
 #define IRC_ALL_CMDS(F) \
     IRC_MANDATORY_CMDS (F) \
-    IRC_OPTIONAL_CMDS  (F)
+    IRC_OPTIONAL_CMDS  (F) \
+    IRC_IRCV3_CMDS     (F)
 
 
 /* 6.1 Error replies */
@@ -102,6 +110,7 @@
     F (405, 1, TOOMANYCHANNELS,  "$s :You have joined too many channels")          \
     F (406, 1, WASNOSUCHNICK,    "$s :There was no such nickname")                 \
     F (407, 1, TOOMANYTARGETS,   "$s :Duplicate recipients. No message delivered") \
+    F (410, 1, INVALIDCAPCMD,    "$s :Invalid CAP command")                        \
     F (409, 0, NOORIGIN,         ":No origin speficied")                           \
     F (411, 1, NORECIPIENT,      ":No recipient given ($s)")                       \
     F (412, 0, NOTEXTTOSEND,     ":No text to send")                               \
@@ -142,6 +151,7 @@
 
 /* 6.2 Command responses */
 #define IRC_CMDRESP_RPLS(F) \
+    F (1,   1, WELCOME,         ":Welcome to the Internet Relay Network $s") \
     F (300, 0, NONE,            "")                                       \
     F (302, 0, USERHOST,        NULL)                                     \
     F (303, 0, ISON,            NULL)                                     \
@@ -201,6 +211,7 @@
     F (215, 4, STATSILINE,      "I $s * $s $I $s")                        \
     F (216, 4, STATSKLINE,      "K $s * $s $I $s")                        \
     F (218, 4, STATSYLINE,      "Y $s $I $I $I")                          \
+    F (249, 1, STATSDEBUG,      ":$s")                                    \
     F (219, 1, ENDOFSTATS,      "$s :End of /STATS report")               \
     F (241, 3, STATSLLINE,      "L $s * $s $I")                           \
     F (242, 0, STATSUPTIME,     NULL)                                     \
@@ -217,9 +228,20 @@
     F (258, 1, ADMINLOC2,       ":$s")                                    \
     F (259, 1, ADMINEMAIL,      ":$s")                                    \
 
+/* IRCv3 SASL authentication */
+#define IRC_SASL_RPLS(F) \
+    F (900, 3, LOGGEDIN,        "$s $s :You are now logged in as $s")     \
+    F (903, 0, SASLSUCCESS,     ":SASL authentication successful")        \
+    F (904, 0, SASLFAIL,        ":SASL authentication failed")            \
+    F (905, 0, SASLTOOLONG,     ":SASL message too long")                 \
+    F (906, 0, SASLABORTED,     ":SASL authentication aborted")           \
+    F (907, 0, SASLALREADY,     ":You have already authenticated using SASL") \
+    F (908, 1, SASLMECHS,       "$s :are available SASL mechanisms")      \
+
 #define IRC_ALL_RPLS(F) \
     IRC_ERROR_RPLS   (F) \
-    IRC_CMDRESP_RPLS (F)
+    IRC_CMDRESP_RPLS (F) \
+    IRC_SASL_RPLS    (F)
 
 typedef enum {
     IRC_CMD_UNKNOWN = 0,
@@ -304,10 +326,28 @@ irc_cmd_info (irc_cmd_t cmd,
 
 enum {
     IRC_MAX_PARAMS = 15,
+    IRC_MAX_LINE   = 512,
+    IRC_MAX_TAGS   = 32,
+    IRC_MAX_TAGS_LENGTH = 8191, /* IRCv3 message-tags, including "@". */
+    IRC_SASL_CHUNK = 400,       /* Base64 bytes per AUTHENTICATE line. */
 };
 
 
+/*
+ * IRCv3 message tag. Both point into "tags_text" of the message, and the
+ * value is kept escaped as received: see irc_tag_unescape().
+ */
+typedef struct {
+    w_buf_t key;
+    w_buf_t value;
+} irc_tag_t;
+
+
 typedef struct {
+    uint8_t         n_tags;
+    w_buf_t         tags_text;
+    irc_tag_t       tags[IRC_MAX_TAGS];
+
     struct {
         union {
             w_buf_t nick;
@@ -330,6 +370,7 @@ static inline void
 irc_message_reset (irc_message_t *msg)
 {
     w_assert (msg);
+    w_buf_clear (&msg->tags_text);
     w_buf_clear (&msg->prefix.nick);
     w_buf_clear (&msg->prefix.user);
     w_buf_clear (&msg->prefix.host);
@@ -341,5 +382,57 @@ irc_message_reset (irc_message_t *msg)
 
 extern bool irc_message_parse (irc_message_t *msg, w_io_t *input);
 
+/* Returns the tag with the given key, or NULL if the message lacks it. */
+extern const irc_tag_t* irc_message_tag (const irc_message_t *msg,
+                                         const char          *key);
+
+/* Appends the unescaped value of a tag to "out". */
+extern void irc_tag_unescape (const irc_tag_t *tag, w_buf_t *out);
+
+/* Appends a "time" tag value (server-time) for the given time. */
+extern void irc_tag_time (w_buf_t *out, const struct timespec *when);
+
+
+/*
+ * Parameters point into "params_text" and are not NUL-terminated, so they
+ * cannot be passed to w_buf_str(). This copies the contents of a buffer
+ * into "out", truncating if needed, and returns it.
+ */
+static inline const char*
+irc_buf_cstr (const w_buf_t *buf, char out[IRC_MAX_LINE])
+{
+    w_assert (buf);
+    w_assert (out);
+
+    size_t length = w_buf_size (buf);
+    if (length >= IRC_MAX_LINE)
+        length = IRC_MAX_LINE - 1;
+    if (length)
+        memcpy (out, w_buf_data (buf), length);
+    out[length] = '\0';
+    return out;
+}
+
+
+/*
+ * RFC1459, section 2.2: The characters {}| are considered to be the lower
+ * case equivalents of the characters []\, respectively.
+ */
+static inline int
+irc_tolower (int ch)
+{
+    return (ch >= 'A' && ch <= ']') ? ch + ('a' - 'A') : ch;
+}
+
+static inline void
+irc_casefold (char *out, const char *str, size_t length)
+{
+    w_assert (out);
+    w_assert (str);
+
+    for (size_t i = 0; i < length; i++)
+        out[i] = irc_tolower ((unsigned char) str[i]);
+}
+
 
 #endif /* !PROTO_IRC_H */
@@ -0,0 +1,420 @@
+/*
+ * proto-xmpp-parse.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "proto-xmpp.h"
+#include "xml-text.h"
+
+
+#define P xmpp_parser_t *p
+
+
+static bool
+fail (P, const char *condition)
+{
+    if (!p->error)
+        p->error = condition;
+    return false;
+}
+
+
+/* Reads a character, counted against the size limit of the stanza. */
+static bool
+getch (P, int *ch)
+{
+    *ch = w_io_getchar (p->input);
+    if (*ch == W_IO_EOF || *ch == W_IO_ERR) {
+        p->eof = true;
+        return false;
+    }
+    if (++p->bytes > CHATEAU_XMPP_STANZA_MAX)
+        return fail (p, "policy-violation");
+    return true;
+}
+
+
+static inline bool
+is_space (int ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+
+/* Reads up to the next character which is not a blank. */
+static bool
+skip_space (P, int *ch)
+{
+    do {
+        if (!getch (p, ch))
+            return false;
+    } while (is_space (*ch));
+    return true;
+}
+
+
+/* Reads a name which starts with "ch", leaving the character after it. */
+static bool
+read_name (P, int *ch, w_buf_t *name)
+{
+    while (!is_space (*ch) && *ch != '>' && *ch != '/' && *ch != '=') {
+        if (*ch == '<' || *ch == '&' || *ch == '"' || *ch == '\'')
+            return fail (p, "not-well-formed");
+        w_buf_append_char (name, *ch);
+        if (!getch (p, ch))
+            return false;
+    }
+    return w_buf_size (name) || fail (p, "not-well-formed");
+}
+
+
+/*
+ * Reads text up to the "end" character, which is consumed, and appends
+ * it to "out" with the references resolved.
+ */
+static bool
+read_text (P, int end, w_buf_t *out)
+{
+    w_buf_t raw = W_BUF;
+    bool ok;
+    int ch;
+
+    while ((ok = getch (p, &ch)) && ch != end)
+        w_buf_append_char (&raw, ch);
+    if (ok && !xml_text_unescape (out, w_buf_data (&raw), w_buf_size (&raw)))
+        ok = fail (p, "not-well-formed");
+
+    w_buf_clear (&raw);
+    return ok;
+}
+
+
+/*
+ * Reads the rest of a start tag, from the first character of the name.
+ * Sets "empty" for tags which end with "/>".
+ */
+static bool
+read_start_tag (P, int ch, xmpp_element_t *element, bool *empty)
+{
+    if (!read_name (p, &ch, &element->name))
+        return false;
+
+    for (;;) {
+        if (is_space (ch) && !skip_space (p, &ch))
+            return false;
+        if (ch == '>') {
+            *empty = false;
+            return true;
+        }
+        if (ch == '/') {
+            *empty = true;
+            return (getch (p, &ch) && ch == '>') || fail (p, "not-well-formed");
+        }
+
+        if (element->n_attrs == XMPP_MAX_ATTRS)
+            return fail (p, "policy-violation");
+        xmpp_attr_t *attr = &element->attrs[element->n_attrs++];
+        if (!read_name (p, &ch, &attr->name))
+            return false;
+        if (is_space (ch) && !skip_space (p, &ch))
+            return false;
+        if (ch != '=')
+            return fail (p, "not-well-formed");
+        if (!skip_space (p, &ch))
+            return false;
+        if (ch != '\'' && ch != '"')
+            return fail (p, "not-well-formed");
+        if (!read_text (p, ch, &attr->value) || !getch (p, &ch))
+            return false;
+        if (!is_space (ch) && ch != '>' && ch != '/')
+            return fail (p, "not-well-formed");
+    }
+}
+
+
+/* Reads an end tag with the expected name, after the "</". */
+static bool
+read_end_tag (P, const char *expected, size_t length)
+{
+    w_buf_t name = W_BUF;
+    int ch;
+    bool ok = getch (p, &ch) && read_name (p, &ch, &name) &&
+        (!is_space (ch) || skip_space (p, &ch));
+
+    if (ok && (ch != '>' || w_buf_size (&name) != length ||
+               memcmp (w_buf_data (&name), expected, length) != 0))
+        ok = fail (p, "not-well-formed");
+
+    w_buf_clear (&name);
+    return ok;
+}
+
+
+/* Reads the content and the end tag of an element. */
+static bool
+read_content (P, xmpp_element_t *element, unsigned depth)
+{
+    xmpp_element_t **tail = &element->children;
+
+    for (;;) {
+        int ch;
+        if (!read_text (p, '<', &element->text) || !getch (p, &ch))
+            return false;
+        if (ch == '/')
+            return read_end_tag (p, w_buf_data (&element->name),
+                                 w_buf_size (&element->name));
+        if (ch == '!' || ch == '?')
+            return fail (p, "restricted-xml");
+        if (depth == XMPP_MAX_DEPTH)
+            return fail (p, "policy-violation");
+
+        xmpp_element_t *child = *tail = w_new0 (xmpp_element_t);
+        tail = &child->next;
+
+        bool empty;
+        if (!read_start_tag (p, ch, child, &empty) ||
+            (!empty && !read_content (p, child, depth + 1)))
+            return false;
+    }
+}
+
+
+/* Skips the XML declaration, after the "<?". */
+static bool
+skip_declaration (P)
+{
+    int ch, last = 0;
+    while (getch (p, &ch)) {
+        if (last == '?' && ch == '>')
+            return true;
+        last = ch;
+    }
+    return false;
+}
+
+
+static inline bool
+name_is (const xmpp_element_t *element, const char *name)
+{
+    return w_buf_size (&element->name) == strlen (name) &&
+        memcmp (w_buf_data (&element->name), name, strlen (name)) == 0;
+}
+
+
+xmpp_event_t
+xmpp_parse (xmpp_parser_t *p, xmpp_element_t **element)
+{
+    w_assert (p);
+    w_assert (element);
+
+    *element = NULL;
+    p->error = NULL;
+
+    for (;;) {
+        int ch;
+        p->bytes = 0;
+        if (!skip_space (p, &ch))
+            goto failed;
+        if (ch != '<') {
+            fail (p, "not-well-formed");
+            goto failed;
+        }
+        if (!getch (p, &ch))
+            goto failed;
+
+        if (ch == '?' && !p->in_stream) {
+            if (!skip_declaration (p))
+                goto failed;
+            continue;
+        }
+        if (ch == '!' || ch == '?') {
+            fail (p, "restricted-xml");
+            goto failed;
+        }
+
+        if (ch == '/') {
+            static const char stream[] = "stream:stream";
+            if ((p->in_stream || fail (p, "not-well-formed")) &&
+                read_end_tag (p, stream, sizeof (stream) - 1))
+                return XMPP_EVENT_CLOSE;
+            goto failed;
+        }
+
+        xmpp_element_t *e = w_new0 (xmpp_element_t);
+        bool empty;
+        if (!read_start_tag (p, ch, e, &empty)) {
+            xmpp_element_free (e);
+            goto failed;
+        }
+
+        if (!p->in_stream) {
+            if (empty || !name_is (e, "stream:stream")) {
+                xmpp_element_free (e);
+                fail (p, "not-well-formed");
+                goto failed;
+            }
+            p->in_stream = true;
+            *element = e;
+            return XMPP_EVENT_STREAM;
+        }
+
+        if (!empty && !read_content (p, e, 1)) {
+            xmpp_element_free (e);
+            goto failed;
+        }
+        *element = e;
+        return XMPP_EVENT_STANZA;
+    }
+
+failed:
+    return p->error ? XMPP_EVENT_ERROR : XMPP_EVENT_EOF;
+}
+
+
+void
+xmpp_element_free (xmpp_element_t *element)
+{
+    while (element) {
+        xmpp_element_t *next = element->next;
+        xmpp_element_free (element->children);
+        for (unsigned i = 0; i < element->n_attrs; i++) {
+            w_buf_clear (&element->attrs[i].name);
+            w_buf_clear (&element->attrs[i].value);
+        }
+        w_buf_clear (&element->name);
+        w_buf_clear (&element->text);
+        w_free (element);
+        element = next;
+    }
+}
+
+
+static xmpp_attr_t*
+find_attr (xmpp_element_t *element, const char *name)
+{
+    const size_t length = strlen (name);
+    for (unsigned i = 0; i < element->n_attrs; i++) {
+        const w_buf_t *attr_name = &element->attrs[i].name;
+        if (w_buf_size (attr_name) == length &&
+            memcmp (w_buf_data (attr_name), name, length) == 0)
+            return &element->attrs[i];
+    }
+    return NULL;
+}
+
+
+const char*
+xmpp_element_attr (xmpp_element_t *element, const char *name)
+{
+    w_assert (element);
+    w_assert (name);
+
+    xmpp_attr_t *attr = find_attr (element, name);
+    return attr ? w_buf_str (&attr->value) : NULL;
+}
+
+
+bool
+xmpp_element_set_attr (xmpp_element_t *element,
+                       const char     *name,
+                       const char     *value)
+{
+    w_assert (element);
+    w_assert (name);
+    w_assert (value);
+
+    xmpp_attr_t *attr = find_attr (element, name);
+    if (!attr) {
+        if (element->n_attrs == XMPP_MAX_ATTRS)
+            return false;
+        attr = &element->attrs[element->n_attrs++];
+        w_buf_set_str (&attr->name, name);
+    }
+    w_buf_set_str (&attr->value, value);
+    return true;
+}
+
+
+xmpp_element_t*
+xmpp_element_child (const xmpp_element_t *element, const char *name)
+{
+    w_assert (element);
+    w_assert (name);
+
+    xmpp_element_t *child = element->children;
+    while (child && !name_is (child, name))
+        child = child->next;
+    return child;
+}
+
+
+bool
+xmpp_element_is_ns (xmpp_element_t *element, const char *ns)
+{
+    w_assert (element);
+    w_assert (ns);
+
+    const char *xmlns = xmpp_element_attr (element, "xmlns");
+    return xmlns && strcmp (xmlns, ns) == 0;
+}
+
+
+/* Text which came from the parser is valid, and needs no repairs. */
+static void
+append_escaped (w_buf_t *out, const char *text, size_t length, bool attribute)
+{
+    while (length) {
+        const char *quote = attribute ? memchr (text, '\'', length) : NULL;
+        const size_t run = quote ? (size_t) (quote - text) : length;
+        xml_text_escape (out, text, run);
+        if (!quote)
+            break;
+        w_buf_append_str (out, "&apos;");
+        text += run + 1;
+        length -= run + 1;
+    }
+}
+
+
+void
+xmpp_append_attr (w_buf_t *out, const char *name, const char *value)
+{
+    w_assert (out);
+    w_assert (name);
+
+    if (value) {
+        w_buf_format (out, " $s='", name);
+        append_escaped (out, value, strlen (value), true);
+        w_buf_append_char (out, '\'');
+    }
+}
+
+
+void
+xmpp_element_write (w_buf_t *out, xmpp_element_t *element)
+{
+    w_assert (out);
+    w_assert (element);
+
+    w_buf_format (out, "<$B", &element->name);
+    for (unsigned i = 0; i < element->n_attrs; i++) {
+        w_buf_format (out, " $B='", &element->attrs[i].name);
+        append_escaped (out, w_buf_data (&element->attrs[i].value),
+                        w_buf_size (&element->attrs[i].value), true);
+        w_buf_append_char (out, '\'');
+    }
+
+    if (!w_buf_size (&element->text) && !element->children) {
+        w_buf_append_str (out, "/>");
+        return;
+    }
+
+    w_buf_append_char (out, '>');
+    append_escaped (out, w_buf_data (&element->text),
+                    w_buf_size (&element->text), false);
+    for (xmpp_element_t *child = element->children; child; child = child->next)
+        xmpp_element_write (out, child);
+    w_buf_format (out, "</$B>", &element->name);
+}
@@ -5,12 +5,826 @@
  * Distributed under terms of the MIT license.
  */
 
-#include "wheel/wheel.h"
+#include "proto-xmpp.h"
+#include "xmpp-route.h"
+#include "xmpp-sm.h"
+#include "xml-text.h"
+#include "admission.h"
+#include "listener.h"
+#include "config.h"
+#include "link.h"
+#include "sasl.h"
+#include "client.h"
+#include <sys/socket.h>
+#include <strings.h>
+
+
+#define NS_CLIENT   "jabber:client"
+#define NS_STREAM   "http://etherx.jabber.org/streams"
+#define NS_STREAMS  "urn:ietf:params:xml:ns:xmpp-streams"
+#define NS_STANZAS  "urn:ietf:params:xml:ns:xmpp-stanzas"
+#define NS_SASL     "urn:ietf:params:xml:ns:xmpp-sasl"
+#define NS_BIND     "urn:ietf:params:xml:ns:xmpp-bind"
+#define NS_SESSION  "urn:ietf:params:xml:ns:xmpp-session"
+#define NS_PING     "urn:xmpp:ping"
+#define NS_SM       "urn:xmpp:sm:3"
+
+
+/*
+ * Clients log in with the accounts of IRC users, as "user@server-name".
+ * Sessions are bound to a full JID in the routing table (xmpp-route.h)
+ * until their stream ends, or with stream management enabled, until the
+ * session expires after losing the connection without being resumed.
+ */
+struct session {
+    w_io_t    *socket;          /* NULL while detached. */
+    w_buf_t    user;            /* Authenticated account, empty until then. */
+    sasl_t     sasl;
+    bool       authenticating;  /* SASL exchange in progress. */
+    jid_t      jid;             /* Bound full JID. */
+
+    /* Stream management, see xmpp-sm.h */
+    xmpp_sm_t *sm;
+    bool       resumable;
+    bool       ack_requested;   /* Sent <r/>, no <a/> received since. */
+    bool       closing;         /* Queue over its bound, not resumable. */
+};
+
+
+static unsigned s_stream_serial = 0;
+static unsigned s_resource_serial = 0;
+
+
+static w_io_result_t
+session_send (struct session *session, const void *data, size_t length)
+{
+    w_io_result_t r = W_IO_RESULT (0);
+    W_IO_CHAIN (r, w_io_write (session->socket, data, length));
+    W_IO_CHAIN (r, w_io_flush (session->socket));
+    return r;
+}
+
+
+static w_io_result_t
+session_send_buf (struct session *session, const w_buf_t *buf)
+{
+    return session_send (session, w_buf_data (buf), w_buf_size (buf));
+}
+
+
+/*
+ * Sends a stanza. With stream management it is also queued until the
+ * client acknowledges it, which is requested unless a request is still
+ * unanswered, and keeps being queued while the session is detached. A
+ * client whose queue goes over its bound gets its stream closed, like
+ * IRC clients over their SendQ (see governor.c), and cannot resume it.
+ */
+static void
+deliver (struct session *session, const w_buf_t *stanza)
+{
+    static const char overflow[] = "<stream:error><policy-violation xmlns='"
+        NS_STREAMS "'/></stream:error></stream:stream>";
+    static const char request[] = "<r xmlns='" NS_SM "'/>";
+
+    if (session->closing)
+        return;
+
+    if (session->sm &&
+        !xmpp_sm_sent (session->sm, w_buf_data (stanza), w_buf_size (stanza))) {
+        if (session->socket) {
+            /* The task of the session sees the connection closed. */
+            const int fd = w_io_get_fd (session->socket);
+            session->closing = true;
+            send (fd, overflow, sizeof (overflow) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            shutdown (fd, SHUT_RDWR);
+        }
+        return;
+    }
+    if (!session->socket)
+        return;
+
+    W_IO_NORESULT (session_send_buf (session, stanza));
+    if (session->sm && !session->ack_requested) {
+        session->ack_requested = true;
+        W_IO_NORESULT (session_send (session, request, sizeof (request) - 1));
+    }
+}
+
+
+static void
+send_stream_header (struct session *session, const config_t *config)
+{
+    w_buf_t out = W_BUF;
+    w_buf_format (&out, "<?xml version='1.0'?>"
+                  "<stream:stream xmlns='" NS_CLIENT "' xmlns:stream='" NS_STREAM "'"
+                  " id='$I' from='$s' version='1.0'><stream:features>",
+                  ++s_stream_serial, link_server_name ());
+
+    if (!w_buf_size (&session->user)) {
+        w_buf_append_str (&out, "<mechanisms xmlns='" NS_SASL "'>");
+        const char *mechanism = sasl_mechanisms (config->auth_agent);
+        while (*mechanism) {
+            const size_t length = strcspn (mechanism, ",");
+            w_buf_append_str (&out, "<mechanism>");
+            w_buf_append_mem (&out, mechanism, length);
+            w_buf_append_str (&out, "</mechanism>");
+            mechanism += length + (mechanism[length] == ',');
+        }
+        w_buf_append_str (&out, "</mechanisms>");
+    } else {
+        w_buf_append_str (&out, "<bind xmlns='" NS_BIND "'/>"
+                          "<session xmlns='" NS_SESSION "'><optional/></session>"
+                          "<sm xmlns='" NS_SM "'/>");
+    }
+
+    w_buf_append_str (&out, "</stream:features>");
+    W_IO_NORESULT (session_send_buf (session, &out));
+    w_buf_clear (&out);
+}
+
+
+static void
+send_stream_error (struct session *session, const char *condition)
+{
+    w_buf_t out = W_BUF;
+    w_buf_format (&out, "<stream:error><$s xmlns='" NS_STREAMS "'/></stream:error>"
+                  "</stream:stream>", condition);
+    W_IO_NORESULT (session_send_buf (session, &out));
+    w_buf_clear (&out);
+}
+
+
+/* Replies to a stanza with an error, unless it is an error itself. */
+static void
+send_stanza_error (struct session *session,
+                   xmpp_element_t *stanza,
+                   const char     *type,
+                   const char     *condition)
+{
+    const char *stanza_type = xmpp_element_attr (stanza, "type");
+    if (stanza_type && strcmp (stanza_type, "error") == 0)
+        return;
+
+    w_buf_t out = W_BUF;
+    w_buf_format (&out, "<$B type='error'", &stanza->name);
+    xmpp_append_attr (&out, "id", xmpp_element_attr (stanza, "id"));
+    xmpp_append_attr (&out, "from", xmpp_element_attr (stanza, "to"));
+    w_buf_format (&out, "><error type='$s'><$s xmlns='" NS_STANZAS "'/></error></$B>",
+                  type, condition, &stanza->name);
+    deliver (session, &out);
+    w_buf_clear (&out);
+}
+
+
+static void
+send_iq_result (struct session *session, xmpp_element_t *iq, const char *payload)
+{
+    w_buf_t out = W_BUF;
+    w_buf_append_str (&out, "<iq type='result'");
+    xmpp_append_attr (&out, "id", xmpp_element_attr (iq, "id"));
+    xmpp_append_attr (&out, "from", xmpp_element_attr (iq, "to"));
+    if (payload)
+        w_buf_format (&out, ">$s</iq>", payload);
+    else
+        w_buf_append_str (&out, "/>");
+    deliver (session, &out);
+    w_buf_clear (&out);
+}
+
+
+static void
+end_sasl (struct session *session)
+{
+    sasl_clear (&session->sasl);
+    session->authenticating = false;
+}
+
+
+static void
+end_session (struct session *session)
+{
+    if (session->sm)
+        xmpp_sm_free (session->sm);
+    if (session->jid.full)
+        xmpp_route_unbind (&session->jid);
+    jid_clear (&session->jid);
+    end_sasl (session);
+    w_buf_clear (&session->user);
+    w_free (session);
+}
+
+
+/* Detached sessions which are not resumed in time, see xmpp-sm.h */
+static void
+expire_session (void *data)
+{
+    struct session *session = data;
+    w_printerr ("xmpp: Session of $s expired\n", atom_str (session->jid.full));
+    session->sm = NULL;
+    end_session (session);
+}
+
+
+/*
+ * Processes a base64 response, where "=" stands for an empty one (RFC
+ * 6120, section 6.4.2). On success the client starts a new stream.
+ */
+static void
+sasl_respond (struct session *session, xmpp_parser_t *parser, const w_buf_t *text)
+{
+    w_buf_t input = W_BUF, output = W_BUF, encoded = W_BUF;
+    const bool empty = w_buf_size (text) == 1 && w_buf_data (text)[0] == '=';
+    sasl_status_t status = SASL_FAILURE;
+
+    if (w_buf_size (text) <= CHATEAU_SASL_MAX_INPUT &&
+        (empty || sasl_base64_decode (&input, w_buf_data (text), w_buf_size (text))))
+        status = sasl_step (&session->sasl, w_buf_data (&input),
+                            w_buf_size (&input), &output);
+
+    /* May hold a password. */
+    memset (w_buf_data (&input), 0x00, w_buf_size (&input));
+    w_buf_clear (&input);
+
+    if (w_buf_size (&output))
+        sasl_base64_encode (&encoded, w_buf_data (&output), w_buf_size (&output));
+    else
+        w_buf_append_char (&encoded, '=');
+
+    w_buf_t reply = W_BUF;
+    switch (status) {
+        case SASL_CONTINUE:
+            w_buf_format (&reply, "<challenge xmlns='" NS_SASL "'>$B</challenge>",
+                          &encoded);
+            break;
+        case SASL_SUCCESS:
+            w_buf_set_str (&session->user, sasl_user (&session->sasl));
+            w_buf_format (&reply, "<success xmlns='" NS_SASL "'>$B</success>",
+                          &encoded);
+            parser->in_stream = false;
+            break;
+        case SASL_FAILURE:
+            w_buf_append_str (&reply, "<failure xmlns='" NS_SASL "'>"
+                              "<not-authorized/></failure>");
+            break;
+    }
+    W_IO_NORESULT (session_send_buf (session, &reply));
+
+    if (status != SASL_CONTINUE)
+        end_sasl (session);
+    w_buf_clear (&reply);
+    w_buf_clear (&encoded);
+    w_buf_clear (&output);
+}
+
+
+/* <auth mechanism="…">initial response</auth>, <response/> and <abort/> */
+static void
+handle_sasl (struct session *session,
+             xmpp_parser_t  *parser,
+             xmpp_element_t *stanza,
+             const config_t *config)
+{
+    const char *failure = NULL;
+
+    if (strcmp (w_buf_str (&stanza->name), "auth") == 0) {
+        const char *mechanism = xmpp_element_attr (stanza, "mechanism");
+        end_sasl (session);
+        if (!mechanism || !sasl_start (&session->sasl, config->auth_agent, mechanism)) {
+            failure = "invalid-mechanism";
+        } else {
+            session->authenticating = true;
+            if (w_buf_size (&stanza->text)) {
+                sasl_respond (session, parser, &stanza->text);
+            } else {
+                W_IO_NORESULT (session_send (session, "<challenge xmlns='" NS_SASL "'/>",
+                                             sizeof ("<challenge xmlns='" NS_SASL "'/>") - 1));
+            }
+        }
+    } else if (strcmp (w_buf_str (&stanza->name), "response") == 0) {
+        if (session->authenticating)
+            sasl_respond (session, parser, &stanza->text);
+        else
+            failure = "malformed-request";
+    } else {
+        failure = session->authenticating ? "aborted" : "malformed-request";
+    }
+
+    if (failure) {
+        w_buf_t out = W_BUF;
+        w_buf_format (&out, "<failure xmlns='" NS_SASL "'><$s/></failure>", failure);
+        W_IO_NORESULT (session_send_buf (session, &out));
+        w_buf_clear (&out);
+        end_sasl (session);
+    }
+}
+
+
+/*
+ * Binds the resource requested by the client, or a generated one. The
+ * resource of a detached session is taken over, ending it; that of a
+ * connected one is not, and the new session gets a conflict error instead
+ * (RFC 6120, section 7.7.2.2).
+ */
+static void
+handle_bind (struct session *session, xmpp_element_t *iq, xmpp_element_t *bind)
+{
+    if (session->jid.full) {
+        send_stanza_error (session, iq, "cancel", "not-allowed");
+        return;
+    }
+
+    w_buf_t text = W_BUF;
+    w_buf_format (&text, "$B@$s/", &session->user, link_server_name ());
+    xmpp_element_t *resource = xmpp_element_child (bind, "resource");
+    if (resource && w_buf_size (&resource->text))
+        w_buf_append_buf (&text, &resource->text);
+    else
+        w_buf_format (&text, "chateau$I", ++s_resource_serial);
+
+    jid_t jid = JID_INIT;
+    if (jid_parse (&jid, w_buf_data (&text), w_buf_size (&text)) && jid.full) {
+        struct session *bound = xmpp_route_lookup (&jid);
+        if (bound && !bound->socket)
+            end_session (bound);
+    }
+
+    if (!jid.full) {
+        send_stanza_error (session, iq, "modify", "bad-request");
+    } else if (!xmpp_route_bind (&jid, session)) {
+        send_stanza_error (session, iq, "cancel", "conflict");
+    } else {
+        session->jid = jid;
+        jid = (jid_t) JID_INIT;
+        admission_registered (w_io_get_fd (session->socket));
+
+        w_buf_t payload = W_BUF;
+        w_buf_append_str (&payload, "<bind xmlns='" NS_BIND "'><jid>");
+        xml_text_escape (&payload, atom_str (session->jid.full),
+                         atom_length (session->jid.full));
+        w_buf_append_str (&payload, "</jid></bind>");
+        send_iq_result (session, iq, w_buf_str (&payload));
+        w_buf_clear (&payload);
+    }
+    jid_clear (&jid);
+    w_buf_clear (&text);
+}
+
+
+static inline bool
+is_server (const char *to)
+{
+    return !to || strcasecmp (to, link_server_name ()) == 0;
+}
+
+
+/*
+ * Sends a message to the local IRC client named by the localpart of a
+ * JID of this server, from the bare JID of the sender. Each line of the
+ * body goes in a PRIVMSG, or a NOTICE for headlines, split at character
+ * boundaries to fit in IRC lines; "/me" becomes a CTCP ACTION. Returns
+ * false if there is no such client.
+ */
+static bool
+send_to_irc (struct session *session, xmpp_element_t *message, const char *to)
+{
+    jid_t jid = JID_INIT;
+    client_t *client = NULL;
+    if (jid_parse (&jid, to, strlen (to))) {
+        const char *bare = atom_str (jid.bare);
+        const char *at = strchr (bare, '@');
+        if (at && strcasecmp (at + 1, link_server_name ()) == 0)
+            client = client_lookup (bare, at - bare);
+    }
+    jid_clear (&jid);
+    if (!client || !client_is_local (client))
+        return false;
+
+    const char *type = xmpp_element_attr (message, "type");
+    xmpp_element_t *body = xmpp_element_child (message, "body");
+    if (!body || (type && strcmp (type, "error") == 0))
+        return true;
+
+    w_buf_t prefix = W_BUF;
+    w_buf_format (&prefix, ":$s!xmpp@$s $s $s :", atom_str (session->jid.bare),
+                  link_server_name (),
+                  (type && strcmp (type, "headline") == 0) ? "NOTICE" : "PRIVMSG",
+                  atom_str (client->nick));
+
+    const char *text = w_buf_data (&body->text);
+    size_t length = w_buf_size (&body->text);
+    const bool action = length > 4 && memcmp (text, "/me ", 4) == 0;
+    if (action) {
+        text += 4;
+        length -= 4;
+    }
+
+    /* Room for at least a few characters of text in each line. */
+    const size_t overhead = w_buf_size (&prefix) + (action ? 9 : 0) + 2;
+    if (overhead + 16 > IRC_MAX_LINE) {
+        send_stanza_error (session, message, "modify", "not-acceptable");
+        w_buf_clear (&prefix);
+        return true;
+    }
+    const size_t room = IRC_MAX_LINE - overhead;
+
+    w_buf_t lines = W_BUF;
+    while (length) {
+        size_t end = 0;
+        while (end < length && text[end] != '\n' && text[end] != '\r')
+            end++;
+        for (size_t done = 0, chunk; done < end; done += chunk) {
+            if ((chunk = end - done) > room) {
+                chunk = room;
+                while (((uint8_t) text[done + chunk] & 0xC0) == 0x80)
+                    chunk--;
+            }
+            w_buf_append_buf (&lines, &prefix);
+            if (action)
+                w_buf_append_str (&lines, "\001ACTION ");
+            w_buf_append_mem (&lines, text + done, chunk);
+            if (action)
+                w_buf_append_char (&lines, '\001');
+            w_buf_append_str (&lines, "\r\n");
+        }
+        if (end < length)
+            end++;
+        text += end;
+        length -= end;
+    }
+
+    if (w_buf_size (&lines))
+        W_IO_NORESULT (client_send (client, w_buf_data (&lines), w_buf_size (&lines)));
+    w_buf_clear (&lines);
+    w_buf_clear (&prefix);
+    return true;
+}
+
+
+/*
+ * Delivers a stanza to the session of the JID it is addressed to, with
+ * the full JID of the sender. Messages to a bare JID go to its preferred
+ * resource, IQs only to full JIDs. Messages for which there is no session
+ * go to the IRC client with the nick of the localpart, if any.
+ */
+static void
+route_stanza (struct session *session, xmpp_element_t *stanza, const char *to)
+{
+    const bool is_iq = strcmp (w_buf_str (&stanza->name), "iq") == 0;
+    const bool is_presence = strcmp (w_buf_str (&stanza->name), "presence") == 0;
+
+    jid_t jid = JID_INIT;
+    struct session *target = NULL;
+    if (jid_parse (&jid, to, strlen (to)) && (jid.full || !is_iq))
+        target = xmpp_route_lookup (&jid);
+    jid_clear (&jid);
+
+    if (!target) {
+        if (!is_iq && !is_presence && send_to_irc (session, stanza, to))
+            return;
+        if (!is_presence)
+            send_stanza_error (session, stanza, "cancel", "service-unavailable");
+        return;
+    }
+    if (!xmpp_element_set_attr (stanza, "from", atom_str (session->jid.full))) {
+        send_stanza_error (session, stanza, "modify", "policy-violation");
+        return;
+    }
+
+    w_buf_t out = W_BUF;
+    xmpp_element_write (&out, stanza);
+    deliver (target, &out);
+    w_buf_clear (&out);
+}
+
+
+static void
+handle_iq (struct session *session, xmpp_element_t *iq)
+{
+    const char *type = xmpp_element_attr (iq, "type");
+    const char *to = xmpp_element_attr (iq, "to");
+
+    if (!type || !xmpp_element_attr (iq, "id")) {
+        send_stanza_error (session, iq, "modify", "bad-request");
+        return;
+    }
+    if (session->jid.full && !is_server (to)) {
+        route_stanza (session, iq, to);
+        return;
+    }
+
+    /* Results and errors for the server need no reply. */
+    if (strcmp (type, "get") != 0 && strcmp (type, "set") != 0)
+        return;
+
+    xmpp_element_t *payload = iq->children;
+    if (payload && xmpp_element_is_ns (payload, NS_BIND)) {
+        handle_bind (session, iq, payload);
+    } else if (!session->jid.full) {
+        send_stanza_error (session, iq, "cancel", "not-allowed");
+    } else if (payload && (xmpp_element_is_ns (payload, NS_SESSION) ||
+                           xmpp_element_is_ns (payload, NS_PING))) {
+        send_iq_result (session, iq, NULL);
+    } else {
+        send_stanza_error (session, iq, "cancel", "service-unavailable");
+    }
+}
+
+
+/* Presence without "to" sets the availability of the session. */
+static void
+handle_presence (struct session *session, xmpp_element_t *presence)
+{
+    const char *to = xmpp_element_attr (presence, "to");
+    if (to) {
+        route_stanza (session, presence, to);
+        return;
+    }
+
+    const char *type = xmpp_element_attr (presence, "type");
+    if (type && strcmp (type, "unavailable") != 0)
+        return;
+
+    xmpp_element_t *priority = xmpp_element_child (presence, "priority");
+    xmpp_route_set_presence (&session->jid, !type,
+                             priority ? atoi (w_buf_str (&priority->text)) : 0);
+}
+
+
+static void
+send_sm_failed (struct session *session, const char *condition)
+{
+    w_buf_t out = W_BUF;
+    w_buf_format (&out, "<failed xmlns='" NS_SM "'><$s xmlns='" NS_STANZAS "'/></failed>",
+                  condition);
+    W_IO_NORESULT (session_send_buf (session, &out));
+    w_buf_clear (&out);
+}
+
+
+static bool
+parse_h (xmpp_element_t *element, uint32_t *h)
+{
+    const char *text = xmpp_element_attr (element, "h");
+    unsigned long value;
+    if (!text || !w_str_uint (text, &value) || value > UINT32_MAX)
+        return false;
+    *h = (uint32_t) value;
+    return true;
+}
+
+
+/*
+ * Resumes a detached session of the same account, which then continues
+ * in this connection and replaces "*sessionp". The stanzas which were
+ * not acknowledged are sent again.
+ */
+static void
+handle_resume (struct session **sessionp, xmpp_element_t *resume)
+{
+    struct session *session = *sessionp;
+    const char *previd = xmpp_element_attr (resume, "previd");
+    w_buf_t gap = W_BUF;
+    uint32_t h;
+
+    xmpp_sm_t *sm = NULL;
+    if (!session->jid.full && previd && parse_h (resume, &h))
+        sm = xmpp_sm_resume (previd, h, &gap);
+
+    struct session *detached = sm ? xmpp_sm_session (sm) : NULL;
+    if (detached && strcmp (w_buf_str (&detached->user),
+                            w_buf_str (&session->user)) != 0) {
+        /* Not for this account to resume. */
+        xmpp_sm_detach (sm);
+        detached = NULL;
+    }
+    if (!detached) {
+        send_sm_failed (session, "item-not-found");
+        w_buf_clear (&gap);
+        return;
+    }
+
+    detached->socket = session->socket;
+    detached->ack_requested = false;
+    end_session (session);
+    *sessionp = session = detached;
+    admission_registered (w_io_get_fd (session->socket));
+
+    w_buf_t out = W_BUF;
+    w_buf_format (&out, "<resumed xmlns='" NS_SM "' h='$L'",
+                  (unsigned long) xmpp_sm_handled (sm));
+    xmpp_append_attr (&out, "previd", previd);
+    w_buf_append_str (&out, "/>");
+    w_buf_append_buf (&out, &gap);
+    if (w_buf_size (&gap)) {
+        session->ack_requested = true;
+        w_buf_append_str (&out, "<r xmlns='" NS_SM "'/>");
+    }
+    W_IO_NORESULT (session_send_buf (session, &out));
+    w_buf_clear (&out);
+    w_buf_clear (&gap);
+    w_printerr ("$s: Session of $s resumed\n", w_task_name (),
+                atom_str (session->jid.full));
+}
+
+
+/*
+ * Stream management (XEP-0198): <enable/>, acknowledgements and their
+ * requests, and <resume/>. Returns false if the stream has to be closed.
+ */
+static bool
+handle_sm (struct session **sessionp, xmpp_element_t *element)
+{
+    struct session *session = *sessionp;
+    const char *name = w_buf_str (&element->name);
+    uint32_t h;
+
+    if (strcmp (name, "enable") == 0) {
+        if (!session->jid.full || session->sm) {
+            send_sm_failed (session, "unexpected-request");
+        } else if (!(session->sm = xmpp_sm_new (session, expire_session))) {
+            send_sm_failed (session, "internal-server-error");
+        } else {
+            const char *resume = xmpp_element_attr (element, "resume");
+            session->resumable = resume && (strcmp (resume, "true") == 0 ||
+                                            strcmp (resume, "1") == 0);
+            w_buf_t out = W_BUF;
+            w_buf_append_str (&out, "<enabled xmlns='" NS_SM "'");
+            if (session->resumable)
+                w_buf_format (&out, " id='$s' resume='true' max='$I'",
+                              xmpp_sm_id (session->sm),
+                              (unsigned) CHATEAU_XMPP_SM_RESUME_TIMEOUT);
+            w_buf_append_str (&out, "/>");
+            W_IO_NORESULT (session_send_buf (session, &out));
+            w_buf_clear (&out);
+        }
+    } else if (strcmp (name, "resume") == 0) {
+        handle_resume (sessionp, element);
+    } else if (!session->sm) {
+        send_sm_failed (session, "unexpected-request");
+    } else if (strcmp (name, "r") == 0) {
+        w_buf_t out = W_BUF;
+        w_buf_format (&out, "<a xmlns='" NS_SM "' h='$L'/>",
+                      (unsigned long) xmpp_sm_handled (session->sm));
+        W_IO_NORESULT (session_send_buf (session, &out));
+        w_buf_clear (&out);
+    } else if (strcmp (name, "a") == 0) {
+        if (!parse_h (element, &h) || !xmpp_sm_ack (session->sm, h)) {
+            send_stream_error (session, "undefined-condition");
+            return false;
+        }
+        session->ack_requested = false;
+    }
+    return true;
+}
+
+
+/* Returns false if the stream has to be closed. */
+static bool
+handle_stanza (struct session **sessionp,
+               xmpp_parser_t   *parser,
+               xmpp_element_t  *stanza,
+               const config_t  *config)
+{
+    struct session *session = *sessionp;
+    const char *name = w_buf_str (&stanza->name);
+
+    if (!w_buf_size (&session->user)) {
+        if (!xmpp_element_is_ns (stanza, NS_SASL)) {
+            send_stream_error (session, "not-authorized");
+            return false;
+        }
+        handle_sasl (session, parser, stanza, config);
+        return true;
+    }
+    if (xmpp_element_is_ns (stanza, NS_SM))
+        return handle_sm (sessionp, stanza);
+
+    if (strcmp (name, "iq") == 0) {
+        handle_iq (session, stanza);
+    } else if (!session->jid.full) {
+        send_stream_error (session, "not-authorized");
+        return false;
+    } else if (strcmp (name, "message") == 0) {
+        const char *to = xmpp_element_attr (stanza, "to");
+        if (!is_server (to))
+            route_stanza (session, stanza, to);
+    } else if (strcmp (name, "presence") == 0) {
+        handle_presence (session, stanza);
+    } else {
+        send_stream_error (session, "unsupported-stanza-type");
+        return false;
+    }
+
+    if (session->sm)
+        xmpp_sm_received (session->sm);
+    return true;
+}
 
 
 void
-proto_xmpp_handler (w_task_listener_t *listener, w_io_t *socket)
+proto_xmpp_handler (listener_t *listener, w_io_t *socket)
 {
     w_printerr ("$s: Client connected\n", w_task_name ());
+
+    struct session *session = w_new0 (struct session);
+    session->socket = socket;
+    session->sasl = (sasl_t) SASL_INIT;
+    session->jid = (jid_t) JID_INIT;
+
+    xmpp_parser_t parser = XMPP_PARSER_INIT (socket);
+    config_t *config = NULL;
+    xmpp_event_t event = XMPP_EVENT_EOF;
+    bool header_sent = false;
+
+    for (bool running = true; running; config_release (&config)) {
+        xmpp_element_t *element;
+        event = xmpp_parse (&parser, &element);
+
+        /* Keeps the configuration alive even if rehashed meanwhile. */
+        config = config_acquire ();
+
+        switch (event) {
+            case XMPP_EVENT_STREAM:
+                send_stream_header (session, config);
+                header_sent = true;
+                break;
+            case XMPP_EVENT_STANZA:
+                running = handle_stanza (&session, &parser, element, config);
+                break;
+            case XMPP_EVENT_CLOSE:
+                W_IO_NORESULT (session_send (session, "</stream:stream>",
+                                             sizeof ("</stream:stream>") - 1));
+                running = false;
+                break;
+            case XMPP_EVENT_ERROR:
+                /* The error goes in a stream, even if the client sent none. */
+                if (!header_sent)
+                    send_stream_header (session, config);
+                send_stream_error (session, parser.error);
+                running = false;
+                break;
+            case XMPP_EVENT_EOF:
+                running = false;
+                break;
+        }
+        xmpp_element_free (element);
+    }
+
+    /* Sessions which lose the connection wait to be resumed. */
+    if (event == XMPP_EVENT_EOF && session->resumable && !session->closing) {
+        w_printerr ("$s: Session of $s detached\n", w_task_name (),
+                    atom_str (session->jid.full));
+        session->socket = NULL;
+        xmpp_sm_detach (session->sm);
+    } else {
+        end_session (session);
+    }
+
     W_IO_NORESULT (w_io_close (socket));
+    w_printerr ("$s: Connection closed\n", w_task_name ());
+}
+
+
+bool
+proto_xmpp_send_from_irc (const char *nick,
+                          bool        notice,
+                          const char *jid,
+                          size_t      jid_length,
+                          const char *text,
+                          size_t      length)
+{
+    w_assert (nick);
+    w_assert (jid);
+    w_assert (text || !length);
+
+    jid_t to = JID_INIT;
+    struct session *session = NULL;
+    if (jid_parse (&to, jid, jid_length))
+        session = xmpp_route_lookup (&to);
+    jid_clear (&to);
+    if (!session)
+        return false;
+
+    static const char action[] = "\001ACTION ";
+    w_buf_t from = W_BUF, out = W_BUF;
+    w_buf_format (&from, "$s@$s", nick, link_server_name ());
+    w_buf_append_str (&out, "<message");
+    xmpp_append_attr (&out, "from", w_buf_str (&from));
+    xmpp_append_attr (&out, "to", atom_str (session->jid.full));
+    w_buf_format (&out, " type='$s'><body>", notice ? "headline" : "chat");
+    if (length > sizeof (action) - 1 &&
+        memcmp (text, action, sizeof (action) - 1) == 0) {
+        text += sizeof (action) - 1;
+        length -= sizeof (action) - 1;
+        if (text[length - 1] == '\001')
+            length--;
+        w_buf_append_str (&out, "/me ");
+    }
+    xml_text_escape (&out, text, length);
+    w_buf_append_str (&out, "</body></message>");
+
+    deliver (session, &out);
+    w_buf_clear (&out);
+    w_buf_clear (&from);
+    return true;
 }
@@ -0,0 +1,117 @@
+/*
+ * proto-xmpp.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef PROTO_XMPP_H
+#define PROTO_XMPP_H
+
+#include "wheel/wheel.h"
+
+/*
+ * The XML of XMPP streams (RFC 6120, section 11): the stream header, and
+ * each stanza as a tree of elements. Comments, processing instructions
+ * other than the XML declaration, DTDs and CDATA sections are refused.
+ * Namespace prefixes are kept as part of the names; streams use the
+ * "stream:" prefix, and stanzas the default namespace.
+ */
+
+#ifndef CHATEAU_XMPP_STANZA_MAX
+#define CHATEAU_XMPP_STANZA_MAX (64 * 1024) /* bytes */
+#endif /* !CHATEAU_XMPP_STANZA_MAX */
+
+enum {
+    XMPP_MAX_ATTRS = 16,
+    XMPP_MAX_DEPTH = 16,
+};
+
+
+typedef struct {
+    w_buf_t name;
+    w_buf_t value;  /* References resolved. */
+} xmpp_attr_t;
+
+typedef struct xmpp_element xmpp_element_t;
+
+struct xmpp_element {
+    w_buf_t          name;
+    xmpp_attr_t      attrs[XMPP_MAX_ATTRS];
+    unsigned         n_attrs;
+    w_buf_t          text;      /* Character data, references resolved. */
+    xmpp_element_t  *children;
+    xmpp_element_t  *next;
+};
+
+
+typedef enum {
+    XMPP_EVENT_ERROR,   /* Sets the stream error condition. */
+    XMPP_EVENT_EOF,
+    XMPP_EVENT_STREAM,  /* Stream header, without children. */
+    XMPP_EVENT_STANZA,  /* Complete child of the stream. */
+    XMPP_EVENT_CLOSE,   /* </stream:stream> */
+} xmpp_event_t;
+
+typedef struct {
+    w_io_t     *input;
+    bool        in_stream;  /* Cleared to expect a new stream header. */
+    bool        eof;
+    size_t      bytes;      /* Read for the current stanza. */
+    const char *error;      /* Condition, see RFC 6120, section 4.9.3 */
+} xmpp_parser_t;
+
+#define XMPP_PARSER_INIT(input) { (input), false, false, 0, NULL }
+
+
+/*
+ * Reads the next stream header or stanza. Whitespace between stanzas is
+ * skipped, and nothing past the end of the stanza is read, so the reply
+ * can be sent before more input arrives. The element is set for
+ * XMPP_EVENT_STREAM and XMPP_EVENT_STANZA, and must be freed.
+ */
+extern xmpp_event_t xmpp_parse (xmpp_parser_t   *parser,
+                                xmpp_element_t **element);
+
+extern void xmpp_element_free (xmpp_element_t *element);
+
+/* Value of an attribute, or NULL if the element does not have it. */
+extern const char* xmpp_element_attr (xmpp_element_t *element,
+                                      const char     *name);
+
+/* Returns false if there is no room for another attribute. */
+extern bool xmpp_element_set_attr (xmpp_element_t *element,
+                                   const char     *name,
+                                   const char     *value);
+
+/* First child with the given name, or NULL. */
+extern xmpp_element_t* xmpp_element_child (const xmpp_element_t *element,
+                                           const char           *name);
+
+/* Whether the element has the given "xmlns" attribute. */
+extern bool xmpp_element_is_ns (xmpp_element_t *element, const char *ns);
+
+/* Appends the element as XML, character data before the children. */
+extern void xmpp_element_write (w_buf_t *out, xmpp_element_t *element);
+
+/* Appends " name='value'", escaped, unless "value" is NULL. */
+extern void xmpp_append_attr (w_buf_t *out, const char *name, const char *value);
+
+
+/*
+ * Delivers a PRIVMSG, or a NOTICE as a headline, from an IRC client to
+ * the XMPP session of a JID, as a message from "nick@server-name". The
+ * text is converted with xml_text_escape(), and a CTCP ACTION becomes
+ * "/me". Returns false if no session takes messages for the JID.
+ *
+ * XMPP clients reach local IRC clients the other way around, sending to
+ * "nick@server-name"; IRC clients see them by their bare JID.
+ */
+extern bool proto_xmpp_send_from_irc (const char *nick,
+                                      bool        notice,
+                                      const char *jid,
+                                      size_t      jid_length,
+                                      const char *text,
+                                      size_t      length);
+
+#endif /* !PROTO_XMPP_H */
@@ -0,0 +1,522 @@
+/*
+ * query.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "query.h"
+#include "channel.h"
+#include "link.h"
+#include "governor.h"
+#include "resolver.h"
+#include "admission.h"
+#include "offline.h"
+#include "xmpp-sm.h"
+#include "hibernate.h"
+#include <limits.h>
+#include <stdlib.h>
+
+
+#ifndef CHATEAU_QUERY_BATCH_LINES
+#define CHATEAU_QUERY_BATCH_LINES 100
+#endif /* !CHATEAU_QUERY_BATCH_LINES */
+
+/* Items looked at between yields, whether they produce lines or not. */
+#ifndef CHATEAU_QUERY_BATCH_ITEMS
+#define CHATEAU_QUERY_BATCH_ITEMS 1000
+#endif /* !CHATEAU_QUERY_BATCH_ITEMS */
+
+#ifndef CHATEAU_QUERY_SENDQ_MAX
+#define CHATEAU_QUERY_SENDQ_MAX (256 * 1024) /* bytes */
+#endif /* !CHATEAU_QUERY_SENDQ_MAX */
+
+
+enum {
+    MAX_FILTERS = 32,
+    MAX_TASKS   = 20,  /* Listed by STATS t. */
+};
+
+
+struct reply {
+    client_t *client;
+    w_buf_t   buf;
+    unsigned  lines;      /* Lines since the last batch was sent. */
+    unsigned  items;      /* Items scanned since then. */
+    bool      truncated;
+};
+
+
+/* Goes through client_send(), so the SendQ of the client accounts it. */
+static bool
+reply_send (struct reply *reply)
+{
+    if (w_buf_size (&reply->buf)) {
+        w_io_result_t r = client_send (reply->client, w_buf_data (&reply->buf),
+                                       w_buf_size (&reply->buf));
+        w_buf_clear (&reply->buf);
+        if (w_io_failed (r))
+            return false;
+    }
+    return true;
+}
+
+
+/*
+ * Called between items. Once a batch of lines is ready, or enough items
+ * were scanned to produce it, sends it and lets other tasks run. Returns
+ * false if generation must stop.
+ */
+static bool
+reply_next (struct reply *reply)
+{
+    if (reply->truncated)
+        return false;
+    if (reply->lines < CHATEAU_QUERY_BATCH_LINES &&
+        ++reply->items < CHATEAU_QUERY_BATCH_ITEMS)
+        return true;
+
+    reply->lines = reply->items = 0;
+    if (!reply_send (reply) ||
+        governor_unsent_bytes (reply->client->socket) > CHATEAU_QUERY_SENDQ_MAX) {
+        reply->truncated = true;
+        return false;
+    }
+    w_task_yield ();
+    return true;
+}
+
+
+static void
+reply_line (struct reply *reply, irc_rpl_t code, const char *format, ...)
+{
+    w_buf_format (&reply->buf, ":$s $I $s ", link_server_name (),
+                  (unsigned) code, client_nick (reply->client));
+
+    va_list args;
+    va_start (args, format);
+    w_io_buf_t io;
+    w_io_buf_init (&io, &reply->buf, true);
+    W_IO_NORESULT (w_io_formatv ((w_io_t*) &io, format, args));
+    va_end (args);
+
+    w_buf_append_str (&reply->buf, "\r\n");
+    reply->lines++;
+}
+
+
+static void
+reply_finish (struct reply *reply)
+{
+    if (reply->truncated) {
+        w_buf_format (&reply->buf, ":$s NOTICE $s :Reply truncated, "
+                      "the output is not being read fast enough\r\n",
+                      link_server_name (), client_nick (reply->client));
+    }
+    reply_send (reply);
+    w_buf_clear (&reply->buf);
+}
+
+
+struct filter {
+    const char *mask;
+    size_t      length;
+};
+
+
+/*
+ * Splits a comma-separated list. Returns the number of items, at most
+ * MAX_FILTERS; the rest are ignored.
+ */
+static unsigned
+split_list (const w_buf_t *list, struct filter items[MAX_FILTERS])
+{
+    const char *p = w_buf_data (list);
+    const char *end = p + w_buf_size (list);
+    unsigned n = 0;
+
+    while (p < end && n < MAX_FILTERS) {
+        const char *comma = memchr (p, ',', end - p);
+        if (!comma)
+            comma = end;
+        if (comma > p)
+            items[n++] = (struct filter) { .mask = p, .length = comma - p };
+        p = comma + 1;
+    }
+    return n;
+}
+
+
+static bool
+parse_count (const char *str, size_t length, unsigned *value)
+{
+    if (length == 0 || length > 9)
+        return false;
+
+    unsigned v = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (str[i] < '0' || str[i] > '9')
+            return false;
+        v = v * 10 + (str[i] - '0');
+    }
+    *value = v;
+    return true;
+}
+
+
+/*
+ * LIST [<channel>{,<channel>}]
+ *
+ * Besides channel names and masks, ">N" and "<N" select channels with
+ * more or less than N users.
+ */
+void
+query_list (client_t *client, const irc_message_t *message)
+{
+    w_assert (client);
+    w_assert (message);
+
+    struct filter items[MAX_FILTERS];
+    mask_t *masks[MAX_FILTERS];
+    unsigned n_masks = 0, min_users = 0, max_users = UINT_MAX;
+    if (message->n_params) {
+        unsigned n = split_list (&message->params[0], items);
+        for (unsigned i = 0; i < n; i++) {
+            unsigned count;
+            if (items[i].mask[0] == '>' &&
+                parse_count (items[i].mask + 1, items[i].length - 1, &count)) {
+                if (count + 1 > min_users)
+                    min_users = count + 1;
+            } else if (items[i].mask[0] == '<' &&
+                       parse_count (items[i].mask + 1, items[i].length - 1, &count)) {
+                if (count < max_users)
+                    max_users = count;
+            } else {
+                masks[n_masks++] = mask_new (items[i].mask, items[i].length);
+            }
+        }
+    }
+
+    channel_t **channels;
+    unsigned n_channels = channel_snapshot (&channels);
+
+    /* Member counts as of the snapshot, for consistent filtering. */
+    unsigned *counts = n_channels ? w_alloc (unsigned, n_channels) : NULL;
+    for (unsigned i = 0; i < n_channels; i++)
+        counts[i] = channels[i]->n_members;
+
+    struct reply reply = { .client = client, .buf = W_BUF };
+    reply_line (&reply, IRC_RPL_LISTSTART, "Channel :Users  Name");
+
+    for (unsigned i = 0; i < n_channels && reply_next (&reply); i++) {
+        if (counts[i] < min_users || counts[i] >= max_users)
+            continue;
+
+        bool matched = (n_masks == 0);
+        for (unsigned j = 0; !matched && j < n_masks; j++)
+            matched = mask_match_folded (masks[j], atom_folded (channels[i]->name),
+                                         atom_length (channels[i]->name));
+        if (matched)
+            reply_line (&reply, IRC_RPL_LIST, "$s $I :",
+                        atom_str (channels[i]->name), counts[i]);
+    }
+
+    reply_line (&reply, IRC_RPL_LISTEND, ":End of /LIST");
+    reply_finish (&reply);
+
+    w_free (counts);
+    channel_snapshot_free (channels, n_channels);
+    for (unsigned i = 0; i < n_masks; i++)
+        mask_free (masks[i]);
+}
+
+
+/* Sends the NAMES lines cached by the channel, which end in CRLF. */
+static void
+names_channel (struct reply *reply, channel_t *channel)
+{
+    const w_buf_t *names = channel_names (channel);
+    const char *line = w_buf_data (names);
+    const char *end = line + w_buf_size (names);
+
+    while (line < end) {
+        const char *next = memchr (line, '\n', end - line) + 1;
+        w_buf_format (&reply->buf, ":$s $I $s ", link_server_name (),
+                      (unsigned) IRC_RPL_NAMREPLY, client_nick (reply->client));
+        w_buf_append_mem (&reply->buf, line, next - line);
+        reply->lines++;
+        line = next;
+    }
+}
+
+
+/*
+ * NAMES [<channel>{,<channel>}]
+ */
+void
+query_names (client_t *client, const irc_message_t *message)
+{
+    w_assert (client);
+    w_assert (message);
+
+    struct reply reply = { .client = client, .buf = W_BUF };
+
+    if (message->n_params) {
+        struct filter items[MAX_FILTERS];
+        unsigned n = split_list (&message->params[0], items);
+        for (unsigned i = 0; i < n && reply_next (&reply); i++) {
+            channel_t *channel = channel_lookup (items[i].mask, items[i].length);
+            if (channel)
+                names_channel (&reply, channel);
+
+            /* Longer items cannot be valid names, and are truncated. */
+            char name[IRC_MAX_LINE];
+            const size_t length = items[i].length < IRC_MAX_LINE
+                                ? items[i].length : IRC_MAX_LINE - 1;
+            memcpy (name, items[i].mask, length);
+            name[length] = '\0';
+            reply_line (&reply, IRC_RPL_ENDOFNAMES, "$s :End of /NAMES list", name);
+        }
+    } else {
+        channel_t **channels;
+        unsigned n_channels = channel_snapshot (&channels);
+        for (unsigned i = 0; i < n_channels && reply_next (&reply); i++)
+            names_channel (&reply, channels[i]);
+        channel_snapshot_free (channels, n_channels);
+        reply_line (&reply, IRC_RPL_ENDOFNAMES, "* :End of /NAMES list");
+    }
+
+    reply_finish (&reply);
+}
+
+
+void
+query_join (client_t *client, channel_t *channel)
+{
+    w_assert (client);
+    w_assert (channel);
+
+    struct reply reply = { .client = client, .buf = W_BUF };
+    names_channel (&reply, channel);
+    reply_line (&reply, IRC_RPL_ENDOFNAMES, "$s :End of /NAMES list",
+                atom_str (channel->name));
+    reply_finish (&reply);
+}
+
+
+static void
+who_client (struct reply *reply, const char *channel, const client_t *client)
+{
+    char host[IRC_MAX_LINE];
+    if (client->server)
+        irc_buf_cstr (&client->server->name, host);
+    else
+        strcpy (host, link_server_name ());
+
+    /* No user names, hosts or real names yet: the nick stands for them. */
+    const char *nick = atom_str (client->nick);
+    reply_line (reply, IRC_RPL_WHOREPLY, "$s $s $s $s $s H$s :$I $s",
+                channel, nick, host, host, nick,
+                client->oper ? "*" : "",
+                client->server ? client->server->hops : 0,
+                nick);
+}
+
+
+/*
+ * WHO [<name> [o]]
+ */
+void
+query_who (client_t *client, const irc_message_t *message)
+{
+    w_assert (client);
+    w_assert (message);
+
+    char mask[IRC_MAX_LINE] = "*";
+    size_t mask_length = 1;
+    if (message->n_params && w_buf_size (&message->params[0])) {
+        irc_buf_cstr (&message->params[0], mask);
+        mask_length = strlen (mask);
+        if (strcmp (mask, "0") == 0) {
+            mask[0] = '*';
+            mask_length = 1;
+        }
+    }
+    const bool opers_only = message->n_params > 1 &&
+        w_buf_size (&message->params[1]) == 1 &&
+        w_buf_data (&message->params[1])[0] == 'o';
+
+    struct reply reply = { .client = client, .buf = W_BUF };
+
+    /*
+     * Either way, the clients are referenced upfront: they may quit, or
+     * leave the channel, while other tasks run between batches.
+     */
+    channel_t *channel = channel_lookup (mask, mask_length);
+    mask_t *compiled = NULL;
+    unsigned n_clients;
+    client_t **clients;
+    if (channel) {
+        n_clients = channel->n_members;
+        clients = n_clients ? w_alloc (client_t*, n_clients) : NULL;
+        for (unsigned i = 0; i < n_clients; i++)
+            clients[i] = w_obj_ref (channel->members[i]);
+    } else {
+        compiled = mask_new (mask, mask_length);
+        n_clients = client_count ();
+        clients = n_clients ? w_alloc (client_t*, n_clients) : NULL;
+        for (unsigned i = 0; i < n_clients; i++)
+            clients[i] = w_obj_ref (client_at (i));
+    }
+
+    for (unsigned i = 0; i < n_clients && reply_next (&reply); i++) {
+        /* Skips clients gone while other tasks were running. */
+        if (client_is_registered (clients[i]) &&
+            (!opers_only || clients[i]->oper) &&
+            (!compiled || client_match_mask (clients[i], compiled)))
+            who_client (&reply, compiled ? "*" : mask, clients[i]);
+    }
+
+    for (unsigned i = 0; i < n_clients; i++)
+        w_obj_unref (clients[i]);
+    w_free (clients);
+    if (compiled)
+        mask_free (compiled);
+
+    reply_line (&reply, IRC_RPL_ENDOFWHO, "$s :End of /WHO list", mask);
+    reply_finish (&reply);
+}
+
+
+static const char*
+level_name (governor_level_t level)
+{
+    switch (level) {
+        case GOVERNOR_LEVEL_OK:         return "ok";
+        case GOVERNOR_LEVEL_THROTTLE:   return "throttling";
+        case GOVERNOR_LEVEL_SHED:       return "shedding history";
+        case GOVERNOR_LEVEL_DISCONNECT: return "disconnecting";
+    }
+    return "unknown";
+}
+
+
+static int
+compare_run_time (const void *a, const void *b)
+{
+    const uint64_t ta = (*(client_t* const*) a)->share.run_time;
+    const uint64_t tb = (*(client_t* const*) b)->share.run_time;
+    return (ta < tb) - (ta > tb);
+}
+
+
+/* Local clients which took the most time to handle, heaviest first. */
+static void
+stats_tasks (struct reply *reply)
+{
+    const unsigned n_clients = client_local_count ();
+    client_t **clients = n_clients ? w_alloc (client_t*, n_clients) : NULL;
+    for (unsigned i = 0; i < n_clients; i++)
+        clients[i] = client_local_at (i);
+    qsort (clients, n_clients, sizeof (client_t*), compare_run_time);
+
+    for (unsigned i = 0; i < n_clients && i < MAX_TASKS; i++) {
+        const fairshare_t *share = &clients[i]->share;
+        reply_line (reply, IRC_RPL_STATSDEBUG,
+                    ":$s $L messages in $L us, $L turns cut",
+                    client_nick (clients[i]), share->messages,
+                    (unsigned long) (share->run_time / 1000), share->yields);
+    }
+    w_free (clients);
+}
+
+
+/*
+ * STATS [<query>]
+ */
+void
+query_stats (client_t *client, const irc_message_t *message)
+{
+    w_assert (client);
+    w_assert (message);
+
+    char letter[IRC_MAX_LINE] = "*";
+    if (message->n_params && w_buf_size (&message->params[0]))
+        irc_buf_cstr (&message->params[0], letter);
+
+    struct reply reply = { .client = client, .buf = W_BUF };
+
+    const bool privileged = strcmp (letter, "z") == 0 || strcmp (letter, "t") == 0;
+    if (privileged && !client->oper) {
+        reply_line (&reply, IRC_RPL_NOPRIVILEGES,
+                    ":Permission Denied- You're not an IRC operator");
+    } else if (strcmp (letter, "z") == 0) {
+        governor_stats_t stats;
+        governor_get_stats (&stats);
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":Memory $L of $L bytes, $s",
+                    (unsigned long) stats.total, (unsigned long) stats.budget,
+                    level_name (stats.level));
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":Clients $I, $I throttled, sendq $L bytes, recvq $L bytes",
+                    stats.clients, stats.throttled,
+                    (unsigned long) stats.sendq, (unsigned long) stats.recvq);
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":History $L bytes, $I atoms in $L bytes",
+                    (unsigned long) stats.history, atom_count (),
+                    (unsigned long) stats.atoms);
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":SendQ user $L, oper $L bytes, $L exceeded",
+                    (unsigned long) stats.sendq_user,
+                    (unsigned long) stats.sendq_oper,
+                    stats.sendq_kills);
+
+        resolver_stats_t resolver;
+        resolver_get_stats (&resolver);
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":Resolver $I cached, $L hits, $L misses, $L timeouts",
+                    resolver.entries, resolver.hits, resolver.misses,
+                    resolver.timeouts);
+
+        admission_stats_t admission;
+        admission_get_stats (&admission);
+        unsigned long rejected = 0;
+        for (unsigned i = 0; i < ADMISSION_N_RESULTS; i++)
+            rejected += admission.rejected[i];
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":Connections $L admitted, $L rejected, $I pending, $I tracked",
+                    admission.admitted, rejected, admission.pending,
+                    admission.tracked);
+
+        fairshare_stats_t share;
+        fairshare_get_stats (&share);
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":Handled $L messages in $L ms, $L turns cut, longest turn $L us",
+                    share.messages, (unsigned long) (share.run_time / 1000000),
+                    share.yields, (unsigned long) (share.longest_turn / 1000));
+
+        hibernate_stats_t hibernate;
+        hibernate_get_stats (&hibernate);
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":Hibernating $I connections, $L hibernations, $L wakeups",
+                    hibernate.parked, hibernate.hibernations, hibernate.wakeups);
+
+        offline_stats_t offline;
+        offline_get_stats (&offline);
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":Offline $I mailboxes in $L bytes, $L stored, $L delivered, $L rejected",
+                    offline.mailboxes, (unsigned long) offline.bytes,
+                    offline.stored, offline.delivered, offline.rejected);
+
+        xmpp_sm_stats_t sm;
+        xmpp_sm_get_stats (&sm);
+        reply_line (&reply, IRC_RPL_STATSDEBUG,
+                    ":XMPP $I detached sessions with $L bytes queued, $L resumed, $L dropped",
+                    sm.detached, (unsigned long) sm.bytes, sm.resumed, sm.dropped);
+    } else if (strcmp (letter, "t") == 0) {
+        stats_tasks (&reply);
+    }
+
+    reply_line (&reply, IRC_RPL_ENDOFSTATS, "$s :End of /STATS report", letter);
+    reply_finish (&reply);
+}
@@ -0,0 +1,37 @@
+/*
+ * query.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "channel.h"
+#include "proto-irc.h"
+
+/*
+ * Replies to LIST, NAMES and WHO. These may produce many lines, so they
+ * are generated from a snapshot of the channels or clients, in batches:
+ * other tasks run in between, and the reply is cut short if the client
+ * does not read it fast enough. Filters are applied while scanning.
+ */
+extern void query_list  (client_t *client, const irc_message_t *message);
+extern void query_names (client_t *client, const irc_message_t *message);
+extern void query_who   (client_t *client, const irc_message_t *message);
+
+/*
+ * Sends the member list to a client which just joined the channel. Lines
+ * are rendered once per channel and shared by every joiner, see
+ * channel_names().
+ */
+extern void query_join (client_t *client, channel_t *channel);
+
+/*
+ * STATS z reports memory usage, as accounted by the governor, and STATS t
+ * the local clients which took the most time to handle.
+ */
+extern void query_stats (client_t *client, const irc_message_t *message);
+
+#endif /* !QUERY_H */
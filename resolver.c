@@ -0,0 +1,584 @@
+/*
+ * resolver.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "resolver.h"
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <strings.h>
+#include <time.h>
+
+
+enum {
+    DNS_HEADER_SIZE = 12,
+    DNS_MAX_UDP     = 512,
+    DNS_MAX_NAME    = 255,
+    DNS_MAX_POINTERS = 16,  /* Compression pointers followed per name. */
+
+    DNS_TYPE_A      = 1,
+    DNS_TYPE_PTR    = 12,
+    DNS_TYPE_AAAA   = 28,
+    DNS_CLASS_IN    = 1,
+
+    DNS_RCODE_NXDOMAIN = 3,
+
+    /* Longer names are not used as hosts, like in most IRC servers. */
+    MAX_HOST = 63,
+};
+
+
+struct cache_entry {
+    atom_t *host;     /* NULL for addresses without a confirmed name. */
+    time_t  expires;
+};
+
+/* Sockets of a lookup in progress; "epoll" is readable when either is. */
+struct lookup {
+    int       sock;
+    int       timer;
+    w_io_t   *epoll;
+    uint16_t  id;
+};
+
+typedef enum {
+    REPLY_FOUND,
+    REPLY_NOT_FOUND,  /* Authoritative, can be cached. */
+    REPLY_FAILED,
+} reply_t;
+
+
+static struct sockaddr_storage s_server;
+static socklen_t               s_server_length = 0;  /* Zero when off. */
+static w_dict_t               *s_cache = NULL;
+static resolver_stats_t        s_stats = { 0, };
+
+
+static bool
+parse_server (const char *address, struct sockaddr_storage *out, socklen_t *length)
+{
+    char host[INET6_ADDRSTRLEN + 2];
+    const char *port = NULL;
+
+    if (address[0] == '[') {
+        const char *end = strchr (address, ']');
+        if (!end || (end[1] && end[1] != ':') || (size_t) (end - address - 1) >= sizeof (host))
+            return false;
+        memcpy (host, address + 1, end - address - 1);
+        host[end - address - 1] = '\0';
+        port = end[1] ? end + 2 : NULL;
+    } else {
+        const char *colon = strchr (address, ':');
+        const bool ipv6 = colon && strchr (colon + 1, ':');
+        size_t host_length = (colon && !ipv6) ? (size_t) (colon - address) : strlen (address);
+        if (host_length >= sizeof (host))
+            return false;
+        memcpy (host, address, host_length);
+        host[host_length] = '\0';
+        port = (colon && !ipv6) ? colon + 1 : NULL;
+    }
+
+    /* Only numeric addresses, resolving these would need a resolver. */
+    const struct addrinfo hints = {
+        .ai_family   = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+        .ai_flags    = AI_NUMERICHOST | AI_NUMERICSERV,
+    };
+    struct addrinfo *addresses;
+    if (getaddrinfo (host, port ? port : "53", &hints, &addresses) != 0)
+        return false;
+
+    memcpy (out, addresses->ai_addr, addresses->ai_addrlen);
+    *length = addresses->ai_addrlen;
+    freeaddrinfo (addresses);
+    return true;
+}
+
+
+/* First "nameserver" line of resolv.conf, or the loopback address. */
+static void
+system_server (char out[INET6_ADDRSTRLEN + 1])
+{
+    strcpy (out, "127.0.0.1");
+
+    w_io_t *io = w_io_unix_open (CHATEAU_RESOLVER_CONF, O_RDONLY, 0);
+    if (!io)
+        return;
+
+    w_buf_t line = W_BUF;
+    w_buf_t overflow = W_BUF;
+    for (bool found = false; !found;) {
+        w_io_result_t r = w_io_read_line (io, &line, &overflow, 0);
+        if (w_io_failed (r) || (w_io_eof (r) && !w_buf_size (&line)))
+            break;
+
+        char address[INET6_ADDRSTRLEN + 1];
+        if (sscanf (w_buf_str (&line), " nameserver %46s", address) == 1) {
+            strcpy (out, address);
+            found = true;
+        }
+        w_buf_clear (&line);
+        if (w_io_eof (r))
+            break;
+    }
+
+    w_buf_clear (&line);
+    w_buf_clear (&overflow);
+    W_IO_NORESULT (w_io_close (io));
+    w_obj_unref (io);
+}
+
+
+bool
+resolver_set_server (const char *address)
+{
+    if (address && strcmp (address, "off") == 0) {
+        s_server_length = 0;
+        return true;
+    }
+
+    char system[INET6_ADDRSTRLEN + 1];
+    if (!address) {
+        system_server (system);
+        address = system;
+    }
+
+    struct sockaddr_storage server;
+    socklen_t length;
+    if (!parse_server (address, &server, &length))
+        return false;
+
+    s_server = server;
+    s_server_length = length;
+    return true;
+}
+
+
+/* Raw bytes of an address; IPv4 addresses mapped in IPv6 are unmapped. */
+static size_t
+address_bytes (const struct sockaddr *addr, socklen_t length, uint8_t out[16])
+{
+    if (addr->sa_family == AF_INET && length >= sizeof (struct sockaddr_in)) {
+        memcpy (out, &((const struct sockaddr_in*) addr)->sin_addr, 4);
+        return 4;
+    }
+    if (addr->sa_family == AF_INET6 && length >= sizeof (struct sockaddr_in6)) {
+        const struct in6_addr *in6 = &((const struct sockaddr_in6*) addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED (in6)) {
+            memcpy (out, &in6->s6_addr[12], 4);
+            return 4;
+        }
+        memcpy (out, in6->s6_addr, 16);
+        return 16;
+    }
+    return 0;
+}
+
+
+static void
+ptr_name (w_buf_t *name, const uint8_t *bytes, size_t length)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    if (length == 4) {
+        w_buf_format (name, "$I.$I.$I.$I.in-addr.arpa",
+                      (unsigned) bytes[3], (unsigned) bytes[2],
+                      (unsigned) bytes[1], (unsigned) bytes[0]);
+    } else {
+        for (size_t i = length; i-- > 0;) {
+            w_buf_append_char (name, hex[bytes[i] & 0x0F]);
+            w_buf_append_char (name, '.');
+            w_buf_append_char (name, hex[bytes[i] >> 4]);
+            w_buf_append_char (name, '.');
+        }
+        w_buf_append_str (name, "ip6.arpa");
+    }
+}
+
+
+static inline void
+put_u16 (w_buf_t *buf, uint16_t value)
+{
+    w_buf_append_char (buf, value >> 8);
+    w_buf_append_char (buf, value & 0xFF);
+}
+
+static inline uint16_t
+get_u16 (const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t
+get_u32 (const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+
+static bool
+encode_query (w_buf_t *packet, uint16_t id, const char *name, uint16_t type)
+{
+    put_u16 (packet, id);
+    put_u16 (packet, 0x0100);  /* Recursion desired. */
+    put_u16 (packet, 1);       /* Questions. */
+    put_u16 (packet, 0);
+    put_u16 (packet, 0);
+    put_u16 (packet, 0);
+
+    if (strlen (name) > DNS_MAX_NAME - 2)
+        return false;
+    for (const char *label = name; *label;) {
+        const size_t length = strcspn (label, ".");
+        if (length == 0 || length > 63)
+            return false;
+        w_buf_append_char (packet, (char) length);
+        w_buf_append_mem (packet, label, length);
+        label += length + (label[length] == '.');
+    }
+    w_buf_append_char (packet, '\0');
+    put_u16 (packet, type);
+    put_u16 (packet, DNS_CLASS_IN);
+    return true;
+}
+
+
+/*
+ * Reads a possibly compressed name at "*offset", which is advanced past
+ * it. The name is appended to "out" in dotted form, unless NULL.
+ */
+static bool
+read_name (const uint8_t *msg, size_t size, size_t *offset, w_buf_t *out)
+{
+    size_t pos = *offset;
+    size_t end = 0;
+    unsigned pointers = 0;
+    size_t total = 0;
+
+    for (;;) {
+        if (pos >= size)
+            return false;
+        const uint8_t length = msg[pos];
+        if ((length & 0xC0) == 0xC0) {
+            if (pos + 1 >= size || ++pointers > DNS_MAX_POINTERS)
+                return false;
+            if (!end)
+                end = pos + 2;
+            pos = ((length & 0x3F) << 8) | msg[pos + 1];
+            continue;
+        }
+        if (length & 0xC0)
+            return false;
+        if (length == 0) {
+            pos++;
+            break;
+        }
+        if (pos + 1 + length > size || (total += length + 1) > DNS_MAX_NAME)
+            return false;
+        if (out) {
+            if (w_buf_size (out))
+                w_buf_append_char (out, '.');
+            w_buf_append_mem (out, msg + pos + 1, length);
+        }
+        pos += 1 + length;
+    }
+
+    *offset = end ? end : pos;
+    return true;
+}
+
+
+/* Names which can be shown as the host in "nick!user@host". */
+static bool
+host_is_valid (const char *host, size_t length)
+{
+    if (length == 0 || length > MAX_HOST || host[0] == '.' || host[0] == '-')
+        return false;
+    for (size_t i = 0; i < length; i++)
+        if (!isalnum ((unsigned char) host[i]) && host[i] != '.' && host[i] != '-')
+            return false;
+    return true;
+}
+
+
+/*
+ * Checks the header and the question of a reply, and looks at the answers
+ * of type "type". For PTR the first name is stored in "name"; for A and
+ * AAAA the reply is found only if one of them is "addr".
+ */
+static reply_t
+parse_reply (const uint8_t *msg, size_t size, uint16_t id, const char *question,
+             uint16_t type, const uint8_t *addr, size_t addr_length,
+             w_buf_t *name, uint32_t *ttl)
+{
+    if (size < DNS_HEADER_SIZE || get_u16 (msg) != id)
+        return REPLY_FAILED;
+
+    const uint16_t flags = get_u16 (msg + 2);
+    if (!(flags & 0x8000) || (flags & 0x7800) || (flags & 0x0200))
+        return REPLY_FAILED;  /* Not a reply, not a query, or truncated. */
+    if ((flags & 0x000F) == DNS_RCODE_NXDOMAIN)
+        return REPLY_NOT_FOUND;
+    if (flags & 0x000F)
+        return REPLY_FAILED;
+    if (get_u16 (msg + 4) != 1)
+        return REPLY_FAILED;
+
+    size_t offset = DNS_HEADER_SIZE;
+    w_buf_t qname = W_BUF;
+    const bool same = (read_name (msg, size, &offset, &qname) &&
+                       offset + 4 <= size &&
+                       get_u16 (msg + offset) == type &&
+                       w_buf_size (&qname) == strlen (question) &&
+                       strncasecmp (w_buf_data (&qname), question, w_buf_size (&qname)) == 0);
+    w_buf_clear (&qname);
+    if (!same)
+        return REPLY_FAILED;
+    offset += 4;
+
+    reply_t result = REPLY_NOT_FOUND;
+    for (unsigned n = get_u16 (msg + 6); n > 0 && result != REPLY_FOUND; n--) {
+        if (!read_name (msg, size, &offset, NULL) || offset + 10 > size)
+            return REPLY_FAILED;
+        const uint16_t rr_type = get_u16 (msg + offset);
+        const uint16_t rr_class = get_u16 (msg + offset + 2);
+        const uint32_t rr_ttl = get_u32 (msg + offset + 4);
+        const uint16_t rr_length = get_u16 (msg + offset + 8);
+        offset += 10;
+        if (offset + rr_length > size)
+            return REPLY_FAILED;
+
+        if (rr_type == type && rr_class == DNS_CLASS_IN) {
+            if (type == DNS_TYPE_PTR) {
+                size_t rdata = offset;
+                w_buf_clear (name);
+                if (read_name (msg, size, &rdata, name) &&
+                    host_is_valid (w_buf_data (name), w_buf_size (name)))
+                    result = REPLY_FOUND;
+            } else if (rr_length == addr_length &&
+                       memcmp (msg + offset, addr, addr_length) == 0) {
+                result = REPLY_FOUND;
+            }
+            if (result == REPLY_FOUND)
+                *ttl = rr_ttl;
+        }
+        offset += rr_length;
+    }
+    return result;
+}
+
+
+static void
+lookup_close (struct lookup *lookup)
+{
+    if (lookup->epoll) {
+        W_IO_NORESULT (w_io_close (lookup->epoll));
+        w_obj_unref (lookup->epoll);
+    }
+    if (lookup->timer >= 0)
+        close (lookup->timer);
+    if (lookup->sock >= 0)
+        close (lookup->sock);
+}
+
+
+static bool
+lookup_open (struct lookup *lookup)
+{
+    *lookup = (struct lookup) { .sock = -1, .timer = -1, .epoll = NULL };
+
+    lookup->sock = socket (s_server.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    lookup->timer = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int epoll = epoll_create1 (EPOLL_CLOEXEC);
+    if (epoll >= 0)
+        lookup->epoll = w_io_unix_open_fd (epoll);
+    if (lookup->sock < 0 || lookup->timer < 0 || epoll < 0)
+        return false;
+
+    const struct itimerspec deadline = {
+        .it_value = {
+            .tv_sec  = CHATEAU_RESOLVER_TIMEOUT / 1000,
+            .tv_nsec = (CHATEAU_RESOLVER_TIMEOUT % 1000) * 1000000L,
+        },
+    };
+    struct epoll_event event = { .events = EPOLLIN };
+    return connect (lookup->sock, (struct sockaddr*) &s_server, s_server_length) == 0
+        && timerfd_settime (lookup->timer, 0, &deadline, NULL) == 0
+        && epoll_ctl (epoll, EPOLL_CTL_ADD, lookup->sock, &event) == 0
+        && epoll_ctl (epoll, EPOLL_CTL_ADD, lookup->timer, &event) == 0;
+}
+
+
+/*
+ * Sends a query and yields until a reply with its identifier arrives, or
+ * the deadline of the lookup passes. Returns the size of the reply, or
+ * zero on failure.
+ */
+static size_t
+lookup_query (struct lookup *lookup, const char *name, uint16_t type,
+              uint8_t reply[DNS_MAX_UDP])
+{
+    uint16_t id;
+    getentropy (&id, sizeof (id));
+    lookup->id = id;
+
+    w_buf_t packet = W_BUF;
+    const bool encoded = encode_query (&packet, id, name, type);
+    const bool sent = encoded && send (lookup->sock, w_buf_data (&packet),
+                                       w_buf_size (&packet), 0) >= 0;
+    w_buf_clear (&packet);
+    if (!sent)
+        return 0;
+
+    for (;;) {
+        ssize_t r = recv (lookup->sock, reply, DNS_MAX_UDP, 0);
+        if (r >= DNS_HEADER_SIZE && get_u16 (reply) == id)
+            return (size_t) r;
+        if (r >= 0 || errno == EINTR)
+            continue;  /* Stale or bogus, keep waiting. */
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return 0;
+
+        uint64_t expirations;
+        if (read (lookup->timer, &expirations, sizeof (expirations)) == sizeof (expirations)) {
+            s_stats.timeouts++;
+            return 0;
+        }
+        w_task_yield_io_read (lookup->epoll);
+    }
+}
+
+
+/* PTR, then A or AAAA of the name, which must point back to the address. */
+static reply_t
+resolve (const uint8_t *addr, size_t addr_length, w_buf_t *host, uint32_t *ttl)
+{
+    struct lookup lookup;
+    if (!lookup_open (&lookup)) {
+        lookup_close (&lookup);
+        return REPLY_FAILED;
+    }
+
+    uint8_t reply[DNS_MAX_UDP];
+    w_buf_t question = W_BUF;
+    ptr_name (&question, addr, addr_length);
+
+    uint32_t ptr_ttl = 0;
+    size_t size = lookup_query (&lookup, w_buf_str (&question), DNS_TYPE_PTR, reply);
+    reply_t result = size
+        ? parse_reply (reply, size, lookup.id, w_buf_str (&question), DNS_TYPE_PTR,
+                       NULL, 0, host, &ptr_ttl)
+        : REPLY_FAILED;
+
+    if (result == REPLY_FOUND) {
+        const uint16_t type = (addr_length == 4) ? DNS_TYPE_A : DNS_TYPE_AAAA;
+        w_buf_set_str (&question, w_buf_str (host));
+        size = lookup_query (&lookup, w_buf_str (&question), type, reply);
+        result = size
+            ? parse_reply (reply, size, lookup.id, w_buf_str (&question), type,
+                           addr, addr_length, NULL, ttl)
+            : REPLY_FAILED;
+        if (ptr_ttl < *ttl)
+            *ttl = ptr_ttl;
+    }
+
+    w_buf_clear (&question);
+    lookup_close (&lookup);
+    return result;
+}
+
+
+static void
+cache_clear (void)
+{
+    w_dict_foreach (s_cache, i) {
+        struct cache_entry *entry = *i;
+        atom_unref (entry->host);
+        w_free (entry);
+    }
+    w_dict_clear (s_cache);
+}
+
+
+static void
+cache_store (const char *key, atom_t *host, time_t expires)
+{
+    if (!s_cache)
+        s_cache = w_dict_new (false);
+
+    struct cache_entry *entry = w_dict_get (s_cache, key);
+    if (!entry) {
+        /* Cheaper than tracking ages, and refilled quickly. */
+        if (w_dict_size (s_cache) >= CHATEAU_RESOLVER_CACHE_MAX)
+            cache_clear ();
+        entry = w_new0 (struct cache_entry);
+        w_dict_set (s_cache, key, entry);
+    }
+    atom_unref (entry->host);
+    entry->host = host ? atom_ref (host) : NULL;
+    entry->expires = expires;
+}
+
+
+atom_t*
+resolver_lookup (const struct sockaddr *addr, socklen_t length)
+{
+    w_assert (addr);
+
+    uint8_t bytes[16];
+    const size_t n_bytes = address_bytes (addr, length, bytes);
+    if (!n_bytes || !s_server_length)
+        return NULL;
+
+    char key[INET6_ADDRSTRLEN];
+    inet_ntop (n_bytes == 4 ? AF_INET : AF_INET6, bytes, key, sizeof (key));
+
+    const time_t now = time (NULL);
+    struct cache_entry *entry = s_cache ? w_dict_get (s_cache, key) : NULL;
+    if (entry && entry->expires > now) {
+        s_stats.hits++;
+        return entry->host ? atom_ref (entry->host) : NULL;
+    }
+    s_stats.misses++;
+
+    w_buf_t name = W_BUF;
+    uint32_t ttl = UINT32_MAX;
+    atom_t *host = NULL;
+
+    switch (resolve (bytes, n_bytes, &name, &ttl)) {
+        case REPLY_FOUND:
+            host = atom_intern (w_buf_data (&name), w_buf_size (&name));
+            if (ttl > 0)
+                cache_store (key, host, now + (ttl < CHATEAU_RESOLVER_MAX_TTL
+                                               ? ttl : CHATEAU_RESOLVER_MAX_TTL));
+            break;
+        case REPLY_NOT_FOUND:
+            cache_store (key, NULL, now + CHATEAU_RESOLVER_NEGATIVE_TTL);
+            break;
+        case REPLY_FAILED:
+            /* Maybe the server is just slow now, ask again next time. */
+            break;
+    }
+
+    w_buf_clear (&name);
+    return host;
+}
+
+
+void
+resolver_get_stats (resolver_stats_t *stats)
+{
+    w_assert (stats);
+    *stats = s_stats;
+    stats->entries = s_cache ? w_dict_size (s_cache) : 0;
+}
@@ -0,0 +1,69 @@
+/*
+ * resolver.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include "atom.h"
+#include <sys/socket.h>
+
+/*
+ * Reverse DNS lookups usable from tasks. The PTR record of an address is
+ * asked to the name server over UDP, and the name obtained is only used if
+ * its A or AAAA records lead back to the same address. Waiting for replies
+ * yields to the scheduler, so other tasks keep running.
+ *
+ * Results, both names and failures, are kept in a cache shared by all the
+ * lookups, for as long as the records say (within limits).
+ */
+
+#ifndef CHATEAU_RESOLVER_TIMEOUT
+#define CHATEAU_RESOLVER_TIMEOUT 1500 /* ms, for the whole lookup */
+#endif /* !CHATEAU_RESOLVER_TIMEOUT */
+
+#ifndef CHATEAU_RESOLVER_MAX_TTL
+#define CHATEAU_RESOLVER_MAX_TTL (60 * 60) /* s */
+#endif /* !CHATEAU_RESOLVER_MAX_TTL */
+
+#ifndef CHATEAU_RESOLVER_NEGATIVE_TTL
+#define CHATEAU_RESOLVER_NEGATIVE_TTL (5 * 60) /* s */
+#endif /* !CHATEAU_RESOLVER_NEGATIVE_TTL */
+
+#ifndef CHATEAU_RESOLVER_CACHE_MAX
+#define CHATEAU_RESOLVER_CACHE_MAX 4096 /* entries */
+#endif /* !CHATEAU_RESOLVER_CACHE_MAX */
+
+#ifndef CHATEAU_RESOLVER_CONF
+#define CHATEAU_RESOLVER_CONF "/etc/resolv.conf"
+#endif /* !CHATEAU_RESOLVER_CONF */
+
+
+/*
+ * Sets the name server as "address[:port]", with IPv6 addresses in
+ * brackets when a port is given. NULL picks the first one listed in
+ * CHATEAU_RESOLVER_CONF, and "off" disables lookups. Returns false if the
+ * address is not valid, leaving the previous one in use.
+ */
+extern bool resolver_set_server (const char *address);
+
+/*
+ * Returns the confirmed name of "addr", or NULL if it has none, it cannot
+ * be confirmed, or the lookup did not finish in CHATEAU_RESOLVER_TIMEOUT.
+ * The returned atom is a new reference.
+ */
+extern atom_t* resolver_lookup (const struct sockaddr *addr, socklen_t length);
+
+typedef struct {
+    unsigned      entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long timeouts;
+} resolver_stats_t;
+
+extern void resolver_get_stats (resolver_stats_t *stats);
+
+#endif /* !RESOLVER_H */
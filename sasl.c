@@ -0,0 +1,416 @@
+/*
+ * sasl.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "sasl.h"
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#include <string.h>
+#include <stddef.h>
+
+
+enum {
+    NONCE_SIZE = 18,  /* Random bytes, 24 characters in base64. */
+};
+
+
+static const char s_mechanisms_plain[] = "PLAIN";
+static const char s_mechanisms_all[]   = "PLAIN,SCRAM-SHA-256";
+
+static unsigned s_mock_iterations = CHATEAU_SCRAM_ITERATIONS;
+static uint8_t  s_mock_secret[AUTH_SCRAM_KEY_SIZE];
+static bool     s_mock_secret_set = false;
+
+
+const char*
+sasl_mechanisms (auth_agent_t *agent)
+{
+    w_assert (agent);
+    return auth_agent_has_scram_keys (agent) ? s_mechanisms_all : s_mechanisms_plain;
+}
+
+
+void
+sasl_base64_encode (w_buf_t *out, const void *data, size_t length)
+{
+    w_assert (out);
+
+    const size_t offset = w_buf_size (out);
+    w_buf_resize (out, offset + 4 * ((length + 2) / 3) + 1);
+    const int n = EVP_EncodeBlock ((unsigned char*) w_buf_data (out) + offset,
+                                   data, (int) length);
+    w_buf_resize (out, offset + n);
+}
+
+
+bool
+sasl_base64_decode (w_buf_t *out, const char *text, size_t length)
+{
+    w_assert (out);
+
+    if (length % 4)
+        return false;
+
+    const size_t offset = w_buf_size (out);
+    w_buf_resize (out, offset + 3 * (length / 4) + 1);
+    const int n = EVP_DecodeBlock ((unsigned char*) w_buf_data (out) + offset,
+                                   (const unsigned char*) text, (int) length);
+    if (n < 0) {
+        w_buf_resize (out, offset);
+        return false;
+    }
+
+    /* The decoder counts padding as zero bytes. */
+    size_t padding = 0;
+    if (length && text[length - 1] == '=') padding++;
+    if (length > 1 && text[length - 2] == '=') padding++;
+    w_buf_resize (out, offset + n - padding);
+    return true;
+}
+
+
+static inline void
+hmac_sha256 (const uint8_t key[AUTH_SCRAM_KEY_SIZE],
+             const void   *data,
+             size_t        length,
+             uint8_t       out[AUTH_SCRAM_KEY_SIZE])
+{
+    HMAC (EVP_sha256 (), key, AUTH_SCRAM_KEY_SIZE, data, length, out, NULL);
+}
+
+
+bool
+sasl_scram_derive (const char *pass, unsigned iterations, auth_scram_keys_t *keys)
+{
+    w_assert (pass);
+    w_assert (keys);
+    w_assert (iterations > 0);
+
+    uint8_t salted[AUTH_SCRAM_KEY_SIZE];
+    uint8_t client_key[AUTH_SCRAM_KEY_SIZE];
+
+    if (RAND_bytes (keys->salt, sizeof (keys->salt)) != 1 ||
+        !PKCS5_PBKDF2_HMAC (pass, strlen (pass), keys->salt, sizeof (keys->salt),
+                            (int) iterations, EVP_sha256 (),
+                            sizeof (salted), salted))
+        return false;
+
+    keys->iterations = iterations;
+    hmac_sha256 (salted, "Client Key", 10, client_key);
+    SHA256 (client_key, sizeof (client_key), keys->stored_key);
+    hmac_sha256 (salted, "Server Key", 10, keys->server_key);
+
+    OPENSSL_cleanse (salted, sizeof (salted));
+    OPENSSL_cleanse (client_key, sizeof (client_key));
+    return true;
+}
+
+
+void
+sasl_set_scram_iterations (unsigned iterations)
+{
+    w_assert (iterations > 0);
+    s_mock_iterations = iterations;
+}
+
+
+/*
+ * The salt is the same for a name every time, as a real one would be, and
+ * the keys are random, so the proof cannot match.
+ */
+static bool
+mock_scram_keys (sasl_t *sasl)
+{
+    if (!s_mock_secret_set) {
+        if (RAND_bytes (s_mock_secret, sizeof (s_mock_secret)) != 1)
+            return false;
+        s_mock_secret_set = true;
+    }
+
+    uint8_t salt[AUTH_SCRAM_KEY_SIZE];
+    hmac_sha256 (s_mock_secret, w_buf_data (&sasl->user), w_buf_size (&sasl->user), salt);
+    memcpy (sasl->keys.salt, salt, sizeof (sasl->keys.salt));
+    sasl->keys.iterations = s_mock_iterations;
+    sasl->mock = true;
+    return RAND_bytes (sasl->keys.stored_key, sizeof (sasl->keys.stored_key)) == 1 &&
+           RAND_bytes (sasl->keys.server_key, sizeof (sasl->keys.server_key)) == 1;
+}
+
+
+bool
+sasl_start (sasl_t *sasl, auth_agent_t *agent, const char *mechanism)
+{
+    w_assert (sasl);
+    w_assert (agent);
+    w_assert (mechanism);
+
+    sasl_clear (sasl);
+    if (strcmp (mechanism, "PLAIN") == 0) {
+        sasl->mechanism = SASL_PLAIN;
+    } else if (strcmp (mechanism, "SCRAM-SHA-256") == 0 &&
+               auth_agent_has_scram_keys (agent)) {
+        sasl->mechanism = SASL_SCRAM_SHA_256;
+    } else {
+        return false;
+    }
+    sasl->agent = w_obj_ref (agent);
+    return true;
+}
+
+
+const char*
+sasl_user (sasl_t *sasl)
+{
+    w_assert (sasl);
+    return w_buf_size (&sasl->user) ? w_buf_str (&sasl->user) : NULL;
+}
+
+
+void
+sasl_clear (sasl_t *sasl)
+{
+    w_assert (sasl);
+
+    if (sasl->agent)
+        w_obj_unref (sasl->agent);
+    w_buf_clear (&sasl->user);
+    w_buf_clear (&sasl->nonce);
+    w_buf_clear (&sasl->gs2_header);
+    w_buf_clear (&sasl->auth_message);
+    OPENSSL_cleanse (&sasl->keys, sizeof (sasl->keys));
+    *sasl = (sasl_t) SASL_INIT;
+}
+
+
+/* authzid NUL authcid NUL passwd, where authzid may only be authcid. */
+static sasl_status_t
+step_plain (sasl_t *sasl, const char *input, size_t length)
+{
+    const char *authzid = input;
+    const char *end = input + length;
+    const char *authcid = memchr (authzid, '\0', length);
+    if (!authcid++)
+        return SASL_FAILURE;
+    const char *pass = memchr (authcid, '\0', end - authcid);
+    if (!pass++ || memchr (pass, '\0', end - pass))
+        return SASL_FAILURE;
+
+    const size_t authcid_length = pass - authcid - 1;
+    if (authcid_length == 0 ||
+        (authcid != authzid + 1 &&
+         ((size_t) (authcid - authzid - 1) != authcid_length ||
+          memcmp (authzid, authcid, authcid_length) != 0)))
+        return SASL_FAILURE;
+
+    w_buf_t password = W_BUF;
+    w_buf_append_mem (&sasl->user, authcid, authcid_length);
+    w_buf_append_mem (&password, pass, end - pass);
+
+    const bool ok = auth_agent_authenticate (sasl->agent,
+                                             w_buf_str (&sasl->user),
+                                             w_buf_str (&password));
+    OPENSSL_cleanse (w_buf_data (&password), w_buf_size (&password));
+    w_buf_clear (&password);
+    if (!ok)
+        return SASL_FAILURE;
+
+    return SASL_SUCCESS;
+}
+
+
+/* Decodes a saslname, where "=2C" is a comma and "=3D" an equals sign. */
+static bool
+unescape_saslname (w_buf_t *out, const char *name, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        if (name[i] == ',')
+            return false;
+        if (name[i] != '=') {
+            w_buf_append_char (out, name[i]);
+        } else if (length - i >= 3 && memcmp (name + i, "=2C", 3) == 0) {
+            w_buf_append_char (out, ',');
+            i += 2;
+        } else if (length - i >= 3 && memcmp (name + i, "=3D", 3) == 0) {
+            w_buf_append_char (out, '=');
+            i += 2;
+        } else {
+            return false;
+        }
+    }
+    return w_buf_size (out) > 0;
+}
+
+
+/*
+ * client-first-message = gs2-header client-first-message-bare
+ * gs2-header           = ("n" / "y") "," [ "a=" authzid ] ","
+ * client-first-bare    = "n=" saslname ",r=" c-nonce ["," extensions]
+ *
+ * Channel binding ("p=") is not supported, and the authzid is ignored.
+ */
+static sasl_status_t
+step_scram_first (sasl_t *sasl, const char *input, size_t length, w_buf_t *out)
+{
+    const char *end = input + length;
+    if (length < 3 || (input[0] != 'n' && input[0] != 'y') || input[1] != ',')
+        return SASL_FAILURE;
+
+    const char *bare = memchr (input + 2, ',', length - 2);
+    if (!bare++)
+        return SASL_FAILURE;
+    w_buf_append_mem (&sasl->gs2_header, input, bare - input);
+
+    if (end - bare < 2 || memcmp (bare, "n=", 2) != 0)
+        return SASL_FAILURE;
+    const char *name = bare + 2;
+    const char *name_end = memchr (name, ',', end - name);
+    if (!name_end || !unescape_saslname (&sasl->user, name, name_end - name))
+        return SASL_FAILURE;
+
+    const char *cnonce = name_end + 1;
+    if (end - cnonce < 3 || memcmp (cnonce, "r=", 2) != 0)
+        return SASL_FAILURE;
+    cnonce += 2;
+    const char *cnonce_end = memchr (cnonce, ',', end - cnonce);
+    if (!cnonce_end)
+        cnonce_end = end;
+    if (cnonce_end == cnonce)
+        return SASL_FAILURE;
+
+    if (!auth_agent_scram_keys (sasl->agent, w_buf_str (&sasl->user), &sasl->keys) &&
+        !mock_scram_keys (sasl))
+        return SASL_FAILURE;
+
+    uint8_t random[NONCE_SIZE];
+    if (RAND_bytes (random, sizeof (random)) != 1)
+        return SASL_FAILURE;
+    w_buf_append_mem (&sasl->nonce, cnonce, cnonce_end - cnonce);
+    sasl_base64_encode (&sasl->nonce, random, sizeof (random));
+
+    w_buf_t server_first = W_BUF;
+    w_buf_format (&server_first, "r=$B,s=", &sasl->nonce);
+    sasl_base64_encode (&server_first, sasl->keys.salt, sizeof (sasl->keys.salt));
+    w_buf_format (&server_first, ",i=$I", sasl->keys.iterations);
+
+    w_buf_append_mem (&sasl->auth_message, bare, end - bare);
+    w_buf_append_char (&sasl->auth_message, ',');
+    w_buf_append_buf (&sasl->auth_message, &server_first);
+    w_buf_append_buf (out, &server_first);
+    w_buf_clear (&server_first);
+    return SASL_CONTINUE;
+}
+
+
+/*
+ * client-final-message = "c=" base64(gs2-header) ",r=" nonce
+ *                        ["," extensions] ",p=" base64(ClientProof)
+ *
+ * ClientSignature := HMAC(StoredKey, AuthMessage)
+ * ClientKey       := ClientProof XOR ClientSignature
+ * valid           := H(ClientKey) == StoredKey
+ */
+static sasl_status_t
+step_scram_final (sasl_t *sasl, const char *input, size_t length, w_buf_t *out)
+{
+    const char *end = input + length;
+
+    /* The proof is always the last attribute. */
+    const char *proof = NULL;
+    for (const char *p = end; p - input >= 3; p--) {
+        if (memcmp (p - 3, ",p=", 3) == 0) {
+            proof = p;
+            break;
+        }
+    }
+    if (!proof)
+        return SASL_FAILURE;
+    const char *without_proof_end = proof - 3;
+
+    w_buf_t expected = W_BUF;
+    w_buf_append_str (&expected, "c=");
+    sasl_base64_encode (&expected, w_buf_data (&sasl->gs2_header),
+                        w_buf_size (&sasl->gs2_header));
+    w_buf_format (&expected, ",r=$B", &sasl->nonce);
+    const size_t prefix = w_buf_size (&expected);
+    const bool bound = (without_proof_end - input >= (ptrdiff_t) prefix &&
+                        memcmp (input, w_buf_data (&expected), prefix) == 0 &&
+                        (without_proof_end - input == (ptrdiff_t) prefix ||
+                         input[prefix] == ','));
+    w_buf_clear (&expected);
+    if (!bound)
+        return SASL_FAILURE;
+
+    w_buf_t client_proof = W_BUF;
+    if (!sasl_base64_decode (&client_proof, proof, end - proof) ||
+        w_buf_size (&client_proof) != AUTH_SCRAM_KEY_SIZE) {
+        w_buf_clear (&client_proof);
+        return SASL_FAILURE;
+    }
+
+    w_buf_append_char (&sasl->auth_message, ',');
+    w_buf_append_mem (&sasl->auth_message, input, without_proof_end - input);
+
+    uint8_t signature[AUTH_SCRAM_KEY_SIZE];
+    uint8_t client_key[AUTH_SCRAM_KEY_SIZE];
+    uint8_t stored_key[AUTH_SCRAM_KEY_SIZE];
+    hmac_sha256 (sasl->keys.stored_key, w_buf_data (&sasl->auth_message),
+                 w_buf_size (&sasl->auth_message), signature);
+    for (unsigned i = 0; i < AUTH_SCRAM_KEY_SIZE; i++)
+        client_key[i] = ((const uint8_t*) w_buf_data (&client_proof))[i] ^ signature[i];
+    SHA256 (client_key, sizeof (client_key), stored_key);
+    w_buf_clear (&client_proof);
+
+    const bool valid = CRYPTO_memcmp (stored_key, sasl->keys.stored_key,
+                                      AUTH_SCRAM_KEY_SIZE) == 0 && !sasl->mock;
+    OPENSSL_cleanse (client_key, sizeof (client_key));
+    if (!valid)
+        return SASL_FAILURE;
+
+    hmac_sha256 (sasl->keys.server_key, w_buf_data (&sasl->auth_message),
+                 w_buf_size (&sasl->auth_message), signature);
+    w_buf_append_str (out, "v=");
+    sasl_base64_encode (out, signature, sizeof (signature));
+    return SASL_CONTINUE;
+}
+
+
+sasl_status_t
+sasl_step (sasl_t *sasl, const void *input, size_t length, w_buf_t *out)
+{
+    w_assert (sasl);
+    w_assert (out);
+    w_assert (sasl->mechanism != SASL_NONE);
+
+    const unsigned step = sasl->step++;
+    sasl_status_t status = SASL_FAILURE;
+
+    switch (sasl->mechanism) {
+        case SASL_PLAIN:
+            if (step == 0)
+                status = step_plain (sasl, input, length);
+            break;
+
+        case SASL_SCRAM_SHA_256:
+            if (step == 0)
+                status = step_scram_first (sasl, input, length, out);
+            else if (step == 1)
+                status = step_scram_final (sasl, input, length, out);
+            else if (step == 2 && length == 0)
+                status = SASL_SUCCESS;  /* Client checked the signature. */
+            break;
+
+        case SASL_NONE:
+            break;
+    }
+
+    /* Names are only reported for exchanges which succeed. */
+    if (status == SASL_FAILURE)
+        w_buf_clear (&sasl->user);
+    return status;
+}
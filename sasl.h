@@ -0,0 +1,101 @@
+/*
+ * sasl.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef SASL_H
+#define SASL_H
+
+#include "auth.h"
+
+/*
+ * Server side of SASL, shared by the protocols. Supports PLAIN, which
+ * passes the password to the authentication agent, and SCRAM-SHA-256
+ * (RFC 7677), which is offered only when the agent provides derived keys,
+ * so that verifying a login takes one HMAC instead of running PBKDF2.
+ *
+ * Exchanges work on raw bytes; both IRC and XMPP carry them in base64,
+ * for which helpers are provided.
+ */
+
+#ifndef CHATEAU_SCRAM_ITERATIONS
+#define CHATEAU_SCRAM_ITERATIONS 4096
+#endif /* !CHATEAU_SCRAM_ITERATIONS */
+
+#ifndef CHATEAU_SASL_MAX_INPUT
+#define CHATEAU_SASL_MAX_INPUT 8192
+#endif /* !CHATEAU_SASL_MAX_INPUT */
+
+
+typedef enum {
+    SASL_CONTINUE,  /* Send the output as a challenge. */
+    SASL_SUCCESS,
+    SASL_FAILURE,
+} sasl_status_t;
+
+typedef enum {
+    SASL_NONE = 0,
+    SASL_PLAIN,
+    SASL_SCRAM_SHA_256,
+} sasl_mechanism_t;
+
+typedef struct {
+    auth_agent_t      *agent;
+    sasl_mechanism_t   mechanism;
+    unsigned           step;
+    w_buf_t            user;
+    w_buf_t            nonce;
+    w_buf_t            gs2_header;
+    w_buf_t            auth_message;
+    auth_scram_keys_t  keys;
+    bool               mock;  /* Unknown user, fails at the last step. */
+} sasl_t;
+
+#define SASL_INIT { NULL, SASL_NONE, 0, W_BUF, W_BUF, W_BUF, W_BUF, \
+                    { { 0 }, 0, { 0 }, { 0 } }, false }
+
+
+/* Comma-separated list of the mechanisms usable with "agent". */
+extern const char* sasl_mechanisms (auth_agent_t *agent);
+
+/*
+ * Begins an exchange. Returns false if the mechanism is unknown, or not
+ * usable with the agent. Keeps a reference to the agent until cleared.
+ */
+extern bool sasl_start (sasl_t           *sasl,
+                        auth_agent_t     *agent,
+                        const char       *mechanism);
+
+/*
+ * Processes a response from the client, and appends the next challenge
+ * to "out". Once SASL_SUCCESS is returned, sasl_user() gives the name
+ * which was authenticated.
+ */
+extern sasl_status_t sasl_step (sasl_t     *sasl,
+                                const void *input,
+                                size_t      length,
+                                w_buf_t    *out);
+
+extern const char* sasl_user (sasl_t *sasl);
+
+/* Forgets the exchange and any secrets derived during it. */
+extern void sasl_clear (sasl_t *sasl);
+
+/*
+ * Iterations announced to unknown users, which get a salt made up from
+ * their name, so that they cannot be told apart from existing ones
+ * (RFC 5802, section 5.1). Should match the ones of the real keys.
+ */
+extern void sasl_set_scram_iterations (unsigned iterations);
+
+/* Derives the keys stored for "pass", with a new random salt. */
+extern bool sasl_scram_derive (const char        *pass,
+                               unsigned           iterations,
+                               auth_scram_keys_t *keys);
+
+extern void sasl_base64_encode (w_buf_t *out, const void *data, size_t length);
+extern bool sasl_base64_decode (w_buf_t *out, const char *text, size_t length);
+
+#endif /* !SASL_H */
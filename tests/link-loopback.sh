@@ -0,0 +1,186 @@
+#! /bin/bash
+#
+# link-loopback.sh
+# Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+#
+# Distributed under terms of the MIT license.
+#
+# Starts three chateaud processes on the loopback interface, links them in
+# a chain (a - b - c), and checks that the burst, JOINs, channel modes and
+# messages cross both links, and that a link which would close a loop is
+# refused.
+# Run with "make check", or pass the chateaud binary as first argument.
+#
+
+set -e
+
+CHATEAUD=${1:-./chateaud}
+BASE_PORT=${CHATEAU_TEST_PORT:-16660}
+TIMEOUT=5
+
+workdir=$(mktemp -d)
+pids=( )
+
+cleanup () {
+    for pid in "${pids[@]}" ; do
+        kill "${pid}" 2> /dev/null || true
+    done
+    wait 2> /dev/null || true
+    rm -rf "${workdir}"
+}
+trap cleanup EXIT
+
+fail () {
+    echo "FAIL: $*" 1>&2
+    for log in "${workdir}"/*.log ; do
+        echo "--- ${log##*/}" 1>&2
+        tail -n 20 "${log}" 1>&2
+    done
+    exit 1
+}
+
+port_of () {
+    case $1 in
+        a) echo $(( BASE_PORT + 0 )) ;;
+        b) echo $(( BASE_PORT + 2 )) ;;
+        c) echo $(( BASE_PORT + 4 )) ;;
+    esac
+}
+
+# start_server name peer...
+start_server () {
+    local name=$1 port
+    port=$(port_of "${name}")
+    shift
+    {
+        echo "server-name     ${name}.test"
+        echo "server-info     Loopback test server ${name}"
+        echo "listen-irc      tcp:127.0.0.1:${port}"
+        echo "listen-xmpp     tcp:127.0.0.1:$(( port + 1 ))"
+        echo "resolver        off"
+        echo "hibernate-idle  0"
+        echo "user  op    op3rat0r"
+        echo "user  joe   jo3jo3"
+        echo "user  tom   t0mt0m"
+        echo "oper  op    op3rat0r"
+        for peer in "$@" ; do
+            echo "link  ${peer}.test  l1nkp4ss  127.0.0.1:$(port_of "${peer}")"
+        done
+    } > "${workdir}/${name}.conf"
+
+    "${CHATEAUD}" -c "${workdir}/${name}.conf" > "${workdir}/${name}.log" 2>&1 &
+    pids+=( $! )
+
+    for (( i = 0 ; i < 50 ; i++ )) ; do
+        if (exec 9<> "/dev/tcp/127.0.0.1/${port}") 2> /dev/null ; then
+            return
+        fi
+        sleep 0.1
+    done
+    fail "server ${name} did not start"
+}
+
+# connect fd server nick password
+connect () {
+    eval "exec $1<> /dev/tcp/127.0.0.1/$(port_of "$2")" \
+        || fail "cannot connect to server $2"
+    send "$1" "PASS $4"
+    send "$1" "NICK $3"
+    expect "$1" " 001 $3 "
+}
+
+send () {
+    printf '%s\r\n' "$2" >&"$1"
+}
+
+# expect fd pattern: reads lines until one contains the pattern.
+expect () {
+    local line
+    while IFS= read -r -t "${TIMEOUT}" -u "$1" line ; do
+        if [[ ${line} = *"$2"* ]] ; then
+            return
+        fi
+    done
+    fail "expected '$2' on fd $1"
+}
+
+
+# wait_link fd server: polls LINKS until the server is listed.
+wait_link () {
+    local line
+    for (( i = 0 ; i < TIMEOUT * 10 ; i++ )) ; do
+        send "$1" "LINKS"
+        while IFS= read -r -t "${TIMEOUT}" -u "$1" line ; do
+            if [[ ${line} = *" 364 "*" $2 "* ]] ; then
+                return
+            elif [[ ${line} = *" 365 "* ]] ; then
+                break
+            fi
+        done
+        sleep 0.1
+    done
+    fail "server $2 not linked"
+}
+
+
+start_server a b
+start_server b a c
+start_server c b
+
+connect 3 c tom t0mt0m
+send 3 "JOIN #loop"
+expect 3 " 366 "
+
+# Operator privileges depend on OPER, not on the nick.
+connect 4 b joe jo3jo3
+send 4 "OPER op op3rat0r"
+expect 4 " 381 "
+send 4 "CONNECT c.test"
+wait_link 4 c.test
+echo "PASS: b - c linked"
+
+connect 5 a op op3rat0r
+send 5 "OPER op op3rat0r"
+expect 5 " 381 "
+send 5 "CONNECT b.test"
+wait_link 5 b.test
+wait_link 5 c.test
+echo "PASS: a - b linked, c known from the burst"
+
+send 5 "CONNECT c.test"
+expect 5 " 402 "
+echo "PASS: link closing a loop refused"
+
+send 5 "JOIN #loop"
+expect 5 " 366 "
+expect 3 ":op JOIN #loop"
+send 5 "PRIVMSG #loop :across two links"
+expect 3 "PRIVMSG #loop :across two links"
+echo "PASS: channel traffic crosses two links"
+
+send 5 "NAMES #loop"
+expect 5 "@tom"
+echo "PASS: channel operators known from the burst"
+
+send 3 "MODE #loop +b *!*@evil.test"
+expect 5 ":tom MODE #loop +b *!*@evil.test"
+send 5 "MODE #loop b"
+expect 5 " 367 op #loop *!*@evil.test"
+echo "PASS: bans cross two links"
+
+send 3 "PRIVMSG op :and back"
+expect 5 "PRIVMSG op :and back"
+echo "PASS: private message routed back"
+
+send 4 "SQUIT a.test :test done"
+expect 3 ":op QUIT"
+echo "PASS: clients behind a split link quit"
+
+send 3 "MODE #loop +b *!*@split.test"
+send 5 "CONNECT b.test"
+wait_link 5 c.test
+send 5 "MODE #loop b"
+expect 5 " 367 op #loop *!*@split.test"
+echo "PASS: bans set during a split sent in the burst"
+
+echo "All link tests passed"
@@ -0,0 +1,255 @@
+#! /bin/bash
+#
+# xmpp-loopback.sh
+# Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+#
+# Distributed under terms of the MIT license.
+#
+# Starts a chateaud process on the loopback interface, logs in XMPP
+# clients, and checks authentication, resource binding, the routing of
+# stanzas between them, stream management with session resumption, and
+# messages between XMPP and IRC clients.
+# Run with "make check", or pass the chateaud binary as first argument.
+#
+
+set -e
+
+CHATEAUD=${1:-./chateaud}
+BASE_PORT=${CHATEAU_TEST_PORT:-16670}
+IRC_PORT=${BASE_PORT}
+XMPP_PORT=$(( BASE_PORT + 1 ))
+DOMAIN=x.test
+TIMEOUT=5
+
+workdir=$(mktemp -d)
+pid=
+
+cleanup () {
+    if [[ -n ${pid} ]] ; then
+        kill "${pid}" 2> /dev/null || true
+        wait 2> /dev/null || true
+    fi
+    rm -rf "${workdir}"
+}
+trap cleanup EXIT
+
+fail () {
+    echo "FAIL: $*" 1>&2
+    echo "--- chateaud.log" 1>&2
+    tail -n 20 "${workdir}/chateaud.log" 1>&2
+    exit 1
+}
+
+start_server () {
+    {
+        echo "server-name     ${DOMAIN}"
+        echo "server-info     Loopback test server"
+        echo "listen-irc      tcp:127.0.0.1:${IRC_PORT}"
+        echo "listen-xmpp     tcp:127.0.0.1:${XMPP_PORT}"
+        echo "resolver        off"
+        echo "hibernate-idle  0"
+        echo "user  op    op3rat0r"
+        echo "user  joe   jo3jo3"
+        echo "user  tom   t0mt0m"
+    } > "${workdir}/chateaud.conf"
+
+    "${CHATEAUD}" -c "${workdir}/chateaud.conf" > "${workdir}/chateaud.log" 2>&1 &
+    pid=$!
+
+    for (( i = 0 ; i < 50 ; i++ )) ; do
+        if (exec 9<> "/dev/tcp/127.0.0.1/${XMPP_PORT}") 2> /dev/null ; then
+            return
+        fi
+        sleep 0.1
+    done
+    fail "server did not start"
+}
+
+send () {
+    printf '%s' "$2" >&"$1"
+}
+
+open_stream () {
+    send "$1" "<?xml version='1.0'?><stream:stream to='${DOMAIN}' version='1.0' xmlns='jabber:client' xmlns:stream='http://etherx.jabber.org/streams'>"
+}
+
+# expect fd pattern: reads up to each ">" until the input contains the
+# pattern; what was read is kept in ${got}.
+expect () {
+    local chunk
+    got=
+    while IFS= read -r -d '>' -t "${TIMEOUT}" -u "$1" chunk ; do
+        got+="${chunk}>"
+        if [[ ${got} = *"$2"* ]] ; then
+            return
+        fi
+    done
+    fail "expected '$2' on fd $1, got '${got}'"
+}
+
+# expect_line fd pattern: same, for the lines of an IRC connection.
+expect_line () {
+    local line
+    while IFS= read -r -t "${TIMEOUT}" -u "$1" line ; do
+        if [[ ${line} = *"$2"* ]] ; then
+            got=${line%$'\r'}
+            return
+        fi
+    done
+    fail "expected line with '$2' on fd $1"
+}
+
+# login fd user password: authenticates with SASL PLAIN.
+login () {
+    eval "exec $1<> /dev/tcp/127.0.0.1/${XMPP_PORT}" \
+        || fail "cannot connect"
+    open_stream "$1"
+    expect "$1" "<mechanism>PLAIN</mechanism>"
+    expect "$1" "</stream:features>"
+    send "$1" "<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='PLAIN'>$(printf '\0%s\0%s' "$2" "$3" | base64)</auth>"
+}
+
+# bind fd resource: starts the stream after authentication, and binds.
+bind () {
+    expect "$1" "<success"
+    open_stream "$1"
+    expect "$1" "urn:ietf:params:xml:ns:xmpp-bind"
+    expect "$1" "</stream:features>"
+    send "$1" "<iq type='set' id='b1'><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'><resource>$2</resource></bind></iq>"
+}
+
+
+start_server
+
+login 3 joe wrongpass
+expect 3 "<not-authorized/>"
+echo "PASS: wrong password refused"
+
+send 3 "<auth xmlns='urn:ietf:params:xml:ns:xmpp-sasl' mechanism='PLAIN'>$(printf '\0joe\0jo3jo3' | base64)</auth>"
+bind 3 phone
+expect 3 "<jid>joe@${DOMAIN}/phone</jid>"
+send 3 "<iq type='set' id='s1'><session xmlns='urn:ietf:params:xml:ns:xmpp-session'/></iq>"
+expect 3 "id='s1'"
+echo "PASS: login and bind"
+
+login 4 tom t0mt0m
+bind 4 desk
+expect 4 "<jid>tom@${DOMAIN}/desk</jid>"
+send 4 "<presence><priority>5</priority></presence>"
+
+login 5 joe jo3jo3
+bind 5 phone
+expect 5 "<conflict"
+echo "PASS: bound resource not taken over"
+send 5 "</stream:stream>"
+expect 5 "</stream:stream>"
+exec 5>&-
+
+send 3 "<message to='tom@${DOMAIN}' type='chat' id='m1'><body>fish &amp; chips &lt;3</body></message>"
+expect 4 "from='joe@${DOMAIN}/phone'"
+expect 4 "<body>fish &amp; chips &lt;3</body>"
+echo "PASS: message to a bare JID reaches the available resource"
+
+send 4 "<iq type='get' id='p1' to='joe@${DOMAIN}/phone'><ping xmlns='urn:xmpp:ping'/></iq>"
+expect 3 "from='tom@${DOMAIN}/desk'"
+send 3 "<iq type='result' id='p1' to='tom@${DOMAIN}/desk'/>"
+expect 4 "id='p1'"
+echo "PASS: IQ routed to a full JID and back"
+
+send 3 "<message to='nobody@${DOMAIN}' id='m2'><body>hello?</body></message>"
+expect 3 "<service-unavailable"
+echo "PASS: message to an unknown JID bounced"
+
+send 4 "</stream:stream>"
+expect 4 "</stream:stream>"
+exec 4>&-
+sleep 0.2
+send 3 "<message to='tom@${DOMAIN}/desk' id='m3'><body>gone?</body></message>"
+expect 3 "<service-unavailable"
+echo "PASS: resource unbound when its stream ends"
+
+login 6 tom t0mt0m
+bind 6 sm
+expect 6 "<jid>tom@${DOMAIN}/sm</jid>"
+send 6 "<enable xmlns='urn:xmpp:sm:3' resume='true'/>"
+expect 6 "<enabled"
+id_pattern="id='([0-9a-f]+)'"
+[[ ${got} =~ ${id_pattern} ]] || fail "no resumption id in '${got}'"
+previd=${BASH_REMATCH[1]}
+send 6 "<presence/>"
+send 6 "<r xmlns='urn:xmpp:sm:3'/>"
+expect 6 "h='1'"
+echo "PASS: stream management enabled, stanzas counted"
+
+send 3 "<message to='tom@${DOMAIN}/sm' id='q1'><body>first</body></message>"
+expect 6 "<body>first</body>"
+expect 6 "<r xmlns='urn:xmpp:sm:3'/>"
+send 6 "<a xmlns='urn:xmpp:sm:3' h='1'/>"
+sleep 0.2
+exec 6>&-
+sleep 0.2
+send 3 "<message to='tom@${DOMAIN}/sm' id='q2'><body>second</body></message>"
+
+login 7 tom t0mt0m
+expect 7 "<success"
+open_stream 7
+expect 7 "urn:xmpp:sm:3"
+expect 7 "</stream:features>"
+send 7 "<resume xmlns='urn:xmpp:sm:3' previd='0123456789abcdef01234567' h='1'/>"
+expect 7 "<failed"
+send 7 "<resume xmlns='urn:xmpp:sm:3' previd='${previd}' h='1'/>"
+expect 7 "<resumed"
+expect 7 "<body>second</body>"
+[[ ${got} != *"<body>first</body>"* ]] || fail "acknowledged stanza sent again"
+echo "PASS: detached session resumed, unacknowledged stanzas sent again"
+
+send 3 "<message to='tom@${DOMAIN}/sm' id='q3'><body>third</body></message>"
+expect 7 "<body>third</body>"
+echo "PASS: resumed session keeps its JID"
+
+exec 7>&-
+sleep 0.2
+login 8 tom t0mt0m
+bind 8 sm
+expect 8 "<jid>tom@${DOMAIN}/sm</jid>"
+echo "PASS: resource of a detached session taken over by a new one"
+
+exec 10<> "/dev/tcp/127.0.0.1/${IRC_PORT}" || fail "cannot connect to IRC"
+printf 'PASS op3rat0r\r\nNICK op\r\n' >&10
+expect_line 10 " 001 op "
+
+printf 'PRIVMSG tom@%s/sm :a < b & \002bold\002 caf\351\r\n' "${DOMAIN}" >&10
+expect 8 "from='op@${DOMAIN}'"
+expect 8 "<body>a &lt; b &amp; bold caf"$'\xef\xbf\xbd'"</body>"
+printf 'PRIVMSG tom@%s/sm :\001ACTION waves\001\r\n' "${DOMAIN}" >&10
+expect 8 "<body>/me waves</body>"
+echo "PASS: IRC text escaped and repaired for XMPP"
+
+printf 'PRIVMSG nobody@%s :anyone?\r\n' "${DOMAIN}" >&10
+expect_line 10 " 401 op nobody@${DOMAIN} "
+echo "PASS: IRC message to an unknown JID refused"
+
+send 8 "<message to='op@${DOMAIN}' type='chat'><body>line &lt;one&gt;"$'\n'"line two</body></message>"
+expect_line 10 ":tom@${DOMAIN}!xmpp@${DOMAIN} PRIVMSG op :line <one>"
+expect_line 10 ":tom@${DOMAIN}!xmpp@${DOMAIN} PRIVMSG op :line two"
+send 8 "<message to='op@${DOMAIN}'><body>/me waves back</body></message>"
+expect_line 10 "PRIVMSG op :"$'\001'"ACTION waves back"$'\001'
+
+long=a$(printf '\303\251%.0s' {1..300})
+send 8 "<message to='op@${DOMAIN}'><body>${long}</body></message>"
+parts=
+for part in 1 2 ; do
+    expect_line 10 "PRIVMSG op :"
+    (( $(printf '%s\r\n' "${got}" | wc -c) <= 512 )) || fail "line too long"
+    printf '%s' "${got#*PRIVMSG op :}" | iconv -f UTF-8 -t UTF-8 > /dev/null \
+        || fail "line split inside a character"
+    parts+=${got#*PRIVMSG op :}
+done
+[[ ${parts} = "${long}" ]] || fail "long message not split in two lines"
+echo "PASS: XMPP messages reach IRC clients, one line each"
+
+send 3 "<message><body>unterminated</nobody></message>"
+expect 3 "<not-well-formed"
+echo "PASS: malformed XML closes the stream"
+
+echo "All XMPP tests passed"
@@ -0,0 +1,81 @@
+/*
+ * ticker.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "ticker.h"
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+
+W_OBJ_DEF (ticker_t)
+{
+    w_obj_t parent;
+    w_io_t *io;
+};
+
+
+static void
+ticker_destroy (void *obj)
+{
+    ticker_t *ticker = obj;
+    W_IO_NORESULT (w_io_close (ticker->io));
+    w_obj_unref (ticker->io);
+}
+
+
+bool
+ticker_set_interval (ticker_t *ticker, unsigned interval_ms)
+{
+    w_assert (ticker);
+    w_assert (interval_ms > 0);
+
+    const struct timespec ts = {
+        .tv_sec  = interval_ms / 1000,
+        .tv_nsec = (interval_ms % 1000) * 1000000L,
+    };
+    const struct itimerspec its = { .it_interval = ts, .it_value = ts };
+    return timerfd_settime (w_io_get_fd (ticker->io), 0, &its, NULL) == 0;
+}
+
+
+ticker_t*
+ticker_new (unsigned interval_ms)
+{
+    int fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    ticker_t *ticker = w_obj_new (ticker_t);
+    ticker->io = w_io_unix_open_fd (fd);
+    w_obj_dtor (ticker, ticker_destroy);
+
+    if (!ticker_set_interval (ticker, interval_ms)) {
+        w_obj_unref (ticker);
+        return NULL;
+    }
+    return ticker;
+}
+
+
+uint64_t
+ticker_wait (ticker_t *ticker)
+{
+    w_assert (ticker);
+
+    for (;;) {
+        uint64_t ticks;
+        ssize_t r = read (w_io_get_fd (ticker->io), &ticks, sizeof (ticks));
+        if (r == sizeof (ticks))
+            return ticks;
+        if (r < 0 && errno == EAGAIN)
+            w_task_yield_io_read (ticker->io);
+        else if (r < 0 && errno == EINTR)
+            continue;
+        else
+            return 0;
+    }
+}
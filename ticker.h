@@ -0,0 +1,28 @@
+/*
+ * ticker.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef TICKER_H
+#define TICKER_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Periodic timer usable from tasks: waiting on a ticker yields to the
+ * scheduler until the next tick, so other tasks keep running.
+ */
+W_OBJ_DECL (ticker_t);
+
+extern ticker_t* ticker_new (unsigned interval_ms);
+extern bool ticker_set_interval (ticker_t *ticker, unsigned interval_ms);
+
+/*
+ * Yields the current task until the ticker fires. Returns the number of
+ * ticks elapsed since the last call, or zero on error.
+ */
+extern uint64_t ticker_wait (ticker_t *ticker);
+
+#endif /* !TICKER_H */
@@ -0,0 +1,297 @@
+/*
+ * tls.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "tls.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <limits.h>
+#include <errno.h>
+
+
+W_OBJ_DEF (tls_context_t)
+{
+    w_obj_t  parent;
+    SSL_CTX *ctx;
+};
+
+
+/* Connection with TLS records processed in userspace. */
+W_OBJ (tls_io_t)
+{
+    w_io_t  parent;
+    SSL    *ssl;
+    w_io_t *socket;
+};
+
+
+/* Indexed by file descriptor; non-zero for userspace connections. */
+static uint8_t *s_userspace = NULL;
+static unsigned s_n_userspace = 0;
+
+static tls_stats_t s_stats = { 0, };
+
+
+static void
+set_userspace (int fd, bool value)
+{
+    if ((unsigned) fd >= s_n_userspace) {
+        if (!value)
+            return;
+        unsigned n = s_n_userspace ? s_n_userspace : 64;
+        while (n <= (unsigned) fd)
+            n *= 2;
+        s_userspace = w_resize (s_userspace, uint8_t, n);
+        memset (s_userspace + s_n_userspace, 0, n - s_n_userspace);
+        s_n_userspace = n;
+    }
+    s_userspace[fd] = value;
+}
+
+
+bool
+tls_fd_is_userspace (int fd)
+{
+    return fd >= 0 && (unsigned) fd < s_n_userspace && s_userspace[fd];
+}
+
+
+static void
+tls_context_destroy (void *obj)
+{
+    tls_context_t *context = obj;
+    SSL_CTX_free (context->ctx);
+}
+
+
+static void
+format_ssl_error (w_buf_t *error, const char *what, const char *path)
+{
+    char message[256];
+    ERR_error_string_n (ERR_get_error (), message, sizeof (message));
+    w_buf_format (error, "$s: $s: $s", path, what, message);
+}
+
+
+tls_context_t*
+tls_context_new (const char *certificate, const char *key, w_buf_t *error)
+{
+    w_assert (certificate);
+    w_assert (key);
+    w_assert (error);
+
+    SSL_CTX *ctx = SSL_CTX_new (TLS_server_method ());
+    if (!ctx) {
+        format_ssl_error (error, "cannot create context", certificate);
+        return NULL;
+    }
+
+    SSL_CTX_set_min_proto_version (ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode (ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                           SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+    /* Needs the "tls" kernel module, and a cipher it supports. */
+    SSL_CTX_set_options (ctx, SSL_OP_ENABLE_KTLS);
+#endif /* SSL_OP_ENABLE_KTLS */
+
+    if (SSL_CTX_use_certificate_chain_file (ctx, certificate) != 1) {
+        format_ssl_error (error, "cannot load certificate", certificate);
+        SSL_CTX_free (ctx);
+        return NULL;
+    }
+    if (SSL_CTX_use_PrivateKey_file (ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key (ctx) != 1) {
+        format_ssl_error (error, "cannot load key", key);
+        SSL_CTX_free (ctx);
+        return NULL;
+    }
+
+    tls_context_t *context = w_obj_new (tls_context_t);
+    context->ctx = ctx;
+    return w_obj_dtor (context, tls_context_destroy);
+}
+
+
+static w_io_result_t
+ssl_result (SSL *ssl, int ret)
+{
+    switch (SSL_get_error (ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            /* Makes the task I/O wrapper yield, and then retry. */
+            return W_IO_RESULT_ERROR (EAGAIN);
+        case SSL_ERROR_ZERO_RETURN:
+            return W_IO_RESULT_EOF;
+        case SSL_ERROR_SYSCALL:
+            return errno ? W_IO_RESULT_ERROR (errno) : W_IO_RESULT_EOF;
+        default:
+            return W_IO_RESULT_ERROR (EPROTO);
+    }
+}
+
+
+static w_io_result_t
+tls_io_read (w_io_t *io, void *buf, size_t len)
+{
+    tls_io_t *tls = (tls_io_t*) io;
+    ERR_clear_error ();
+    errno = 0;
+    int r = SSL_read (tls->ssl, buf, len > INT_MAX ? INT_MAX : (int) len);
+    return (r > 0) ? W_IO_RESULT (r) : ssl_result (tls->ssl, r);
+}
+
+
+static w_io_result_t
+tls_io_write (w_io_t *io, const void *buf, size_t len)
+{
+    tls_io_t *tls = (tls_io_t*) io;
+    ERR_clear_error ();
+    errno = 0;
+    int r = SSL_write (tls->ssl, buf, len > INT_MAX ? INT_MAX : (int) len);
+    return (r > 0) ? W_IO_RESULT (r) : ssl_result (tls->ssl, r);
+}
+
+
+static w_io_result_t
+tls_io_close (w_io_t *io)
+{
+    tls_io_t *tls = (tls_io_t*) io;
+    if (!tls->ssl)
+        return W_IO_RESULT_SUCCESS;
+
+    /* Best effort, without waiting for the peer to reply. */
+    SSL_shutdown (tls->ssl);
+    SSL_free (tls->ssl);
+    tls->ssl = NULL;
+
+    set_userspace (w_io_get_fd (tls->socket), false);
+    return w_io_close (tls->socket);
+}
+
+
+static int
+tls_io_getfd (w_io_t *io)
+{
+    return w_io_get_fd (((tls_io_t*) io)->socket);
+}
+
+
+static void
+tls_io_destroy (void *obj)
+{
+    tls_io_t *tls = obj;
+    W_IO_NORESULT (tls_io_close ((w_io_t*) tls));
+    w_obj_unref (tls->socket);
+}
+
+
+static w_io_t*
+tls_io_new (SSL *ssl, w_io_t *socket)
+{
+    tls_io_t *tls = w_obj_new (tls_io_t);
+    w_io_init ((w_io_t*) tls);
+    tls->parent.read = tls_io_read;
+    tls->parent.write = tls_io_write;
+    tls->parent.close = tls_io_close;
+    tls->parent.getfd = tls_io_getfd;
+    tls->ssl = ssl;
+    tls->socket = w_obj_ref (socket);
+    set_userspace (w_io_get_fd (socket), true);
+    return w_obj_dtor ((w_io_t*) tls, tls_io_destroy);
+}
+
+
+void
+tls_context_set_offload (tls_context_t *context, bool enable)
+{
+    w_assert (context);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (enable)
+        SSL_CTX_set_options (context->ctx, SSL_OP_ENABLE_KTLS);
+    else
+        SSL_CTX_clear_options (context->ctx, SSL_OP_ENABLE_KTLS);
+#else
+    w_unused (enable);
+#endif /* SSL_OP_ENABLE_KTLS */
+}
+
+
+static bool
+is_offloaded (SSL *ssl)
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+    /*
+     * Both directions are needed to use the plain socket, and nothing
+     * may have been read ahead: it would be lost otherwise.
+     */
+    return BIO_get_ktls_send (SSL_get_wbio (ssl)) &&
+           BIO_get_ktls_recv (SSL_get_rbio (ssl)) &&
+           !SSL_has_pending (ssl);
+#else
+    w_unused (ssl);
+    return false;
+#endif
+}
+
+
+w_io_t*
+tls_accept (tls_context_t *context, w_io_t *socket)
+{
+    w_assert (context);
+    w_assert (socket);
+
+    SSL *ssl = SSL_new (context->ctx);
+    if (!ssl || SSL_set_fd (ssl, w_io_get_fd (socket)) != 1) {
+        SSL_free (ssl);
+        return NULL;
+    }
+
+    for (;;) {
+        ERR_clear_error ();
+        int r = SSL_accept (ssl);
+        if (r == 1)
+            break;
+
+        int error = SSL_get_error (ssl, r);
+        if (error == SSL_ERROR_WANT_READ) {
+            w_task_yield_io_read (socket);
+        } else if (error == SSL_ERROR_WANT_WRITE) {
+            w_task_yield_io_write (socket);
+        } else {
+            char message[256];
+            ERR_error_string_n (ERR_get_error (), message, sizeof (message));
+            w_printerr ("$s: TLS handshake failed: $s\n", w_task_name (), message);
+            SSL_free (ssl);
+            s_stats.failed++;
+            return NULL;
+        }
+    }
+
+    s_stats.handshakes++;
+    if (is_offloaded (ssl)) {
+        /*
+         * The kernel does the record layer now, and the socket is used
+         * as a plain one. The socket BIO does not own the descriptor, so
+         * freeing the SSL object leaves it open.
+         */
+        w_printerr ("$s: $s offloaded to the kernel\n",
+                    w_task_name (), SSL_get_version (ssl));
+        SSL_free (ssl);
+        s_stats.offloaded++;
+        return w_obj_ref (socket);
+    }
+
+    w_printerr ("$s: $s in userspace\n", w_task_name (), SSL_get_version (ssl));
+    return tls_io_new (ssl, socket);
+}
+
+
+void
+tls_get_stats (tls_stats_t *stats)
+{
+    w_assert (stats);
+    *stats = s_stats;
+}
@@ -0,0 +1,57 @@
+/*
+ * tls.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef TLS_H
+#define TLS_H
+
+#include "wheel/wheel.h"
+
+/*
+ * TLS for incoming connections. The handshake is done in userspace, and
+ * then record encryption is handed to the kernel (kTLS) when possible:
+ * the connection becomes a plain socket again, and writes and flushes
+ * need no extra copies. Otherwise, records are processed in userspace.
+ */
+W_OBJ_DECL (tls_context_t);
+
+/*
+ * Loads a certificate chain and its private key, both in PEM format. On
+ * failure, returns NULL and a message is placed in "error".
+ */
+extern tls_context_t* tls_context_new (const char *certificate,
+                                       const char *key,
+                                       w_buf_t    *error);
+
+/*
+ * Allows or forbids kernel offload for new connections. It is allowed by
+ * default; forbidding it is meant for comparing both record layers.
+ */
+extern void tls_context_set_offload (tls_context_t *context, bool enable);
+
+/*
+ * Does the server side of the handshake on a non-blocking socket, which
+ * yields the current task while waiting for the peer. Returns an I/O
+ * object for application data (which may be a new reference to "socket"
+ * itself), or NULL if the handshake failed.
+ */
+extern w_io_t* tls_accept (tls_context_t *context, w_io_t *socket);
+
+/*
+ * Whether TLS records for a connection are processed in userspace. Such
+ * connections cannot be handed over to another process.
+ */
+extern bool tls_fd_is_userspace (int fd);
+
+typedef struct {
+    unsigned long handshakes;
+    unsigned long offloaded;
+    unsigned long failed;
+} tls_stats_t;
+
+extern void tls_get_stats (tls_stats_t *stats);
+
+#endif /* !TLS_H */
@@ -0,0 +1,594 @@
+/*
+ * upgrade.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _GNU_SOURCE /* MSG_CMSG_CLOEXEC */
+#include "upgrade.h"
+#include "listener.h"
+#include "channel.h"
+#include "journal.h"
+#include "client.h"
+#include "link.h"
+#include "proto-irc.h"
+#include "tls.h"
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+
+extern void proto_irc_handler  (listener_t*, w_io_t*);
+extern void proto_irc_resume   (listener_t*, client_t*);
+extern void proto_xmpp_handler (listener_t*, w_io_t*);
+
+
+#ifndef CHATEAU_UPGRADE_TIMEOUT
+#define CHATEAU_UPGRADE_TIMEOUT 10 /* s */
+#endif /* !CHATEAU_UPGRADE_TIMEOUT */
+
+
+/*
+ * Each record is a single SOCK_SEQPACKET message, which carries at most
+ * one file descriptor. Strings are prefixed by their 16-bit length.
+ *
+ *   LISTENER  flags name
+ *   CLIENT    listener-index flags nick login-nick login-pass
+ *             n-channels channel...
+ *   END
+ *
+ * The new process replies with a single ACK byte once it is done.
+ */
+enum {
+    RECORD_LISTENER = 1,
+    RECORD_CLIENT   = 2,
+    RECORD_END      = 3,
+    RECORD_ACK      = 4,
+
+    FLAG_REGISTERED = 1 << 0,
+    FLAG_OPER       = 1 << 1,
+    FLAG_TLS        = 1 << 2,
+    FLAG_CAP_TAGS   = 1 << 3,
+    FLAG_CAP_TIME   = 1 << 4,
+    FLAG_CAP_WAIT   = 1 << 5,
+    FLAG_CAP_SASL   = 1 << 6,
+
+    STACK_SIZE      = 16384,
+};
+
+
+static char    *s_path = NULL;
+static char   **s_argv = NULL;
+static unsigned s_argc = 0;
+
+
+void
+upgrade_init (int argc, char **argv)
+{
+    w_assert (argc > 0);
+    w_assert (argv);
+
+    char path[PATH_MAX];
+    s_path = w_str_dup (realpath (argv[0], path) ? path : argv[0]);
+
+    /* Room for "-U <fd>" and the terminating NULL. */
+    s_argv = w_alloc (char*, argc + 3);
+    for (int i = 0; i < argc; i++) {
+        if (strcmp (argv[i], "-U") == 0) {
+            i++;
+        } else if (strncmp (argv[i], "-U", 2) != 0) {
+            s_argv[s_argc++] = argv[i];
+        }
+    }
+}
+
+
+static void
+put_u8 (w_buf_t *buf, uint8_t value)
+{
+    w_buf_append_char (buf, (char) value);
+}
+
+
+static void
+put_u16 (w_buf_t *buf, uint16_t value)
+{
+    w_buf_append_char (buf, (char) (value >> 8));
+    w_buf_append_char (buf, (char) (value & 0xFF));
+}
+
+
+static void
+put_str (w_buf_t *buf, const char *str, size_t length)
+{
+    w_assert (length <= UINT16_MAX);
+    put_u16 (buf, (uint16_t) length);
+    w_buf_append_mem (buf, str, length);
+}
+
+
+static bool
+send_record (int sock, const w_buf_t *buf, int fd)
+{
+    struct iovec iov = {
+        .iov_base = w_buf_data (buf),
+        .iov_len  = w_buf_size (buf),
+    };
+    union {
+        struct cmsghdr header;
+        char           data[CMSG_SPACE (sizeof (int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov    = &iov,
+        .msg_iovlen = 1,
+    };
+
+    if (fd >= 0) {
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof (control.data);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+        memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+    }
+
+    ssize_t r;
+    while ((r = sendmsg (sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+    return r == (ssize_t) w_buf_size (buf);
+}
+
+
+/* Accepted server links start as clients, and are not handed over. */
+static bool
+is_link_socket (const w_io_t *socket)
+{
+    for (unsigned i = 0; i < link_server_count (); i++) {
+        const struct link_server *server = link_server_at (i);
+        if (server->link && server->link->socket == socket)
+            return true;
+    }
+    return false;
+}
+
+
+static bool
+send_client (int sock, client_t *client)
+{
+    if (client->link || is_link_socket (client->socket))
+        return true;
+
+    /* The TLS session state cannot be handed over, only kTLS sockets. */
+    int fd = w_io_get_fd (client->socket);
+    if (fd < 0 || tls_fd_is_userspace (fd))
+        return true;
+
+    /* Whatever is still buffered must reach the client before the fd does. */
+    W_IO_NORESULT (w_io_flush (client->socket));
+
+    uint8_t flags = 0;
+    if (client_is_registered (client))
+        flags |= FLAG_REGISTERED;
+    if (client->oper)
+        flags |= FLAG_OPER;
+    if (client->caps & CLIENT_CAP_MESSAGE_TAGS)
+        flags |= FLAG_CAP_TAGS;
+    if (client->caps & CLIENT_CAP_SERVER_TIME)
+        flags |= FLAG_CAP_TIME;
+    if (client->caps & CLIENT_CAP_SASL)
+        flags |= FLAG_CAP_SASL;
+    if (client->cap_negotiating)
+        flags |= FLAG_CAP_WAIT;
+
+    w_buf_t buf = W_BUF;
+    put_u8 (&buf, RECORD_CLIENT);
+    put_u8 (&buf, 0); /* Only IRC clients are handed over. */
+    put_u8 (&buf, flags);
+    if (client->nick)
+        put_str (&buf, atom_str (client->nick), atom_length (client->nick));
+    else
+        put_str (&buf, "", 0);
+    put_str (&buf, w_buf_data (&client->login_nick), w_buf_size (&client->login_nick));
+    put_str (&buf, w_buf_data (&client->login_pass), w_buf_size (&client->login_pass));
+    put_u16 (&buf, (uint16_t) client->n_channels);
+    for (unsigned i = 0; i < client->n_channels; i++) {
+        const atom_t *name = client->channels[i]->name;
+        put_str (&buf, atom_str (name), atom_length (name));
+    }
+
+    bool ok = send_record (sock, &buf, fd);
+    w_buf_clear (&buf);
+    return ok;
+}
+
+
+static bool
+send_state (int sock)
+{
+    w_buf_t buf = W_BUF;
+    bool ok = true;
+
+    for (unsigned i = 0; ok && i < listener_count (); i++) {
+        listener_t *listener = listener_at (i);
+        w_buf_clear (&buf);
+        put_u8 (&buf, RECORD_LISTENER);
+        put_u8 (&buf, listener->tls ? FLAG_TLS : 0);
+        put_str (&buf, listener->name, strlen (listener->name));
+        ok = send_record (sock, &buf, listener->fd);
+    }
+
+    /* The IRC listener is always the first one. */
+    for (unsigned i = 0; ok && i < client_local_count (); i++)
+        ok = send_client (sock, client_local_at (i));
+
+    if (ok) {
+        w_buf_clear (&buf);
+        put_u8 (&buf, RECORD_END);
+        ok = send_record (sock, &buf, -1);
+    }
+
+    w_buf_clear (&buf);
+    return ok;
+}
+
+
+bool
+upgrade_start (void)
+{
+    w_assert (s_path);
+
+    int fds[2];
+    if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+        w_printerr ("upgrade: socketpair failed: $s\n", strerror (errno));
+        return false;
+    }
+
+    /* Everything written so far must be visible to the new process. */
+    if (journal_is_open ())
+        journal_commit ();
+
+    char fd_arg[16];
+    snprintf (fd_arg, sizeof (fd_arg), "%d", fds[1]);
+    s_argv[s_argc] = "-U";
+    s_argv[s_argc + 1] = fd_arg;
+    s_argv[s_argc + 2] = NULL;
+
+    pid_t pid = fork ();
+    if (pid == 0) {
+        /* Only the child end of the pair survives the exec. */
+        int flags = fcntl (fds[1], F_GETFD);
+        fcntl (fds[1], F_SETFD, flags & ~FD_CLOEXEC);
+        execv (s_path, s_argv);
+        _exit (127);
+    }
+
+    close (fds[1]);
+    s_argv[s_argc] = NULL;
+
+    if (pid < 0) {
+        w_printerr ("upgrade: fork failed: $s\n", strerror (errno));
+        close (fds[0]);
+        return false;
+    }
+
+    w_printerr ("upgrade: Started $s (pid $I)\n", s_path, (unsigned) pid);
+
+    /*
+     * This blocks the whole process on purpose: no other task may run
+     * and touch the state which is being handed over.
+     */
+    const struct timeval timeout = { .tv_sec = CHATEAU_UPGRADE_TIMEOUT };
+    setsockopt (fds[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+
+    uint8_t ack = 0;
+    if (send_state (fds[0]) && recv (fds[0], &ack, 1, 0) == 1 && ack == RECORD_ACK) {
+        w_printerr ("upgrade: Handed over to pid $I\n", (unsigned) pid);
+        exit (EXIT_SUCCESS);
+    }
+
+    w_printerr ("upgrade: New process failed, resuming\n");
+    close (fds[0]);
+    kill (pid, SIGKILL);
+    waitpid (pid, NULL, 0);
+    return false;
+}
+
+
+struct reader {
+    const uint8_t *data;
+    size_t         size;
+    bool           error;
+};
+
+
+static uint8_t
+get_u8 (struct reader *r)
+{
+    if (r->size < 1) {
+        r->error = true;
+        return 0;
+    }
+    r->size--;
+    return *r->data++;
+}
+
+
+static uint16_t
+get_u16 (struct reader *r)
+{
+    uint16_t value = get_u8 (r) << 8;
+    return value | get_u8 (r);
+}
+
+
+static const char*
+get_str (struct reader *r, size_t *length)
+{
+    *length = get_u16 (r);
+    if (r->error || r->size < *length) {
+        r->error = true;
+        *length = 0;
+        return "";
+    }
+    const char *str = (const char*) r->data;
+    r->data += *length;
+    r->size -= *length;
+    return str;
+}
+
+
+/* Returns the size of the record, zero at EOF, or negative on error. */
+static ssize_t
+receive_record (int sock, uint8_t **data, int *fd)
+{
+    *fd = -1;
+
+    ssize_t size;
+    while ((size = recv (sock, NULL, 0, MSG_PEEK | MSG_TRUNC)) < 0 && errno == EINTR);
+    if (size <= 0)
+        return size;
+
+    *data = w_resize (*data, uint8_t, size);
+    struct iovec iov = { .iov_base = *data, .iov_len = size };
+    union {
+        struct cmsghdr header;
+        char           data[CMSG_SPACE (sizeof (int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov        = &iov,
+        .msg_iovlen     = 1,
+        .msg_control    = control.data,
+        .msg_controllen = sizeof (control.data),
+    };
+
+    while ((size = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (size <= 0)
+        return size;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy (fd, CMSG_DATA (cmsg), sizeof (int));
+    return size;
+}
+
+
+static void
+receive_listener (struct reader *r, int fd)
+{
+    char name[64];
+    size_t length;
+    uint8_t flags = get_u8 (r);
+    const char *str = get_str (r, &length);
+    if (r->error || length >= sizeof (name) || fd < 0) {
+        r->error = true;
+        return;
+    }
+    memcpy (name, str, length);
+    name[length] = '\0';
+
+    listener_handler_t handler;
+    if (strcmp (name, "IRC") == 0 || strcmp (name, "IRC-TLS") == 0) {
+        handler = proto_irc_handler;
+    } else if (strcmp (name, "XMPP") == 0) {
+        handler = proto_xmpp_handler;
+    } else {
+        w_printerr ("upgrade: Unknown listener '$s'\n", name);
+        close (fd);
+        return;
+    }
+
+    listener_t *listener = listener_new_fd (name, fd, handler, NULL);
+    if (!listener) {
+        close (fd);
+        r->error = true;
+        return;
+    }
+    listener->tls = (flags & FLAG_TLS) != 0;
+    listener_start (listener);
+    w_obj_unref (listener);
+}
+
+
+struct resume {
+    listener_t *listener;
+    client_t   *client;
+    w_io_t     *unix_io;
+};
+
+
+static void
+resume_task (void *data)
+{
+    struct resume *resume = data;
+    w_io_t *socket = resume->client->socket;
+
+    proto_irc_resume (resume->listener, resume->client);
+
+    w_obj_unref (socket);
+    w_obj_unref (resume->unix_io);
+    w_obj_unref (resume->listener);
+    w_free (resume);
+}
+
+
+static void
+receive_client (struct reader *r, int fd)
+{
+    if (fd < 0) {
+        r->error = true;
+        return;
+    }
+
+    uint8_t index = get_u8 (r);
+    uint8_t flags = get_u8 (r);
+    if (r->error || index >= listener_count ()) {
+        r->error = true;
+        close (fd);
+        return;
+    }
+
+    size_t nick_length, login_nick_length, login_pass_length;
+    const char *nick = get_str (r, &nick_length);
+    const char *login_nick = get_str (r, &login_nick_length);
+    const char *login_pass = get_str (r, &login_pass_length);
+    uint16_t n_channels = get_u16 (r);
+    if (r->error) {
+        close (fd);
+        return;
+    }
+
+    w_io_t *unix_io = w_io_unix_open_fd (fd);
+    client_t *client = client_new (w_io_task_open (unix_io));
+    client_lookup_host (client);
+    client->oper = (flags & FLAG_OPER) != 0;
+    if (flags & FLAG_CAP_TAGS)
+        client->caps |= CLIENT_CAP_MESSAGE_TAGS;
+    if (flags & FLAG_CAP_TIME)
+        client->caps |= CLIENT_CAP_SERVER_TIME;
+    if (flags & FLAG_CAP_SASL)
+        client->caps |= CLIENT_CAP_SASL;
+    client->cap_negotiating = (flags & FLAG_CAP_WAIT) != 0;
+    w_buf_append_mem (&client->login_nick, login_nick, login_nick_length);
+    w_buf_append_mem (&client->login_pass, login_pass, login_pass_length);
+
+    if (flags & FLAG_REGISTERED) {
+        char buf[IRC_MAX_LINE];
+        if (nick_length >= sizeof (buf))
+            nick_length = sizeof (buf) - 1;
+        memcpy (buf, nick, nick_length);
+        buf[nick_length] = '\0';
+        client_register (client, buf);
+
+        /* Channels are rejoined silently, members already know. */
+        for (uint16_t i = 0; i < n_channels && !r->error; i++) {
+            size_t length;
+            const char *name = get_str (r, &length);
+            if (!r->error && channel_name_is_valid (name, length))
+                channel_join (name, length, client);
+        }
+    }
+
+    struct resume *resume = w_new (struct resume);
+    resume->listener = w_obj_ref (listener_at (index));
+    resume->client = client;
+    resume->unix_io = unix_io;
+
+    w_task_t *task = w_task_prepare (resume_task, resume, STACK_SIZE);
+    w_task_set_name (task, resume->listener->name);
+}
+
+
+bool
+upgrade_receive (int fd)
+{
+    uint8_t *data = NULL;
+    unsigned n_clients = 0;
+    bool done = false;
+
+    for (;;) {
+        int received_fd;
+        ssize_t size = receive_record (fd, &data, &received_fd);
+        if (size <= 0)
+            break;
+
+        struct reader r = { .data = data, .size = size };
+        switch (get_u8 (&r)) {
+            case RECORD_LISTENER:
+                receive_listener (&r, received_fd);
+                break;
+            case RECORD_CLIENT:
+                receive_client (&r, received_fd);
+                n_clients++;
+                break;
+            case RECORD_END:
+                done = true;
+                break;
+            default:
+                r.error = true;
+                if (received_fd >= 0)
+                    close (received_fd);
+        }
+        if (r.error || done)
+            break;
+    }
+    w_free (data);
+
+    if (done) {
+        const uint8_t ack = RECORD_ACK;
+        done = send (fd, &ack, 1, MSG_NOSIGNAL) == 1;
+    }
+    close (fd);
+
+    w_printerr ("upgrade: Received $I listeners, $I clients\n",
+                listener_count (), n_clients);
+    return done;
+}
+
+
+static void
+sigusr2_task (void *data)
+{
+    w_io_t *io = data;
+
+    for (;;) {
+        struct signalfd_siginfo info;
+        ssize_t r = read (w_io_get_fd (io), &info, sizeof (info));
+        if (r < 0 && errno == EAGAIN) {
+            w_task_yield_io_read (io);
+            continue;
+        }
+        if (r != sizeof (info))
+            break;
+
+        upgrade_start ();
+    }
+
+    W_IO_NORESULT (w_io_close (io));
+    w_obj_unref (io);
+}
+
+
+void
+upgrade_watch_sigusr2 (void)
+{
+    sigset_t mask;
+    sigemptyset (&mask);
+    sigaddset (&mask, SIGUSR2);
+    if (sigprocmask (SIG_BLOCK, &mask, NULL) != 0)
+        return;
+
+    int fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    w_task_t *task = w_task_prepare (sigusr2_task, w_io_unix_open_fd (fd), STACK_SIZE);
+    w_task_set_name (task, "upgrade");
+    w_task_set_is_system (task, true);
+}
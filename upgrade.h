@@ -0,0 +1,39 @@
+/*
+ * upgrade.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Binary upgrades: the running process executes a new copy of its own
+ * binary and hands it the listening sockets and the sockets of local
+ * clients (over SCM_RIGHTS), along with enough session state (nick,
+ * oper status, joined channels) to let clients carry on unaffected.
+ * Server links are not handed over: peers reconnect by themselves.
+ */
+
+/* Saves the command line used to execute the new binary. */
+extern void upgrade_init (int argc, char **argv);
+
+/* Starts an upgrade when SIGUSR2 is received. */
+extern void upgrade_watch_sigusr2 (void);
+
+/*
+ * Executes the new binary and hands over the state. Only returns, with
+ * false, if the new process could not be started; otherwise exits.
+ */
+extern bool upgrade_start (void);
+
+/*
+ * Receives state from the previous process over "fd", restoring the
+ * listeners and clients. Returns false if nothing could be restored.
+ */
+extern bool upgrade_receive (int fd);
+
+#endif /* !UPGRADE_H */
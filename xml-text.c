@@ -0,0 +1,571 @@
+/*
+ * xml-text.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "xml-text.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# define HAVE_X86_KERNELS 1
+# include <immintrin.h>
+#endif
+
+
+enum {
+    INVALID = 0x110000,     /* Decoded from an invalid sequence. */
+    REFERENCE_MAX = 12,     /* "&#x10FFFF;" and some leading zeroes. */
+};
+
+static const char s_replacement[] = "\xEF\xBF\xBD";  /* U+FFFD */
+
+
+/*
+ * Kernels return the length of the leading run of "plain" text: valid
+ * UTF-8, characters allowed by XML, and no control characters nor "&",
+ * "<" and ">". TAB, LF and CR are rare enough in IRC text to be left to
+ * the slow path. Kernels may stop up to "block" bytes short of the end
+ * of the run, and always stop at the start of a character.
+ */
+struct kernel {
+    const char *name;
+    size_t      block;
+    size_t    (*scan) (const uint8_t *text, size_t length);
+    bool      (*supported) (void);
+};
+
+
+static inline bool
+is_xml_char (uint32_t c)
+{
+    /* XML 1.0, section 2.2 */
+    return (c >= 0x20 && c <= 0xD7FF) || c == 0x09 || c == 0x0A || c == 0x0D ||
+           (c >= 0xE000 && c <= 0xFFFD) || (c >= 0x10000 && c <= 0x10FFFF);
+}
+
+
+static inline bool
+is_plain_ascii (uint8_t c)
+{
+    return c >= 0x20 && c < 0x80 && c != '&' && c != '<' && c != '>';
+}
+
+
+/*
+ * Decodes the character at the start of the text. Invalid sequences
+ * decode as INVALID, consuming their longest valid prefix (at least one
+ * byte), as the Unicode standard recommends.
+ */
+static unsigned
+decode (const uint8_t *text, size_t length, uint32_t *c)
+{
+    uint8_t lead = text[0];
+    if (lead < 0x80) {
+        *c = lead;
+        return 1;
+    }
+
+    unsigned need;
+    uint8_t lo = 0x80, hi = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        need = 1;
+        *c = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        need = 2;
+        *c = lead & 0x0F;
+        if (lead == 0xE0) lo = 0xA0;  /* Overlong. */
+        if (lead == 0xED) hi = 0x9F;  /* Surrogates. */
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        need = 3;
+        *c = lead & 0x07;
+        if (lead == 0xF0) lo = 0x90;  /* Overlong. */
+        if (lead == 0xF4) hi = 0x8F;  /* Over U+10FFFF. */
+    } else {
+        *c = INVALID;
+        return 1;
+    }
+
+    for (unsigned i = 1; i <= need; i++) {
+        if (i >= length || text[i] < lo || text[i] > hi) {
+            *c = INVALID;
+            return i;
+        }
+        *c = (*c << 6) | (text[i] & 0x3F);
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    return need + 1;
+}
+
+
+static void
+encode (w_buf_t *out, uint32_t c)
+{
+    if (c < 0x80) {
+        w_buf_append_char (out, c);
+    } else if (c < 0x800) {
+        w_buf_append_char (out, 0xC0 | (c >> 6));
+        w_buf_append_char (out, 0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        w_buf_append_char (out, 0xE0 | (c >> 12));
+        w_buf_append_char (out, 0x80 | ((c >> 6) & 0x3F));
+        w_buf_append_char (out, 0x80 | (c & 0x3F));
+    } else {
+        w_buf_append_char (out, 0xF0 | (c >> 18));
+        w_buf_append_char (out, 0x80 | ((c >> 12) & 0x3F));
+        w_buf_append_char (out, 0x80 | ((c >> 6) & 0x3F));
+        w_buf_append_char (out, 0x80 | (c & 0x3F));
+    }
+}
+
+
+static size_t
+scan_scalar (const uint8_t *text, size_t length)
+{
+    size_t i = 0;
+    while (i < length) {
+        if (is_plain_ascii (text[i])) {
+            i++;
+        } else if (text[i] >= 0x80) {
+            uint32_t c;
+            unsigned n = decode (text + i, length - i, &c);
+            if (!is_xml_char (c))
+                break;
+            i += n;
+        } else {
+            break;
+        }
+    }
+    return i;
+}
+
+
+static bool
+supported_scalar (void)
+{
+    return true;
+}
+
+
+#if HAVE_X86_KERNELS
+
+/*
+ * UTF-8 validation with lookup tables indexed by the nibbles of each byte
+ * and the previous one, after Keiser and Lemire, "Validating UTF-8 in less
+ * than one instruction per byte" (2021). Each table gives the errors which
+ * the nibble makes possible, and only an actual error has a bit set in
+ * the three of them. Third and fourth bytes of sequences are checked by
+ * comparing with the bytes two and three positions before.
+ */
+#define TOO_SHORT      (1 << 0)
+#define TOO_LONG       (1 << 1)
+#define OVERLONG_3     (1 << 2)
+#define TOO_LARGE      (1 << 3)
+#define SURROGATE      (1 << 4)
+#define OVERLONG_2     (1 << 5)
+#define TOO_LARGE_1000 (1 << 6)
+#define OVERLONG_4     (1 << 6)
+#define TWO_CONTS      (1 << 7)
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define BYTE_1_HIGH \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+    TOO_SHORT | OVERLONG_2, \
+    TOO_SHORT, \
+    TOO_SHORT | OVERLONG_3 | SURROGATE, \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+    CARRY | OVERLONG_2, \
+    CARRY, \
+    CARRY, \
+    CARRY | TOO_LARGE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+/* Only a lead byte in the last three positions can have a byte missing. */
+#define INCOMPLETE_TAIL  (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1)
+
+
+/*
+ * Drops a sequence at the end of the checked text which continues after
+ * it, and thus was not checked yet.
+ */
+static inline size_t
+char_boundary (const uint8_t *text, size_t end)
+{
+    if (end >= 1 && text[end - 1] >= 0xC0) return end - 1;
+    if (end >= 2 && text[end - 2] >= 0xE0) return end - 2;
+    if (end >= 3 && text[end - 3] >= 0xF0) return end - 3;
+    return end;
+}
+
+
+__attribute__ ((target ("sse4.1")))
+static size_t
+scan_sse4 (const uint8_t *text, size_t length)
+{
+    const __m128i byte_1_high = _mm_setr_epi8 (BYTE_1_HIGH);
+    const __m128i byte_1_low = _mm_setr_epi8 (BYTE_1_LOW);
+    const __m128i byte_2_high = _mm_setr_epi8 (BYTE_2_HIGH);
+    const __m128i incomplete_tail = _mm_setr_epi8 (-1, -1, -1, -1, -1, -1, -1, -1,
+                                                   -1, -1, -1, -1, -1, INCOMPLETE_TAIL);
+    const __m128i nibble = _mm_set1_epi8 (0x0F);
+    const __m128i control_max = _mm_set1_epi8 (0x1F);
+
+    __m128i prev = _mm_setzero_si128 ();
+    __m128i incomplete = _mm_setzero_si128 ();
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        const __m128i input = _mm_loadu_si128 ((const __m128i*) (text + i));
+        __m128i error = _mm_or_si128 (
+            _mm_cmpeq_epi8 (_mm_max_epu8 (input, control_max), control_max),
+            _mm_or_si128 (_mm_cmpeq_epi8 (input, _mm_set1_epi8 ('&')),
+                          _mm_or_si128 (_mm_cmpeq_epi8 (input, _mm_set1_epi8 ('<')),
+                                        _mm_cmpeq_epi8 (input, _mm_set1_epi8 ('>')))));
+
+        if (!_mm_movemask_epi8 (input)) {
+            error = _mm_or_si128 (error, incomplete);
+            incomplete = _mm_setzero_si128 ();
+        } else {
+            const __m128i prev1 = _mm_alignr_epi8 (input, prev, 15);
+            const __m128i prev2 = _mm_alignr_epi8 (input, prev, 14);
+            const __m128i prev3 = _mm_alignr_epi8 (input, prev, 13);
+
+            const __m128i special = _mm_and_si128 (
+                _mm_and_si128 (
+                    _mm_shuffle_epi8 (byte_1_high,
+                                      _mm_and_si128 (_mm_srli_epi16 (prev1, 4), nibble)),
+                    _mm_shuffle_epi8 (byte_1_low, _mm_and_si128 (prev1, nibble))),
+                _mm_shuffle_epi8 (byte_2_high,
+                                  _mm_and_si128 (_mm_srli_epi16 (input, 4), nibble)));
+            const __m128i third_or_fourth = _mm_or_si128 (
+                _mm_subs_epu8 (prev2, _mm_set1_epi8 (0xE0 - 0x80)),
+                _mm_subs_epu8 (prev3, _mm_set1_epi8 (0xF0 - 0x80)));
+            error = _mm_or_si128 (error, _mm_xor_si128 (special,
+                _mm_and_si128 (third_or_fourth, _mm_set1_epi8 ((char) 0x80))));
+
+            /* U+FFFE and U+FFFF are valid UTF-8, but not XML characters. */
+            error = _mm_or_si128 (error, _mm_and_si128 (
+                _mm_and_si128 (_mm_cmpeq_epi8 (prev2, _mm_set1_epi8 ((char) 0xEF)),
+                               _mm_cmpeq_epi8 (prev1, _mm_set1_epi8 ((char) 0xBF))),
+                _mm_cmpeq_epi8 (_mm_or_si128 (input, _mm_set1_epi8 (1)),
+                                _mm_set1_epi8 ((char) 0xBF))));
+
+            incomplete = _mm_subs_epu8 (input, incomplete_tail);
+        }
+
+        if (!_mm_testz_si128 (error, error))
+            break;
+        prev = input;
+    }
+    return char_boundary (text, i);
+}
+
+
+static bool
+supported_sse4 (void)
+{
+    return __builtin_cpu_supports ("sse4.1");
+}
+
+
+/* Same as scan_sse4(), but shuffles only look up within each 128-bit lane. */
+__attribute__ ((target ("avx2")))
+static size_t
+scan_avx2 (const uint8_t *text, size_t length)
+{
+    const __m256i byte_1_high = _mm256_setr_epi8 (BYTE_1_HIGH, BYTE_1_HIGH);
+    const __m256i byte_1_low = _mm256_setr_epi8 (BYTE_1_LOW, BYTE_1_LOW);
+    const __m256i byte_2_high = _mm256_setr_epi8 (BYTE_2_HIGH, BYTE_2_HIGH);
+    const __m256i incomplete_tail = _mm256_setr_epi8 (-1, -1, -1, -1, -1, -1, -1, -1,
+                                                      -1, -1, -1, -1, -1, -1, -1, -1,
+                                                      -1, -1, -1, -1, -1, -1, -1, -1,
+                                                      -1, -1, -1, -1, -1, INCOMPLETE_TAIL);
+    const __m256i nibble = _mm256_set1_epi8 (0x0F);
+    const __m256i control_max = _mm256_set1_epi8 (0x1F);
+
+    __m256i prev = _mm256_setzero_si256 ();
+    __m256i incomplete = _mm256_setzero_si256 ();
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        const __m256i input = _mm256_loadu_si256 ((const __m256i*) (text + i));
+        __m256i error = _mm256_or_si256 (
+            _mm256_cmpeq_epi8 (_mm256_max_epu8 (input, control_max), control_max),
+            _mm256_or_si256 (_mm256_cmpeq_epi8 (input, _mm256_set1_epi8 ('&')),
+                             _mm256_or_si256 (_mm256_cmpeq_epi8 (input, _mm256_set1_epi8 ('<')),
+                                              _mm256_cmpeq_epi8 (input, _mm256_set1_epi8 ('>')))));
+
+        if (!_mm256_movemask_epi8 (input)) {
+            error = _mm256_or_si256 (error, incomplete);
+            incomplete = _mm256_setzero_si256 ();
+        } else {
+            /* The last 16 bytes of "prev" followed by the first 16 of "input". */
+            const __m256i shifted = _mm256_permute2x128_si256 (prev, input, 0x21);
+            const __m256i prev1 = _mm256_alignr_epi8 (input, shifted, 15);
+            const __m256i prev2 = _mm256_alignr_epi8 (input, shifted, 14);
+            const __m256i prev3 = _mm256_alignr_epi8 (input, shifted, 13);
+
+            const __m256i special = _mm256_and_si256 (
+                _mm256_and_si256 (
+                    _mm256_shuffle_epi8 (byte_1_high,
+                                         _mm256_and_si256 (_mm256_srli_epi16 (prev1, 4), nibble)),
+                    _mm256_shuffle_epi8 (byte_1_low, _mm256_and_si256 (prev1, nibble))),
+                _mm256_shuffle_epi8 (byte_2_high,
+                                     _mm256_and_si256 (_mm256_srli_epi16 (input, 4), nibble)));
+            const __m256i third_or_fourth = _mm256_or_si256 (
+                _mm256_subs_epu8 (prev2, _mm256_set1_epi8 (0xE0 - 0x80)),
+                _mm256_subs_epu8 (prev3, _mm256_set1_epi8 (0xF0 - 0x80)));
+            error = _mm256_or_si256 (error, _mm256_xor_si256 (special,
+                _mm256_and_si256 (third_or_fourth, _mm256_set1_epi8 ((char) 0x80))));
+
+            error = _mm256_or_si256 (error, _mm256_and_si256 (
+                _mm256_and_si256 (_mm256_cmpeq_epi8 (prev2, _mm256_set1_epi8 ((char) 0xEF)),
+                                  _mm256_cmpeq_epi8 (prev1, _mm256_set1_epi8 ((char) 0xBF))),
+                _mm256_cmpeq_epi8 (_mm256_or_si256 (input, _mm256_set1_epi8 (1)),
+                                   _mm256_set1_epi8 ((char) 0xBF))));
+
+            incomplete = _mm256_subs_epu8 (input, incomplete_tail);
+        }
+
+        if (!_mm256_testz_si256 (error, error))
+            break;
+        prev = input;
+    }
+    return char_boundary (text, i);
+}
+
+
+static bool
+supported_avx2 (void)
+{
+    return __builtin_cpu_supports ("avx2");
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+
+static const struct kernel s_kernels[XML_TEXT_KERNEL_LAST] = {
+    [XML_TEXT_SCALAR] = { "scalar", 1, scan_scalar, supported_scalar },
+#if HAVE_X86_KERNELS
+    [XML_TEXT_SSE4]   = { "sse4.1", 16, scan_sse4, supported_sse4 },
+    [XML_TEXT_AVX2]   = { "avx2",   32, scan_avx2, supported_avx2 },
+#else
+    [XML_TEXT_SSE4]   = { "sse4.1", 1, scan_scalar, NULL },
+    [XML_TEXT_AVX2]   = { "avx2",   1, scan_scalar, NULL },
+#endif /* HAVE_X86_KERNELS */
+};
+
+static const struct kernel *s_kernel = NULL;
+
+
+static inline const struct kernel*
+get_kernel (void)
+{
+    if (!s_kernel) {
+        xml_text_kernel_t best = XML_TEXT_KERNEL_LAST;
+        while (!xml_text_use_kernel (--best))
+            ;
+    }
+    return s_kernel;
+}
+
+
+bool
+xml_text_use_kernel (xml_text_kernel_t kernel)
+{
+    w_assert (kernel < XML_TEXT_KERNEL_LAST);
+
+    if (!s_kernels[kernel].supported || !(*s_kernels[kernel].supported) ())
+        return false;
+    s_kernel = &s_kernels[kernel];
+    return true;
+}
+
+
+xml_text_kernel_t
+xml_text_get_kernel (void)
+{
+    return get_kernel () - s_kernels;
+}
+
+
+const char*
+xml_text_kernel_name (xml_text_kernel_t kernel)
+{
+    w_assert (kernel < XML_TEXT_KERNEL_LAST);
+    return s_kernels[kernel].name;
+}
+
+
+/*
+ * Length of the plain text from "start". The kernel may stop up to a block
+ * short of the end of the run, so the text until a block after where it
+ * stopped, "*scalar_end", is scanned with scan_scalar(). This also avoids
+ * restarting the kernel after each character which needs conversion, when
+ * they come close together.
+ */
+static inline size_t
+scan (const struct kernel *kernel,
+      const uint8_t       *text,
+      size_t               start,
+      size_t               length,
+      size_t              *scalar_end)
+{
+    size_t plain = 0;
+    if (start >= *scalar_end) {
+        plain = (*kernel->scan) (text + start, length - start);
+        *scalar_end = start + plain + kernel->block;
+        if (*scalar_end > length)
+            *scalar_end = length;
+    }
+    return plain + scan_scalar (text + start + plain, *scalar_end - start - plain);
+}
+
+
+bool
+xml_text_escape (w_buf_t *out, const char *text, size_t length)
+{
+    w_assert (out);
+    w_assert (text || !length);
+
+    const struct kernel *kernel = get_kernel ();
+    const uint8_t *s = (const uint8_t*) text;
+    bool valid = true;
+
+    for (size_t i = 0, scalar_end = 0; i < length;) {
+        const size_t plain = scan (kernel, s, i, length, &scalar_end);
+        w_buf_append_mem (out, s + i, plain);
+        if ((i += plain) == scalar_end)
+            continue;
+
+        uint32_t c;
+        const unsigned n = decode (s + i, length - i, &c);
+        switch (c) {
+            case '&': w_buf_append_str (out, "&amp;"); break;
+            case '<': w_buf_append_str (out, "&lt;");  break;
+            case '>': w_buf_append_str (out, "&gt;");  break;
+            default:
+                if (is_xml_char (c)) {
+                    /* TAB, LF and CR, or cut by the end of the scalar scan. */
+                    w_buf_append_mem (out, s + i, n);
+                } else {
+                    if (c >= 0x20)
+                        w_buf_append_mem (out, s_replacement, sizeof (s_replacement) - 1);
+                    valid = false;
+                }
+        }
+        i += n;
+    }
+    return valid;
+}
+
+
+/* Resolves the reference at "text", which starts with "&". */
+static unsigned
+resolve (const uint8_t *text, size_t length, uint32_t *c)
+{
+    const uint8_t *semi = memchr (text, ';', length < REFERENCE_MAX ? length : REFERENCE_MAX);
+    if (!semi)
+        return 0;
+
+    const char *name = (const char*) text + 1;
+    const size_t name_length = semi - text - 1;
+    static const struct {
+        const char *name;
+        size_t      length;
+        uint32_t    c;
+    } entities[] = {
+        { "amp",  3, '&'  },
+        { "lt",   2, '<'  },
+        { "gt",   2, '>'  },
+        { "quot", 4, '"'  },
+        { "apos", 4, '\'' },
+    };
+
+    if (name_length > 1 && name[0] == '#') {
+        const bool hex = (name[1] == 'x');
+        size_t i = hex ? 2 : 1;
+        if (i == name_length)
+            return 0;
+        for (*c = 0; i < name_length; i++) {
+            unsigned digit;
+            if (name[i] >= '0' && name[i] <= '9')
+                digit = name[i] - '0';
+            else if (hex && name[i] >= 'a' && name[i] <= 'f')
+                digit = name[i] - 'a' + 10;
+            else if (hex && name[i] >= 'A' && name[i] <= 'F')
+                digit = name[i] - 'A' + 10;
+            else
+                return 0;
+            /* Cannot overflow, at most eight hex digits fit in the name. */
+            *c = *c * (hex ? 16 : 10) + digit;
+        }
+        return is_xml_char (*c) ? name_length + 2 : 0;
+    }
+
+    for (size_t i = 0; i < w_lengthof (entities); i++) {
+        if (entities[i].length == name_length &&
+            memcmp (entities[i].name, name, name_length) == 0) {
+            *c = entities[i].c;
+            return name_length + 2;
+        }
+    }
+    return 0;
+}
+
+
+bool
+xml_text_unescape (w_buf_t *out, const char *text, size_t length)
+{
+    w_assert (out);
+    w_assert (text || !length);
+
+    const struct kernel *kernel = get_kernel ();
+    const uint8_t *s = (const uint8_t*) text;
+
+    for (size_t i = 0, scalar_end = 0; i < length;) {
+        const size_t plain = scan (kernel, s, i, length, &scalar_end);
+        w_buf_append_mem (out, s + i, plain);
+        if ((i += plain) == scalar_end)
+            continue;
+
+        uint32_t c;
+        unsigned n = decode (s + i, length - i, &c);
+        if (c == '&') {
+            if (!(n = resolve (s + i, length - i, &c)))
+                return false;
+            encode (out, c);
+        } else if (c == '<' || !is_xml_char (c)) {
+            return false;
+        } else {
+            w_buf_append_mem (out, s + i, n);
+        }
+        i += n;
+    }
+    return true;
+}
@@ -0,0 +1,52 @@
+/*
+ * xml-text.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef XML_TEXT_H
+#define XML_TEXT_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Conversion of message bodies between IRC, where they are arbitrary
+ * bytes, and XMPP, where they are XML character data in UTF-8. Both
+ * directions validate and convert in a single pass over the text.
+ *
+ * Runs of text which need no conversion are found by a kernel, which is
+ * chosen at run time among the ones the CPU supports: SSE4.1 and AVX2
+ * kernels check 16 or 32 bytes at a time, including UTF-8 validation of
+ * non-ASCII input, and are only left for the bytes around the ones which
+ * need conversion. The scalar kernel is always available.
+ */
+
+typedef enum {
+    XML_TEXT_SCALAR,
+    XML_TEXT_SSE4,
+    XML_TEXT_AVX2,
+    XML_TEXT_KERNEL_LAST,
+} xml_text_kernel_t;
+
+/* Returns false if the CPU does not support the kernel. */
+extern bool xml_text_use_kernel (xml_text_kernel_t kernel);
+extern xml_text_kernel_t xml_text_get_kernel (void);
+extern const char* xml_text_kernel_name (xml_text_kernel_t kernel);
+
+/*
+ * Appends text from IRC to "out" as XML character data. Invalid UTF-8
+ * sequences, and characters which XML does not allow, are replaced with
+ * U+FFFD; control characters other than TAB, LF and CR, e.g. mIRC
+ * formatting, are dropped. Returns false if the text had to be repaired.
+ */
+extern bool xml_text_escape (w_buf_t *out, const char *text, size_t length);
+
+/*
+ * Appends XML character data to "out", resolving references. Returns
+ * false if the text is not valid, and then "out" holds a part of it.
+ * Line breaks are kept, and must not be sent as they are over IRC.
+ */
+extern bool xml_text_unescape (w_buf_t *out, const char *text, size_t length);
+
+#endif /* !XML_TEXT_H */
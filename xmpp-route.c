@@ -0,0 +1,401 @@
+/*
+ * xmpp-route.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "xmpp-route.h"
+
+
+enum {
+    TABLE_MIN_SIZE = 64,
+};
+
+
+/*
+ * Open addressing tables, keyed by atom pointers. Removal shifts back the
+ * entries which follow, so there are no tombstones to skip on lookups.
+ */
+struct slot {
+    const atom_t *key;
+    void         *value;
+};
+
+struct table {
+    struct slot *slots;
+    size_t       size;   /* Power of two. */
+    size_t       used;
+};
+
+
+struct bare;
+
+struct resource {
+    atom_t      *full;
+    struct bare *bare;
+    void        *session;
+    unsigned     index;      /* In the resources of the bare JID. */
+    int8_t       priority;
+    bool         available;
+};
+
+struct bare {
+    atom_t           *jid;
+    struct resource **resources;
+    unsigned          n_resources;
+    unsigned          a_resources;
+    struct resource  *best;  /* NULL if no resource takes messages. */
+};
+
+
+static struct table s_full = { NULL, 0, 0 };
+static struct table s_bare = { NULL, 0, 0 };
+
+
+static inline size_t
+hash_pointer (const void *pointer)
+{
+    /* Finalizer of MurmurHash3, atoms are aligned and close together. */
+    uint64_t h = (uint64_t) (uintptr_t) pointer;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (size_t) h;
+}
+
+
+static void*
+table_get (const struct table *table, const atom_t *key)
+{
+    if (!table->used)
+        return NULL;
+
+    const size_t mask = table->size - 1;
+    for (size_t i = hash_pointer (key) & mask;; i = (i + 1) & mask) {
+        if (table->slots[i].key == key)
+            return table->slots[i].value;
+        if (!table->slots[i].key)
+            return NULL;
+    }
+}
+
+
+static void
+table_insert (struct table *table, const atom_t *key, void *value)
+{
+    const size_t mask = table->size - 1;
+    size_t i = hash_pointer (key) & mask;
+    while (table->slots[i].key)
+        i = (i + 1) & mask;
+    table->slots[i] = (struct slot) { key, value };
+    table->used++;
+}
+
+
+static void
+table_set (struct table *table, const atom_t *key, void *value)
+{
+    if ((table->used + 1) * 4 > table->size * 3) {
+        struct slot *old = table->slots;
+        const size_t old_size = table->size;
+
+        table->size = old_size ? old_size * 2 : TABLE_MIN_SIZE;
+        table->slots = w_alloc0 (struct slot, table->size);
+        table->used = 0;
+        for (size_t i = 0; i < old_size; i++)
+            if (old[i].key)
+                table_insert (table, old[i].key, old[i].value);
+        w_free (old);
+    }
+    table_insert (table, key, value);
+}
+
+
+static void
+table_del (struct table *table, const atom_t *key)
+{
+    if (!table->used)
+        return;
+
+    const size_t mask = table->size - 1;
+    size_t i = hash_pointer (key) & mask;
+    while (table->slots[i].key != key) {
+        if (!table->slots[i].key)
+            return;
+        i = (i + 1) & mask;
+    }
+
+    /* Moves back entries which would not be found past the hole. */
+    for (size_t j = (i + 1) & mask; table->slots[j].key; j = (j + 1) & mask) {
+        const size_t home = hash_pointer (table->slots[j].key) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            table->slots[i] = table->slots[j];
+            i = j;
+        }
+    }
+    table->slots[i] = (struct slot) { NULL, NULL };
+    table->used--;
+}
+
+
+static inline bool
+is_local_char (uint8_t c)
+{
+    /* Excluded from localparts by RFC 7622, section 3.3.1. */
+    return c > 0x20 && c != 0x7F && !strchr ("\"&'/:<>@", c);
+}
+
+
+static inline bool
+is_domain_char (uint8_t c)
+{
+    return c >= 0x80 || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+           c == '[' || c == ']' || c == ':';
+}
+
+
+static inline char
+fold_ascii (char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+
+/*
+ * Full PRECIS profiles need Unicode tables; only ASCII is folded here,
+ * which covers the usual addresses. Other characters are kept as given.
+ */
+bool
+jid_parse (jid_t *jid, const char *text, size_t length)
+{
+    w_assert (jid);
+    w_assert (text);
+
+    const char *slash = memchr (text, '/', length);
+    const size_t address_length = slash ? (size_t) (slash - text) : length;
+    const char *at = memchr (text, '@', address_length);
+
+    const char *local = at ? text : NULL;
+    const size_t local_length = at ? (size_t) (at - text) : 0;
+    const char *domain = at ? at + 1 : text;
+    size_t domain_length = address_length - (domain - text);
+    const char *resource = slash ? slash + 1 : NULL;
+    const size_t resource_length = slash ? length - (resource - text) : 0;
+
+    if (domain_length && domain[domain_length - 1] == '.')
+        domain_length--;
+
+    if ((local && (local_length == 0 || local_length > JID_PART_MAX)) ||
+        domain_length == 0 || domain_length > JID_PART_MAX ||
+        (resource && (resource_length == 0 || resource_length > JID_PART_MAX)))
+        return false;
+
+    w_buf_t buf = W_BUF;
+    for (size_t i = 0; i < local_length; i++) {
+        if (!is_local_char (local[i]))
+            goto invalid;
+        w_buf_append_char (&buf, fold_ascii (local[i]));
+    }
+    if (local)
+        w_buf_append_char (&buf, '@');
+    for (size_t i = 0; i < domain_length; i++) {
+        if (!is_domain_char (domain[i]))
+            goto invalid;
+        w_buf_append_char (&buf, fold_ascii (domain[i]));
+    }
+
+    const size_t bare_length = w_buf_size (&buf);
+    if (resource) {
+        w_buf_append_char (&buf, '/');
+        for (size_t i = 0; i < resource_length; i++) {
+            if ((uint8_t) resource[i] < 0x20 || resource[i] == 0x7F)
+                goto invalid;
+        }
+        w_buf_append_mem (&buf, resource, resource_length);
+    }
+
+    jid->bare = atom_intern (w_buf_data (&buf), bare_length);
+    jid->full = resource ? atom_intern (w_buf_data (&buf), w_buf_size (&buf)) : NULL;
+    w_buf_clear (&buf);
+    return true;
+
+invalid:
+    w_buf_clear (&buf);
+    return false;
+}
+
+
+void
+jid_clear (jid_t *jid)
+{
+    w_assert (jid);
+    atom_unref (jid->bare);
+    atom_unref (jid->full);
+    jid->bare = jid->full = NULL;
+}
+
+
+static inline bool
+takes_messages (const struct resource *resource)
+{
+    /* Negative priorities never get messages for the bare JID. */
+    return resource->available && resource->priority >= 0;
+}
+
+
+static void
+find_best (struct bare *bare)
+{
+    bare->best = NULL;
+    for (unsigned i = 0; i < bare->n_resources; i++) {
+        struct resource *resource = bare->resources[i];
+        if (takes_messages (resource) &&
+            (!bare->best || resource->priority > bare->best->priority))
+            bare->best = resource;
+    }
+}
+
+
+/*
+ * Called after the presence of "changed" changed. Resources are only
+ * scanned when the preferred one got worse.
+ */
+static void
+update_best (struct bare *bare, struct resource *changed, bool worse)
+{
+    if (changed == bare->best) {
+        if (worse)
+            find_best (bare);
+    } else if (takes_messages (changed) &&
+               (!bare->best || changed->priority > bare->best->priority)) {
+        bare->best = changed;
+    }
+}
+
+
+bool
+xmpp_route_bind (const jid_t *jid, void *session)
+{
+    w_assert (jid);
+    w_assert (jid->bare);
+    w_assert (session);
+
+    if (!jid->full || table_get (&s_full, jid->full))
+        return false;
+
+    struct bare *bare = table_get (&s_bare, jid->bare);
+    if (!bare) {
+        bare = w_new0 (struct bare);
+        bare->jid = atom_ref (jid->bare);
+        table_set (&s_bare, bare->jid, bare);
+    }
+    if (bare->n_resources == bare->a_resources) {
+        bare->a_resources = bare->a_resources ? bare->a_resources * 2 : 2;
+        bare->resources = w_resize (bare->resources, struct resource*,
+                                    bare->a_resources);
+    }
+
+    struct resource *resource = w_new0 (struct resource);
+    resource->full = atom_ref (jid->full);
+    resource->bare = bare;
+    resource->session = session;
+    resource->index = bare->n_resources;
+    bare->resources[bare->n_resources++] = resource;
+    table_set (&s_full, resource->full, resource);
+    return true;
+}
+
+
+void
+xmpp_route_unbind (const jid_t *jid)
+{
+    w_assert (jid);
+
+    struct resource *resource = jid->full ? table_get (&s_full, jid->full) : NULL;
+    if (!resource)
+        return;
+
+    struct bare *bare = resource->bare;
+    const unsigned last = --bare->n_resources;
+    if (resource->index != last) {
+        bare->resources[resource->index] = bare->resources[last];
+        bare->resources[resource->index]->index = resource->index;
+    }
+    if (bare->best == resource)
+        find_best (bare);
+
+    table_del (&s_full, resource->full);
+    atom_unref (resource->full);
+    w_free (resource);
+
+    if (bare->n_resources == 0) {
+        table_del (&s_bare, bare->jid);
+        atom_unref (bare->jid);
+        w_free (bare->resources);
+        w_free (bare);
+    }
+}
+
+
+void
+xmpp_route_set_presence (const jid_t *jid, bool available, int priority)
+{
+    w_assert (jid);
+
+    struct resource *resource = jid->full ? table_get (&s_full, jid->full) : NULL;
+    if (!resource)
+        return;
+
+    if (priority < INT8_MIN)
+        priority = INT8_MIN;
+    else if (priority > INT8_MAX)
+        priority = INT8_MAX;
+
+    if (resource->available == available && resource->priority == priority)
+        return;
+
+    const bool worse = !available || priority < resource->priority;
+    resource->available = available;
+    resource->priority = (int8_t) priority;
+    update_best (resource->bare, resource, worse);
+}
+
+
+void*
+xmpp_route_lookup (const jid_t *jid)
+{
+    w_assert (jid);
+    w_assert (jid->bare);
+
+    if (jid->full) {
+        struct resource *resource = table_get (&s_full, jid->full);
+        return resource ? resource->session : NULL;
+    }
+
+    struct bare *bare = table_get (&s_bare, jid->bare);
+    return (bare && bare->best) ? bare->best->session : NULL;
+}
+
+
+void
+xmpp_route_foreach (const jid_t *jid,
+                    void (*func) (void *session, void *userdata),
+                    void        *userdata)
+{
+    w_assert (jid);
+    w_assert (jid->bare);
+    w_assert (func);
+
+    struct bare *bare = table_get (&s_bare, jid->bare);
+    for (unsigned i = 0; bare && i < bare->n_resources; i++)
+        (*func) (bare->resources[i]->session, userdata);
+}
+
+
+unsigned
+xmpp_route_count (void)
+{
+    return (unsigned) s_full.used;
+}
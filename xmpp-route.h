@@ -0,0 +1,78 @@
+/*
+ * xmpp-route.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef XMPP_ROUTE_H
+#define XMPP_ROUTE_H
+
+#include "atom.h"
+
+/*
+ * Routing of XMPP stanzas to sessions. JIDs are normalized once, when
+ * parsed, and interned as atoms; since equal JIDs are then the same atom,
+ * the routing tables are keyed by the atom pointers and lookups never
+ * hash or compare strings again.
+ *
+ * Each bare JID ("user@domain") keeps the list of its bound resources and
+ * caches the one which gets messages sent to the bare JID: the available
+ * resource with the highest non-negative priority (RFC 6121, section
+ * 8.5.2). The cached choice is only recomputed when a presence change
+ * could alter it.
+ */
+
+enum {
+    JID_PART_MAX = 1023,  /* RFC 7622, section 3 */
+};
+
+
+typedef struct {
+    atom_t *bare;   /* "localpart@domain", or "domain". */
+    atom_t *full;   /* With "/resource", NULL if there is none. */
+} jid_t;
+
+#define JID_INIT { NULL, NULL }
+
+
+/*
+ * Parses and normalizes a JID: the localpart and the domain are folded
+ * to lowercase, and a trailing dot in the domain is dropped. Returns
+ * false if the JID is not valid. Release with jid_clear().
+ */
+extern bool jid_parse (jid_t *jid, const char *text, size_t length);
+
+extern void jid_clear (jid_t *jid);
+
+
+/*
+ * Binds a session to a full JID. Returns false if the JID has no
+ * resource, or another session is bound to it. Sessions start as not
+ * available, with priority zero.
+ */
+extern bool xmpp_route_bind (const jid_t *jid, void *session);
+
+extern void xmpp_route_unbind (const jid_t *jid);
+
+/* Applies a presence sent by the session bound to the full JID. */
+extern void xmpp_route_set_presence (const jid_t *jid,
+                                     bool         available,
+                                     int          priority);
+
+/*
+ * Session to which a stanza addressed to the JID is delivered: the one
+ * bound to a full JID, or the preferred resource of a bare one. Returns
+ * NULL if there is none.
+ */
+extern void* xmpp_route_lookup (const jid_t *jid);
+
+/* Calls "func" for the session of each resource bound to a bare JID. */
+extern void xmpp_route_foreach (const jid_t *jid,
+                                void (*func) (void *session, void *userdata),
+                                void        *userdata);
+
+/* Number of bound sessions. */
+extern unsigned xmpp_route_count (void);
+
+#endif /* !XMPP_ROUTE_H */
@@ -0,0 +1,382 @@
+/*
+ * xmpp-sm.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#include "xmpp-sm.h"
+#include "ticker.h"
+#include <openssl/rand.h>
+#include <time.h>
+
+
+enum {
+    ID_BYTES = 12,
+    QUEUE_MIN_SIZE = 256,
+    SWEEP_INTERVAL = 1000, /* ms */
+};
+
+
+struct xmpp_sm {
+    char        id[ID_BYTES * 2 + 1];
+    void       *session;
+    void      (*expire) (void *session);
+
+    uint32_t    handled;    /* Stanzas received. */
+    uint32_t    sent;       /* Stanzas sent. */
+    uint32_t    acked;      /* Last "h" from the client. */
+
+    char       *queue;      /* Unacknowledged stanzas, from "head". */
+    size_t      head;
+    size_t      size;
+    size_t      alloc;
+    uint32_t   *lengths;    /* Of each queued stanza, from "first". */
+    unsigned    first;
+    unsigned    count;
+    unsigned    a_lengths;
+
+    /* Detached sessions, in the order they were detached. */
+    bool        detached;
+    bool        dropped;
+    uint64_t    detached_at;  /* s, monotonic */
+    xmpp_sm_t  *prev;
+    xmpp_sm_t  *next;
+};
+
+
+static w_dict_t       *s_detached = NULL;  /* By id, without dropped ones. */
+static xmpp_sm_t      *s_first = NULL;
+static xmpp_sm_t      *s_last = NULL;
+static unsigned        s_n_dropped = 0;
+static ticker_t       *s_ticker = NULL;
+static xmpp_sm_stats_t s_stats = { 0, };
+
+
+static inline uint64_t
+now_s (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec;
+}
+
+
+xmpp_sm_t*
+xmpp_sm_new (void *session, void (*expire) (void *session))
+{
+    w_assert (session);
+    w_assert (expire);
+
+    uint8_t random[ID_BYTES];
+    if (RAND_bytes (random, sizeof (random)) != 1)
+        return NULL;
+
+    xmpp_sm_t *sm = w_new0 (xmpp_sm_t);
+    for (unsigned i = 0; i < ID_BYTES; i++) {
+        sm->id[i * 2]     = "0123456789abcdef"[random[i] >> 4];
+        sm->id[i * 2 + 1] = "0123456789abcdef"[random[i] & 0x0F];
+    }
+    sm->session = session;
+    sm->expire = expire;
+    return sm;
+}
+
+
+const char*
+xmpp_sm_id (const xmpp_sm_t *sm)
+{
+    w_assert (sm);
+    return sm->id;
+}
+
+
+void*
+xmpp_sm_session (const xmpp_sm_t *sm)
+{
+    w_assert (sm);
+    return sm->session;
+}
+
+
+uint32_t
+xmpp_sm_received (xmpp_sm_t *sm)
+{
+    w_assert (sm);
+    return ++sm->handled;  /* Wraps around, as the XEP mandates. */
+}
+
+
+uint32_t
+xmpp_sm_handled (const xmpp_sm_t *sm)
+{
+    w_assert (sm);
+    return sm->handled;
+}
+
+
+static inline size_t
+queued_bytes (const xmpp_sm_t *sm)
+{
+    return sm->size - sm->head;
+}
+
+
+/* Moves the queued stanzas to the start, and optionally frees the rest. */
+static void
+compact (xmpp_sm_t *sm, bool shrink)
+{
+    if (sm->head) {
+        memmove (sm->queue, sm->queue + sm->head, queued_bytes (sm));
+        sm->size -= sm->head;
+        sm->head = 0;
+    }
+    if (sm->first) {
+        memmove (sm->lengths, sm->lengths + sm->first, sm->count * sizeof (uint32_t));
+        sm->first = 0;
+    }
+
+    if (shrink) {
+        if ((sm->alloc = sm->size))
+            sm->queue = w_resize (sm->queue, char, sm->alloc);
+        else
+            w_free (sm->queue);
+        if ((sm->a_lengths = sm->count))
+            sm->lengths = w_resize (sm->lengths, uint32_t, sm->a_lengths);
+        else
+            w_free (sm->lengths);
+    }
+}
+
+
+static void
+list_remove (xmpp_sm_t *sm)
+{
+    if (sm->prev)
+        sm->prev->next = sm->next;
+    else
+        s_first = sm->next;
+    if (sm->next)
+        sm->next->prev = sm->prev;
+    else
+        s_last = sm->prev;
+    sm->prev = sm->next = NULL;
+}
+
+
+/* Removes a detached session from the lookup table and the stats. */
+static void
+forget (xmpp_sm_t *sm)
+{
+    w_dict_del (s_detached, sm->id);
+    s_stats.detached--;
+    s_stats.bytes -= queued_bytes (sm);
+}
+
+
+/* Frees the queue now; the session is ended by the next sweep. */
+static void
+drop (xmpp_sm_t *sm)
+{
+    w_assert (sm->detached);
+    w_assert (!sm->dropped);
+
+    forget (sm);
+    s_stats.dropped++;
+
+    sm->head = sm->size = sm->first = sm->count = 0;
+    compact (sm, true);
+    sm->dropped = true;
+    s_n_dropped++;
+}
+
+
+void
+xmpp_sm_free (xmpp_sm_t *sm)
+{
+    w_assert (sm);
+
+    if (sm->detached) {
+        if (sm->dropped)
+            s_n_dropped--;
+        else
+            forget (sm);
+        list_remove (sm);
+    }
+    w_free (sm->queue);
+    w_free (sm->lengths);
+    w_free (sm);
+}
+
+
+bool
+xmpp_sm_sent (xmpp_sm_t *sm, const void *stanza, size_t length)
+{
+    w_assert (sm);
+    w_assert (stanza);
+
+    if (sm->dropped)
+        return false;
+    if (queued_bytes (sm) + length + (sm->count + 1) * sizeof (uint32_t) >
+        CHATEAU_XMPP_SM_QUEUE_MAX || length > UINT32_MAX) {
+        if (sm->detached)
+            drop (sm);
+        return false;
+    }
+
+    if (sm->size + length > sm->alloc) {
+        compact (sm, false);
+        if (sm->size + length > sm->alloc) {
+            sm->alloc = sm->alloc ? sm->alloc * 2 : QUEUE_MIN_SIZE;
+            if (sm->alloc < sm->size + length)
+                sm->alloc = sm->size + length;
+            sm->queue = w_resize (sm->queue, char, sm->alloc);
+        }
+    }
+    if (sm->first + sm->count == sm->a_lengths) {
+        compact (sm, false);
+        if (sm->count == sm->a_lengths) {
+            sm->a_lengths = sm->a_lengths ? sm->a_lengths * 2 : 16;
+            sm->lengths = w_resize (sm->lengths, uint32_t, sm->a_lengths);
+        }
+    }
+
+    memcpy (sm->queue + sm->size, stanza, length);
+    sm->size += length;
+    sm->lengths[sm->first + sm->count++] = (uint32_t) length;
+    sm->sent++;
+    if (sm->detached)
+        s_stats.bytes += length;
+    return true;
+}
+
+
+bool
+xmpp_sm_ack (xmpp_sm_t *sm, uint32_t h)
+{
+    w_assert (sm);
+
+    /* Counters wrap around, so only the difference is meaningful. */
+    const uint32_t n = h - sm->acked;
+    if (n > sm->count)
+        return false;
+
+    size_t bytes = 0;
+    for (unsigned i = 0; i < n; i++)
+        bytes += sm->lengths[sm->first + i];
+    sm->head += bytes;
+    sm->first += n;
+    sm->count -= n;
+    sm->acked = h;
+    if (sm->detached)
+        s_stats.bytes -= bytes;
+
+    if (!sm->count)
+        sm->head = sm->size = sm->first = 0;
+    return true;
+}
+
+
+static void
+sweep (void)
+{
+    const uint64_t now = now_s ();
+    for (xmpp_sm_t *sm = s_first, *next; sm; sm = next) {
+        next = sm->next;
+        if (!sm->dropped) {
+            /* Sessions are in detachment order, the rest expire later. */
+            if (now - sm->detached_at < CHATEAU_XMPP_SM_RESUME_TIMEOUT) {
+                if (!s_n_dropped)
+                    break;
+                continue;
+            }
+            drop (sm);
+        }
+        list_remove (sm);
+        s_n_dropped--;
+        (*sm->expire) (sm->session);
+        w_free (sm);
+    }
+}
+
+
+static void
+sweep_task (void *data)
+{
+    w_unused (data);
+
+    while (s_ticker && ticker_wait (s_ticker))
+        if (s_first)
+            sweep ();
+}
+
+
+void
+xmpp_sm_detach (xmpp_sm_t *sm)
+{
+    w_assert (sm);
+    w_assert (!sm->detached);
+
+    if (!s_ticker) {
+        if (!(s_ticker = ticker_new (SWEEP_INTERVAL))) {
+            /* Sessions could never expire, so they are not kept. */
+            (*sm->expire) (sm->session);
+            xmpp_sm_free (sm);
+            return;
+        }
+        w_task_t *task = w_task_prepare (sweep_task, NULL, 16384);
+        w_task_set_name (task, "xmpp-sm");
+        w_task_set_is_system (task, true);
+        s_detached = w_dict_new (false);
+    }
+
+    if (s_stats.detached >= CHATEAU_XMPP_SM_DETACHED_MAX) {
+        xmpp_sm_t *oldest = s_first;
+        while (oldest->dropped)
+            oldest = oldest->next;
+        drop (oldest);
+    }
+
+    compact (sm, true);
+    sm->detached = true;
+    sm->detached_at = now_s ();
+    sm->prev = s_last;
+    if (s_last)
+        s_last->next = sm;
+    else
+        s_first = sm;
+    s_last = sm;
+
+    w_dict_set (s_detached, sm->id, sm);
+    s_stats.detached++;
+    s_stats.bytes += queued_bytes (sm);
+}
+
+
+xmpp_sm_t*
+xmpp_sm_resume (const char *id, uint32_t h, w_buf_t *gap)
+{
+    w_assert (id);
+    w_assert (gap);
+
+    xmpp_sm_t *sm = s_detached ? w_dict_get (s_detached, id) : NULL;
+    if (!sm || !xmpp_sm_ack (sm, h))
+        return NULL;
+
+    forget (sm);
+    list_remove (sm);
+    s_stats.resumed++;
+    sm->detached = false;
+
+    /* Stay queued until acknowledged from the new connection. */
+    w_buf_append_mem (gap, sm->queue + sm->head, queued_bytes (sm));
+    return sm;
+}
+
+
+void
+xmpp_sm_get_stats (xmpp_sm_stats_t *stats)
+{
+    w_assert (stats);
+    *stats = s_stats;
+}
@@ -0,0 +1,100 @@
+/*
+ * xmpp-sm.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef XMPP_SM_H
+#define XMPP_SM_H
+
+#include "wheel/wheel.h"
+
+/*
+ * Stream management (XEP-0198) of XMPP sessions: counting of handled
+ * stanzas in both directions, and the queue of stanzas sent but not yet
+ * acknowledged by the client.
+ *
+ * When the connection of a session is lost, the session is detached
+ * instead of ended: it stays bound, stanzas sent to it keep being queued,
+ * and the client can resume it from a new connection for a while. On
+ * resumption only the unacknowledged stanzas are sent again; presence is
+ * not broadcast, since for everybody else the session never went away.
+ *
+ * The queue of a detached session is compacted to its exact size, and
+ * bounded like while the session is attached. Detached sessions which go
+ * over the bound, stay detached for too long, or are the oldest when there
+ * are too many of them, are dropped, and the "expire" callback given on
+ * creation ends them. Dropped sessions are collected by a system task, so
+ * the callback never runs while stanzas are being routed.
+ */
+
+#ifndef CHATEAU_XMPP_SM_QUEUE_MAX
+#define CHATEAU_XMPP_SM_QUEUE_MAX (32 * 1024) /* bytes per session */
+#endif /* !CHATEAU_XMPP_SM_QUEUE_MAX */
+
+#ifndef CHATEAU_XMPP_SM_RESUME_TIMEOUT
+#define CHATEAU_XMPP_SM_RESUME_TIMEOUT 300 /* s */
+#endif /* !CHATEAU_XMPP_SM_RESUME_TIMEOUT */
+
+#ifndef CHATEAU_XMPP_SM_DETACHED_MAX
+#define CHATEAU_XMPP_SM_DETACHED_MAX 4096
+#endif /* !CHATEAU_XMPP_SM_DETACHED_MAX */
+
+
+typedef struct xmpp_sm xmpp_sm_t;
+
+/*
+ * Enables stream management for a session, with a new resumption id.
+ * The "expire" callback ends the session; the state is freed after it
+ * returns, so it must not call xmpp_sm_free().
+ */
+extern xmpp_sm_t* xmpp_sm_new (void *session, void (*expire) (void *session));
+
+/*
+ * Ends stream management of a session without calling its "expire"
+ * callback, e.g. on </stream>, or when a new session takes its resource.
+ */
+extern void xmpp_sm_free (xmpp_sm_t *sm);
+
+extern const char* xmpp_sm_id (const xmpp_sm_t *sm);
+extern void* xmpp_sm_session (const xmpp_sm_t *sm);
+
+/* Counts a stanza from the client, returns the "h" value to report. */
+extern uint32_t xmpp_sm_received (xmpp_sm_t *sm);
+extern uint32_t xmpp_sm_handled (const xmpp_sm_t *sm);
+
+/*
+ * Queues a complete stanza sent to the client, until acknowledged.
+ * Returns false if the queue would go over its bound; the stream should
+ * then be closed if the session is attached, and a detached one is
+ * dropped.
+ */
+extern bool xmpp_sm_sent (xmpp_sm_t *sm, const void *stanza, size_t length);
+
+/*
+ * Handles an acknowledgement with the given "h". Returns false if the
+ * client acknowledges stanzas which were never sent.
+ */
+extern bool xmpp_sm_ack (xmpp_sm_t *sm, uint32_t h);
+
+/* Detaches a session whose connection was lost. */
+extern void xmpp_sm_detach (xmpp_sm_t *sm);
+
+/*
+ * Resumes a detached session, handling "h" from the client first, and
+ * appends the stanzas to send again to "gap". Returns NULL if there is
+ * no such session, it was dropped, or "h" is not valid.
+ */
+extern xmpp_sm_t* xmpp_sm_resume (const char *id, uint32_t h, w_buf_t *gap);
+
+typedef struct {
+    unsigned      detached;
+    size_t        bytes;     /* Queued for detached sessions. */
+    unsigned long resumed;
+    unsigned long dropped;
+} xmpp_sm_stats_t;
+
+extern void xmpp_sm_get_stats (xmpp_sm_stats_t *stats);
+
+#endif /* !XMPP_SM_H */